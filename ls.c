@@ -55,6 +55,8 @@
 #include <pwd.h>
 #include <getopt.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #if HAVE_LANGINFO_CODESET
 # include <langinfo.h>
@@ -96,7 +98,6 @@
 #include "idcache.h"
 #include "ls.h"
 #include "mbswidth.h"
-#include "mpsort.h"
 #include "obstack.h"
 #include "quote.h"
 #include "stat-size.h"
@@ -108,9 +109,14 @@
 #include "areadlink.h"
 #include "dircolors.h"
 #include "xgethostname.h"
+#include "xvasprintf.h"
 #include "c-ctype.h"
+#include "c-strtod.h"
 #include "canonicalize.h"
 #include "statx.h"
+#include "alignalloc.h"
+#include "ignore-value.h"
+#include "openat-priv.h"
 
 /* Include <sys/capability.h> last to avoid a clash of <sys/types.h>
    include guards with some premature versions of libcap.
@@ -121,11 +127,23 @@
 
 #if HAVE_LINUX_XATTR_H
 # include <linux/xattr.h>
+# include <sys/xattr.h>
 # ifndef XATTR_NAME_CAPS
 #  define XATTR_NAME_CAPS "security.capability"
 # endif
 #endif
 
+#if !defined HAVE_LINUX_PERF_EVENT_H && defined __linux__ \
+    && defined __has_include
+# if __has_include (<linux/perf_event.h>)
+#  define HAVE_LINUX_PERF_EVENT_H 1
+# endif
+#endif
+#if HAVE_LINUX_PERF_EVENT_H
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+#endif
+
 #define PROGRAM_NAME (ls_mode == LS_LS ? "ls" \
                       : (ls_mode == LS_MULTI_COL \
                          ? "dir" : "vdir"))
@@ -246,6 +264,21 @@ struct fileinfo
 
     /* Cached screen width (including quoting).  */
     size_t width;
+
+    /* For --sort=iname and --sort=natural, the name transformed so that
+       strcmp orders it, or null if not yet computed.  For a --sort list,
+       the packed key that memcmp orders, and its length.  */
+    char *sortkey;
+    idx_t sortkey_len;
+
+    /* With --compress-names, NAME is null once the name is front-coded,
+       and this is its index in the store; see fileinfo_name.  */
+    idx_t name_index;
+
+    /* For --xattrs, the lines to print after the entry, each
+       null-terminated, and their total length; or null.  */
+    char *xattrs;
+    idx_t xattrs_len;
   };
 
 /* Null is a valid character in a color indicator (think about Epson
@@ -258,6 +291,26 @@ struct bin_str
     char const *string;		/* Pointer to the same */
   };
 
+/* A complete escape sequence, C_LEFT + indicator + C_RIGHT, composed
+   once after LS_COLORS is parsed so that each colored name costs a
+   single fwrite.  */
+struct sgr
+  {
+    struct bin_str seq;		/* The composed sequence */
+    bool blank_safe;		/* Blanks output under it look uncolored */
+  };
+
+/* Where gobble_file finds the file BASE of the directory DIRNAME:
+   NAME relative to the descriptor FD, which is that of the directory
+   being listed, or AT_FDCWD if NAME is the full name.  */
+struct entry_path
+  {
+    int fd;
+    char const *name;
+    char const *base;
+    char const *dirname;
+  };
+
 #if ! HAVE_TCGETPGRP
 # define tcgetpgrp(Fd) 0
 #endif
@@ -265,7 +318,7 @@ struct bin_str
 static size_t quote_name (char const *name,
                           struct quoting_options const *options,
                           int needs_general_quoting,
-                          const struct bin_str *color,
+                          struct sgr const *color,
                           bool allow_pad, struct obstack *stack,
                           char const *absolute_name);
 static size_t quote_name_buf (char **inbuf, size_t bufsize, char *name,
@@ -277,22 +330,44 @@ static bool file_ignored (char const *name);
 static uintmax_t gobble_file (char const *name, enum filetype type,
                               ino_t inode, bool command_line_arg,
                               char const *dirname);
-static const struct bin_str * get_color_indicator (const struct fileinfo *f,
-                                                   bool symlink_target);
-static bool print_color_indicator (const struct bin_str *ind);
+static struct sgr const *get_color_indicator (const struct fileinfo *f,
+                                              bool symlink_target);
+static bool print_color_indicator (struct sgr const *ind);
 static void put_indicator (const struct bin_str *ind);
 static void add_ignore_pattern (char const *pattern);
+static void aggregate_file (struct fileinfo const *f, char const *name,
+                            char const *dirname);
+static void print_aggregates (void);
 static void attach (char *dest, char const *dirname, char const *name);
 static void clear_files (void);
 static void extract_dirs_from_files (char const *dirname,
                                      bool command_line_arg);
-static void get_link_name (char const *filename, struct fileinfo *f,
+static void get_link_name (struct entry_path const *e, struct fileinfo *f,
                            bool command_line_arg);
 static void indent (size_t from, size_t to);
 static idx_t calculate_columns (bool by_columns);
+static bool bounded_listing_applies (void);
+static void page_begin (char const *dirname);
+static void page_select (uintmax_t *total_blocks);
+static void page_measure (void);
+static void page_end (void);
+static bool should_print_immediately (void);
+static void list_bounded_dir (DIR *dirp, char const *name,
+                              bool command_line_arg);
+static uintmax_t read_directory_entries_parallel (DIR *dirp,
+                                                  char const *name,
+                                                  bool command_line_arg);
+static void prefetch_finish (void);
+static void compress_file_names (void);
+static char const *fileinfo_name (struct fileinfo const *f);
+static bool gobble_operands_parallel (idx_t n, char **argv);
 static void print_current_files (void);
 static void print_dir (char const *name, char const *realname,
-                       bool command_line_arg);
+                       bool command_line_arg, int parent_fd,
+                       char const *relname);
+static int dir_fd_lookup (char const *name, int slot, uintmax_t gen,
+                          char const **relname);
+static void dir_fd_drop (int slot);
 static size_t print_file_name_and_frills (const struct fileinfo *f,
                                           size_t start_col);
 static void print_horizontal (void);
@@ -305,6 +380,7 @@ static size_t print_name_with_quoting (const struct fileinfo *f,
                                        struct obstack *stack,
                                        size_t start_col);
 static void prep_non_filename_text (void);
+static void sgr_release (void);
 static bool print_type_indicator (bool stat_ok, mode_t mode,
                                   enum filetype type);
 static void print_with_separator (char sep);
@@ -312,6 +388,26 @@ static void queue_directory (char const *name, char const *realname,
                              bool command_line_arg);
 static void sort_files (void);
 static void parse_ls_color (void);
+static void compose_color_sequences (void);
+static void set_exit_status (bool serious);
+static void update_file_widths (struct fileinfo *f);
+static void capture_open (void);
+static void capture_operands (intmax_t n_files);
+static void capture_dir (char const *name, DIR *dirp);
+static void capture_close (void);
+static void also_output_open (void);
+static void columnar_write_header (FILE *fp);
+static void also_output_files (char const *dirname);
+static void also_output_close (void);
+static void snapshot_open (void);
+static void replay_file_arguments (void);
+static void replay_dir (char const *name, char const *realname,
+                        bool command_line_arg);
+static void set_flat_dir (char const *dirname);
+static void decode_sort_keys (char const *spec);
+static bool sort_keys_need_stat (void);
+static struct timespec get_file_timestamp (const struct fileinfo *f,
+                                           bool *btime_ok);
 
 static int getenv_quoting_style (void);
 
@@ -368,6 +464,8 @@ static size_t sorted_file_alloc;
 
 static bool color_symlink_as_referent;
 
+/* The host name for hyperlinks, or null until the first one is
+   printed.  */
 static char const *hostname;
 
 /* Mode of appropriate file for coloring.  */
@@ -390,11 +488,103 @@ struct pending
        link, otherwise zero.  */
     char *realname;
     bool command_line_arg;
+    /* The slot in DIR_FD_CACHE of the directory this one was found in,
+       or -1, and the generation that identifies that directory.  */
+    int parent_slot;
+    uintmax_t parent_gen;
     struct pending *next;
   };
 
 static struct pending *pending_dirs;
 
+/* Descriptors of recently listed directories that queued
+   subdirectories, so that -R can open each subdirectory relative to
+   its parent instead of resolving its full name, which costs more the
+   deeper it is and fails beyond PATH_MAX.  The cache is bounded; a
+   subdirectory whose parent was evicted is opened relative to its
+   nearest cached ancestor, or by name if there is none.  A slot whose
+   GEN is 0 is free; otherwise GEN identifies the directory NAME, and
+   USED says when the slot was last used, for LRU eviction.  */
+enum { DIR_FD_CACHE_SIZE = 32 };
+static struct
+{
+  int fd;
+  char *name;
+  uintmax_t gen;
+  uintmax_t used;
+} dir_fd_cache[DIR_FD_CACHE_SIZE];
+static uintmax_t dir_fd_clock;
+
+/* The slot of the directory being listed, or -1 if it is not cached.  */
+static int listing_slot = -1;
+
+/* The descriptor of the directory whose entries are being read, or -1.
+   Entries are statted relative to it.  */
+static int listing_fd = -1;
+
+/* With --capture, the stream that the metadata of each listed
+   directory is recorded to, and its name.  */
+static FILE *capture_fp;
+static char const *capture_name;
+
+/* The extra renderings requested with --also-output=FORMAT:FILE.  They
+   are fed the same sorted tables as the main listing.  */
+enum also_output_format
+  {
+    also_output_names,		/* NUL-terminated names, with their directory */
+    also_output_columnar,	/* The --format=columnar table */
+    also_output_snapshot	/* The --capture snapshot */
+  };
+
+static char const *const also_output_format_args[] =
+{
+  "names", "columnar", "snapshot", nullptr
+};
+static enum also_output_format const also_output_format_types[] =
+{
+  also_output_names, also_output_columnar, also_output_snapshot
+};
+ARGMATCH_VERIFY (also_output_format_args, also_output_format_types);
+
+struct also_output
+  {
+    enum also_output_format format;
+    char const *name;
+    FILE *fp;
+    struct also_output *next;
+  };
+
+/* The --also-output sinks, in reverse order of the options, and
+   whether any of them is a columnar table.  */
+static struct also_output *also_outputs;
+static bool also_output_columnar_p;
+
+/* Paged listings.  With --page-size, at most PAGE_SIZE entries of an
+   unsorted listing are read, starting at the telldir cookie given by
+   --cursor.  With --limit and --after, a sorted listing keeps only the
+   PAGE_LIMIT first entries that sort after the file PAGE_AFTER.  Zero
+   sizes mean no limit.  PAGE_MORE says whether entries were left out
+   after the page, and PAGE_NEXT_CURSOR where the next page starts.  */
+static idx_t page_size;
+static char const *page_cursor;
+static idx_t page_limit;
+static char const *page_after;
+static bool page_more;
+static long page_next_cursor;
+
+/* True while the entries of a --limit or --after page are being
+   selected, so that the field widths are measured only on the entries
+   that are kept.  */
+static bool page_widths_deferred;
+
+/* With --from-snapshot, the stream that metadata is read from instead
+   of the file system, and its name.  */
+static FILE *snapshot_fp;
+static char const *snapshot_name;
+
+/* The number of operands the replayed snapshot was captured with.  */
+static intmax_t snapshot_n_files;
+
 /* Current time in seconds and nanoseconds since 1970, updated as
    needed when deciding whether a file is recent.  */
 
@@ -440,7 +630,8 @@ enum format
     one_per_line,		/* -1 */
     many_per_line,		/* -C */
     horizontal,			/* -x */
-    with_commas			/* -m */
+    with_commas,		/* -m */
+    columnar_format		/* --format=columnar */
   };
 
 static enum format format;
@@ -494,6 +685,9 @@ enum sort_type
     sort_width,
     sort_size,			/* -S */
     sort_version,		/* -v */
+    sort_iname,			/* --sort=iname */
+    sort_natural,		/* --sort=natural */
+    sort_multi,			/* --sort=KEY,KEY... */
     sort_time,			/* -t; must be second to last */
     sort_none,			/* -U; must be last */
     sort_numtypes		/* the number of elements of this enum */
@@ -501,6 +695,34 @@ enum sort_type
 
 static enum sort_type sort_type;
 
+/* The keys of a --sort=KEY[:DIR][,KEY[:DIR]]... list, used when
+   SORT_TYPE is sort_multi.  */
+enum sort_key_field
+  {
+    key_name, key_extension, key_iname, key_natural, key_width,
+    key_size, key_time, key_atime, key_mtime, key_ctime
+  };
+
+static char const *const sort_key_args[] =
+{
+  "name", "extension", "ext", "iname", "natural", "width",
+  "size", "time", "atime", "mtime", "ctime", nullptr
+};
+static enum sort_key_field const sort_key_types[] =
+{
+  key_name, key_extension, key_extension, key_iname, key_natural, key_width,
+  key_size, key_time, key_atime, key_mtime, key_ctime
+};
+ARGMATCH_VERIFY (sort_key_args, sort_key_types);
+
+enum { MAX_SORT_KEYS = 16 };
+static struct sort_key
+  {
+    enum sort_key_field field;
+    bool descending;
+  } sort_keys[MAX_SORT_KEYS];
+static int n_sort_keys;
+
 /* Direction of sort.
    false means highest first if numeric,
    lowest first if alphabetic;
@@ -627,6 +849,7 @@ struct color_ext_type
   {
     struct bin_str ext;		/* The extension we're looking for */
     struct bin_str seq;		/* The sequence to output when we do */
+    struct sgr sgr;		/* SEQ composed with C_LEFT and C_RIGHT */
     bool   exact_match;		/* Whether to compare case insensitively */
     struct color_ext_type *next;	/* Next in list */
   };
@@ -675,14 +898,24 @@ static struct bin_str color_indicator[] =
 /* A list mapping file extensions to corresponding display sequence.  */
 static struct color_ext_type *color_ext_list = nullptr;
 
+/* COLOR_INDICATOR entries composed with C_LEFT and C_RIGHT, plus the
+   composed sequences for restoring the default color (C_LEFT C_RIGHT),
+   for switching to normal text, and for ending a colored name.  */
+static struct sgr color_sgr[ARRAY_CARDINALITY (color_indicator)];
+static struct bin_str sgr_default;
+static struct bin_str sgr_normal;
+static struct bin_str sgr_reset;
+
+/* The sequence still in effect after the most recently printed name, or
+   null if the color was reset after it.  A following name of the same
+   color is then printed without a reset/set pair, provided only blanks
+   were output in between.  A color is never held across the end of a
+   line.  */
+static struct sgr const *sgr_held;
+
 /* Buffer for color sequences */
 static char *color_buf;
 
-/* True means to check for orphaned symbolic link, for displaying
-   colors, or to group symlink to directories with other dirs.  */
-
-static bool check_symlink_mode;
-
 /* True means mention the inode number of each file.  -i  */
 
 static bool print_inode;
@@ -767,23 +1000,80 @@ static bool print_dir_name;
 
 static size_t line_length;
 
-/* The local time zone rules, as per the TZ environment variable.  */
+/* The local time zone rules, as per the TZ environment variable.
+   Use get_localtz to access this, as it is set up on first use.  */
 
 static timezone_t localtz;
 
-/* If true, the file listing format requires that stat be called on
-   each file.  */
+static timezone_t
+get_localtz (void)
+{
+  static bool localtz_init;
+  if (!localtz_init)
+    {
+      localtz = tzalloc (getenv ("TZ"));
+      localtz_init = true;
+    }
+  return localtz;
+}
 
-static bool format_needs_stat;
+/* What listing an entry costs, decided once after the options are
+   parsed.  The listing follows it, and --explain prints it.  */
 
-/* Similar to 'format_needs_stat', but set if only the file type is
-   needed.  */
+struct listing_plan
+  {
+    /* Stat every entry, because the format, sort or a column needs
+       more than its name.  */
+    bool needs_stat;
+
+    /* Like NEEDS_STAT, but only the file type is needed, so an entry
+       is stat'ed only if readdir did not report its type.  */
+    bool needs_type;
+
+    /* Probe regular files for capabilities, to color them or to
+       record them in a snapshot.  */
+    bool needs_capability;
+
+    /* Get the ACL and security context of each entry.  */
+    bool needs_aclinfo;
+
+    /* Stat the targets of symbolic links, to check for orphans, for
+       colors, or to group links to directories with directories.  */
+    bool check_symlinks;
+
+    /* Read the targets of symbolic links, and stat them.  */
+    bool read_links;
+    bool stat_link_targets;
+
+    /* Without NEEDS_STAT, which other entries are stat'ed: directories
+       for the sticky and other-writable colors, symbolic links to
+       follow them, regular files for the executable indicator and
+       colors, and entries whose inode number readdir did not give.  */
+    bool stat_dirs;
+    bool stat_symlinks;
+    bool stat_regular;
+    bool stat_missing_ino;
+
+    /* The statx mask of each stat.  */
+    unsigned int statx_mask;
+
+    /* Whether the entries are sorted, and whether the field widths
+       that pad the output are measured as entries are read; with -m or
+       --format=columnar nothing is padded, so they are not.  */
+    bool sort;
+    bool widths;
+
+    /* Whether each entry is printed as soon as it is read, and whether
+       --bounded-memory rereads directories instead of holding them.  */
+    bool streaming;
+    bool bounded;
+  };
 
-static bool format_needs_type;
+static struct listing_plan plan;
 
-/* Like 'format_needs_stat', but set only if capability colors are needed.  */
+/* True means print the listing plan instead of listing.  --explain  */
 
-static bool format_needs_capability;
+static bool explain_plan;
 
 /* An arbitrary limit on the number of bytes in a printed timestamp.
    This is set to a relatively small value to avoid the need to worry
@@ -860,23 +1150,48 @@ enum
    non-character as a pseudo short option, starting with CHAR_MAX + 1.  */
 enum
 {
-  AUTHOR_OPTION = CHAR_MAX + 1,
+  AFTER_OPTION = CHAR_MAX + 1,
+  AGG_OPTION,
+  ALSO_OUTPUT_OPTION,
+  AUTHOR_OPTION,
   BLOCK_SIZE_OPTION,
+  BOUNDED_MEMORY_OPTION,
+  CALL_BUDGET_OPTION,
+  CALL_STATS_OPTION,
+  CAPTURE_OPTION,
   COLOR_OPTION,
+  COMPRESS_NAMES_OPTION,
+  CURSOR_OPTION,
   DEREFERENCE_COMMAND_LINE_SYMLINK_TO_DIR_OPTION,
+  ERRORS_OPTION,
+  EXPLAIN_OPTION,
   FILE_TYPE_INDICATOR_OPTION,
+  FLAT_OPTION,
   FORMAT_OPTION,
+  FROM_SNAPSHOT_OPTION,
   FULL_TIME_OPTION,
+  GROUP_BY_OPTION,
   GROUP_DIRECTORIES_FIRST_OPTION,
   HIDE_OPTION,
   HYPERLINK_OPTION,
   INDICATOR_STYLE_OPTION,
+  INJECT_OPTION,
+  LIMIT_OPTION,
+  OUTPUT_OPTION,
+  OUTPUT_OPTIONS_OPTION,
+  PAGE_SIZE_OPTION,
+  PARALLEL_OPTION,
+  PERF_COUNTERS_OPTION,
+  PROFILE_OPTION,
+  PROGRESS_FD_OPTION,
+  PROGRESS_OPTION,
   QUOTING_STYLE_OPTION,
   SHOW_CONTROL_CHARS_OPTION,
   SI_OPTION,
   SORT_OPTION,
   TIME_OPTION,
   TIME_STYLE_OPTION,
+  XATTRS_OPTION,
   ZERO_OPTION,
 };
 
@@ -926,6 +1241,31 @@ static struct option const long_options[] =
   {"block-size", required_argument, nullptr, BLOCK_SIZE_OPTION},
   {"context", no_argument, 0, 'Z'},
   {"author", no_argument, nullptr, AUTHOR_OPTION},
+  {"-call-budget", required_argument, nullptr, CALL_BUDGET_OPTION},
+  {"-call-stats", no_argument, nullptr, CALL_STATS_OPTION},
+  {"-inject", required_argument, nullptr, INJECT_OPTION},
+  {"-perf-counters", no_argument, nullptr, PERF_COUNTERS_OPTION},
+  {"after", required_argument, nullptr, AFTER_OPTION},
+  {"agg", required_argument, nullptr, AGG_OPTION},
+  {"also-output", required_argument, nullptr, ALSO_OUTPUT_OPTION},
+  {"bounded-memory", no_argument, nullptr, BOUNDED_MEMORY_OPTION},
+  {"capture", required_argument, nullptr, CAPTURE_OPTION},
+  {"compress-names", no_argument, nullptr, COMPRESS_NAMES_OPTION},
+  {"cursor", required_argument, nullptr, CURSOR_OPTION},
+  {"errors", required_argument, nullptr, ERRORS_OPTION},
+  {"explain", no_argument, nullptr, EXPLAIN_OPTION},
+  {"flat", no_argument, nullptr, FLAT_OPTION},
+  {"from-snapshot", required_argument, nullptr, FROM_SNAPSHOT_OPTION},
+  {"group-by", required_argument, nullptr, GROUP_BY_OPTION},
+  {"limit", required_argument, nullptr, LIMIT_OPTION},
+  {"output", required_argument, nullptr, OUTPUT_OPTION},
+  {"output-options", required_argument, nullptr, OUTPUT_OPTIONS_OPTION},
+  {"page-size", required_argument, nullptr, PAGE_SIZE_OPTION},
+  {"parallel", required_argument, nullptr, PARALLEL_OPTION},
+  {"profile", required_argument, nullptr, PROFILE_OPTION},
+  {"progress", optional_argument, nullptr, PROGRESS_OPTION},
+  {"progress-fd", required_argument, nullptr, PROGRESS_FD_OPTION},
+  {"xattrs", optional_argument, nullptr, XATTRS_OPTION},
   {GETOPT_HELP_OPTION_DECL},
   {GETOPT_VERSION_OPTION_DECL},
   {nullptr, 0, nullptr, 0}
@@ -934,24 +1274,24 @@ static struct option const long_options[] =
 static char const *const format_args[] =
 {
   "verbose", "long", "commas", "horizontal", "across",
-  "vertical", "single-column", nullptr
+  "vertical", "single-column", "columnar", nullptr
 };
 static enum format const format_types[] =
 {
   long_format, long_format, with_commas, horizontal, horizontal,
-  many_per_line, one_per_line
+  many_per_line, one_per_line, columnar_format
 };
 ARGMATCH_VERIFY (format_args, format_types);
 
 static char const *const sort_args[] =
 {
   "none", "size", "time", "version", "extension",
-  "name", "width", nullptr
+  "name", "width", "iname", "natural", nullptr
 };
 static enum sort_type const sort_types[] =
 {
   sort_none, sort_size, sort_time, sort_version, sort_extension,
-  sort_name, sort_width
+  sort_name, sort_width, sort_iname, sort_natural
 };
 ARGMATCH_VERIFY (sort_args, sort_types);
 
@@ -987,6 +1327,83 @@ static enum when_type const when_types[] =
 };
 ARGMATCH_VERIFY (when_args, when_types);
 
+/* The key that --group-by aggregates listed files by.  */
+enum group_by
+  {
+    group_by_none,
+    group_by_ext,		/* --group-by=ext */
+    group_by_owner,		/* --group-by=owner */
+    group_by_group,		/* --group-by=group */
+    group_by_type,		/* --group-by=type */
+    group_by_mtime_bucket,	/* --group-by=mtime-bucket */
+    group_by_dir		/* --group-by=dir */
+  };
+
+static char const *const group_by_args[] =
+{
+  "ext", "owner", "group", "type", "mtime-bucket", "dir", nullptr
+};
+static enum group_by const group_by_types[] =
+{
+  group_by_ext, group_by_owner, group_by_group, group_by_type,
+  group_by_mtime_bucket, group_by_dir
+};
+ARGMATCH_VERIFY (group_by_args, group_by_types);
+
+static enum group_by group_by;
+
+/* How file_failure reports errors.  */
+enum error_mode
+  {
+    errors_full,		/* --errors=full: each one via error () */
+    errors_buffered,		/* --errors=buffered: each one, buffered */
+    errors_summary		/* --errors=summary: grouped, at exit */
+  };
+
+static char const *const error_mode_args[] =
+{
+  "full", "buffered", "summary", nullptr
+};
+static enum error_mode const error_mode_types[] =
+{
+  errors_full, errors_buffered, errors_summary
+};
+ARGMATCH_VERIFY (error_mode_args, error_mode_types);
+
+static enum error_mode error_mode;
+
+/* True means --flat: print each entry under its directory's name,
+   with no per-directory headers or totals.  FLAT_DIR is the name of
+   the directory being listed, followed by a slash, and FLAT_DIR_LEN
+   its length; it is null for the command-line operands.  Only the
+   main thread prints, so --parallel workers never see these.  */
+static bool flat;
+static char *flat_dir;
+static idx_t flat_dir_len;
+
+/* True means --bounded-memory: lay out unsorted -C and -x listings by
+   reading each directory several times, holding one entry at a time
+   rather than all of them.  */
+static bool bounded_memory;
+
+/* True while rereading a directory for --bounded-memory, whose
+   failures were already reported on the first pass.  */
+static bool failures_muted;
+
+/* True means --xattrs: with -l, list extended attribute names after
+   each entry.  XATTR_PATTERN, if not null, restricts them to names
+   that match it, and asks for their values too.  */
+static bool print_xattrs;
+static char const *xattr_pattern;
+
+/* True means --compress-names: see compress_file_names.  */
+static bool compress_names;
+
+/* --parallel: the number of threads that stat directory entries
+   ahead of the main thread, or 0.  */
+enum { MAX_STAT_THREADS = 256 };
+static int stat_threads;
+
 /* Information about filling a column.  */
 struct column_info
 {
@@ -1122,2736 +1539,5969 @@ static void dired_dump_obstack(const char *prefix, struct obstack *os)
     print_positions(prefix, positions, n_pos);
 }
 
-/* Return the platform birthtime member of the stat structure,
-   or fallback to the mtime member, which we have populated
-   from the statx structure or reset to an invalid timestamp
-   where birth time is not supported.  */
-static struct timespec
-get_stat_btime (struct stat const *st)
-{
-#if HAVE_STATX && defined STATX_INO
-  return get_stat_mtime (st);
-#else
-  return get_stat_birthtime (st);
-#endif
-}
+/* Kinds of system calls that ls makes on behalf of the entries it lists.
+   They are counted so that ---call-stats can report the cost of a
+   listing, and so that ---call-budget can fail a run whose per-entry
+   cost exceeds a fixed bound.  Keep in sync with syscall_kind_name.
 
-#if HAVE_STATX && defined STATX_INO
-ATTRIBUTE_PURE
-static unsigned int
-time_type_to_statx (void)
-{
-  switch (time_type)
-    {
-    case time_ctime:
-      return STATX_CTIME;
-    case time_mtime:
-      return STATX_MTIME;
-    case time_atime:
-      return STATX_ATIME;
-    case time_btime:
-      return STATX_BTIME;
-    case time_numtypes: default:
-      unreachable ();
-    }
-    return 0;
-}
+   What is counted is the calls of ls.c's own wrappers, not the system
+   calls beneath them: one file_has_aclinfo (a listxattr and several
+   getxattr), one areadlink_with_size however often it retries, and
+   one readdir whether or not it had to refill its getdents buffer
+   each count once.  A regression inside gnulib or libc is not seen;
+   only the write count comes from the kernel.  */
+enum syscall_kind
+  {
+    SYSCALL_STATX,
+    SYSCALL_READDIR,
+    SYSCALL_XATTR,
+    SYSCALL_READLINK,
+    SYSCALL_WRITE,
+    SYSCALL_OPEN
+  };
+enum { syscall_kind_cardinality = SYSCALL_OPEN + 1 };
 
-ATTRIBUTE_PURE
-static unsigned int
-calc_req_mask (void)
-{
-  unsigned int mask = STATX_MODE;
+static char const syscall_kind_name[][sizeof "readlink"] =
+  {
+    "statx", "readdir", "xattr", "readlink", "write", "open"
+  };
+static_assert (ARRAY_CARDINALITY (syscall_kind_name)
+               == syscall_kind_cardinality);
 
-  if (print_inode)
-    mask |= STATX_INO;
+/* True means report the syscall counts on standard error at exit.  */
+static bool print_stats;
 
-  if (print_block_size)
-    mask |= STATX_BLOCKS;
+/* The number of calls made so far, indexed by enum syscall_kind.
+   Writes happen inside stdio, so SYSCALL_WRITE is filled in from
+   the kernel's accounting when the report is made.  */
+static uintmax_t syscall_count[syscall_kind_cardinality];
 
-  if (format == long_format) {
-    mask |= STATX_NLINK | STATX_SIZE | time_type_to_statx ();
-    if (print_owner || print_author)
-      mask |= STATX_UID;
-    if (print_group)
-      mask |= STATX_GID;
-  }
+/* For --profile, 1 + the kind of the system call in progress, or 0 if
+   none is.  Set by enter_syscall and cleared by leave_syscall.  */
+static volatile sig_atomic_t profile_site;
 
-  switch (sort_type)
-    {
-    case sort_none:
-    case sort_name:
-    case sort_version:
-    case sort_extension:
-    case sort_width:
-      break;
-    case sort_time:
-      mask |= time_type_to_statx ();
-      break;
-    case sort_size:
-      mask |= STATX_SIZE;
-      break;
-    case sort_numtypes: default:
-      unreachable ();
-    }
+/* The number of entries ls has considered for listing.  */
+static uintmax_t stats_entries;
 
-  return mask;
+/* Upper bounds on the calls per entry, as given by ---call-budget.
+   Only kinds whose SYSCALL_BUDGET_SET element is true are checked.  */
+static double syscall_budget[syscall_kind_cardinality];
+static bool syscall_budget_set[syscall_kind_cardinality];
+
+/* Delays and failures to inject before each kind of call, as given by
+   ---inject.  This lets the behavior of ls on slow or flaky network
+   file systems be measured on a local disk.  */
+struct syscall_injection
+  {
+    /* Nanoseconds to sleep before each call.  */
+    uintmax_t delay;
+
+    /* True if the delay is uniformly distributed in [0, 2 * DELAY]
+       rather than fixed.  */
+    bool uniform;
+
+    /* Probability in [0, 1] that the call fails with EIO.  */
+    double error_rate;
+  };
+
+static struct syscall_injection syscall_injection[syscall_kind_cardinality];
+static bool inject_syscalls;
+
+/* Return a pseudo-random number in [0, 1).  The sequence is the same
+   in every run, so that injected failures are reproducible.  Each
+   --parallel worker has a sequence of its own.  */
+
+static double
+inject_random (void)
+{
+  static thread_local uint_least64_t state = 0x9e3779b97f4a7c15;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return ((state * 0x2545f4914f6cdd1d) >> 11) * 0x1p-53;
 }
 
-static int
-do_statx (int fd, char const *name, struct stat *st, int flags,
-          unsigned int mask)
+/* Apply any injected delay to a call of kind KIND that is about to
+   be made.  Return false, with errno set, if an injected failure means
+   the call should not be made; otherwise preserve errno and return
+   true.  Unlike enter_syscall, this is thread-safe.  */
+
+static bool
+inject_syscall (enum syscall_kind kind)
 {
-  struct statx stx;
-  bool want_btime = mask & STATX_BTIME;
-  int ret = statx (fd, name, flags | AT_NO_AUTOMOUNT, mask, &stx);
-  if (ret >= 0)
+  if (!inject_syscalls)
+    return true;
+
+  struct syscall_injection const *inj = &syscall_injection[kind];
+  int saved_errno = errno;
+
+  if (inj->delay)
     {
-      statx_to_stat (&stx, st);
-      /* Since we only need one timestamp type,
-         store birth time in st_mtim.  */
-      if (want_btime)
-        {
-          if (stx.stx_mask & STATX_BTIME)
-            st->st_mtim = statx_timestamp_to_timespec (stx.stx_btime);
-          else
-            st->st_mtim.tv_sec = st->st_mtim.tv_nsec = -1;
-        }
+      uintmax_t ns = (inj->uniform
+                      ? 2 * inj->delay * inject_random ()
+                      : inj->delay);
+      struct timespec d = { .tv_sec = ns / 1000000000,
+                            .tv_nsec = ns % 1000000000 };
+      while (nanosleep (&d, &d) != 0 && errno == EINTR)
+        continue;
     }
 
-  return ret;
-}
+  if (inj->error_rate && inject_random () < inj->error_rate)
+    {
+      errno = EIO;
+      return false;
+    }
 
-static int
-do_stat (char const *name, struct stat *st)
-{
-  return do_statx (AT_FDCWD, name, st, 0, calc_req_mask ());
+  errno = saved_errno;
+  return true;
 }
 
-static int
-do_lstat (char const *name, struct stat *st)
-{
-  return do_statx (AT_FDCWD, name, st, AT_SYMLINK_NOFOLLOW, calc_req_mask ());
-}
+/* Account for a call of kind KIND that is about to be made.  */
 
-static int
-stat_for_mode (char const *name, struct stat *st)
+static void
+count_syscall (enum syscall_kind kind)
 {
-  return do_statx (AT_FDCWD, name, st, 0, STATX_MODE);
+  syscall_count[kind]++;
+  profile_site = kind + 1;
 }
 
-/* dev+ino should be static, so no need to sync with backing store */
-static int
-stat_for_ino (char const *name, struct stat *st)
-{
-  return do_statx (AT_FDCWD, name, st, 0, STATX_INO);
-}
+/* Account for a call of kind KIND that is about to be made, and apply
+   any injected delay.  Return false, with errno set, if an injected
+   failure means the call should not be made; otherwise preserve errno
+   and return true.  */
 
-static int
-fstat_for_ino (int fd, struct stat *st)
-{
-  return do_statx (fd, "", st, AT_EMPTY_PATH, STATX_INO);
-}
-#else
-static int
-do_stat (char const *name, struct stat *st)
+static bool
+enter_syscall (enum syscall_kind kind)
 {
-  return stat (name, st);
-}
+  count_syscall (kind);
 
-static int
-do_lstat (char const *name, struct stat *st)
-{
-  return lstat (name, st);
+  if (!inject_syscall (kind))
+    {
+      profile_site = 0;
+      return false;
+    }
+  return true;
 }
 
-static int
-stat_for_mode (char const *name, struct stat *st)
-{
-  return stat (name, st);
-}
+/* Note that the system call begun by enter_syscall has returned.  */
 
-static int
-stat_for_ino (char const *name, struct stat *st)
+static void
+leave_syscall (void)
 {
-  return stat (name, st);
+  profile_site = 0;
 }
 
-static int
-fstat_for_ino (int fd, struct stat *st)
+/* Parse SPEC, a nonempty comma-separated list of KIND=MAX items, into
+   SYSCALL_BUDGET.  MAX is a per-entry bound such as 1 or 0.25.  */
+
+static void
+decode_call_budget (char const *spec)
 {
-  return fstat (fd, st);
-}
-#endif
+  char const *p = spec;
 
-/* Return the address of the first plain %b spec in FMT, or nullptr if
-   there is no such spec.  %5b etc. do not match, so that user
-   widths/flags are honored.  */
+  if (!*p)
+    error (LS_FAILURE, 0, _("invalid call budget: %s"), quote (spec));
 
-ATTRIBUTE_PURE
-static char const *
-first_percent_b (char const *fmt)
-{
-  for (; *fmt; fmt++)
+  while (*p)
     {
-      if (fmt[0] != '%')
-        continue;
-      
-      if (fmt[1] == 'b')
-        return fmt;
-      
-      if (fmt[1] == '%')
-        fmt++;
+      char const *eq = strchr (p, '=');
+      size_t namelen = eq ? eq - p : 0;
+      int kind = -1;
+      char *end;
+      double bound;
+
+      for (int k = 0; k < syscall_kind_cardinality; k++)
+        if (namelen == strlen (syscall_kind_name[k])
+            && STREQ_LEN (p, syscall_kind_name[k], namelen))
+          kind = k;
+
+      if (kind < 0
+          || ! (0 <= (bound = c_strtod (eq + 1, &end)))
+          || end == eq + 1 || (*end && *end != ','))
+        error (LS_FAILURE, 0, _("invalid call budget: %s"), quote (spec));
+
+      syscall_budget[kind] = bound;
+      syscall_budget_set[kind] = true;
+      p = *end ? end + 1 : end;
     }
-  return nullptr;
 }
 
-static char RFC3986[256];
+/* Parse SPEC, a comma-separated list of KIND=[~]DELAY[@RATE] items,
+   into SYSCALL_INJECTION.  DELAY is a number followed by ns, us, ms
+   or s; a leading '~' makes it the mean of a uniform distribution.
+   RATE is the probability that the call fails with EIO.  */
+
 static void
-file_escape_init (void)
+decode_injection (char const *spec)
 {
-  const char ALLOWED_CHARS[] = {'~', '-', '.', '_'};
-  const int ALLOWED_CHARS_COUNT = sizeof(ALLOWED_CHARS) / sizeof(ALLOWED_CHARS[0]);
-  const int ASCII_TABLE_SIZE = 256;
-  
-  for (int i = 0; i < ASCII_TABLE_SIZE; i++)
-  {
-    int is_allowed = c_isalnum(i);
-    
-    for (int j = 0; j < ALLOWED_CHARS_COUNT && !is_allowed; j++)
+  static struct { char const *suffix; uintmax_t ns; } const units[] =
     {
-      if (i == ALLOWED_CHARS[j])
-      {
-        is_allowed = 1;
-      }
-    }
-    
-    RFC3986[i] |= is_allowed;
-  }
-}
+      { "ns", 1 }, { "us", 1000 }, { "ms", 1000000 }, { "s", 1000000000 }
+    };
+  char const *p = spec;
+
+  while (*p)
+    {
+      char const *eq = strchr (p, '=');
+      size_t namelen = eq ? eq - p : 0;
+      int kind = -1;
+
+      for (int k = 0; k < syscall_kind_cardinality; k++)
+        if (namelen == strlen (syscall_kind_name[k])
+            && STREQ_LEN (p, syscall_kind_name[k], namelen))
+          kind = k;
+      if (kind < 0 || kind == SYSCALL_WRITE)
+        goto invalid;
+
+      struct syscall_injection *inj = &syscall_injection[kind];
+      char *end;
+      p = eq + 1;
+      inj->uniform = *p == '~';
+      p += inj->uniform;
+
+      if (! c_isdigit (*p))
+        goto invalid;
+      errno = 0;
+      uintmax_t delay = strtoumax (p, &end, 10);
+      if (errno)
+        goto invalid;
+
+      int u;
+      for (u = 0; u < ARRAY_CARDINALITY (units); u++)
+        if (STREQ_LEN (end, units[u].suffix, strlen (units[u].suffix))
+            && ! c_isalpha (end[strlen (units[u].suffix)]))
+          break;
+      if (u == ARRAY_CARDINALITY (units)
+          || ckd_mul (&inj->delay, delay, units[u].ns))
+        goto invalid;
+      end += strlen (units[u].suffix);
 
-enum { MBSWIDTH_FLAGS = MBSW_REJECT_INVALID | MBSW_REJECT_UNPRINTABLE };
+      inj->error_rate = 0;
+      if (*end == '@')
+        {
+          char const *rate = end + 1;
+          inj->error_rate = c_strtod (rate, &end);
+          if (end == rate || ! (0 <= inj->error_rate && inj->error_rate <= 1))
+            goto invalid;
+        }
 
-/* Read the abbreviated month names from the locale, to align them
-   and to determine the max width of the field and to truncate names
-   greater than our max allowed.
-   Note even though this handles multibyte locales correctly
-   it's not restricted to them as single byte locales can have
-   variable width abbreviated months and also precomputing/caching
-   the names was seen to increase the performance of ls significantly.  */
+      if (*end && *end != ',')
+        goto invalid;
+      p = *end ? end + 1 : end;
+    }
 
-/* abformat[RECENT][MON] is the format to use for timestamps with
-   recentness RECENT and month MON.  */
-enum { ABFORMAT_SIZE = 128 };
-static char abformat[2][12][ABFORMAT_SIZE];
-/* True if precomputed formats should be used.  This can be false if
-   nl_langinfo fails, if a format or month abbreviation is unusually
-   long, or if a month abbreviation contains '%'.  */
-static bool use_abformat;
+  inject_syscalls = true;
+  return;
 
-/* Store into ABMON the abbreviated month names, suitably aligned.
-   Return true if successful.  */
+ invalid:
+  error (LS_FAILURE, 0, _("invalid syscall injection: %s"), quote (spec));
+}
 
-static bool
-abmon_init (char abmon[12][ABFORMAT_SIZE])
+/* Return the number of write system calls this process has made,
+   or -1 if the kernel does not say.  */
+
+static intmax_t
+proc_write_count (void)
 {
-#ifndef HAVE_NL_LANGINFO
-  return false;
-#else
-  int max_mon_width = 0;
-  int mon_width[12];
-  int mon_len[12];
+  FILE *fp = fopen ("/proc/self/io", "r");
+  if (!fp)
+    return -1;
 
-  if (!load_month_abbreviations(abmon, mon_width, mon_len, &max_mon_width))
-    return false;
+  intmax_t n = -1;
+  char line[64];
+  while (fgets (line, sizeof line, fp))
+    if (STRNCMP_LIT (line, "syscw:") == 0)
+      {
+        n = strtoimax (line + sizeof "syscw:" - 1, nullptr, 10);
+        break;
+      }
+  fclose (fp);
+  return n;
+}
 
-  if (!align_month_abbreviations(abmon, mon_width, mon_len, max_mon_width))
-    return false;
+/* Phases of a listing whose cost ---call-stats reports separately.
+   Time spent in a nested phase is charged to that phase alone, so
+   PHASE_FORMAT does not include PHASE_COLUMNS.  */
+enum ls_phase
+  {
+    PHASE_OTHER,		/* reading directories, stat, and the rest */
+    PHASE_SORT,			/* sort_files */
+    PHASE_FORMAT,		/* print_current_files */
+    PHASE_COLUMNS		/* calculate_columns */
+  };
+enum { ls_phase_cardinality = PHASE_COLUMNS + 1 };
 
-  return true;
-#endif
-}
+static char const ls_phase_name[][sizeof "columns"] =
+  {
+    "other", "sort", "format", "columns"
+  };
+static_assert (ARRAY_CARDINALITY (ls_phase_name) == ls_phase_cardinality);
 
-static bool
-load_month_abbreviations(char abmon[12][ABFORMAT_SIZE], int mon_width[12], 
-                         int mon_len[12], int *max_mon_width)
-{
-  for (int i = 0; i < 12; i++)
-    {
-      if (!load_single_month(abmon[i], &mon_width[i], &mon_len[i], i))
-        return false;
-      *max_mon_width = MAX(*max_mon_width, mon_width[i]);
-    }
-  return true;
-}
+/* The phase the listing is in now.  Volatile, since the --profile
+   signal handler reads it.  */
+static enum ls_phase volatile current_phase;
 
-static bool
-load_single_month(char *month_buffer, int *width, int *length, int month_index)
-{
-  char const *abbr = nl_langinfo(ABMON_1 + month_index);
-  *length = strnlen(abbr, ABFORMAT_SIZE);
-  
-  if (*length == ABFORMAT_SIZE)
-    return false;
-  if (strchr(abbr, '%'))
-    return false;
-  
-  *width = mbswidth(strcpy(month_buffer, abbr), MBSWIDTH_FLAGS);
-  return *width >= 0;
-}
+/* Hardware events counted per phase with ---perf-counters.  */
+enum perf_counter
+  {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES
+  };
+enum { perf_counter_cardinality = PERF_BRANCH_MISSES + 1 };
 
-static bool
-align_month_abbreviations(char abmon[12][ABFORMAT_SIZE], int mon_width[12],
-                          int mon_len[12], int max_mon_width)
-{
-  for (int i = 0; i < 12; i++)
-    {
-      if (!align_single_month(abmon[i], mon_width[i], mon_len[i], max_mon_width))
-        return false;
-    }
-  return true;
-}
+static char const perf_counter_name[][sizeof "branch-misses"] =
+  {
+    "cycles", "instructions", "cache-misses", "branch-misses"
+  };
+static_assert (ARRAY_CARDINALITY (perf_counter_name)
+               == perf_counter_cardinality);
 
-static bool
-align_single_month(char *month_buffer, int width, int length, int max_width)
-{
-  int fill = max_width - width;
-  
-  if (ABFORMAT_SIZE - length <= fill)
-    return false;
-  
-  bool align_left = !c_isdigit(month_buffer[0]);
-  apply_alignment(month_buffer, length, fill, align_left);
-  month_buffer[length + fill] = '\0';
-  
-  return true;
-}
+/* True means count hardware events per phase.  ---perf-counters  */
+static bool print_perf_counters;
+
+/* The leader of the group of perf event descriptors, or -1 if none
+   could be opened.  PERF_GROUP_INDEX[C] is the position of counter C
+   in a read of the group, or -1 if that counter is unavailable.  */
+static int perf_group_fd = -1;
+static int perf_group_index[perf_counter_cardinality];
+
+/* The cost charged to each phase so far.  */
+struct phase_cost
+  {
+    uintmax_t ns;
+    uint_least64_t count[perf_counter_cardinality];
+  };
+static struct phase_cost phase_cost[ls_phase_cardinality];
+
+/* The time and counter values when the current phase was last charged.  */
+static struct timespec phase_mark;
+static uint_least64_t phase_mark_count[perf_counter_cardinality];
+
+/* Open the hardware counters as one group, so that they are scheduled
+   together.  Counters the CPU or the kernel's perf_event_paranoid
+   setting do not allow are left out; if none is allowed, warn and
+   report only wall time.  */
 
 static void
-apply_alignment(char *buffer, int length, int fill, bool align_left)
+perf_counters_init (void)
 {
-  int fill_offset;
-  
-  if (align_left)
-    {
-      fill_offset = length;
-    }
-  else
+#if HAVE_LINUX_PERF_EVENT_H
+  static uint_least64_t const config[] =
     {
-      memmove(buffer + fill, buffer, length);
-      fill_offset = 0;
-    }
-  
-  memset(buffer + fill_offset, ' ', fill);
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+  static_assert (ARRAY_CARDINALITY (config) == perf_counter_cardinality);
+  int fds[perf_counter_cardinality];
+  int n = 0;
+
+  for (int c = 0; c < perf_counter_cardinality; c++)
+    {
+      struct perf_event_attr attr = { .size = sizeof attr };
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[c];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.disabled = perf_group_fd < 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      int fd = syscall (SYS_perf_event_open, &attr, 0, -1, perf_group_fd,
+                        PERF_FLAG_FD_CLOEXEC);
+      perf_group_index[c] = fd < 0 ? -1 : n;
+      if (0 <= fd)
+        fds[n++] = fd;
+      if (0 <= fd && perf_group_fd < 0)
+        perf_group_fd = fd;
+    }
+
+  if (0 <= perf_group_fd
+      && ioctl (perf_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == 0)
+    return;
+
+  /* A group that cannot be enabled would only ever read zeros.  */
+  int saved_errno = errno;
+  for (int i = 0; i < n; i++)
+    close (fds[i]);
+  for (int c = 0; c < perf_counter_cardinality; c++)
+    perf_group_index[c] = -1;
+  perf_group_fd = -1;
+  errno = saved_errno;
+#else
+  errno = ENOTSUP;
+#endif
+  error (0, errno, _("hardware performance counters are unavailable"));
 }
 
-/* Initialize ABFORMAT and USE_ABFORMAT.  */
+/* Store the current values of the hardware counters into COUNT.
+   Leave the elements for unavailable counters alone.  */
 
 static void
-abformat_init (void)
+read_perf_counters (uint_least64_t count[perf_counter_cardinality])
 {
-  char const *pb[2];
-  for (int recent = 0; recent < 2; recent++)
-    pb[recent] = first_percent_b (long_time_format[recent]);
-  if (! (pb[0] || pb[1]))
-    return;
+  uint64_t buf[1 + perf_counter_cardinality];
 
-  char abmon[12][ABFORMAT_SIZE];
-  if (! abmon_init (abmon))
+  if (perf_group_fd < 0
+      || read (perf_group_fd, buf, sizeof buf) < (ssize_t) sizeof *buf)
     return;
 
-  for (int recent = 0; recent < 2; recent++)
-    if (!format_month_names(recent, pb[recent], long_time_format[recent], abmon))
-      return;
-
-  use_abformat = true;
+  for (int c = 0; c < perf_counter_cardinality; c++)
+    if (0 <= perf_group_index[c] && (uint64_t) perf_group_index[c] < buf[0])
+      count[c] = buf[1 + perf_group_index[c]];
 }
 
-static bool
-format_month_names(int recent, char const *percent_b, char const *fmt, char abmon[][ABFORMAT_SIZE])
-{
-  for (int i = 0; i < 12; i++)
-    if (!format_single_month(abformat[recent][i], percent_b, fmt, abmon[i]))
-      return false;
-  return true;
-}
+/* Charge the cost since the last mark to the current phase,
+   and set a new mark.  */
 
-static bool
-format_single_month(char *nfmt, char const *percent_b, char const *fmt, char const *month_abbr)
+static void
+charge_current_phase (void)
 {
-  int nbytes;
-  
-  if (!percent_b)
-    nbytes = snprintf(nfmt, ABFORMAT_SIZE, "%s", fmt);
-  else
-    nbytes = format_with_month_substitution(nfmt, percent_b, fmt, month_abbr);
-  
-  return (0 <= nbytes && nbytes < ABFORMAT_SIZE);
-}
+  struct timespec now;
+  uint_least64_t count[perf_counter_cardinality];
+  struct phase_cost *cost = &phase_cost[current_phase];
 
-static int
-format_with_month_substitution(char *nfmt, char const *percent_b, char const *fmt, char const *month_abbr)
-{
-  int prefix_len = percent_b - fmt;
-  if (prefix_len > MIN(ABFORMAT_SIZE, INT_MAX))
-    return -1;
-  
-  return snprintf(nfmt, ABFORMAT_SIZE, "%.*s%s%s",
-                  prefix_len, fmt, month_abbr, percent_b + 2);
-}
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  cost->ns += ((now.tv_sec - phase_mark.tv_sec) * (uintmax_t) 1000000000
+               + now.tv_nsec - phase_mark.tv_nsec);
+  phase_mark = now;
 
-static size_t
-dev_ino_hash (void const *x, size_t table_size)
-{
-  struct dev_ino const *p = x;
-  return (uintmax_t) p->st_ino % table_size;
+  memcpy (count, phase_mark_count, sizeof count);
+  read_perf_counters (count);
+  for (int c = 0; c < perf_counter_cardinality; c++)
+    cost->count[c] += count[c] - phase_mark_count[c];
+  memcpy (phase_mark_count, count, sizeof count);
 }
 
-static bool
-dev_ino_compare (void const *x, void const *y)
-{
-  struct dev_ino const *a = x;
-  struct dev_ino const *b = y;
-  return PSAME_INODE (a, b);
-}
+/* Start tracking the cost of phases, if it will be reported.  */
 
-static void dev_ino_free(void *x)
+static void
+phase_tracking_init (void)
 {
-    free(x);
+  if (print_perf_counters)
+    perf_counters_init ();
+  if (print_stats)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &phase_mark);
+      read_perf_counters (phase_mark_count);
+    }
 }
 
-/* Add the device/inode pair (P->st_dev/P->st_ino) to the set of
-   active directories.  Return true if there is already a matching
-   entry in the table.  */
+/* Enter PHASE and return the phase to pass to phase_leave.  */
 
-static struct dev_ino* create_dev_ino_entry(dev_t dev, ino_t ino)
+static enum ls_phase
+phase_enter (enum ls_phase phase)
 {
-  struct dev_ino *ent = xmalloc(sizeof *ent);
-  ent->st_ino = ino;
-  ent->st_dev = dev;
-  return ent;
+  enum ls_phase prev = current_phase;
+  if (print_stats)
+    charge_current_phase ();
+  current_phase = phase;
+  return prev;
 }
 
-static void handle_insertion_failure(void)
-{
-  xalloc_die();
-}
+/* Leave the current phase, going back to PREV.  */
 
-static bool is_duplicate_entry(struct dev_ino *inserted, struct dev_ino *original)
+static void
+phase_leave (enum ls_phase prev)
 {
-  return inserted != original;
+  if (print_stats)
+    charge_current_phase ();
+  current_phase = prev;
 }
 
-static bool visit_dir(dev_t dev, ino_t ino)
+/* Print the cost of each phase on standard error.  */
+
+static void
+report_phases (void)
 {
-  struct dev_ino *ent = create_dev_ino_entry(dev, ino);
-  struct dev_ino *ent_from_table = hash_insert(active_dir_set, ent);
+  charge_current_phase ();
 
-  if (ent_from_table == nullptr)
-    handle_insertion_failure();
+  fprintf (stderr, "\n%-9s %14s", "phase", "ms");
+  if (0 <= perf_group_fd)
+    for (int c = 0; c < perf_counter_cardinality; c++)
+      if (0 <= perf_group_index[c])
+        fprintf (stderr, " %14s", perf_counter_name[c]);
+  putc ('\n', stderr);
 
-  bool found_match = is_duplicate_entry(ent_from_table, ent);
+  for (int p = 0; p < ls_phase_cardinality; p++)
+    {
+      fprintf (stderr, "%-9s %14.3f", ls_phase_name[p],
+               phase_cost[p].ns / 1e6);
+      if (0 <= perf_group_fd)
+        for (int c = 0; c < perf_counter_cardinality; c++)
+          if (0 <= perf_group_index[c])
+            fprintf (stderr, " %14ju", (uintmax_t) phase_cost[p].count[c]);
+      putc ('\n', stderr);
+    }
+}
 
-  if (found_match)
-    free(ent);
+/* With --profile, the file that samples are written to, its stream,
+   and the number of samples taken in each phase at each value of
+   PROFILE_SITE.  Samples are taken PROFILE_HZ times per second of the
+   process's CPU time.  Only the main thread takes them, as the
+   --parallel workers block all signals, so the workers' CPU time is
+   charged to the phase and call the main thread is in.  */
+static char const *profile_name;
+static FILE *profile_fp;
+enum { PROFILE_HZ = 1000 };
+static uintmax_t profile_samples[ls_phase_cardinality]
+                                [syscall_kind_cardinality + 1];
 
-  return found_match;
-}
+/* True if ls is being profiled, by --profile or by a profiler that
+   armed a profiling timer before ls started, so that the profiling
+   signals must not be treated as requests to terminate.  */
+static bool profiling;
 
-static void
-free_pending_ent (struct pending *p)
+/* Return true if SIGNUM is one that profiling timers deliver.  */
+
+static bool
+profiling_signal (int signum)
 {
-  free (p->name);
-  free (p->realname);
-  free (p);
+#ifdef SIGPROF
+  if (signum == SIGPROF)
+    return true;
+#endif
+#ifdef SIGVTALRM
+  if (signum == SIGVTALRM)
+    return true;
+#endif
+  return false;
 }
 
+#if defined SIGPROF && defined ITIMER_PROF
+/* Return true if a profiler handles SIGNUM, or has armed TIMER.  */
+
 static bool
-is_colored (enum indicator_no type)
+profiler_attached (int signum, int timer)
 {
-  size_t len = color_indicator[type].len;
-  if (len == 0)
-    return false;
-  if (len > 2)
-    return true;
-  char const *s = color_indicator[type].string;
-  return (s[0] != '0') | (s[len - 1] != '0');
+  struct sigaction act;
+  struct itimerval it;
+  return ((sigaction (signum, nullptr, &act) == 0
+           && act.sa_handler != SIG_DFL && act.sa_handler != SIG_IGN)
+          || (getitimer (timer, &it) == 0
+              && (it.it_value.tv_sec || it.it_value.tv_usec)));
 }
 
 static void
-restore_default_color (void)
+profile_sample (MAYBE_UNUSED int sig)
 {
-  put_indicator (&color_indicator[C_LEFT]);
-  put_indicator (&color_indicator[C_RIGHT]);
+  profile_samples[current_phase][profile_site]++;
 }
+#endif
+
+/* Detect an attached profiler, and with --profile start sampling.  */
 
 static void
-set_normal_color (void)
+profile_start (void)
 {
-  if (!print_with_color || !is_colored (C_NORM))
+#if defined SIGPROF && defined ITIMER_PROF
+  profiling = (profile_name || profiler_attached (SIGPROF, ITIMER_PROF)
+# ifdef SIGVTALRM
+               || profiler_attached (SIGVTALRM, ITIMER_VIRTUAL)
+# endif
+               );
+  if (!profile_name)
     return;
-    
-  put_indicator (&color_indicator[C_LEFT]);
-  put_indicator (&color_indicator[C_NORM]);
-  put_indicator (&color_indicator[C_RIGHT]);
+
+  /* Open the file now, so that a bad name is reported before the
+     listing rather than after it.  */
+  profile_fp = fopen (profile_name, "w");
+  if (!profile_fp)
+    error (LS_FAILURE, errno, _("cannot create %s"), quoteaf (profile_name));
+
+  struct sigaction act;
+  act.sa_handler = profile_sample;
+  sigemptyset (&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  struct itimerval it;
+  it.it_interval.tv_sec = it.it_value.tv_sec = 0;
+  it.it_interval.tv_usec = it.it_value.tv_usec = 1000000 / PROFILE_HZ;
+  if (sigaction (SIGPROF, &act, nullptr) != 0
+      || setitimer (ITIMER_PROF, &it, nullptr) != 0)
+    error (LS_FAILURE, errno, _("cannot start profiling"));
+#else
+  if (profile_name)
+    error (LS_FAILURE, 0, _("profiling is not supported on this system"));
+#endif
 }
 
-/* An ordinary signal was received; arrange for the program to exit.  */
+/* Stop sampling and write the samples to the --profile file, one line
+   per phase and system call kind, in the folded-stack format that
+   flame graph tools read: "ls;PHASE[;CALL] COUNT".  */
 
-static void sighandler(int sig)
+static void
+profile_finish (void)
 {
-    if (!SA_NOCLDSTOP) {
-        signal(sig, SIG_IGN);
-    }
-    
-    if (!interrupt_signal) {
-        interrupt_signal = sig;
-    }
-}
+#if defined SIGPROF && defined ITIMER_PROF
+  if (!profile_fp)
+    return;
 
-/* A SIGTSTP was received; arrange for the program to suspend itself.  */
+  struct itimerval it = { 0 };
+  setitimer (ITIMER_PROF, &it, nullptr);
 
-static void stophandler(int sig) {
-    if (!SA_NOCLDSTOP) {
-        signal(sig, stophandler);
-    }
-    
-    if (!interrupt_signal) {
-        stop_signal_count++;
+  FILE *fp = profile_fp;
+  profile_fp = nullptr;
+
+  for (int p = 0; p < ls_phase_cardinality; p++)
+    for (int k = 0; k <= syscall_kind_cardinality; k++)
+      if (profile_samples[p][k])
+        fprintf (fp, "ls;%s%s%s %ju\n", ls_phase_name[p],
+                 k ? ";" : "", k ? syscall_kind_name[k - 1] : "",
+                 profile_samples[p][k]);
+
+  bool failed = ferror (fp);
+  if (fclose (fp) != 0 || failed)
+    {
+      error (0, failed ? 0 : errno, _("error writing %s"),
+             quoteaf (profile_name));
+      set_exit_status (true);
     }
+#endif
 }
 
-/* Process any pending signals.  If signals are caught, this function
-   should be called periodically.  Ideally there should never be an
-   unbounded amount of time when signals are not being processed.
-   Signal handling can restore the default colors, so callers must
-   immediately change colors after invoking this function.  */
+/* With ---call-stats, print the number of calls of each kind and the
+   number per listed entry.  With ---call-budget, diagnose each kind
+   that went over its bound and arrange for a failing exit status.  */
 
-static void restore_output_state(void)
+static void
+report_stats (void)
 {
-    if (used_color)
-        restore_default_color();
-    fflush(stdout);
-}
+  bool any_budget = false;
+  for (int k = 0; k < syscall_kind_cardinality; k++)
+    any_budget |= syscall_budget_set[k];
+  if (!print_stats && !any_budget)
+    return;
 
-static void block_signals(sigset_t *oldset)
-{
-    sigprocmask(SIG_BLOCK, &caught_signals, oldset);
-}
+  /* Let stdio issue its pending writes, so that they are counted.  */
+  fflush (stdout);
+  intmax_t writes = proc_write_count ();
+  if (0 <= writes)
+    syscall_count[SYSCALL_WRITE] = writes;
 
-static void restore_signals(const sigset_t *oldset)
-{
-    sigprocmask(SIG_SETMASK, oldset, nullptr);
-}
+  if (print_stats)
+    fprintf (stderr, "%-9s %14ju\n", "entries", stats_entries);
 
-static int determine_signal_to_raise(int *stops)
-{
-    int sig = interrupt_signal;
-    *stops = stop_signal_count;
-    
-    if (*stops)
+  for (int k = 0; k < syscall_kind_cardinality; k++)
     {
-        stop_signal_count = *stops - 1;
-        return SIGSTOP;
-    }
-    
-    signal(sig, SIG_DFL);
-    return sig;
-}
+      bool known = k != SYSCALL_WRITE || 0 <= writes;
+      double per_entry = (stats_entries
+                          ? (double) syscall_count[k] / stats_entries
+                          : syscall_count[k]);
 
-static void handle_one_signal(void)
-{
-    int stops;
-    sigset_t oldset;
-    
-    restore_output_state();
-    block_signals(&oldset);
-    
-    int sig = determine_signal_to_raise(&stops);
-    
-    raise(sig);
-    restore_signals(&oldset);
-}
+      if (print_stats)
+        {
+          if (known)
+            fprintf (stderr, "%-9s %14ju %10.3f\n", syscall_kind_name[k],
+                     syscall_count[k], per_entry);
+          else
+            fprintf (stderr, "%-9s %14s %10s\n", syscall_kind_name[k],
+                     "?", "?");
+        }
 
-static void process_signals(void)
-{
-    while (interrupt_signal || stop_signal_count)
-    {
-        handle_one_signal();
+      if (known && syscall_budget_set[k] && syscall_budget[k] < per_entry)
+        {
+          error (0, 0, _("%s: %.3f calls per entry exceeds budget of %g"),
+                 syscall_kind_name[k], per_entry, syscall_budget[k]);
+          set_exit_status (true);
+        }
     }
+
+  if (print_stats)
+    report_phases ();
 }
 
-/* Setup signal handlers if INIT is true,
-   otherwise restore to the default.  */
+/* With --progress, the nanoseconds between progress reports, or zero
+   for no reports, and the stream they go to.  */
+static uintmax_t progress_interval;
+static FILE *progress_fp;
+static int progress_fd = STDERR_FILENO;
 
-static int const sig[] =
-{
-    SIGTSTP,
-    SIGALRM, SIGHUP, SIGINT, SIGPIPE, SIGQUIT, SIGTERM,
-#ifdef SIGPOLL
-    SIGPOLL,
-#endif
-#ifdef SIGPROF
-    SIGPROF,
-#endif
-#ifdef SIGVTALRM
-    SIGVTALRM,
-#endif
-#ifdef SIGXCPU
-    SIGXCPU,
-#endif
-#ifdef SIGXFSZ
-    SIGXFSZ,
-#endif
-};
+/* When the last progress report was made, and how many entries had
+   been considered by then.  */
+static struct timespec progress_mark;
+static uintmax_t progress_mark_entries;
 
-enum { nsigs = ARRAY_CARDINALITY (sig) };
+/* The number of directories listed, the number waiting in
+   PENDING_DIRS, and the one being listed.  */
+static uintmax_t dirs_done;
+static uintmax_t dirs_pending;
+static char const *progress_dir;
 
-#if ! SA_NOCLDSTOP
-static bool caught_sig[nsigs];
-#endif
+/* A histogram of stat latencies.  Bucket I counts the calls that took
+   less than 2**I nanoseconds, and at least half that.  */
+enum { stat_latency_buckets = 40 };
+static uintmax_t stat_latency[stat_latency_buckets];
+static uintmax_t stat_latency_count;
 
-static void (*get_signal_handler(int signal_num))(int)
+static uintmax_t
+timespec_ns_since (struct timespec const *then, struct timespec const *now)
 {
-    return signal_num == SIGTSTP ? stophandler : sighandler;
+  return ((now->tv_sec - then->tv_sec) * (uintmax_t) 1000000000
+          + now->tv_nsec - then->tv_nsec);
 }
 
-#if SA_NOCLDSTOP
-static void setup_signal_action(int signal_num, struct sigaction *act)
-{
-    if (sigismember(&caught_signals, signal_num))
-    {
-        act->sa_handler = get_signal_handler(signal_num);
-        sigaction(signal_num, act, nullptr);
-    }
-}
+/* Parse the SECONDS argument of --progress.  */
 
-static void collect_non_ignored_signals(void)
+static void
+decode_progress (char const *spec)
 {
-    struct sigaction act;
-    int j;
-    
-    sigemptyset(&caught_signals);
-    for (j = 0; j < nsigs; j++)
+  double seconds = 1;
+  if (spec)
     {
-        sigaction(sig[j], nullptr, &act);
-        if (act.sa_handler != SIG_IGN)
-            sigaddset(&caught_signals, sig[j]);
+      char *end;
+      errno = 0;
+      seconds = c_strtod (spec, &end);
+      if (errno || end == spec || *end || ! (0 < seconds && seconds < 1e9))
+        error (LS_FAILURE, 0, _("invalid progress interval: %s"),
+               quote (spec));
     }
+  progress_interval = MAX (1, seconds * 1e9);
 }
 
-static void install_signal_handlers(void)
+static void
+progress_init (void)
 {
-    struct sigaction act;
-    int j;
-    
-    collect_non_ignored_signals();
-    
-    act.sa_mask = caught_signals;
-    act.sa_flags = SA_RESTART;
-    
-    for (j = 0; j < nsigs; j++)
-        setup_signal_action(sig[j], &act);
+  if (!progress_interval)
+    return;
+
+  progress_fp = (progress_fd == STDERR_FILENO ? stderr
+                 : fdopen (progress_fd, "w"));
+  if (!progress_fp)
+    error (LS_FAILURE, errno, _("cannot write progress to file descriptor %d"),
+           progress_fd);
+  setvbuf (progress_fp, nullptr, _IOLBF, 0);
+  clock_gettime (CLOCK_MONOTONIC, &progress_mark);
 }
 
-static void restore_signal_defaults(void)
+/* Record that a stat call begun at START has returned.  */
+
+static void
+record_stat_latency (struct timespec const *start)
 {
-    int j;
-    
-    for (j = 0; j < nsigs; j++)
-        if (sigismember(&caught_signals, sig[j]))
-            signal(sig[j], SIG_DFL);
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  uintmax_t ns = timespec_ns_since (start, &now);
+
+  int i = 0;
+  while (i < stat_latency_buckets - 1 && ((uintmax_t) 1 << i) <= ns)
+    i++;
+  stat_latency[i]++;
+  stat_latency_count++;
 }
-#else
-static void setup_single_signal(int j)
+
+/* Return the upper bound in microseconds of the bucket that holds the
+   stat latency at quantile Q.  */
+
+static double
+stat_latency_quantile (double q)
 {
-    caught_sig[j] = (signal(sig[j], SIG_IGN) != SIG_IGN);
-    if (caught_sig[j])
+  uintmax_t rank = q * stat_latency_count;
+  uintmax_t seen = 0;
+  int i;
+  for (i = 0; i < stat_latency_buckets - 1; i++)
     {
-        signal(sig[j], get_signal_handler(sig[j]));
-        siginterrupt(sig[j], 0);
+      seen += stat_latency[i];
+      if (rank < seen)
+        break;
     }
+  return ((uintmax_t) 1 << i) / 1e3;
 }
 
-static void install_signal_handlers(void)
-{
-    int j;
-    
-    for (j = 0; j < nsigs; j++)
-        setup_single_signal(j);
-}
+/* Report progress, as of NOW, on the progress stream.  */
 
-static void restore_signal_defaults(void)
+static void
+progress_report (struct timespec const *now)
 {
-    int j;
-    
-    for (j = 0; j < nsigs; j++)
-        if (caught_sig[j])
-            signal(sig[j], SIG_DFL);
-}
-#endif
+  uintmax_t elapsed = timespec_ns_since (&progress_mark, now);
+  double rate = (elapsed
+                 ? (stats_entries - progress_mark_entries) * 1e9 / elapsed
+                 : 0);
+  progress_mark = *now;
+  progress_mark_entries = stats_entries;
 
-static void signal_setup(bool init)
-{
-    if (init)
-        install_signal_handlers();
-    else
-        restore_signal_defaults();
-}
+  fprintf (progress_fp,
+           _("%s: %ju directories done, %ju pending, %ju entries, %.0f/s"),
+           program_name, dirs_done, dirs_pending, stats_entries, rate);
 
-static void signal_init(void)
-{
-    signal_setup(true);
-}
+  if (stat_latency_count)
+    fprintf (progress_fp, _(", stat p50 %.1fus p90 %.1fus p99 %.1fus"),
+             stat_latency_quantile (0.50), stat_latency_quantile (0.90),
+             stat_latency_quantile (0.99));
 
-static void signal_restore(void)
-{
-    signal_setup(false);
+  /* This is a seek, not a write, and costs nothing per entry.  */
+  off_t written = ftello (stdout);
+  if (0 <= written)
+    fprintf (progress_fp, _(", %jd bytes written"), (intmax_t) written);
+
+  if (progress_dir)
+    fprintf (progress_fp, _(", in %s"), quotef (progress_dir));
+  putc ('\n', progress_fp);
 }
 
-int
-main (int argc, char **argv)
-{
-  int i;
-  struct pending *thispend;
-  int n_files;
+/* Report progress if the interval has passed since the last report.
+   This reads only the vDSO clock, so it is cheap enough to call every
+   few entries.  */
 
-  initialize_main (&argc, &argv);
-  set_program_name (argv[0]);
-  setlocale (LC_ALL, "");
-  bindtextdomain (PACKAGE, LOCALEDIR);
-  textdomain (PACKAGE);
+static void
+progress_tick (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (progress_interval <= timespec_ns_since (&progress_mark, &now))
+    progress_report (&now);
+}
 
-  initialize_exit_failure (LS_FAILURE);
-  atexit (close_stdout);
+/* Make the final progress report, with the totals.  */
 
-  static_assert (ARRAY_CARDINALITY (color_indicator)
-                 == ARRAY_CARDINALITY (indicator_name));
+static void
+progress_finish (void)
+{
+  if (!progress_interval)
+    return;
 
-  exit_status = EXIT_SUCCESS;
-  print_dir_name = true;
-  pending_dirs = nullptr;
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  progress_dir = nullptr;
+  progress_report (&now);
+}
 
-  current_time.tv_sec = TYPE_MINIMUM (time_t);
-  current_time.tv_nsec = -1;
+/* With --output, the file that standard output was redirected to.
+   Its stdio buffer is OUTPUT_BUFFER_SIZE bytes, page aligned, so that
+   each flush is one large write.  OUTPUT_PREALLOCATE bytes are
+   reserved for it up front.  With OUTPUT_DONTNEED, the pages written
+   are dropped from the page cache as the listing proceeds.  */
+enum { OUTPUT_BUFFER_DEFAULT = 4 * 1024 * 1024 };
+static char const *output_name;
+static idx_t output_buffer_size = OUTPUT_BUFFER_DEFAULT;
+static off_t output_preallocate;
+static bool output_dontneed;
 
-  i = decode_switches (argc, argv);
+/* The output offsets up to which writeback was started, and up to
+   which the page cache was told to drop the pages.  */
+static off_t output_written;
+static off_t output_dropped;
 
-  setup_color_output();
-  setup_symlink_checking();
-  setup_dereference_mode();
-  setup_recursive_mode();
-  setup_format_flags();
-  setup_auxiliary_structures();
+/* Whether standard output is a tty, or -1 if not yet known.  */
+static signed char stdout_tty = -1;
 
-  cwd_n_alloc = 100;
-  cwd_file = xmalloc (cwd_n_alloc * sizeof *cwd_file);
-  cwd_n_used = 0;
+/* Return the size given by SPEC, such as 4M, or -1 if invalid.  */
 
-  clear_files ();
+static intmax_t
+decode_output_size (char const *spec)
+{
+  uintmax_t val;
+  if (xstrtoumax (spec, nullptr, 10, &val, "EGKkMPTYZ0") != LONGINT_OK
+      || MIN (IDX_MAX, TYPE_MAXIMUM (off_t)) < val)
+    return -1;
+  return val;
+}
 
-  n_files = argc - i;
+/* Parse SPEC, a comma-separated list of buffer=SIZE,
+   preallocate=SIZE and dontneed items, for --output-options.  */
 
-  process_file_arguments(n_files, argc, argv, i);
+static void
+decode_output_options (char const *spec)
+{
+  char *list = xstrdup (spec);
 
-  if (cwd_n_used)
+  for (char *item = strtok (list, ","); item; item = strtok (nullptr, ","))
     {
-      sort_files ();
-      if (!immediate_dirs)
-        extract_dirs_from_files (nullptr, true);
-    }
+      char *eq = strchr (item, '=');
+      intmax_t size = -1;
+      if (eq)
+        {
+          *eq = '\0';
+          size = decode_output_size (eq + 1);
+        }
 
-  handle_current_files_output(n_files);
-  process_pending_directories();
-  finalize_color_output();
-  finalize_dired_output();
-  cleanup_recursive_structures();
+      if (STREQ (item, "dontneed") && !eq)
+        output_dontneed = true;
+      else if (STREQ (item, "buffer") && 0 < size)
+        output_buffer_size = size;
+      else if (STREQ (item, "preallocate") && 0 <= size)
+        output_preallocate = size;
+      else
+        error (LS_FAILURE, 0, _("invalid output options: %s"), quote (spec));
+    }
 
-  return exit_status;
+  free (list);
 }
 
-static void setup_color_output(void)
-{
-  if (print_with_color)
-    parse_ls_color ();
+/* Redirect standard output to the file NAME, as the shell would.
+   This is done as soon as --output is seen, so that the options that
+   follow it test whether the file is a terminal.  The file is not
+   truncated until output_truncate, so that an invalid option later on
+   the command line leaves an existing file as it was.  */
 
-  if (print_with_color)
+static void
+output_open (char const *name)
+{
+  int fd = open (name, O_WRONLY | O_CREAT | O_CLOEXEC, MODE_RW_UGO);
+  if (fd < 0)
+    error (LS_FAILURE, errno, _("cannot create %s"), quoteaf (name));
+  if (fd != STDOUT_FILENO)
     {
-      tabsize = 0;
+      if (dup2 (fd, STDOUT_FILENO) < 0)
+        error (LS_FAILURE, errno, _("cannot redirect output to %s"),
+               quoteaf (name));
+      close (fd);
     }
+
+  output_name = name;
+  stdout_tty = -1;
 }
 
-static void setup_symlink_checking(void)
-{
-  if (directories_first)
-    {
-      check_symlink_mode = true;
-    }
-  else if (print_with_color)
-    {
-      if (is_colored (C_ORPHAN)
-          || (is_colored (C_EXEC) && color_symlink_as_referent)
-          || (is_colored (C_MISSING) && format == long_format))
-        check_symlink_mode = true;
-    }
-}
+/* Empty the --output file, now that all options have been checked.  */
 
-static void setup_dereference_mode(void)
+static void
+output_truncate (void)
 {
-  if (dereference == DEREF_UNDEFINED)
-    {
-      dereference = ((immediate_dirs
-                      || indicator_style == classify
-                      || format == long_format)
-                     ? DEREF_NEVER
-                     : DEREF_COMMAND_LINE_SYMLINK_TO_DIR);
-    }
+  if (output_name && ftruncate (STDOUT_FILENO, 0) < 0)
+    error (LS_FAILURE, errno, _("cannot truncate %s"), quoteaf (output_name));
 }
 
-static void setup_recursive_mode(void)
+/* Give standard output its large buffer, before anything is written
+   to it, and reserve space for the file.  */
+
+static void
+output_setup (void)
 {
-  if (recursive)
-    {
-      active_dir_set = hash_initialize (INITIAL_TABLE_SIZE, nullptr,
-                                        dev_ino_hash,
-                                        dev_ino_compare,
-                                        dev_ino_free);
-      if (active_dir_set == nullptr)
-        xalloc_die ();
+  if (!output_name)
+    return;
 
-      obstack_init (&dev_ino_obstack);
-    }
+  /* Round up to whole pages, so that full buffers are written at
+     page-aligned offsets.  */
+  idx_t page = getpagesize ();
+  idx_t size = output_buffer_size;
+  if (ckd_add (&size, size, page - 1))
+    xalloc_die ();
+  size -= size % page;
+  setvbuf (stdout, xalignalloc (page, size), _IOFBF, size);
+
+#if defined FALLOC_FL_KEEP_SIZE
+  /* This is only a hint; the listing is written either way.  */
+  if (output_preallocate)
+    ignore_value (fallocate (STDOUT_FILENO, FALLOC_FL_KEEP_SIZE,
+                             0, output_preallocate));
+#endif
 }
 
-static void setup_format_flags(void)
+/* With --output-options=dontneed, drop the output that stdio has
+   written so far from the page cache.  Dirty pages cannot be dropped,
+   so writeback of newly written data is started now and the data is
+   dropped on a later call, once at least one buffer's worth more has
+   been written.  FINAL says to wait for and drop everything.  */
+
+static void
+output_advise (bool final)
 {
-  localtz = tzalloc (getenv ("TZ"));
+  if (!output_dontneed)
+    return;
+
+  off_t pos = lseek (STDOUT_FILENO, 0, SEEK_CUR);
+  if (pos < 0 || (!final && pos - output_written < output_buffer_size))
+    return;
 
-  format_needs_stat = ((sort_type == sort_time) | (sort_type == sort_size)
-                       | (format == long_format)
-                       | print_block_size | print_hyperlink | print_scontext);
-  format_needs_type = ((! format_needs_stat)
-                       & (recursive | print_with_color | print_scontext
-                          | directories_first
-                          | (indicator_style != none)));
-  format_needs_capability = print_with_color && is_colored (C_CAP);
+#if defined SYNC_FILE_RANGE_WRITE
+  ignore_value (sync_file_range (STDOUT_FILENO, output_written,
+                                 pos - output_written,
+                                 SYNC_FILE_RANGE_WRITE));
+#endif
+  off_t drop_end = final ? pos : output_written;
+  if (final)
+    fdatasync (STDOUT_FILENO);
+#if defined SYNC_FILE_RANGE_WAIT_AFTER
+  else
+    ignore_value (sync_file_range (STDOUT_FILENO, output_dropped,
+                                   drop_end - output_dropped,
+                                   (SYNC_FILE_RANGE_WAIT_BEFORE
+                                    | SYNC_FILE_RANGE_WRITE
+                                    | SYNC_FILE_RANGE_WAIT_AFTER)));
+#endif
+  if (output_dropped < drop_end)
+    posix_fadvise (STDOUT_FILENO, output_dropped, drop_end - output_dropped,
+                   POSIX_FADV_DONTNEED);
+  output_dropped = drop_end;
+  output_written = pos;
 }
 
-static void setup_auxiliary_structures(void)
+/* Write out what stdio still holds for the --output file, drop it
+   from the page cache if requested, and give back the space that was
+   preallocated past its end.  */
+
+static void
+output_finish (void)
 {
-  if (dired)
-    {
-      obstack_init (&dired_obstack);
-      obstack_init (&subdired_obstack);
-    }
+  if (!output_name)
+    return;
 
-  if (print_hyperlink)
-    {
-      file_escape_init ();
+  fflush (stdout);
+  output_advise (true);
 
-      hostname = xgethostname ();
-      if (! hostname)
-        hostname = "";
-    }
+  off_t pos = lseek (STDOUT_FILENO, 0, SEEK_CUR);
+  if (pos < 0 || output_preallocate <= pos)
+    return;
+#if defined FALLOC_FL_PUNCH_HOLE && defined FALLOC_FL_KEEP_SIZE
+  if (fallocate (STDOUT_FILENO, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 pos, output_preallocate - pos) == 0)
+    return;
+#endif
+  /* Truncating to the current size frees the blocks past it on the
+     file systems that kept them.  */
+  ignore_value (ftruncate (STDOUT_FILENO, pos));
 }
 
-static void process_file_arguments(int n_files, int argc, char **argv, int i)
+/* Return the platform birthtime member of the stat structure,
+   or fallback to the mtime member, which we have populated
+   from the statx structure or reset to an invalid timestamp
+   where birth time is not supported.  */
+static struct timespec
+get_stat_btime (struct stat const *st)
 {
-  if (n_files <= 0)
-    {
-      if (immediate_dirs)
-        gobble_file (".", directory, NOT_AN_INODE_NUMBER, true, nullptr);
-      else
-        queue_directory (".", nullptr, true);
-    }
-  else
-    {
-      do
-        gobble_file (argv[i++], unknown, NOT_AN_INODE_NUMBER, true, nullptr);
-      while (i < argc);
-    }
+#if HAVE_STATX && defined STATX_INO
+  return get_stat_mtime (st);
+#else
+  return get_stat_birthtime (st);
+#endif
 }
 
-static void handle_current_files_output(int n_files)
+#if HAVE_STATX && defined STATX_INO
+ATTRIBUTE_PURE
+static unsigned int
+time_type_to_statx (void)
 {
-  if (cwd_n_used)
-    {
-      print_current_files ();
-      if (pending_dirs)
-        dired_outbyte ('\n');
-    }
-  else if (n_files <= 1 && pending_dirs && pending_dirs->next == 0)
+  switch (time_type)
     {
-      print_dir_name = false;
+    case time_ctime:
+      return STATX_CTIME;
+    case time_mtime:
+      return STATX_MTIME;
+    case time_atime:
+      return STATX_ATIME;
+    case time_btime:
+      return STATX_BTIME;
+    case time_numtypes: default:
+      unreachable ();
     }
+    return 0;
 }
 
-static void process_pending_directories(void)
+ATTRIBUTE_PURE
+static unsigned int
+calc_req_mask (void)
 {
-  struct pending *thispend;
-  
-  while (pending_dirs)
-    {
-      thispend = pending_dirs;
-      pending_dirs = pending_dirs->next;
+  unsigned int mask = STATX_MODE;
 
-      if (LOOP_DETECT && process_marker_entry(thispend))
-        continue;
+  /* A snapshot or columnar table must hold every field a later reader
+     might want.  Birth time still replaces mtime, as below.  */
+  if (capture_name || format == columnar_format || also_output_columnar_p)
+    return (STATX_BASIC_STATS
+            | (time_type == time_btime ? STATX_BTIME : 0));
 
-      print_dir (thispend->name, thispend->realname,
-                 thispend->command_line_arg);
+  if (print_inode)
+    mask |= STATX_INO;
 
-      free_pending_ent (thispend);
-      print_dir_name = true;
+  if (print_block_size)
+    mask |= STATX_BLOCKS;
+
+  if (format == long_format) {
+    mask |= STATX_NLINK | STATX_SIZE | time_type_to_statx ();
+    if (print_owner || print_author)
+      mask |= STATX_UID;
+    if (print_group)
+      mask |= STATX_GID;
+  }
+
+  switch (sort_type)
+    {
+    case sort_none:
+    case sort_name:
+    case sort_version:
+    case sort_iname:
+    case sort_natural:
+    case sort_extension:
+    case sort_width:
+      break;
+    case sort_multi:
+      for (int i = 0; i < n_sort_keys; i++)
+        switch (sort_keys[i].field)
+          {
+          case key_size: mask |= STATX_SIZE; break;
+          case key_time: mask |= time_type_to_statx (); break;
+          case key_atime: mask |= STATX_ATIME; break;
+          case key_mtime: mask |= STATX_MTIME; break;
+          case key_ctime: mask |= STATX_CTIME; break;
+          default: break;
+          }
+      break;
+    case sort_time:
+      mask |= time_type_to_statx ();
+      break;
+    case sort_size:
+      mask |= STATX_SIZE;
+      break;
+    case sort_numtypes: default:
+      unreachable ();
     }
+
+  return mask;
 }
 
-static bool process_marker_entry(struct pending *thispend)
+static int
+statx_stat (int fd, char const *name, struct stat *st, int flags,
+            unsigned int mask)
 {
-  if (thispend->name == nullptr)
+  struct statx stx;
+  bool want_btime = mask & STATX_BTIME;
+  int ret = statx (fd, name, flags | AT_NO_AUTOMOUNT, mask, &stx);
+  if (ret >= 0)
     {
-      struct dev_ino di = dev_ino_pop ();
-      struct dev_ino *found = hash_remove (active_dir_set, &di);
-      if (false)
-        assert_matching_dev_ino (thispend->realname, di);
-      affirm (found);
-      dev_ino_free (found);
-      free_pending_ent (thispend);
-      return true;
+      statx_to_stat (&stx, st);
+      /* Since we only need one timestamp type,
+         store birth time in st_mtim.  */
+      if (want_btime)
+        {
+          if (stx.stx_mask & STATX_BTIME)
+            st->st_mtim = statx_timestamp_to_timespec (stx.stx_btime);
+          else
+            st->st_mtim.tv_sec = st->st_mtim.tv_nsec = -1;
+        }
     }
-  return false;
+
+  return ret;
 }
 
-static void finalize_color_output(void)
+static int
+do_statx (int fd, char const *name, struct stat *st, int flags,
+          unsigned int mask)
 {
-  int j;
-  
-  if (!print_with_color || !used_color)
-    return;
-
-  if (!is_default_color_restore_needed())
-    restore_default_color ();
-
-  fflush (stdout);
-
-  signal_restore ();
-
-  for (j = stop_signal_count; j; j--)
-    raise (SIGSTOP);
-  j = interrupt_signal;
-  if (j)
-    raise (j);
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = statx_stat (fd, name, st, flags, mask);
+  leave_syscall ();
+  return ret;
 }
 
-static bool is_default_color_restore_needed(void)
+static int
+do_stat (int fd, char const *name, struct stat *st)
 {
-  #define COLOR_LEFT_LEN 2
-  #define COLOR_LEFT_STR "\033["
-  #define COLOR_RIGHT_LEN 1
-  #define COLOR_RIGHT_CHAR 'm'
-  
-  return (color_indicator[C_LEFT].len == COLOR_LEFT_LEN
-          && memcmp (color_indicator[C_LEFT].string, COLOR_LEFT_STR, COLOR_LEFT_LEN) == 0
-          && color_indicator[C_RIGHT].len == COLOR_RIGHT_LEN
-          && color_indicator[C_RIGHT].string[0] == COLOR_RIGHT_CHAR);
+  return do_statx (fd, name, st, 0, plan.statx_mask);
 }
 
-static void finalize_dired_output(void)
+static int
+do_lstat (int fd, char const *name, struct stat *st)
 {
-  if (dired)
-    {
-      dired_dump_obstack ("//DIRED//", &dired_obstack);
-      dired_dump_obstack ("//SUBDIRED//", &subdired_obstack);
-      printf ("//DIRED-OPTIONS// --quoting-style=%s\n",
-              quoting_style_args[get_quoting_style (filename_quoting_options)]);
-    }
+  return do_statx (fd, name, st, AT_SYMLINK_NOFOLLOW, plan.statx_mask);
 }
 
-static void cleanup_recursive_structures(void)
+static int
+stat_for_mode (int fd, char const *name, struct stat *st)
 {
-  if (LOOP_DETECT)
-    {
-      assure (hash_get_n_entries (active_dir_set) == 0);
-      hash_free (active_dir_set);
-    }
+  return do_statx (fd, name, st, 0, STATX_MODE);
 }
 
-/* Return the line length indicated by the value given by SPEC, or -1
-   if unsuccessful.  0 means no limit on line length.  */
-
-static ptrdiff_t
-decode_line_length (char const *spec)
+/* dev+ino should be static, so no need to sync with backing store */
+static int
+stat_for_ino (char const *name, struct stat *st)
 {
-  uintmax_t val;
-  
-  switch (xstrtoumax (spec, nullptr, 0, &val, ""))
-    {
-    case LONGINT_OK:
-      return val <= MIN (PTRDIFF_MAX, SIZE_MAX) ? val : 0;
+  return do_statx (AT_FDCWD, name, st, 0, STATX_INO);
+}
 
-    case LONGINT_OVERFLOW:
-      return 0;
-
-    case LONGINT_INVALID:
-    case LONGINT_INVALID_SUFFIX_CHAR:
-    case LONGINT_INVALID_SUFFIX_CHAR_WITH_OVERFLOW:
-      return -1;
-
-    default:
-      unreachable ();
-    }
+static int
+fstat_for_ino (int fd, struct stat *st)
+{
+  return do_statx (fd, "", st, AT_EMPTY_PATH, STATX_INO);
 }
-
-/* Return true if standard output is a tty, caching the result.  */
-
-static bool
-stdout_isatty (void)
+#else
+static int
+do_stat (int fd, char const *name, struct stat *st)
 {
-  static signed char out_tty = -1;
-  if (out_tty < 0)
-    out_tty = isatty (STDOUT_FILENO);
-  assume (out_tty == 0 || out_tty == 1);
-  return out_tty;
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = fstatat (fd, name, st, 0);
+  leave_syscall ();
+  return ret;
 }
 
-/* Set all the option flags according to the switches specified.
-   Return the index of the first non-option argument.  */
-
-static void handle_option_a(void) {
-    ignore_mode = IGNORE_MINIMAL;
+static int
+do_lstat (int fd, char const *name, struct stat *st)
+{
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = fstatat (fd, name, st, AT_SYMLINK_NOFOLLOW);
+  leave_syscall ();
+  return ret;
 }
 
-static void handle_option_f(void) {
-    ignore_mode = IGNORE_MINIMAL;
-    sort_opt = sort_none;
+static int
+stat_for_mode (int fd, char const *name, struct stat *st)
+{
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = fstatat (fd, name, st, 0);
+  leave_syscall ();
+  return ret;
 }
 
-static void handle_option_g(int *format_opt) {
-    *format_opt = long_format;
-    print_owner = false;
+static int
+stat_for_ino (char const *name, struct stat *st)
+{
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = stat (name, st);
+  leave_syscall ();
+  return ret;
 }
 
-static void handle_option_h(void) {
-    file_human_output_opts = human_output_opts =
-        human_autoscale | human_SI | human_base_1024;
-    file_output_block_size = output_block_size = 1;
+static int
+fstat_for_ino (int fd, struct stat *st)
+{
+  if (!enter_syscall (SYSCALL_STATX))
+    return -1;
+  int ret = fstat (fd, st);
+  leave_syscall ();
+  return ret;
 }
+#endif
 
-static void handle_option_n(int *format_opt) {
-    numeric_ids = true;
-    *format_opt = long_format;
+/* Stat NAME relative to the directory FD, following a final symlink
+   if FOLLOW, as do_stat or do_lstat would but without enter_syscall,
+   which is not thread-safe.  For the --parallel workers; the main
+   thread accounts for the call when it uses the result, but any
+   injected delay or failure applies here, so that it is spread over
+   the workers as real latency would be.  */
+static int
+stat_at_unaccounted (int fd, char const *name, struct stat *st, bool follow)
+{
+  if (!inject_syscall (SYSCALL_STATX))
+    return -1;
+#if HAVE_STATX && defined STATX_INO
+  return statx_stat (fd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW,
+                     plan.statx_mask);
+#else
+  return fstatat (fd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
 }
 
-static void handle_option_o(int *format_opt) {
-    *format_opt = long_format;
-    print_group = false;
-}
+/* Return the address of the first plain %b spec in FMT, or nullptr if
+   there is no such spec.  %5b etc. do not match, so that user
+   widths/flags are honored.  */
 
-static void handle_option_D(int *format_opt) {
-    *format_opt = long_format;
-    print_hyperlink = false;
-    dired = true;
+ATTRIBUTE_PURE
+static char const *
+first_percent_b (char const *fmt)
+{
+  for (; *fmt; fmt++)
+    {
+      if (fmt[0] != '%')
+        continue;
+      
+      if (fmt[1] == 'b')
+        return fmt;
+      
+      if (fmt[1] == '%')
+        fmt++;
+    }
+  return nullptr;
 }
 
-static void handle_option_B(void) {
-    add_ignore_pattern("*~");
-    add_ignore_pattern(".*~");
+static char RFC3986[256];
+static void
+file_escape_init (void)
+{
+  const char ALLOWED_CHARS[] = {'~', '-', '.', '_'};
+  const int ALLOWED_CHARS_COUNT = sizeof(ALLOWED_CHARS) / sizeof(ALLOWED_CHARS[0]);
+  const int ASCII_TABLE_SIZE = 256;
+  
+  for (int i = 0; i < ASCII_TABLE_SIZE; i++)
+  {
+    int is_allowed = c_isalnum(i);
+    
+    for (int j = 0; j < ALLOWED_CHARS_COUNT && !is_allowed; j++)
+    {
+      if (i == ALLOWED_CHARS[j])
+      {
+        is_allowed = 1;
+      }
+    }
+    
+    RFC3986[i] |= is_allowed;
+  }
 }
 
-static void handle_classify_option(char *optarg) {
-    int i = optarg ? XARGMATCH("--classify", optarg, when_args, when_types) : when_always;
-    if (i == when_always || (i == when_if_tty && stdout_isatty()))
-        indicator_style = classify;
-}
+enum { MBSWIDTH_FLAGS = MBSW_REJECT_INVALID | MBSW_REJECT_UNPRINTABLE };
 
-static void handle_color_option(char *optarg) {
-    int i = optarg ? XARGMATCH("--color", optarg, when_args, when_types) : when_always;
-    print_with_color = (i == when_always || (i == when_if_tty && stdout_isatty()));
-}
+/* Read the abbreviated month names from the locale, to align them
+   and to determine the max width of the field and to truncate names
+   greater than our max allowed.
+   Note even though this handles multibyte locales correctly
+   it's not restricted to them as single byte locales can have
+   variable width abbreviated months and also precomputing/caching
+   the names was seen to increase the performance of ls significantly.  */
 
-static void handle_hyperlink_option(char *optarg) {
-    int i = optarg ? XARGMATCH("--hyperlink", optarg, when_args, when_types) : when_always;
-    print_hyperlink = (i == when_always || (i == when_if_tty && stdout_isatty()));
-}
+/* abformat[RECENT][MON] is the format to use for timestamps with
+   recentness RECENT and month MON.  */
+enum { ABFORMAT_SIZE = 128 };
+static char abformat[2][12][ABFORMAT_SIZE];
+/* True if precomputed formats should be used.  This can be false if
+   nl_langinfo fails, if a format or month abbreviation is unusually
+   long, or if a month abbreviation contains '%'.  */
+static bool use_abformat;
 
-static void handle_hide_option(char *optarg) {
-    struct ignore_pattern *hide = xmalloc(sizeof *hide);
-    hide->pattern = optarg;
-    hide->next = hide_patterns;
-    hide_patterns = hide;
-}
+/* True if abformat_init should be called before the first timestamp
+   is formatted.  Formatting 24 month names is wasted on runs that
+   print no timestamp, so it is put off until then.  */
+static bool abformat_pending;
 
-static void handle_block_size_option(char *optarg, int oi) {
-    enum strtol_error e = human_options(optarg, &human_output_opts, &output_block_size);
-    if (e != LONGINT_OK)
-        xstrtol_fatal(e, oi, 0, long_options, optarg);
-    file_human_output_opts = human_output_opts;
-    file_output_block_size = output_block_size;
-}
+/* Store into ABMON the abbreviated month names, suitably aligned.
+   Return true if successful.  */
 
-static void handle_si_option(void) {
-    file_human_output_opts = human_output_opts = human_autoscale | human_SI;
-    file_output_block_size = output_block_size = 1;
-}
+static bool
+abmon_init (char abmon[12][ABFORMAT_SIZE])
+{
+#ifndef HAVE_NL_LANGINFO
+  return false;
+#else
+  int max_mon_width = 0;
+  int mon_width[12];
+  int mon_len[12];
 
-static void handle_zero_option(int *format_opt, int *hide_control_chars_opt, int *quoting_style_opt) {
-    eolbyte = 0;
-    *hide_control_chars_opt = false;
-    if (*format_opt != long_format)
-        *format_opt = one_per_line;
-    print_with_color = false;
-    *quoting_style_opt = literal_quoting_style;
+  if (!load_month_abbreviations(abmon, mon_width, mon_len, &max_mon_width))
+    return false;
+
+  if (!align_month_abbreviations(abmon, mon_width, mon_len, max_mon_width))
+    return false;
+
+  return true;
+#endif
 }
 
-static void process_block_size_env(bool kibibytes_specified) {
-    if (!output_block_size) {
-        char const *ls_block_size = getenv("LS_BLOCK_SIZE");
-        human_options(ls_block_size, &human_output_opts, &output_block_size);
-        if (ls_block_size || getenv("BLOCK_SIZE")) {
-            file_human_output_opts = human_output_opts;
-            file_output_block_size = output_block_size;
-        }
-        if (kibibytes_specified) {
-            human_output_opts = 0;
-            output_block_size = 1024;
-        }
+static bool
+load_month_abbreviations(char abmon[12][ABFORMAT_SIZE], int mon_width[12], 
+                         int mon_len[12], int *max_mon_width)
+{
+  for (int i = 0; i < 12; i++)
+    {
+      if (!load_single_month(abmon[i], &mon_width[i], &mon_len[i], i))
+        return false;
+      *max_mon_width = MAX(*max_mon_width, mon_width[i]);
     }
+  return true;
 }
 
-static int determine_format(int format_opt) {
-    if (format_opt >= 0)
-        return format_opt;
-    if (ls_mode == LS_LS)
-        return stdout_isatty() ? many_per_line : one_per_line;
-    if (ls_mode == LS_MULTI_COL)
-        return many_per_line;
-    return long_format;
+static bool
+load_single_month(char *month_buffer, int *width, int *length, int month_index)
+{
+  char const *abbr = nl_langinfo(ABMON_1 + month_index);
+  *length = strnlen(abbr, ABFORMAT_SIZE);
+  
+  if (*length == ABFORMAT_SIZE)
+    return false;
+  if (strchr(abbr, '%'))
+    return false;
+  
+  *width = mbswidth(strcpy(month_buffer, abbr), MBSWIDTH_FLAGS);
+  return *width >= 0;
 }
 
-static ptrdiff_t get_terminal_width(void) {
-    ptrdiff_t width = -1;
-#ifdef TIOCGWINSZ
-    struct winsize ws;
-    if (stdout_isatty() && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) >= 0 && ws.ws_col > 0)
-        width = ws.ws_col <= MIN(PTRDIFF_MAX, SIZE_MAX) ? ws.ws_col : 0;
-#endif
-    return width;
+static bool
+align_month_abbreviations(char abmon[12][ABFORMAT_SIZE], int mon_width[12],
+                          int mon_len[12], int max_mon_width)
+{
+  for (int i = 0; i < 12; i++)
+    {
+      if (!align_single_month(abmon[i], mon_width[i], mon_len[i], max_mon_width))
+        return false;
+    }
+  return true;
 }
 
-static ptrdiff_t get_env_columns(void) {
-    char const *p = getenv("COLUMNS");
-    if (p && *p) {
-        ptrdiff_t width = decode_line_length(p);
-        if (width < 0)
+static bool
+align_single_month(char *month_buffer, int width, int length, int max_width)
+{
+  int fill = max_width - width;
+  
+  if (ABFORMAT_SIZE - length <= fill)
+    return false;
+  
+  bool align_left = !c_isdigit(month_buffer[0]);
+  apply_alignment(month_buffer, length, fill, align_left);
+  month_buffer[length + fill] = '\0';
+  
+  return true;
+}
+
+static void
+apply_alignment(char *buffer, int length, int fill, bool align_left)
+{
+  int fill_offset;
+  
+  if (align_left)
+    {
+      fill_offset = length;
+    }
+  else
+    {
+      memmove(buffer + fill, buffer, length);
+      fill_offset = 0;
+    }
+  
+  memset(buffer + fill_offset, ' ', fill);
+}
+
+/* Initialize ABFORMAT and USE_ABFORMAT.  */
+
+static void
+abformat_init (void)
+{
+  char const *pb[2];
+  for (int recent = 0; recent < 2; recent++)
+    pb[recent] = first_percent_b (long_time_format[recent]);
+  if (! (pb[0] || pb[1]))
+    return;
+
+  char abmon[12][ABFORMAT_SIZE];
+  if (! abmon_init (abmon))
+    return;
+
+  for (int recent = 0; recent < 2; recent++)
+    if (!format_month_names(recent, pb[recent], long_time_format[recent], abmon))
+      return;
+
+  use_abformat = true;
+}
+
+static bool
+format_month_names(int recent, char const *percent_b, char const *fmt, char abmon[][ABFORMAT_SIZE])
+{
+  for (int i = 0; i < 12; i++)
+    if (!format_single_month(abformat[recent][i], percent_b, fmt, abmon[i]))
+      return false;
+  return true;
+}
+
+static bool
+format_single_month(char *nfmt, char const *percent_b, char const *fmt, char const *month_abbr)
+{
+  int nbytes;
+  
+  if (!percent_b)
+    nbytes = snprintf(nfmt, ABFORMAT_SIZE, "%s", fmt);
+  else
+    nbytes = format_with_month_substitution(nfmt, percent_b, fmt, month_abbr);
+  
+  return (0 <= nbytes && nbytes < ABFORMAT_SIZE);
+}
+
+static int
+format_with_month_substitution(char *nfmt, char const *percent_b, char const *fmt, char const *month_abbr)
+{
+  int prefix_len = percent_b - fmt;
+  if (prefix_len > MIN(ABFORMAT_SIZE, INT_MAX))
+    return -1;
+  
+  return snprintf(nfmt, ABFORMAT_SIZE, "%.*s%s%s",
+                  prefix_len, fmt, month_abbr, percent_b + 2);
+}
+
+static size_t
+dev_ino_hash (void const *x, size_t table_size)
+{
+  struct dev_ino const *p = x;
+  return (uintmax_t) p->st_ino % table_size;
+}
+
+static bool
+dev_ino_compare (void const *x, void const *y)
+{
+  struct dev_ino const *a = x;
+  struct dev_ino const *b = y;
+  return PSAME_INODE (a, b);
+}
+
+static void dev_ino_free(void *x)
+{
+    free(x);
+}
+
+/* Add the device/inode pair (P->st_dev/P->st_ino) to the set of
+   active directories.  Return true if there is already a matching
+   entry in the table.  */
+
+static struct dev_ino* create_dev_ino_entry(dev_t dev, ino_t ino)
+{
+  struct dev_ino *ent = xmalloc(sizeof *ent);
+  ent->st_ino = ino;
+  ent->st_dev = dev;
+  return ent;
+}
+
+static void handle_insertion_failure(void)
+{
+  xalloc_die();
+}
+
+static bool is_duplicate_entry(struct dev_ino *inserted, struct dev_ino *original)
+{
+  return inserted != original;
+}
+
+static bool visit_dir(dev_t dev, ino_t ino)
+{
+  struct dev_ino *ent = create_dev_ino_entry(dev, ino);
+  struct dev_ino *ent_from_table = hash_insert(active_dir_set, ent);
+
+  if (ent_from_table == nullptr)
+    handle_insertion_failure();
+
+  bool found_match = is_duplicate_entry(ent_from_table, ent);
+
+  if (found_match)
+    free(ent);
+
+  return found_match;
+}
+
+static void
+free_pending_ent (struct pending *p)
+{
+  free (p->name);
+  free (p->realname);
+  free (p);
+}
+
+static bool
+is_colored (enum indicator_no type)
+{
+  size_t len = color_indicator[type].len;
+  if (len == 0)
+    return false;
+  if (len > 2)
+    return true;
+  char const *s = color_indicator[type].string;
+  return (s[0] != '0') | (s[len - 1] != '0');
+}
+
+static void
+restore_default_color (void)
+{
+  put_indicator (&sgr_default);
+}
+
+static void
+set_normal_color (void)
+{
+  if (!print_with_color || !is_colored (C_NORM))
+    return;
+    
+  put_indicator (&sgr_normal);
+}
+
+/* An ordinary signal was received; arrange for the program to exit.  */
+
+static void sighandler(int sig)
+{
+    if (!SA_NOCLDSTOP) {
+        signal(sig, SIG_IGN);
+    }
+    
+    if (!interrupt_signal) {
+        interrupt_signal = sig;
+    }
+}
+
+/* A SIGTSTP was received; arrange for the program to suspend itself.  */
+
+static void stophandler(int sig) {
+    if (!SA_NOCLDSTOP) {
+        signal(sig, stophandler);
+    }
+    
+    if (!interrupt_signal) {
+        stop_signal_count++;
+    }
+}
+
+/* Process any pending signals.  If signals are caught, this function
+   should be called periodically.  Ideally there should never be an
+   unbounded amount of time when signals are not being processed.
+   Signal handling can restore the default colors, so callers must
+   immediately change colors after invoking this function.  */
+
+static void restore_output_state(void)
+{
+    sgr_held = nullptr;
+    if (used_color)
+        restore_default_color();
+    fflush(stdout);
+}
+
+static void block_signals(sigset_t *oldset)
+{
+    sigprocmask(SIG_BLOCK, &caught_signals, oldset);
+}
+
+static void restore_signals(const sigset_t *oldset)
+{
+    sigprocmask(SIG_SETMASK, oldset, nullptr);
+}
+
+static int determine_signal_to_raise(int *stops)
+{
+    int sig = interrupt_signal;
+    *stops = stop_signal_count;
+    
+    if (*stops)
+    {
+        stop_signal_count = *stops - 1;
+        return SIGSTOP;
+    }
+    
+    signal(sig, SIG_DFL);
+    return sig;
+}
+
+static void handle_one_signal(void)
+{
+    int stops;
+    sigset_t oldset;
+    
+    restore_output_state();
+    block_signals(&oldset);
+    
+    int sig = determine_signal_to_raise(&stops);
+    
+    raise(sig);
+    restore_signals(&oldset);
+}
+
+static void process_signals(void)
+{
+    while (interrupt_signal || stop_signal_count)
+    {
+        handle_one_signal();
+    }
+}
+
+/* Setup signal handlers if INIT is true,
+   otherwise restore to the default.  */
+
+static int const sig[] =
+{
+    SIGTSTP,
+    SIGALRM, SIGHUP, SIGINT, SIGPIPE, SIGQUIT, SIGTERM,
+#ifdef SIGPOLL
+    SIGPOLL,
+#endif
+#ifdef SIGPROF
+    SIGPROF,
+#endif
+#ifdef SIGVTALRM
+    SIGVTALRM,
+#endif
+#ifdef SIGXCPU
+    SIGXCPU,
+#endif
+#ifdef SIGXFSZ
+    SIGXFSZ,
+#endif
+};
+
+enum { nsigs = ARRAY_CARDINALITY (sig) };
+
+#if ! SA_NOCLDSTOP
+static bool caught_sig[nsigs];
+#endif
+
+static void (*get_signal_handler(int signal_num))(int)
+{
+    return signal_num == SIGTSTP ? stophandler : sighandler;
+}
+
+#if SA_NOCLDSTOP
+static void setup_signal_action(int signal_num, struct sigaction *act)
+{
+    if (sigismember(&caught_signals, signal_num))
+    {
+        act->sa_handler = get_signal_handler(signal_num);
+        sigaction(signal_num, act, nullptr);
+    }
+}
+
+static void collect_non_ignored_signals(void)
+{
+    struct sigaction act;
+    int j;
+    
+    sigemptyset(&caught_signals);
+    for (j = 0; j < nsigs; j++)
+    {
+        if (profiling && profiling_signal(sig[j]))
+            continue;
+        sigaction(sig[j], nullptr, &act);
+        if (act.sa_handler != SIG_IGN)
+            sigaddset(&caught_signals, sig[j]);
+    }
+}
+
+static void install_signal_handlers(void)
+{
+    struct sigaction act;
+    int j;
+    
+    collect_non_ignored_signals();
+    
+    act.sa_mask = caught_signals;
+    act.sa_flags = SA_RESTART;
+    
+    for (j = 0; j < nsigs; j++)
+        setup_signal_action(sig[j], &act);
+}
+
+static void restore_signal_defaults(void)
+{
+    int j;
+    
+    for (j = 0; j < nsigs; j++)
+        if (sigismember(&caught_signals, sig[j]))
+            signal(sig[j], SIG_DFL);
+}
+#else
+static void setup_single_signal(int j)
+{
+    if (profiling && profiling_signal(sig[j]))
+        return;
+    caught_sig[j] = (signal(sig[j], SIG_IGN) != SIG_IGN);
+    if (caught_sig[j])
+    {
+        signal(sig[j], get_signal_handler(sig[j]));
+        siginterrupt(sig[j], 0);
+    }
+}
+
+static void install_signal_handlers(void)
+{
+    int j;
+    
+    for (j = 0; j < nsigs; j++)
+        setup_single_signal(j);
+}
+
+static void restore_signal_defaults(void)
+{
+    int j;
+    
+    for (j = 0; j < nsigs; j++)
+        if (caught_sig[j])
+            signal(sig[j], SIG_DFL);
+}
+#endif
+
+static void signal_setup(bool init)
+{
+    if (init)
+        install_signal_handlers();
+    else
+        restore_signal_defaults();
+}
+
+static void signal_init(void)
+{
+    signal_setup(true);
+}
+
+static void signal_restore(void)
+{
+    signal_setup(false);
+}
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  struct pending *thispend;
+  int n_files;
+
+  initialize_main (&argc, &argv);
+  set_program_name (argv[0]);
+  setlocale (LC_ALL, "");
+  bindtextdomain (PACKAGE, LOCALEDIR);
+  textdomain (PACKAGE);
+
+  initialize_exit_failure (LS_FAILURE);
+  atexit (close_stdout);
+
+  static_assert (ARRAY_CARDINALITY (color_indicator)
+                 == ARRAY_CARDINALITY (indicator_name));
+
+  exit_status = EXIT_SUCCESS;
+  print_dir_name = true;
+  pending_dirs = nullptr;
+
+  current_time.tv_sec = TYPE_MINIMUM (time_t);
+  current_time.tv_nsec = -1;
+
+  i = decode_switches (argc, argv);
+
+  setup_color_output();
+  setup_symlink_checking();
+  setup_dereference_mode();
+  setup_recursive_mode();
+  setup_format_flags();
+  setup_listing_plan();
+  if (explain_plan)
+    {
+      explain_listing_plan ();
+      return EXIT_SUCCESS;
+    }
+  setup_auxiliary_structures();
+  phase_tracking_init ();
+  profile_start ();
+
+  cwd_n_alloc = 100;
+  cwd_file = xmalloc (cwd_n_alloc * sizeof *cwd_file);
+  cwd_n_used = 0;
+
+  clear_files ();
+
+  n_files = argc - i;
+
+  if (snapshot_fp)
+    {
+      if (0 < n_files)
+        {
+          error (0, 0, _("extra operand %s"), quoteaf (argv[i]));
+          error (0, 0, _("file operands cannot be combined with "
+                         "--from-snapshot"));
+          usage (LS_FAILURE);
+        }
+      replay_file_arguments ();
+    }
+  else
+    {
+      process_file_arguments(n_files, argc, argv, i);
+      if (capture_fp)
+        capture_operands (n_files);
+    }
+
+  if (cwd_n_used)
+    {
+      sort_files ();
+      if (!immediate_dirs)
+        extract_dirs_from_files (nullptr, true);
+    }
+
+  if (snapshot_fp)
+    n_files = snapshot_n_files;
+
+  handle_current_files_output(n_files);
+  process_pending_directories();
+  if (group_by != group_by_none)
+    print_aggregates ();
+  finalize_color_output();
+  finalize_dired_output();
+  cleanup_recursive_structures();
+  progress_finish ();
+  prefetch_finish ();
+  report_failure_summary ();
+  capture_close ();
+  also_output_close ();
+  report_stats ();
+  profile_finish ();
+  output_finish ();
+
+  return exit_status;
+}
+
+static void setup_color_output(void)
+{
+  if (print_with_color)
+    parse_ls_color ();
+
+  if (print_with_color)
+    {
+      compose_color_sequences ();
+      tabsize = 0;
+    }
+}
+
+static void setup_symlink_checking(void)
+{
+  if (directories_first)
+    {
+      plan.check_symlinks = true;
+    }
+  else if (print_with_color)
+    {
+      if (is_colored (C_ORPHAN)
+          || (is_colored (C_EXEC) && color_symlink_as_referent)
+          || (is_colored (C_MISSING) && format == long_format))
+        plan.check_symlinks = true;
+    }
+}
+
+static void setup_dereference_mode(void)
+{
+  if (dereference == DEREF_UNDEFINED)
+    {
+      dereference = ((immediate_dirs
+                      || indicator_style == classify
+                      || format == long_format)
+                     ? DEREF_NEVER
+                     : DEREF_COMMAND_LINE_SYMLINK_TO_DIR);
+    }
+}
+
+static void setup_recursive_mode(void)
+{
+  if (recursive)
+    {
+      active_dir_set = hash_initialize (INITIAL_TABLE_SIZE, nullptr,
+                                        dev_ino_hash,
+                                        dev_ino_compare,
+                                        dev_ino_free);
+      if (active_dir_set == nullptr)
+        xalloc_die ();
+
+      obstack_init (&dev_ino_obstack);
+    }
+}
+
+static void setup_format_flags(void)
+{
+  plan.needs_stat = ((sort_type == sort_time) | (sort_type == sort_size)
+                     | ((sort_type == sort_multi) & sort_keys_need_stat ())
+                     | (format == long_format) | (format == columnar_format)
+                     | also_output_columnar_p
+                     | print_block_size | print_hyperlink | print_scontext
+                     | !!capture_name);
+  plan.needs_type = ((! plan.needs_stat)
+                     & (recursive | print_with_color | print_scontext
+                        | directories_first
+                        | (indicator_style != none)));
+  plan.needs_capability = ((print_with_color && is_colored (C_CAP))
+                           | !!capture_name);
+
+  if (group_by != group_by_none)
+    {
+      aggs_init ();
+      plan.needs_stat |= aggs_need_stat ();
+      plan.needs_type |= ((! plan.needs_stat)
+                          & (group_by == group_by_type));
+    }
+}
+
+/* Complete the listing plan, now that the format flags and symlink
+   checks are known.  */
+
+static void setup_listing_plan(void)
+{
+  plan.needs_aclinfo = (format == long_format) | print_scontext | !!capture_name;
+  plan.read_links = ((format == long_format) | plan.check_symlinks
+                     | !!capture_name);
+  plan.stat_link_targets = (file_type <= indicator_style
+                            || plan.check_symlinks || capture_name);
+  plan.stat_dirs = (print_with_color
+                    && (is_colored (C_OTHER_WRITABLE) || is_colored (C_STICKY)
+                        || is_colored (C_STICKY_OTHER_WRITABLE)));
+  plan.stat_symlinks = ((print_inode || plan.needs_type)
+                        && (dereference == DEREF_ALWAYS
+                            || color_symlink_as_referent
+                            || plan.check_symlinks));
+  plan.stat_regular = (indicator_style == classify
+                       || (print_with_color
+                           && (is_colored (C_EXEC) || is_colored (C_SETUID)
+                               || is_colored (C_SETGID))));
+  plan.stat_missing_ino = print_inode;
+#if HAVE_STATX && defined STATX_INO
+  plan.statx_mask = calc_req_mask ();
+#endif
+  plan.sort = sort_type != sort_none;
+  plan.widths = format != with_commas && format != columnar_format;
+  plan.streaming = should_print_immediately ();
+  plan.bounded = bounded_listing_applies ();
+}
+
+/* Append to the obstack OS the description of an entry kind KIND that
+   is stat'ed, separated from any earlier one.  */
+
+static void
+explain_append (struct obstack *os, char const *kind)
+{
+  if (obstack_object_size (os))
+    obstack_grow (os, ", ", 2);
+  obstack_grow (os, kind, strlen (kind));
+}
+
+/* Print the listing plan, for --explain.  */
+
+static void
+explain_listing_plan (void)
+{
+  struct obstack os;
+  obstack_init (&os);
+
+  if (plan.needs_stat)
+    explain_append (&os, _("every entry"));
+  else
+    {
+      explain_append (&os, _("command-line operands"));
+      if (plan.needs_type)
+        explain_append (&os, _("entries of unknown type"));
+      if (plan.stat_dirs)
+        explain_append (&os, _("directories"));
+      if (plan.stat_symlinks)
+        explain_append (&os, _("symbolic links"));
+      if (plan.stat_regular)
+        explain_append (&os, _("regular files"));
+      if (plan.stat_missing_ino)
+        explain_append (&os, _("entries without an inode number"));
+    }
+  obstack_1grow (&os, '\0');
+  printf ("%-22s%s\n", _("stat:"), (char *) obstack_finish (&os));
+
+#if HAVE_STATX && defined STATX_INO
+  static struct { unsigned int bit; char const *name; } const fields[] =
+    {
+      { STATX_TYPE, "type" }, { STATX_MODE, "mode" },
+      { STATX_NLINK, "nlink" }, { STATX_UID, "uid" }, { STATX_GID, "gid" },
+      { STATX_ATIME, "atime" }, { STATX_MTIME, "mtime" },
+      { STATX_CTIME, "ctime" }, { STATX_INO, "ino" }, { STATX_SIZE, "size" },
+      { STATX_BLOCKS, "blocks" }, { STATX_BTIME, "btime" },
+    };
+  printf ("%-22s", _("statx mask:"));
+  for (int i = 0; i < ARRAY_CARDINALITY (fields); i++)
+    if (plan.statx_mask & fields[i].bit)
+      printf (" %s", fields[i].name);
+  putchar ('\n');
+#endif
+
+  char const *yes = _("yes");
+  char const *no = _("no");
+  printf ("%-22s%s\n", _("readlink:"),
+          plan.read_links ? _("symbolic links") : no);
+  printf ("%-22s%s\n", _("stat link targets:"),
+          plan.read_links && plan.stat_link_targets
+          ? _("symbolic links") : no);
+  printf ("%-22s%s\n", _("ACL and context:"),
+          plan.needs_aclinfo ? _("every entry") : no);
+  printf ("%-22s%s\n", _("capabilities:"),
+          plan.needs_capability ? _("regular files with xattrs") : no);
+
+  char const *sort_name = "multi";
+  for (int i = 0; sort_args[i]; i++)
+    if (sort_types[i] == sort_type)
+      {
+        sort_name = sort_args[i];
+        break;
+      }
+  if (plan.sort)
+    printf ("%-22s%s (%s)\n", _("sort:"), yes, sort_name);
+  else
+    printf ("%-22s%s\n", _("sort:"), no);
+  printf ("%-22s%s\n", _("width pass:"), plan.widths ? yes : no);
+  printf ("%-22s%s\n", _("streaming:"), plan.streaming ? yes : no);
+  printf ("%-22s%s\n", _("bounded memory:"), plan.bounded ? yes : no);
+  printf ("%-22s%s\n", _("recursive:"), recursive ? yes : no);
+
+  obstack_free (&os, nullptr);
+}
+
+static void setup_auxiliary_structures(void)
+{
+  output_setup ();
+
+  if (format == columnar_format)
+    columnar_write_header (stdout);
+
+  progress_init ();
+
+  if (capture_name)
+    capture_open ();
+
+  also_output_open ();
+
+  if (snapshot_name)
+    snapshot_open ();
+
+  if (dired)
+    {
+      obstack_init (&dired_obstack);
+      obstack_init (&subdired_obstack);
+    }
+
+}
+
+static void process_file_arguments(int n_files, int argc, char **argv, int i)
+{
+  if (n_files <= 0)
+    {
+      if (immediate_dirs)
+        gobble_file (".", directory, NOT_AN_INODE_NUMBER, true, nullptr);
+      else
+        queue_directory (".", nullptr, true);
+    }
+  else if (! (stat_threads && 1 < n_files
+                && gobble_operands_parallel (n_files, argv + i)))
+    {
+      do
+        gobble_file (argv[i++], unknown, NOT_AN_INODE_NUMBER, true, nullptr);
+      while (i < argc);
+    }
+}
+
+static void handle_current_files_output(int n_files)
+{
+  /* The columnar format has a row group for the operands even when
+     there are none.  */
+  also_output_files (nullptr);
+  if (cwd_n_used || format == columnar_format)
+    print_current_files ();
+
+  if (cwd_n_used)
+    {
+      if (pending_dirs && format != columnar_format && !flat)
+        dired_outbyte ('\n');
+    }
+  else if (n_files <= 1 && pending_dirs && pending_dirs->next == 0)
+    {
+      print_dir_name = false;
+    }
+}
+
+static void process_pending_directories(void)
+{
+  struct pending *thispend;
+  
+  while (pending_dirs)
+    {
+      thispend = pending_dirs;
+      pending_dirs = pending_dirs->next;
+
+      if (LOOP_DETECT && process_marker_entry(thispend))
+        continue;
+
+      dirs_pending--;
+      if (progress_interval)
+        {
+          progress_dir = thispend->name;
+          progress_tick ();
+        }
+
+      char const *relname;
+      int parent_fd = dir_fd_lookup (thispend->name, thispend->parent_slot,
+                                     thispend->parent_gen, &relname);
+      print_dir (thispend->name, thispend->realname,
+                 thispend->command_line_arg, parent_fd, relname);
+
+      dirs_done++;
+      progress_dir = nullptr;
+      free_pending_ent (thispend);
+      print_dir_name = true;
+    }
+}
+
+static bool process_marker_entry(struct pending *thispend)
+{
+  if (thispend->name == nullptr)
+    {
+      struct dev_ino di = dev_ino_pop ();
+      struct dev_ino *found = hash_remove (active_dir_set, &di);
+      if (false)
+        assert_matching_dev_ino (thispend->realname, di);
+      affirm (found);
+      dev_ino_free (found);
+      free_pending_ent (thispend);
+      return true;
+    }
+  return false;
+}
+
+static void finalize_color_output(void)
+{
+  int j;
+  
+  if (!print_with_color || !used_color)
+    return;
+
+  sgr_release ();
+
+  if (!is_default_color_restore_needed())
+    restore_default_color ();
+
+  fflush (stdout);
+
+  signal_restore ();
+
+  for (j = stop_signal_count; j; j--)
+    raise (SIGSTOP);
+  j = interrupt_signal;
+  if (j)
+    raise (j);
+}
+
+static bool is_default_color_restore_needed(void)
+{
+  #define COLOR_LEFT_LEN 2
+  #define COLOR_LEFT_STR "\033["
+  #define COLOR_RIGHT_LEN 1
+  #define COLOR_RIGHT_CHAR 'm'
+  
+  return (color_indicator[C_LEFT].len == COLOR_LEFT_LEN
+          && memcmp (color_indicator[C_LEFT].string, COLOR_LEFT_STR, COLOR_LEFT_LEN) == 0
+          && color_indicator[C_RIGHT].len == COLOR_RIGHT_LEN
+          && color_indicator[C_RIGHT].string[0] == COLOR_RIGHT_CHAR);
+}
+
+static void finalize_dired_output(void)
+{
+  if (dired)
+    {
+      dired_dump_obstack ("//DIRED//", &dired_obstack);
+      dired_dump_obstack ("//SUBDIRED//", &subdired_obstack);
+      printf ("//DIRED-OPTIONS// --quoting-style=%s\n",
+              quoting_style_args[get_quoting_style (filename_quoting_options)]);
+    }
+}
+
+static void cleanup_recursive_structures(void)
+{
+  if (LOOP_DETECT)
+    {
+      assure (hash_get_n_entries (active_dir_set) == 0);
+      hash_free (active_dir_set);
+    }
+
+  for (int i = 0; i < DIR_FD_CACHE_SIZE; i++)
+    if (dir_fd_cache[i].gen)
+      dir_fd_drop (i);
+}
+
+/* Return the line length indicated by the value given by SPEC, or -1
+   if unsuccessful.  0 means no limit on line length.  */
+
+static ptrdiff_t
+decode_line_length (char const *spec)
+{
+  uintmax_t val;
+  
+  switch (xstrtoumax (spec, nullptr, 0, &val, ""))
+    {
+    case LONGINT_OK:
+      return val <= MIN (PTRDIFF_MAX, SIZE_MAX) ? val : 0;
+
+    case LONGINT_OVERFLOW:
+      return 0;
+
+    case LONGINT_INVALID:
+    case LONGINT_INVALID_SUFFIX_CHAR:
+    case LONGINT_INVALID_SUFFIX_CHAR_WITH_OVERFLOW:
+      return -1;
+
+    default:
+      unreachable ();
+    }
+}
+
+/* Return true if standard output is a tty, caching the result.  */
+
+static bool
+stdout_isatty (void)
+{
+  if (stdout_tty < 0)
+    stdout_tty = isatty (STDOUT_FILENO);
+  assume (stdout_tty == 0 || stdout_tty == 1);
+  return stdout_tty;
+}
+
+/* Set all the option flags according to the switches specified.
+   Return the index of the first non-option argument.  */
+
+static void handle_option_a(void) {
+    ignore_mode = IGNORE_MINIMAL;
+}
+
+static void handle_option_f(void) {
+    ignore_mode = IGNORE_MINIMAL;
+    sort_opt = sort_none;
+}
+
+static void handle_option_g(int *format_opt) {
+    *format_opt = long_format;
+    print_owner = false;
+}
+
+static void handle_option_h(void) {
+    file_human_output_opts = human_output_opts =
+        human_autoscale | human_SI | human_base_1024;
+    file_output_block_size = output_block_size = 1;
+}
+
+static void handle_option_n(int *format_opt) {
+    numeric_ids = true;
+    *format_opt = long_format;
+}
+
+static void handle_option_o(int *format_opt) {
+    *format_opt = long_format;
+    print_group = false;
+}
+
+static void handle_option_D(int *format_opt) {
+    *format_opt = long_format;
+    print_hyperlink = false;
+    dired = true;
+}
+
+static void handle_option_B(void) {
+    add_ignore_pattern("*~");
+    add_ignore_pattern(".*~");
+}
+
+static void handle_classify_option(char *optarg) {
+    int i = optarg ? XARGMATCH("--classify", optarg, when_args, when_types) : when_always;
+    if (i == when_always || (i == when_if_tty && stdout_isatty()))
+        indicator_style = classify;
+}
+
+static void handle_color_option(char *optarg) {
+    int i = optarg ? XARGMATCH("--color", optarg, when_args, when_types) : when_always;
+    print_with_color = (i == when_always || (i == when_if_tty && stdout_isatty()));
+}
+
+static void handle_hyperlink_option(char *optarg) {
+    int i = optarg ? XARGMATCH("--hyperlink", optarg, when_args, when_types) : when_always;
+    print_hyperlink = (i == when_always || (i == when_if_tty && stdout_isatty()));
+}
+
+static void handle_hide_option(char *optarg) {
+    struct ignore_pattern *hide = xmalloc(sizeof *hide);
+    hide->pattern = optarg;
+    hide->next = hide_patterns;
+    hide_patterns = hide;
+}
+
+static void handle_block_size_option(char *optarg, int oi) {
+    enum strtol_error e = human_options(optarg, &human_output_opts, &output_block_size);
+    if (e != LONGINT_OK)
+        xstrtol_fatal(e, oi, 0, long_options, optarg);
+    file_human_output_opts = human_output_opts;
+    file_output_block_size = output_block_size;
+}
+
+static void handle_si_option(void) {
+    file_human_output_opts = human_output_opts = human_autoscale | human_SI;
+    file_output_block_size = output_block_size = 1;
+}
+
+static void handle_zero_option(int *format_opt, int *hide_control_chars_opt, int *quoting_style_opt) {
+    eolbyte = 0;
+    *hide_control_chars_opt = false;
+    if (*format_opt != long_format)
+        *format_opt = one_per_line;
+    print_with_color = false;
+    *quoting_style_opt = literal_quoting_style;
+}
+
+static void process_block_size_env(bool kibibytes_specified) {
+    if (!output_block_size) {
+        char const *ls_block_size = getenv("LS_BLOCK_SIZE");
+        human_options(ls_block_size, &human_output_opts, &output_block_size);
+        if (ls_block_size || getenv("BLOCK_SIZE")) {
+            file_human_output_opts = human_output_opts;
+            file_output_block_size = output_block_size;
+        }
+        if (kibibytes_specified) {
+            human_output_opts = 0;
+            output_block_size = 1024;
+        }
+    }
+}
+
+static int determine_format(int format_opt) {
+    if (format_opt >= 0)
+        return format_opt;
+    if (ls_mode == LS_LS)
+        return stdout_isatty() ? many_per_line : one_per_line;
+    if (ls_mode == LS_MULTI_COL)
+        return many_per_line;
+    return long_format;
+}
+
+static ptrdiff_t get_terminal_width(void) {
+    ptrdiff_t width = -1;
+#ifdef TIOCGWINSZ
+    struct winsize ws;
+    if (stdout_isatty() && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) >= 0 && ws.ws_col > 0)
+        width = ws.ws_col <= MIN(PTRDIFF_MAX, SIZE_MAX) ? ws.ws_col : 0;
+#endif
+    return width;
+}
+
+static ptrdiff_t get_env_columns(void) {
+    char const *p = getenv("COLUMNS");
+    if (p && *p) {
+        ptrdiff_t width = decode_line_length(p);
+        if (width < 0)
             error(0, 0, _("ignoring invalid width in environment variable COLUMNS: %s"), quote(p));
         return width;
     }
     return -1;
 }
 
-static ptrdiff_t determine_line_length(ptrdiff_t width_opt, int format) {
-    ptrdiff_t linelen = width_opt;
-    if (format == many_per_line || format == horizontal || format == with_commas || print_with_color) {
-        if (linelen < 0)
-            linelen = get_terminal_width();
-        if (linelen < 0)
-            linelen = get_env_columns();
+static ptrdiff_t determine_line_length(ptrdiff_t width_opt, int format) {
+    ptrdiff_t linelen = width_opt;
+    if (format == many_per_line || format == horizontal || format == with_commas || print_with_color) {
+        if (linelen < 0)
+            linelen = get_terminal_width();
+        if (linelen < 0)
+            linelen = get_env_columns();
+    }
+    return linelen < 0 ? 80 : linelen;
+}
+
+static void set_tabsize(ptrdiff_t tabsize_opt, int format) {
+    if (format == many_per_line || format == horizontal || format == with_commas) {
+        if (tabsize_opt >= 0) {
+            tabsize = tabsize_opt;
+        } else {
+            tabsize = 8;
+            char const *p = getenv("TABSIZE");
+            if (p) {
+                uintmax_t tmp;
+                if (xstrtoumax(p, nullptr, 0, &tmp, "") == LONGINT_OK && tmp <= SIZE_MAX)
+                    tabsize = tmp;
+                else
+                    error(0, 0, _("ignoring invalid tab size in environment variable TABSIZE: %s"), quote(p));
+            }
+        }
+    }
+}
+
+static void configure_quoting(int quoting_style_opt, int format) {
+    int qs = quoting_style_opt;
+    if (qs < 0)
+        qs = getenv_quoting_style();
+    if (qs < 0)
+        qs = (ls_mode == LS_LS ? (stdout_isatty() ? shell_escape_quoting_style : -1) : escape_quoting_style);
+    if (qs >= 0)
+        set_quoting_style(nullptr, qs);
+    
+    qs = get_quoting_style(nullptr);
+    align_variable_outer_quotes =
+        ((format == long_format || ((format == many_per_line || format == horizontal) && line_length))
+         && (qs == shell_quoting_style || qs == shell_escape_quoting_style || qs == c_maybe_quoting_style));
+    
+    filename_quoting_options = clone_quoting_options(nullptr);
+    if (qs == escape_quoting_style)
+        set_char_quoting(filename_quoting_options, ' ', 1);
+    if (file_type <= indicator_style) {
+        char const *p;
+        for (p = &"*=>@|"[indicator_style - file_type]; *p; p++)
+            set_char_quoting(filename_quoting_options, *p, 1);
+    }
+    
+    dirname_quoting_options = clone_quoting_options(nullptr);
+    set_char_quoting(dirname_quoting_options, ':', 1);
+}
+
+static void configure_time_style(char const *time_style_option) {
+    static char const posix_prefix[] = "posix-";
+    char const *style = time_style_option;
+    
+    if (!style) {
+        style = getenv("TIME_STYLE");
+        if (!style)
+            style = "locale";
+    }
+    
+    while (STREQ_LEN(style, posix_prefix, sizeof posix_prefix - 1)) {
+        if (!hard_locale(LC_TIME))
+            return;
+        style += sizeof posix_prefix - 1;
+    }
+    
+    if (*style == '+') {
+        char const *p0 = style + 1;
+        char *p0nl = strchr(p0, '\n');
+        char const *p1 = p0;
+        if (p0nl) {
+            if (strchr(p0nl + 1, '\n'))
+                error(LS_FAILURE, 0, _("invalid time style format %s"), quote(p0));
+            *p0nl++ = '\0';
+            p1 = p0nl;
+        }
+        long_time_format[0] = p0;
+        long_time_format[1] = p1;
+    } else {
+        switch (x_timestyle_match(style, true, time_style_args, (char const *)time_style_types, sizeof(*time_style_types), LS_FAILURE)) {
+        case full_iso_time_style:
+            long_time_format[0] = long_time_format[1] = "%Y-%m-%d %H:%M:%S.%N %z";
+            break;
+        case long_iso_time_style:
+            long_time_format[0] = long_time_format[1] = "%Y-%m-%d %H:%M";
+            break;
+        case iso_time_style:
+            long_time_format[0] = "%Y-%m-%d ";
+            long_time_format[1] = "%m-%d %H:%M";
+            break;
+        case locale_time_style:
+            if (hard_locale(LC_TIME)) {
+                for (int i = 0; i < 2; i++)
+                    long_time_format[i] = dcgettext(nullptr, long_time_format[i], LC_TIME);
+            }
+        }
+    }
+    abformat_pending = true;
+}
+
+static int decode_switches(int argc, char **argv) {
+    char const *time_style_option = nullptr;
+    bool kibibytes_specified = false;
+    int format_opt = -1;
+    int hide_control_chars_opt = -1;
+    int quoting_style_opt = -1;
+    int sort_opt = -1;
+    ptrdiff_t tabsize_opt = -1;
+    ptrdiff_t width_opt = -1;
+
+    while (true) {
+        int oi = -1;
+        int c = getopt_long(argc, argv, "abcdfghiklmnopqrstuvw:xABCDFGHI:LNQRST:UXZ1", long_options, &oi);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'a': handle_option_a(); break;
+        case 'b': quoting_style_opt = escape_quoting_style; break;
+        case 'c': time_type = time_ctime; explicit_time = true; break;
+        case 'd': immediate_dirs = true; break;
+        case 'f': handle_option_f(); break;
+        case FILE_TYPE_INDICATOR_OPTION: indicator_style = file_type; break;
+        case 'g': handle_option_g(&format_opt); break;
+        case 'h': handle_option_h(); break;
+        case 'i': print_inode = true; break;
+        case 'k': kibibytes_specified = true; break;
+        case 'l': format_opt = long_format; break;
+        case 'm': format_opt = with_commas; break;
+        case 'n': handle_option_n(&format_opt); break;
+        case 'o': handle_option_o(&format_opt); break;
+        case 'p': indicator_style = slash; break;
+        case 'q': hide_control_chars_opt = true; break;
+        case 'r': sort_reverse = true; break;
+        case 's': print_block_size = true; break;
+        case 't': sort_opt = sort_time; break;
+        case 'u': time_type = time_atime; explicit_time = true; break;
+        case 'v': sort_opt = sort_version; break;
+        case 'w':
+            width_opt = decode_line_length(optarg);
+            if (width_opt < 0)
+                error(LS_FAILURE, 0, "%s: %s", _("invalid line width"), quote(optarg));
+            break;
+        case 'x': format_opt = horizontal; break;
+        case 'A': ignore_mode = IGNORE_DOT_AND_DOTDOT; break;
+        case 'B': handle_option_B(); break;
+        case 'C': format_opt = many_per_line; break;
+        case 'D': handle_option_D(&format_opt); break;
+        case 'F': handle_classify_option(optarg); break;
+        case 'G': print_group = false; break;
+        case 'H': dereference = DEREF_COMMAND_LINE_ARGUMENTS; break;
+        case DEREFERENCE_COMMAND_LINE_SYMLINK_TO_DIR_OPTION:
+            dereference = DEREF_COMMAND_LINE_SYMLINK_TO_DIR; break;
+        case 'I': add_ignore_pattern(optarg); break;
+        case 'L': dereference = DEREF_ALWAYS; break;
+        case 'N': quoting_style_opt = literal_quoting_style; break;
+        case 'Q': quoting_style_opt = c_quoting_style; break;
+        case 'R': recursive = true; break;
+        case 'S': sort_opt = sort_size; break;
+        case 'T':
+            tabsize_opt = xnumtoumax(optarg, 0, 0, MIN(PTRDIFF_MAX, SIZE_MAX), "", _("invalid tab size"), LS_FAILURE, 0);
+            break;
+        case 'U': sort_opt = sort_none; break;
+        case 'X': sort_opt = sort_extension; break;
+        case '1':
+            if (format_opt != long_format)
+                format_opt = one_per_line;
+            break;
+        case AUTHOR_OPTION: print_author = true; break;
+        case HIDE_OPTION: handle_hide_option(optarg); break;
+        case SORT_OPTION:
+            if (strpbrk(optarg, ",:"))
+            {
+                decode_sort_keys(optarg);
+                sort_opt = sort_multi;
+            }
+            else
+                sort_opt = XARGMATCH("--sort", optarg, sort_args, sort_types);
+            break;
+        case GROUP_DIRECTORIES_FIRST_OPTION: directories_first = true; break;
+        case TIME_OPTION:
+            time_type = XARGMATCH("--time", optarg, time_args, time_types);
+            explicit_time = true;
+            break;
+        case FORMAT_OPTION: format_opt = XARGMATCH("--format", optarg, format_args, format_types); break;
+        case FULL_TIME_OPTION:
+            format_opt = long_format;
+            time_style_option = "full-iso";
+            break;
+        case COLOR_OPTION: handle_color_option(optarg); break;
+        case COMPRESS_NAMES_OPTION: compress_names = true; break;
+        case HYPERLINK_OPTION: handle_hyperlink_option(optarg); break;
+        case INDICATOR_STYLE_OPTION:
+            indicator_style = XARGMATCH("--indicator-style", optarg, indicator_style_args, indicator_style_types);
+            break;
+        case QUOTING_STYLE_OPTION:
+            quoting_style_opt = XARGMATCH("--quoting-style", optarg, quoting_style_args, quoting_style_vals);
+            break;
+        case TIME_STYLE_OPTION: time_style_option = optarg; break;
+        case SHOW_CONTROL_CHARS_OPTION: hide_control_chars_opt = false; break;
+        case BLOCK_SIZE_OPTION: handle_block_size_option(optarg, oi); break;
+        case BOUNDED_MEMORY_OPTION: bounded_memory = true; break;
+        case CAPTURE_OPTION: capture_name = optarg; break;
+        case GROUP_BY_OPTION:
+            group_by = XARGMATCH("--group-by", optarg, group_by_args, group_by_types);
+            break;
+        case AGG_OPTION: decode_aggs(optarg); break;
+        case ALSO_OUTPUT_OPTION: decode_also_output(optarg); break;
+        case AFTER_OPTION: page_after = optarg; break;
+        case CURSOR_OPTION: page_cursor = optarg; break;
+        case LIMIT_OPTION:
+            page_limit = xnumtoimax(optarg, 10, 1, IDX_MAX, "",
+                                    _("invalid number of entries"), LS_FAILURE, 0);
+            break;
+        case PAGE_SIZE_OPTION:
+            page_size = xnumtoimax(optarg, 10, 1, IDX_MAX, "",
+                                   _("invalid page size"), LS_FAILURE, 0);
+            break;
+        case FLAT_OPTION: flat = true; break;
+        case ERRORS_OPTION:
+            error_mode = XARGMATCH("--errors", optarg, error_mode_args, error_mode_types);
+            if (error_mode == errors_buffered)
+                setvbuf(stderr, nullptr, _IOFBF, BUFSIZ);
+            break;
+        case EXPLAIN_OPTION: explain_plan = true; break;
+        case FROM_SNAPSHOT_OPTION: snapshot_name = optarg; break;
+        case SI_OPTION: handle_si_option(); break;
+        case 'Z': print_scontext = true; break;
+        case CALL_STATS_OPTION: print_stats = true; break;
+        case CALL_BUDGET_OPTION: decode_call_budget(optarg); break;
+        case INJECT_OPTION: decode_injection(optarg); break;
+        case PERF_COUNTERS_OPTION:
+            print_perf_counters = print_stats = true;
+            break;
+        case OUTPUT_OPTION: output_open(optarg); break;
+        case OUTPUT_OPTIONS_OPTION: decode_output_options(optarg); break;
+        case PARALLEL_OPTION:
+            stat_threads = xnumtoimax(optarg, 10, 0, MAX_STAT_THREADS, "",
+                                      _("invalid number of threads"), LS_FAILURE, 0);
+            break;
+        case PROFILE_OPTION: profile_name = optarg; break;
+        case PROGRESS_OPTION: decode_progress(optarg); break;
+        case PROGRESS_FD_OPTION:
+            progress_fd = xnumtoimax(optarg, 10, 0, INT_MAX, "",
+                                     _("invalid file descriptor"), LS_FAILURE, 0);
+            if (!progress_interval)
+                decode_progress(nullptr);
+            break;
+        case XATTRS_OPTION:
+            print_xattrs = true;
+            xattr_pattern = optarg;
+            break;
+        case ZERO_OPTION: handle_zero_option(&format_opt, &hide_control_chars_opt, &quoting_style_opt); break;
+        case_GETOPT_HELP_CHAR;
+        case_GETOPT_VERSION_CHAR(PROGRAM_NAME, AUTHORS);
+        default: usage(LS_FAILURE);
+        }
+    }
+
+    process_block_size_env(kibibytes_specified);
+    format = determine_format(format_opt);
+    if (flat && format != long_format && format != columnar_format)
+        format = one_per_line;
+    line_length = determine_line_length(width_opt, format);
+    max_idx = line_length / MIN_COLUMN_WIDTH;
+    max_idx += line_length % MIN_COLUMN_WIDTH != 0;
+    set_tabsize(tabsize_opt, format);
+    qmark_funny_chars = (hide_control_chars_opt < 0 ? ls_mode == LS_LS && stdout_isatty() : hide_control_chars_opt);
+    configure_quoting(quoting_style_opt, format);
+    if (flat)
+        align_variable_outer_quotes = false;
+    if (format == columnar_format)
+    {
+        if (stdout_isatty())
+            error(LS_FAILURE, 0, _("refusing to write columnar output to a terminal"));
+        print_with_color = print_hyperlink = false;
+    }
+    dired &= (format == long_format) & !print_hyperlink & !flat;
+    if (eolbyte < dired)
+        error(LS_FAILURE, 0, _("--dired and --zero are incompatible"));
+    sort_type = (sort_opt >= 0 ? sort_opt : (format != long_format && explicit_time) ? sort_time : sort_name);
+    if ((page_size || page_cursor) && sort_type != sort_none)
+        error(LS_FAILURE, 0, _("--page-size and --cursor require an unsorted listing (-U);"
+                               " use --limit and --after to page a sorted one"));
+    if ((page_limit || page_after) && sort_type == sort_none)
+        error(LS_FAILURE, 0, _("--limit and --after require a sorted listing"));
+    if ((page_size || page_cursor || page_limit || page_after)
+        && (recursive || group_by != group_by_none))
+        error(LS_FAILURE, 0, _("paged listings cannot be recursive or grouped"));
+    if ((page_size || page_cursor || page_limit || page_after)
+        && format == columnar_format)
+        error(LS_FAILURE, 0, _("paged listings cannot use --format=columnar"));
+    /* A cursor is a position in one directory.  */
+    if ((page_size || page_cursor) && 1 < argc - optind)
+        error(LS_FAILURE, 0, _("--page-size and --cursor take at most one operand"));
+    if (format == long_format)
+        configure_time_style(time_style_option);
+
+    /* Check these before any file is created or truncated, so that
+       the snapshot is never clobbered by the run that reads it.  */
+    if (snapshot_name && capture_name)
+    {
+        error(0, 0, _("--capture and --from-snapshot are mutually exclusive"));
+        usage(LS_FAILURE);
+    }
+    struct stat snapshot_st;
+    if (snapshot_name && stat(snapshot_name, &snapshot_st) == 0)
+    {
+        struct stat out_st;
+        bool clobbered = (output_name && fstat(STDOUT_FILENO, &out_st) == 0
+                          && PSAME_INODE(&out_st, &snapshot_st));
+        for (struct also_output *out = also_outputs; out && !clobbered;
+             out = out->next)
+            clobbered = (stat(out->name, &out_st) == 0
+                         && PSAME_INODE(&out_st, &snapshot_st));
+        if (clobbered)
+            error(LS_FAILURE, 0, _("%s: cannot write output over the snapshot"),
+                  quotef(snapshot_name));
+    }
+    output_truncate();
+    
+    return optind;
+}
+
+/* Parse a string as part of the LS_COLORS variable; this may involve
+   decoding all kinds of escape characters.  If equals_end is set an
+   unescaped equal sign ends the string, otherwise only a : or \0
+   does.  Set *OUTPUT_COUNT to the number of bytes output.  Return
+   true if successful.
+
+   The resulting string is *not* null-terminated, but may contain
+   embedded nulls.
+
+   Note that both dest and src are char **; on return they point to
+   the first free byte after the array and the character that ended
+   the input string, respectively.  */
+
+#define OCTAL_BASE 8
+#define HEX_BASE 16
+#define ESCAPE_CHAR 27
+#define DELETE_CHAR 127
+#define CONTROL_MASK 037
+#define HEX_DIGIT_OFFSET 10
+
+typedef enum {
+    ST_GND, ST_BACKSLASH, ST_OCTAL, ST_HEX, ST_CARET, ST_END, ST_ERROR
+} parse_state;
+
+static bool is_octal_digit(char c)
+{
+    return c >= '0' && c <= '7';
+}
+
+static bool is_hex_digit(char c)
+{
+    return (c >= '0' && c <= '9') || 
+           (c >= 'a' && c <= 'f') || 
+           (c >= 'A' && c <= 'F');
+}
+
+static int hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + HEX_DIGIT_OFFSET;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + HEX_DIGIT_OFFSET;
+    return -1;
+}
+
+static char get_escape_char(char c)
+{
+    switch (c)
+    {
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'e': return ESCAPE_CHAR;
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    case '?': return DELETE_CHAR;
+    case '_': return ' ';
+    default: return c;
+    }
+}
+
+static void write_char(char **q, char c, size_t *count)
+{
+    *(*q)++ = c;
+    (*count)++;
+}
+
+static parse_state process_ground_state(char const **p, char **q, 
+                                       size_t *count, bool equals_end)
+{
+    char c = **p;
+    
+    if (c == ':' || c == '\0')
+        return ST_END;
+    
+    if (c == '\\')
+    {
+        (*p)++;
+        return ST_BACKSLASH;
+    }
+    
+    if (c == '^')
+    {
+        (*p)++;
+        return ST_CARET;
+    }
+    
+    if (c == '=' && equals_end)
+        return ST_END;
+    
+    write_char(q, *(*p)++, count);
+    return ST_GND;
+}
+
+static parse_state process_backslash_state(char const **p, char **q, 
+                                          size_t *count, char *num)
+{
+    char c = **p;
+    
+    if (c == '\0')
+    {
+        (*p)++;
+        return ST_ERROR;
+    }
+    
+    if (is_octal_digit(c))
+    {
+        *num = c - '0';
+        (*p)++;
+        return ST_OCTAL;
+    }
+    
+    if (c == 'x' || c == 'X')
+    {
+        *num = 0;
+        (*p)++;
+        return ST_HEX;
+    }
+    
+    *num = get_escape_char(c);
+    write_char(q, *num, count);
+    (*p)++;
+    return ST_GND;
+}
+
+static parse_state process_octal_state(char const **p, char **q, 
+                                      size_t *count, char *num)
+{
+    if (!is_octal_digit(**p))
+    {
+        write_char(q, *num, count);
+        return ST_GND;
+    }
+    
+    *num = (*num << 3) + (*(*p)++ - '0');
+    return ST_OCTAL;
+}
+
+static parse_state process_hex_state(char const **p, char **q, 
+                                    size_t *count, char *num)
+{
+    int value = hex_digit_value(**p);
+    
+    if (value < 0)
+    {
+        write_char(q, *num, count);
+        return ST_GND;
+    }
+    
+    *num = (*num << 4) + value;
+    (*p)++;
+    return ST_HEX;
+}
+
+static parse_state process_caret_state(char const **p, char **q, 
+                                      size_t *count)
+{
+    char c = **p;
+    
+    if (c >= '@' && c <= '~')
+    {
+        write_char(q, *(*p)++ & CONTROL_MASK, count);
+        return ST_GND;
+    }
+    
+    if (c == '?')
+    {
+        write_char(q, DELETE_CHAR, count);
+        (*p)++;
+        return ST_GND;
+    }
+    
+    return ST_ERROR;
+}
+
+static bool
+get_funky_string (char **dest, char const **src, bool equals_end,
+                  size_t *output_count)
+{
+    char num = 0;
+    size_t count = 0;
+    parse_state state = ST_GND;
+    char const *p = *src;
+    char *q = *dest;
+
+    while (state < ST_END)
+    {
+        switch (state)
+        {
+        case ST_GND:
+            state = process_ground_state(&p, &q, &count, equals_end);
+            break;
+
+        case ST_BACKSLASH:
+            state = process_backslash_state(&p, &q, &count, &num);
+            break;
+
+        case ST_OCTAL:
+            state = process_octal_state(&p, &q, &count, &num);
+            break;
+
+        case ST_HEX:
+            state = process_hex_state(&p, &q, &count, &num);
+            break;
+
+        case ST_CARET:
+            state = process_caret_state(&p, &q, &count);
+            break;
+
+        case ST_END: 
+        case ST_ERROR: 
+        default:
+            unreachable();
+        }
+    }
+
+    *dest = q;
+    *src = p;
+    *output_count = count;
+
+    return state != ST_ERROR;
+}
+
+enum parse_state
+  {
+    PS_START = 1,
+    PS_2,
+    PS_3,
+    PS_4,
+    PS_DONE,
+    PS_FAIL
+  };
+
+
+/* Check if the content of TERM is a valid name in dircolors.  */
+
+static bool
+known_term_type (void)
+{
+  char const *term = getenv ("TERM");
+  if (! term || ! *term)
+    return false;
+
+  return term_matches_any_in_list(term);
+}
+
+static bool
+term_matches_any_in_list(char const *term)
+{
+  char const *line = G_line;
+  while (line - G_line < sizeof (G_line))
+    {
+      if (is_term_line(line) && term_matches_pattern(line, term))
+        return true;
+      
+      line += strlen (line) + 1;
+    }
+  return false;
+}
+
+static bool
+is_term_line(char const *line)
+{
+  return STRNCMP_LIT (line, "TERM ") == 0;
+}
+
+static bool
+term_matches_pattern(char const *line, char const *term)
+{
+  const int TERM_PREFIX_LENGTH = 5;
+  return fnmatch (line + TERM_PREFIX_LENGTH, term, 0) == 0;
+}
+
+static bool should_disable_colors(void)
+{
+    char const *colorterm = getenv("COLORTERM");
+    return !(colorterm && *colorterm) && !known_term_type();
+}
+
+static struct color_ext_type* allocate_extension(void)
+{
+    struct color_ext_type *ext = xmalloc(sizeof *ext);
+    ext->next = color_ext_list;
+    color_ext_list = ext;
+    ext->exact_match = false;
+    return ext;
+}
+
+static enum parse_state process_extension_definition(struct color_ext_type *ext, char **buf, char const **p)
+{
+    ext->ext.string = *buf;
+    return get_funky_string(buf, p, true, &ext->ext.len) ? PS_4 : PS_FAIL;
+}
+
+static enum parse_state process_indicator_label(char label0, char label1, char **buf, char const **p)
+{
+    for (int i = 0; i < ARRAY_CARDINALITY(indicator_name); i++)
+    {
+        if (label0 == indicator_name[i][0] && label1 == indicator_name[i][1])
+        {
+            color_indicator[i].string = *buf;
+            return get_funky_string(buf, p, false, &color_indicator[i].len) ? PS_START : PS_FAIL;
+        }
+    }
+    error(0, 0, _("unrecognized prefix: %s"), quote((char []){label0, label1, '\0'}));
+    return PS_FAIL;
+}
+
+static enum parse_state handle_start_state(char const **p, char **buf, struct color_ext_type **ext)
+{
+    switch (**p)
+    {
+    case ':':
+        ++(*p);
+        return PS_START;
+    case '*':
+        *ext = allocate_extension();
+        ++(*p);
+        return process_extension_definition(*ext, buf, p);
+    case '\0':
+        return PS_DONE;
+    default:
+        return PS_2;
+    }
+}
+
+static void cleanup_on_failure(void)
+{
+    struct color_ext_type *e;
+    struct color_ext_type *e2;
+    
+    error(0, 0, _("unparsable value for LS_COLORS environment variable"));
+    free(color_buf);
+    
+    for (e = color_ext_list; e != nullptr;)
+    {
+        e2 = e;
+        e = e->next;
+        free(e2);
+    }
+    print_with_color = false;
+}
+
+static bool extensions_match_exact(struct color_ext_type *e1, struct color_ext_type *e2)
+{
+    return e2->ext.len < SIZE_MAX && 
+           e1->ext.len == e2->ext.len && 
+           memcmp(e1->ext.string, e2->ext.string, e1->ext.len) == 0;
+}
+
+static bool extensions_match_case_insensitive(struct color_ext_type *e1, struct color_ext_type *e2)
+{
+    return e2->ext.len < SIZE_MAX && 
+           e1->ext.len == e2->ext.len && 
+           c_strncasecmp(e1->ext.string, e2->ext.string, e1->ext.len) == 0;
+}
+
+static bool sequences_are_identical(struct color_ext_type *e1, struct color_ext_type *e2)
+{
+    return e1->seq.len == e2->seq.len && 
+           memcmp(e1->seq.string, e2->seq.string, e1->seq.len) == 0;
+}
+
+static void process_case_insensitive_match(struct color_ext_type *e1, struct color_ext_type *e2, bool *case_ignored)
+{
+    if (*case_ignored)
+    {
+        e2->ext.len = SIZE_MAX;
+    }
+    else if (sequences_are_identical(e1, e2))
+    {
+        e2->ext.len = SIZE_MAX;
+        *case_ignored = true;
+    }
+    else
+    {
+        e1->exact_match = true;
+        e2->exact_match = true;
+    }
+}
+
+static void mark_duplicate_extensions(struct color_ext_type *e1)
+{
+    struct color_ext_type *e2;
+    bool case_ignored = false;
+    
+    for (e2 = e1->next; e2 != nullptr; e2 = e2->next)
+    {
+        if (extensions_match_exact(e1, e2))
+        {
+            e2->ext.len = SIZE_MAX;
+        }
+        else if (extensions_match_case_insensitive(e1, e2))
+        {
+            process_case_insensitive_match(e1, e2, &case_ignored);
+        }
+    }
+}
+
+static void postprocess_extension_list(void)
+{
+    struct color_ext_type *e1;
+    
+    for (e1 = color_ext_list; e1 != nullptr; e1 = e1->next)
+    {
+        mark_duplicate_extensions(e1);
+    }
+}
+
+static void check_symlink_color_setting(void)
+{
+    if (color_indicator[C_LINK].len == 6 && 
+        !STRNCMP_LIT(color_indicator[C_LINK].string, "target"))
+    {
+        color_symlink_as_referent = true;
+    }
+}
+
+static void parse_ls_color(void)
+{
+    char const *p;
+    char *buf;
+    char label0, label1;
+    struct color_ext_type *ext;
+    
+    if ((p = getenv("LS_COLORS")) == nullptr || *p == '\0')
+    {
+        if (should_disable_colors())
+            print_with_color = false;
+        return;
+    }
+    
+    ext = nullptr;
+    buf = color_buf = xstrdup(p);
+    
+    enum parse_state state = PS_START;
+    while (true)
+    {
+        switch (state)
+        {
+        case PS_START:
+            label0 = *p++;
+            state = handle_start_state(&p, &buf, &ext);
+            break;
+            
+        case PS_2:
+            if (*p)
+            {
+                label1 = *p++;
+                state = PS_3;
+            }
+            else
+            {
+                state = PS_FAIL;
+            }
+            break;
+            
+        case PS_3:
+            state = PS_FAIL;
+            if (*(p++) == '=')
+            {
+                state = process_indicator_label(label0, label1, &buf, &p);
+            }
+            break;
+            
+        case PS_4:
+            if (*(p++) == '=')
+            {
+                ext->seq.string = buf;
+                state = get_funky_string(&buf, &p, false, &ext->seq.len) ? PS_START : PS_FAIL;
+            }
+            else
+            {
+                state = PS_FAIL;
+            }
+            break;
+            
+        case PS_FAIL:
+            goto done;
+            
+        case PS_DONE:
+            goto done;
+            
+        default:
+            affirm(false);
+        }
+    }
+    
+done:
+    if (state == PS_FAIL)
+    {
+        cleanup_on_failure();
+    }
+    else
+    {
+        postprocess_extension_list();
+        check_symlink_color_setting();
+    }
+}
+
+/* Return true if blanks output with the SGR parameters IND in effect
+   look the same as uncolored blanks: IND may set the foreground color,
+   intensity and italics, but nothing that is visible on a blank such
+   as a background, underline or reverse video.  Anything not
+   recognized counts as visible.  */
+
+static bool
+sgr_blank_safe (struct bin_str const *ind)
+{
+  char const *p = ind->string;
+  char const *lim = p + ind->len;
+  int skip = 0;
+  bool extended = false;
+
+  while (p < lim)
+    {
+      if (! c_isdigit (*p))
+        return false;
+      int n = 0;
+      for (; p < lim && c_isdigit (*p); p++)
+        n = MIN (n * 10 + (*p - '0'), 1000);
+      if (p < lim && *p++ != ';')
+        return false;
+
+      if (skip)
+        skip--;
+      else if (extended)
+        {
+          /* 38;5;N or 38;2;R;G;B.  */
+          extended = false;
+          if (n == 5)
+            skip = 1;
+          else if (n == 2)
+            skip = 3;
+          else
+            return false;
+        }
+      else if (n == 38)
+        extended = true;
+      else if (! (n <= 3 || n == 22 || n == 23 || n == 39
+                  || (30 <= n && n <= 37) || (90 <= n && n <= 97)))
+        return false;
+    }
+
+  return !skip && !extended;
+}
+
+/* Set *OUT to C_LEFT, IND and C_RIGHT composed into one sequence.  */
+
+static void
+compose_sgr (struct bin_str *out, struct bin_str const *ind)
+{
+  struct bin_str const *left = &color_indicator[C_LEFT];
+  struct bin_str const *right = &color_indicator[C_RIGHT];
+  char *p = xmalloc (left->len + ind->len + right->len);
+
+  out->string = p;
+  out->len = left->len + ind->len + right->len;
+  if (left->len)
+    p = mempcpy (p, left->string, left->len);
+  if (ind->len)
+    p = mempcpy (p, ind->string, ind->len);
+  if (right->len)
+    memcpy (p, right->string, right->len);
+}
+
+/* Compose the full escape sequence of every indicator and extension,
+   so that each colored name needs one write rather than three.  */
+
+static void
+compose_color_sequences (void)
+{
+  /* Holding a color across blanks assumes standard SGR framing.  */
+  bool sgr_framing = is_default_color_restore_needed ();
+
+  for (size_t i = 0; i < ARRAY_CARDINALITY (color_indicator); i++)
+    if (color_indicator[i].string)
+      {
+        compose_sgr (&color_sgr[i].seq, &color_indicator[i]);
+        color_sgr[i].blank_safe = (sgr_framing
+                                   && sgr_blank_safe (&color_indicator[i]));
+      }
+
+  for (struct color_ext_type *ext = color_ext_list; ext; ext = ext->next)
+    if (ext->seq.string)
+      {
+        compose_sgr (&ext->sgr.seq, &ext->seq);
+        ext->sgr.blank_safe = sgr_framing && sgr_blank_safe (&ext->seq);
+      }
+
+  compose_sgr (&sgr_default, &(struct bin_str) { 0, nullptr });
+  compose_sgr (&sgr_normal, &color_indicator[C_NORM]);
+  if (color_indicator[C_END].string)
+    sgr_reset = color_indicator[C_END];
+  else
+    compose_sgr (&sgr_reset, &color_indicator[C_RESET]);
+}
+
+/* Return the quoting style specified by the environment variable
+   QUOTING_STYLE if set and valid, -1 otherwise.  */
+
+static int
+getenv_quoting_style (void)
+{
+  char const *q_style = getenv ("QUOTING_STYLE");
+  if (!q_style)
+    return -1;
+  
+  int i = ARGMATCH (q_style, quoting_style_args, quoting_style_vals);
+  if (i < 0)
+    {
+      error (0, 0,
+             _("ignoring invalid value"
+               " of environment variable QUOTING_STYLE: %s"),
+             quote (q_style));
+      return -1;
+    }
+  
+  return quoting_style_vals[i];
+}
+
+/* Set the exit status to report a failure.  If SERIOUS, it is a
+   serious failure; otherwise, it is merely a minor problem.  */
+
+static void
+set_exit_status (bool serious)
+{
+  if (serious)
+  {
+    exit_status = LS_FAILURE;
+    return;
+  }
+  
+  if (exit_status == EXIT_SUCCESS)
+  {
+    exit_status = LS_MINOR_PROBLEM;
+  }
+}
+
+/* Errors reported by file_failure with --errors=summary, grouped by
+   errno value and message.  COUNT is the number of errors in the
+   group and SAMPLE holds the first few file names.  */
+enum { ERROR_SAMPLES = 3 };
+static struct error_group
+  {
+    int errnum;
+    char const *message;
+    uintmax_t count;
+    char *sample[ERROR_SAMPLES];
+  } *error_groups;
+static idx_t n_error_groups;
+static idx_t error_groups_alloc;
+
+/* Record a failure for --errors=summary.  */
+
+static void
+summarize_failure (int errnum, char const *message, char const *file)
+{
+  struct error_group *g;
+  for (g = error_groups; g < error_groups + n_error_groups; g++)
+    if (g->errnum == errnum && g->message == message)
+      break;
+
+  if (g == error_groups + n_error_groups)
+    {
+      if (n_error_groups == error_groups_alloc)
+        error_groups = xpalloc (error_groups, &error_groups_alloc, 1, -1,
+                                sizeof *error_groups);
+      g = &error_groups[n_error_groups++];
+      memset (g, 0, sizeof *g);
+      g->errnum = errnum;
+      g->message = message;
+    }
+
+  if (g->count < ERROR_SAMPLES)
+    g->sample[g->count] = xstrdup (file);
+  g->count++;
+}
+
+/* With --errors=summary, report each group of failures once.  */
+
+static void
+report_failure_summary (void)
+{
+  for (struct error_group *g = error_groups;
+       g < error_groups + n_error_groups; g++)
+    {
+      if (g->count == 1)
+        error (0, g->errnum, g->message, quoteaf (g->sample[0]));
+      else
+        {
+          char *first = xasprintf (g->message, quoteaf (g->sample[0]));
+          if (g->count == 2)
+            error (0, g->errnum, _("%s, and 1 more: %s"),
+                   first, quoteaf (g->sample[1]));
+          else
+            error (0, g->errnum, _("%s, and %ju more, e.g., %s, %s"),
+                   first, g->count - 1, quoteaf_n (1, g->sample[1]),
+                   quoteaf_n (2, g->sample[2]));
+          free (first);
+        }
+
+      for (int i = 0; i < MIN (g->count, ERROR_SAMPLES); i++)
+        free (g->sample[i]);
+    }
+
+  free (error_groups);
+  error_groups = nullptr;
+  n_error_groups = 0;
+}
+
+/* Assuming a failure is serious if SERIOUS, use the printf-style
+   MESSAGE to report the failure to access a file named FILE.  Assume
+   errno is set appropriately for the failure.  */
+
+static void
+file_failure (bool serious, char const *message, char const *file)
+{
+  int errnum = errno;
+
+  if (failures_muted)
+    return;
+
+  /* Do not let a held color bleed into the diagnostic.  */
+  sgr_release ();
+
+  switch (error_mode)
+    {
+    case errors_full:
+      error (0, errnum, message, quoteaf (file));
+      break;
+
+    case errors_buffered:
+      /* Unlike error, do not flush stdout or stderr each time.  */
+      fprintf (stderr, "%s: ", program_name);
+      fprintf (stderr, message, quoteaf (file));
+      if (errnum)
+        fprintf (stderr, ": %s", strerror (errnum));
+      putc ('\n', stderr);
+      break;
+
+    case errors_summary:
+      summarize_failure (errnum, message, file);
+      break;
+    }
+
+  set_exit_status (serious);
+}
+
+/* Request that the directory named NAME have its contents listed later.
+   If REALNAME is nonzero, it will be used instead of NAME when the
+   directory name is printed.  This allows symbolic links to directories
+   to be treated as regular directories but still be listed under their
+   real names.  NAME == nullptr is used to insert a marker entry for the
+   directory named in REALNAME.
+   If NAME is non-null, we use its dev/ino information to save
+   a call to stat -- when doing a recursive (-R) traversal.
+   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+
+static void
+queue_directory (char const *name, char const *realname, bool command_line_arg)
+{
+  struct pending *new = xmalloc (sizeof *new);
+  new->realname = realname ? xstrdup (realname) : NULL;
+  new->name = name ? xstrdup (name) : NULL;
+  new->command_line_arg = command_line_arg;
+  new->parent_slot = -1;
+  new->next = pending_dirs;
+  pending_dirs = new;
+  dirs_pending += !!name;
+}
+
+/* Read directory NAME, and list the files in it.
+   If REALNAME is nonzero, print its name instead of NAME;
+   this is used for symbolic links to directories.
+   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+
+static void dir_fd_drop(int slot)
+{
+    close(dir_fd_cache[slot].fd);
+    free(dir_fd_cache[slot].name);
+    dir_fd_cache[slot].gen = 0;
+}
+
+/* Cache FD, a descriptor of the directory NAME being listed, evicting
+   the least recently used entry if need be, and make it LISTING_SLOT.  */
+static void dir_fd_enter(int fd, char const *name)
+{
+    int slot = 0;
+    for (int i = 0; i < DIR_FD_CACHE_SIZE; i++)
+    {
+        if (!dir_fd_cache[i].gen)
+        {
+            slot = i;
+            break;
+        }
+        if (dir_fd_cache[i].used < dir_fd_cache[slot].used)
+            slot = i;
+    }
+
+    if (dir_fd_cache[slot].gen)
+        dir_fd_drop(slot);
+    dir_fd_cache[slot].fd = fd;
+    dir_fd_cache[slot].name = xstrdup(name);
+    dir_fd_cache[slot].gen = dir_fd_cache[slot].used = ++dir_fd_clock;
+    listing_slot = slot;
+}
+
+/* Return the length of the cached directory name DIR if it names an
+   ancestor of the directory NAME, or 0 otherwise.  */
+static idx_t dir_fd_ancestor_len(char const *dir, char const *name)
+{
+    idx_t len = strlen(dir);
+    if (!len || strncmp(dir, name, len) != 0
+        || (dir[len - 1] != '/' && name[len] != '/'))
+        return 0;
+    char const *rest = name + len;
+    while (*rest == '/')
+        rest++;
+    return *rest ? len : 0;
+}
+
+/* Return a cached descriptor to open the directory NAME relative to,
+   and set *RELNAME to NAME relative to it: that of its parent, which
+   SLOT and GEN identify, or else that of its nearest cached ancestor.
+   Return -1 if there is none.  */
+static int dir_fd_lookup(char const *name, int slot, uintmax_t gen,
+                         char const **relname)
+{
+    if (!(0 <= slot && dir_fd_cache[slot].gen == gen))
+    {
+        idx_t best_len = 0;
+        slot = -1;
+        for (int i = 0; i < DIR_FD_CACHE_SIZE; i++)
+        {
+            if (!dir_fd_cache[i].gen)
+                continue;
+            idx_t len = dir_fd_ancestor_len(dir_fd_cache[i].name, name);
+            if (best_len < len)
+            {
+                best_len = len;
+                slot = i;
+            }
+        }
+        if (slot < 0)
+            return -1;
+        *relname = name + best_len;
+        while (**relname == '/')
+            ++*relname;
+    }
+    else
+        *relname = last_component(name);
+
+    dir_fd_cache[slot].used = ++dir_fd_clock;
+    return dir_fd_cache[slot].fd;
+}
+
+/* Open the directory NAME, relative to PARENT_FD as RELNAME if
+   PARENT_FD is not -1.  */
+static bool open_directory(DIR **dirp, const char *name, int parent_fd,
+                           char const *relname, bool command_line_arg)
+{
+    errno = 0;
+    if (!enter_syscall(SYSCALL_OPEN))
+        *dirp = nullptr;
+    else if (parent_fd < 0)
+        *dirp = opendir(name);
+    else
+    {
+        int flags = (O_RDONLY | O_DIRECTORY | O_NOCTTY | O_CLOEXEC
+                     | (dereference == DEREF_ALWAYS ? 0 : O_NOFOLLOW));
+        int fd = openat(parent_fd, relname, flags);
+        *dirp = 0 <= fd ? fdopendir(fd) : nullptr;
+        if (!*dirp && 0 <= fd)
+        {
+            int err = errno;
+            close(fd);
+            errno = err;
+        }
+    }
+    leave_syscall();
+    if (!*dirp)
+    {
+        file_failure(command_line_arg, _("cannot open directory %s"), name);
+        return false;
+    }
+    return true;
+}
+
+static bool check_directory_loop(DIR *dirp, const char *name, bool command_line_arg)
+{
+    if (!LOOP_DETECT)
+        return true;
+
+    struct stat dir_stat;
+    int fd = dirfd(dirp);
+
+    if ((0 <= fd ? fstat_for_ino(fd, &dir_stat) : stat_for_ino(name, &dir_stat)) < 0)
+    {
+        file_failure(command_line_arg, _("cannot determine device and inode of %s"), name);
+        closedir(dirp);
+        return false;
+    }
+
+    if (visit_dir(dir_stat.st_dev, dir_stat.st_ino))
+    {
+        error(0, 0, _("%s: not listing already-listed directory"), quotef(name));
+        closedir(dirp);
+        set_exit_status(true);
+        return false;
+    }
+
+    dev_ino_push(dir_stat.st_dev, dir_stat.st_ino);
+    return true;
+}
+
+static void print_directory_header(const char *name, const char *realname, bool command_line_arg)
+{
+    static bool first = true;
+
+    if (flat)
+    {
+        /* Rather than a header, each entry gets the directory's name.  */
+        set_flat_dir(name);
+        return;
+    }
+    
+    if ((!recursive && !print_dir_name) || group_by != group_by_none
+        || format == columnar_format)
+        return;
+
+    if (!first)
+        dired_outbyte('\n');
+    first = false;
+    dired_indent();
+
+    char *absolute_name = nullptr;
+    if (print_hyperlink)
+    {
+        absolute_name = canonicalize_filename_mode(name, CAN_MISSING);
+        if (!absolute_name)
+            file_failure(command_line_arg, _("error canonicalizing %s"), name);
+    }
+    
+    quote_name(realname ? realname : name, dirname_quoting_options, -1,
+               nullptr, true, &subdired_obstack, absolute_name);
+    free(absolute_name);
+    dired_outstring(":\n");
+}
+
+static bool should_print_immediately(void)
+{
+    return format == one_per_line && !plan.sort &&
+           !print_block_size && !recursive && !capture_name &&
+           !also_outputs && group_by == group_by_none;
+}
+
+static enum filetype dirent_filetype(struct dirent const *entry)
+{
+#if HAVE_STRUCT_DIRENT_D_TYPE
+    return d_type_filetype[entry->d_type];
+#else
+    return unknown;
+#endif
+}
+
+/* Add the entry FILE of type TYPE and inode INODE, read from the
+   directory NAME, and print it now if the listing is streamed.  */
+static void process_entry(char const *file, enum filetype type, ino_t inode,
+                          const char *name, uintmax_t *total_blocks)
+{
+    *total_blocks += gobble_file(file, type, inode, false, name);
+
+    if (progress_interval && stats_entries % 256 == 0)
+        progress_tick();
+
+    if (plan.streaming)
+    {
+        sort_files();
+        print_current_files();
+        clear_files();
     }
-    return linelen < 0 ? 80 : linelen;
 }
 
-static void set_tabsize(ptrdiff_t tabsize_opt, int format) {
-    if (format == many_per_line || format == horizontal || format == with_commas) {
-        if (tabsize_opt >= 0) {
-            tabsize = tabsize_opt;
-        } else {
-            tabsize = 8;
-            char const *p = getenv("TABSIZE");
-            if (p) {
-                uintmax_t tmp;
-                if (xstrtoumax(p, nullptr, 0, &tmp, "") == LONGINT_OK && tmp <= SIZE_MAX)
-                    tabsize = tmp;
-                else
-                    error(0, 0, _("ignoring invalid tab size in environment variable TABSIZE: %s"), quote(p));
-            }
-        }
-    }
+static void process_directory_entry(struct dirent *entry, const char *name, uintmax_t *total_blocks)
+{
+    if (file_ignored(entry->d_name))
+        return;
+
+    process_entry(entry->d_name, dirent_filetype(entry), RELIABLE_D_INO(entry),
+                  name, total_blocks);
 }
 
-static void configure_quoting(int quoting_style_opt, int format) {
-    int qs = quoting_style_opt;
-    if (qs < 0)
-        qs = getenv_quoting_style();
-    if (qs < 0)
-        qs = (ls_mode == LS_LS ? (stdout_isatty() ? shell_escape_quoting_style : -1) : escape_quoting_style);
-    if (qs >= 0)
-        set_quoting_style(nullptr, qs);
-    
-    qs = get_quoting_style(nullptr);
-    align_variable_outer_quotes =
-        ((format == long_format || ((format == many_per_line || format == horizontal) && line_length))
-         && (qs == shell_quoting_style || qs == shell_escape_quoting_style || qs == c_maybe_quoting_style));
-    
-    filename_quoting_options = clone_quoting_options(nullptr);
-    if (qs == escape_quoting_style)
-        set_char_quoting(filename_quoting_options, ' ', 1);
-    if (file_type <= indicator_style) {
-        char const *p;
-        for (p = &"*=>@|"[indicator_style - file_type]; *p; p++)
-            set_char_quoting(filename_quoting_options, *p, 1);
-    }
+static bool should_continue_reading(int err)
+{
+    if (err == 0)
+        return false;
+        
+#if !(2 < __GLIBC__ + (3 <= __GLIBC_MINOR__))
+    if (err == ENOENT)
+        return false;
+#endif
     
-    dirname_quoting_options = clone_quoting_options(nullptr);
-    set_char_quoting(dirname_quoting_options, ':', 1);
+    return err == EOVERFLOW;
 }
 
-static void configure_time_style(char const *time_style_option) {
-    static char const posix_prefix[] = "posix-";
-    char const *style = time_style_option;
-    
-    if (!style) {
-        style = getenv("TIME_STYLE");
-        if (!style)
-            style = "locale";
-    }
-    
-    while (STREQ_LEN(style, posix_prefix, sizeof posix_prefix - 1)) {
-        if (!hard_locale(LC_TIME))
-            return;
-        style += sizeof posix_prefix - 1;
-    }
-    
-    if (*style == '+') {
-        char const *p0 = style + 1;
-        char *p0nl = strchr(p0, '\n');
-        char const *p1 = p0;
-        if (p0nl) {
-            if (strchr(p0nl + 1, '\n'))
-                error(LS_FAILURE, 0, _("invalid time style format %s"), quote(p0));
-            *p0nl++ = '\0';
-            p1 = p0nl;
-        }
-        long_time_format[0] = p0;
-        long_time_format[1] = p1;
-    } else {
-        switch (x_timestyle_match(style, true, time_style_args, (char const *)time_style_types, sizeof(*time_style_types), LS_FAILURE)) {
-        case full_iso_time_style:
-            long_time_format[0] = long_time_format[1] = "%Y-%m-%d %H:%M:%S.%N %z";
-            break;
-        case long_iso_time_style:
-            long_time_format[0] = long_time_format[1] = "%Y-%m-%d %H:%M";
-            break;
-        case iso_time_style:
-            long_time_format[0] = "%Y-%m-%d ";
-            long_time_format[1] = "%m-%d %H:%M";
-            break;
-        case locale_time_style:
-            if (hard_locale(LC_TIME)) {
-                for (int i = 0; i < 2; i++)
-                    long_time_format[i] = dcgettext(nullptr, long_time_format[i], LC_TIME);
-            }
+/* Return the next entry of the directory DIRP named NAME, or null at
+   its end or after a read error, which is diagnosed.  */
+static struct dirent *next_dir_entry(DIR *dirp, const char *name, bool command_line_arg)
+{
+    while (true)
+    {
+        errno = 0;
+        struct dirent *next
+          = enter_syscall(SYSCALL_READDIR) ? readdir(dirp) : nullptr;
+        leave_syscall();
+
+        if (next)
+            return next;
+
+        int err = errno;
+        if (!should_continue_reading(err))
+        {
+            if (err != 0 && err != ENOENT)
+                file_failure(command_line_arg, _("reading directory %s"), name);
+            return nullptr;
         }
+        file_failure(command_line_arg, _("reading directory %s"), name);
+        process_signals();
     }
-    abformat_init();
 }
 
-static int decode_switches(int argc, char **argv) {
-    char const *time_style_option = nullptr;
-    bool kibibytes_specified = false;
-    int format_opt = -1;
-    int hide_control_chars_opt = -1;
-    int quoting_style_opt = -1;
-    int sort_opt = -1;
-    ptrdiff_t tabsize_opt = -1;
-    ptrdiff_t width_opt = -1;
+static uintmax_t read_directory_entries(DIR *dirp, const char *name, bool command_line_arg)
+{
+    bool paged = page_size || page_cursor || page_limit || page_after;
+    if (stat_threads && !paged)
+        return read_directory_entries_parallel(dirp, name, command_line_arg);
 
-    while (true) {
-        int oi = -1;
-        int c = getopt_long(argc, argv, "abcdfghiklmnopqrstuvw:xABCDFGHI:LNQRST:UXZ1", long_options, &oi);
-        if (c == -1)
-            break;
+    uintmax_t total_blocks = 0;
+    struct dirent *next;
 
-        switch (c) {
-        case 'a': handle_option_a(); break;
-        case 'b': quoting_style_opt = escape_quoting_style; break;
-        case 'c': time_type = time_ctime; explicit_time = true; break;
-        case 'd': immediate_dirs = true; break;
-        case 'f': handle_option_f(); break;
-        case FILE_TYPE_INDICATOR_OPTION: indicator_style = file_type; break;
-        case 'g': handle_option_g(&format_opt); break;
-        case 'h': handle_option_h(); break;
-        case 'i': print_inode = true; break;
-        case 'k': kibibytes_specified = true; break;
-        case 'l': format_opt = long_format; break;
-        case 'm': format_opt = with_commas; break;
-        case 'n': handle_option_n(&format_opt); break;
-        case 'o': handle_option_o(&format_opt); break;
-        case 'p': indicator_style = slash; break;
-        case 'q': hide_control_chars_opt = true; break;
-        case 'r': sort_reverse = true; break;
-        case 's': print_block_size = true; break;
-        case 't': sort_opt = sort_time; break;
-        case 'u': time_type = time_atime; explicit_time = true; break;
-        case 'v': sort_opt = sort_version; break;
-        case 'w':
-            width_opt = decode_line_length(optarg);
-            if (width_opt < 0)
-                error(LS_FAILURE, 0, "%s: %s", _("invalid line width"), quote(optarg));
-            break;
-        case 'x': format_opt = horizontal; break;
-        case 'A': ignore_mode = IGNORE_DOT_AND_DOTDOT; break;
-        case 'B': handle_option_B(); break;
-        case 'C': format_opt = many_per_line; break;
-        case 'D': handle_option_D(&format_opt); break;
-        case 'F': handle_classify_option(optarg); break;
-        case 'G': print_group = false; break;
-        case 'H': dereference = DEREF_COMMAND_LINE_ARGUMENTS; break;
-        case DEREFERENCE_COMMAND_LINE_SYMLINK_TO_DIR_OPTION:
-            dereference = DEREF_COMMAND_LINE_SYMLINK_TO_DIR; break;
-        case 'I': add_ignore_pattern(optarg); break;
-        case 'L': dereference = DEREF_ALWAYS; break;
-        case 'N': quoting_style_opt = literal_quoting_style; break;
-        case 'Q': quoting_style_opt = c_quoting_style; break;
-        case 'R': recursive = true; break;
-        case 'S': sort_opt = sort_size; break;
-        case 'T':
-            tabsize_opt = xnumtoumax(optarg, 0, 0, MIN(PTRDIFF_MAX, SIZE_MAX), "", _("invalid tab size"), LS_FAILURE, 0);
-            break;
-        case 'U': sort_opt = sort_none; break;
-        case 'X': sort_opt = sort_extension; break;
-        case '1':
-            if (format_opt != long_format)
-                format_opt = one_per_line;
-            break;
-        case AUTHOR_OPTION: print_author = true; break;
-        case HIDE_OPTION: handle_hide_option(optarg); break;
-        case SORT_OPTION: sort_opt = XARGMATCH("--sort", optarg, sort_args, sort_types); break;
-        case GROUP_DIRECTORIES_FIRST_OPTION: directories_first = true; break;
-        case TIME_OPTION:
-            time_type = XARGMATCH("--time", optarg, time_args, time_types);
-            explicit_time = true;
-            break;
-        case FORMAT_OPTION: format_opt = XARGMATCH("--format", optarg, format_args, format_types); break;
-        case FULL_TIME_OPTION:
-            format_opt = long_format;
-            time_style_option = "full-iso";
-            break;
-        case COLOR_OPTION: handle_color_option(optarg); break;
-        case HYPERLINK_OPTION: handle_hyperlink_option(optarg); break;
-        case INDICATOR_STYLE_OPTION:
-            indicator_style = XARGMATCH("--indicator-style", optarg, indicator_style_args, indicator_style_types);
-            break;
-        case QUOTING_STYLE_OPTION:
-            quoting_style_opt = XARGMATCH("--quoting-style", optarg, quoting_style_args, quoting_style_vals);
+    if (paged)
+        page_begin(name);
+    if (page_cursor)
+        seekdir(dirp, page_next_cursor);
+
+    /* With --page-size, POS is where the entry about to be read starts,
+       so that the next page can resume at the first one left out.  */
+    long pos = page_size ? telldir(dirp) : 0;
+    idx_t listed = 0;
+
+    while ((next = next_dir_entry(dirp, name, command_line_arg)))
+    {
+        if (page_size && !file_ignored(next->d_name)
+            && listed++ == page_size)
+        {
+            page_more = true;
+            page_next_cursor = pos;
             break;
-        case TIME_STYLE_OPTION: time_style_option = optarg; break;
-        case SHOW_CONTROL_CHARS_OPTION: hide_control_chars_opt = false; break;
-        case BLOCK_SIZE_OPTION: handle_block_size_option(optarg, oi); break;
-        case SI_OPTION: handle_si_option(); break;
-        case 'Z': print_scontext = true; break;
-        case ZERO_OPTION: handle_zero_option(&format_opt, &hide_control_chars_opt, &quoting_style_opt); break;
-        case_GETOPT_HELP_CHAR;
-        case_GETOPT_VERSION_CHAR(PROGRAM_NAME, AUTHORS);
-        default: usage(LS_FAILURE);
         }
+
+        idx_t n_used = cwd_n_used;
+        process_directory_entry(next, name, &total_blocks);
+        if ((page_limit || page_after) && n_used < cwd_n_used)
+            page_select(&total_blocks);
+        process_signals();
+
+        if (page_size)
+            pos = telldir(dirp);
+    }
+
+    if (paged)
+        page_measure();
+    
+    return total_blocks;
+}
+
+static void print_total_blocks(uintmax_t total_blocks)
+{
+    if ((!format == long_format && !print_block_size)
+        || format == columnar_format || flat)
+        return;
+
+    char buf[LONGEST_HUMAN_READABLE + 3];
+    char *p = human_readable(total_blocks, buf + 1, human_output_opts,
+                            ST_NBLOCKSIZE, output_block_size);
+    char *pend = p + strlen(p);
+    *--p = ' ';
+    *pend++ = eolbyte;
+    dired_indent();
+    dired_outstring(_("total"));
+    dired_outbuf(p, pend - p);
+}
+
+/* Sort and print the entries read from directory NAME, which occupy
+   TOTAL_BLOCKS, queueing its subdirectories if recursive.  */
+static void list_current_dir(char const *name, uintmax_t total_blocks)
+{
+    sort_files();
+
+    if (recursive)
+        extract_dirs_from_files(name, false);
+
+    also_output_files(name);
+
+    if (group_by != group_by_none)
+        return;
+
+    if (compress_names)
+        compress_file_names();
+
+    print_total_blocks(total_blocks);
+
+    columnar_dir = name;
+    if (cwd_n_used || format == columnar_format)
+        print_current_files();
+    columnar_dir = nullptr;
+}
+
+static void print_dir(char const *name, char const *realname, bool command_line_arg,
+                      int parent_fd, char const *relname)
+{
+    DIR *dirp;
+
+    if (snapshot_fp)
+    {
+        replay_dir(name, realname, command_line_arg);
+        return;
     }
+    
+    if (!open_directory(&dirp, name, parent_fd, relname, command_line_arg))
+        return;
 
-    process_block_size_env(kibibytes_specified);
-    format = determine_format(format_opt);
-    line_length = determine_line_length(width_opt, format);
-    max_idx = line_length / MIN_COLUMN_WIDTH;
-    max_idx += line_length % MIN_COLUMN_WIDTH != 0;
-    set_tabsize(tabsize_opt, format);
-    qmark_funny_chars = (hide_control_chars_opt < 0 ? ls_mode == LS_LS && stdout_isatty() : hide_control_chars_opt);
-    configure_quoting(quoting_style_opt, format);
-    dired &= (format == long_format) & !print_hyperlink;
-    if (eolbyte < dired)
-        error(LS_FAILURE, 0, _("--dired and --zero are incompatible"));
-    sort_type = (sort_opt >= 0 ? sort_opt : (format != long_format && explicit_time) ? sort_time : sort_name);
-    if (format == long_format)
-        configure_time_style(time_style_option);
+    if (!check_directory_loop(dirp, name, command_line_arg))
+        return;
+
+    clear_files();
+    print_directory_header(name, realname, command_line_arg);
+
+    bool bounded = plan.bounded;
+    uintmax_t total_blocks = 0;
+    listing_fd = dirfd(dirp);
+    if (bounded)
+        list_bounded_dir(dirp, name, command_line_arg);
+    else
+        total_blocks = read_directory_entries(dirp, name, command_line_arg);
+
+    if (capture_fp)
+        capture_dir(name, dirp);
+
+    /* Keep a descriptor for opening any subdirectories.  Bounded
+       listings are never recursive.  */
+    int keep_fd = (recursive && 0 <= listing_fd
+                   ? fcntl(listing_fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1)
+                   : -1);
+    listing_fd = -1;
+
+    if (closedir(dirp) != 0)
+        file_failure(command_line_arg, _("closing directory %s"), name);
+
+    if (!bounded)
+    {
+        uintmax_t pending_before = dirs_pending;
+        if (0 <= keep_fd)
+            dir_fd_enter(keep_fd, name);
+        list_current_dir(name, total_blocks);
+        if (0 <= listing_slot && dirs_pending == pending_before)
+            dir_fd_drop(listing_slot);
+        listing_slot = -1;
+    }
+
+    page_end();
+
+    sgr_release();
+    output_advise(false);
+}
+
+/* Add 'pattern' to the list of patterns for which files that match are
+   not listed.  */
+
+static void
+add_ignore_pattern (char const *pattern)
+{
+  struct ignore_pattern *ignore = xmalloc (sizeof *ignore);
+  ignore->pattern = pattern;
+  ignore->next = ignore_patterns;
+  ignore_patterns = ignore;
+}
+
+/* Return true if one of the PATTERNS matches FILE.  */
+
+static bool
+patterns_match (struct ignore_pattern const *patterns, char const *file)
+{
+  struct ignore_pattern const *p;
+  for (p = patterns; p; p = p->next)
+    if (fnmatch (p->pattern, file, FNM_PERIOD) == 0)
+      return true;
+  return false;
+}
+
+/* Return true if FILE should be ignored.  */
+
+static bool is_dot_file(char const *name)
+{
+    return name[0] == '.';
+}
+
+static bool is_special_dot_file(char const *name)
+{
+    return name[1] == '\0' || (name[1] == '.' && name[2] == '\0');
+}
+
+static bool should_ignore_dot_file(char const *name)
+{
+    if (ignore_mode == IGNORE_MINIMAL) {
+        return false;
+    }
     
-    return optind;
+    if (!is_dot_file(name)) {
+        return false;
+    }
+    
+    if (ignore_mode == IGNORE_DEFAULT) {
+        return true;
+    }
+    
+    return !is_special_dot_file(name);
 }
 
-/* Parse a string as part of the LS_COLORS variable; this may involve
-   decoding all kinds of escape characters.  If equals_end is set an
-   unescaped equal sign ends the string, otherwise only a : or \0
-   does.  Set *OUTPUT_COUNT to the number of bytes output.  Return
-   true if successful.
+static bool should_apply_hide_patterns(char const *name)
+{
+    return ignore_mode == IGNORE_DEFAULT && patterns_match(hide_patterns, name);
+}
 
-   The resulting string is *not* null-terminated, but may contain
-   embedded nulls.
+static bool file_ignored(char const *name)
+{
+    if (should_ignore_dot_file(name)) {
+        return true;
+    }
+    
+    if (should_apply_hide_patterns(name)) {
+        return true;
+    }
+    
+    return patterns_match(ignore_patterns, name);
+}
 
-   Note that both dest and src are char **; on return they point to
-   the first free byte after the array and the character that ended
-   the input string, respectively.  */
+/* POSIX requires that a file size be printed without a sign, even
+   when negative.  Assume the typical case where negative sizes are
+   actually positive values that have wrapped around.  */
 
-#define OCTAL_BASE 8
-#define HEX_BASE 16
-#define ESCAPE_CHAR 27
-#define DELETE_CHAR 127
-#define CONTROL_MASK 037
-#define HEX_DIGIT_OFFSET 10
+static uintmax_t
+unsigned_file_size (off_t size)
+{
+  if (size < 0)
+  {
+    return size + ((uintmax_t) OFF_T_MAX - OFF_T_MIN + 1);
+  }
+  return size;
+}
 
-typedef enum {
-    ST_GND, ST_BACKSLASH, ST_OCTAL, ST_HEX, ST_CARET, ST_END, ST_ERROR
-} parse_state;
+#ifdef HAVE_CAP
+/* Return true if NAME has a capability (see linux/capability.h) */
+static bool
+has_capability (char const *name)
+{
+  char *result;
+  bool has_cap;
 
-static bool is_octal_digit(char c)
+  cap_t cap_d = cap_get_file (name);
+  if (cap_d == nullptr)
+    return false;
+
+  result = cap_to_text (cap_d, nullptr);
+  cap_free (cap_d);
+  if (!result)
+    return false;
+
+  /* check if human-readable capability string is empty */
+  has_cap = !!*result;
+
+  cap_free (result);
+  return has_cap;
+}
+#else
+static bool
+has_capability (MAYBE_UNUSED char const *name)
 {
-    return c >= '0' && c <= '7';
+  errno = ENOTSUP;
+  return false;
 }
+#endif
 
-static bool is_hex_digit(char c)
+/* Enter and remove entries in the table 'cwd_file'.  */
+
+static void
+free_ent (struct fileinfo *f)
 {
-    return (c >= '0' && c <= '9') || 
-           (c >= 'a' && c <= 'f') || 
-           (c >= 'A' && c <= 'F');
+  free (f->name);
+  free (f->linkname);
+  free (f->absolute_name);
+  free (f->sortkey);
+  free (f->xattrs);
+  if (f->scontext != UNKNOWN_SECURITY_CONTEXT)
+    aclinfo_scontext_free (f->scontext);
 }
 
-static int hex_digit_value(char c)
+/* Empty the table of files.  */
+static void reset_width_counters(void)
 {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + HEX_DIGIT_OFFSET;
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + HEX_DIGIT_OFFSET;
-    return -1;
+    inode_number_width = 0;
+    block_size_width = 0;
+    nlink_width = 0;
+    owner_width = 0;
+    group_width = 0;
+    author_width = 0;
+    scontext_width = 0;
+    major_device_number_width = 0;
+    minor_device_number_width = 0;
+    file_size_width = 0;
 }
 
-static char get_escape_char(char c)
+static void reset_file_flags(void)
 {
-    switch (c)
+    cwd_n_used = 0;
+    cwd_some_quoted = false;
+    any_has_acl = false;
+}
+
+static void free_all_files(void)
+{
+    for (idx_t i = 0; i < cwd_n_used; i++)
     {
-    case 'a': return '\a';
-    case 'b': return '\b';
-    case 'e': return ESCAPE_CHAR;
-    case 'f': return '\f';
-    case 'n': return '\n';
-    case 'r': return '\r';
-    case 't': return '\t';
-    case 'v': return '\v';
-    case '?': return DELETE_CHAR;
-    case '_': return ' ';
-    default: return c;
+        struct fileinfo *f = sorted_file[i];
+        free_ent(f);
+    }
+}
+
+static void clear_files(void)
+{
+    free_all_files();
+    reset_file_flags();
+    reset_width_counters();
+}
+
+/* Cache file_has_aclinfo failure, when it's trivial to do.
+   Like file_has_aclinfo, but when F's st_dev says it's on a file
+   system lacking ACL support, return 0 with ENOTSUP immediately.  */
+static int
+file_has_aclinfo_cache (char const *file, struct fileinfo *f,
+                        struct aclinfo *ai, int flags)
+{
+  static int unsupported_return;
+  static char *unsupported_scontext;
+  static int unsupported_scontext_err;
+  static dev_t unsupported_device;
+
+  if (is_cached_unsupported_device(f, unsupported_scontext, unsupported_device))
+    {
+      return setup_cached_unsupported_response(ai, unsupported_scontext, 
+                                                unsupported_scontext_err, 
+                                                unsupported_return);
+    }
+
+  count_syscall (SYSCALL_XATTR);
+  errno = 0;
+  int n = file_has_aclinfo (file, ai, flags);
+  int err = errno;
+  leave_syscall ();
+  
+  if (should_cache_as_unsupported(f, n, err, flags, ai->scontext_err))
+    {
+      cache_unsupported_device(n, ai->scontext, ai->scontext_err, 
+                                f->stat.st_dev, &unsupported_return,
+                                &unsupported_scontext, &unsupported_scontext_err,
+                                &unsupported_device);
     }
+  return n;
 }
 
-static void write_char(char **q, char c, size_t *count)
+static int 
+is_cached_unsupported_device(struct fileinfo *f, char *unsupported_scontext, 
+                              dev_t unsupported_device)
 {
-    *(*q)++ = c;
-    (*count)++;
+  return f->stat_ok && unsupported_scontext && 
+         f->stat.st_dev == unsupported_device;
 }
 
-static parse_state process_ground_state(char const **p, char **q, 
-                                       size_t *count, bool equals_end)
+static int 
+setup_cached_unsupported_response(struct aclinfo *ai, char *unsupported_scontext,
+                                   int unsupported_scontext_err, int unsupported_return)
 {
-    char c = **p;
-    
-    if (c == ':' || c == '\0')
-        return ST_END;
-    
-    if (c == '\\')
-    {
-        (*p)++;
-        return ST_BACKSLASH;
-    }
-    
-    if (c == '^')
-    {
-        (*p)++;
-        return ST_CARET;
-    }
-    
-    if (c == '=' && equals_end)
-        return ST_END;
-    
-    write_char(q, *(*p)++, count);
-    return ST_GND;
+  ai->buf = ai->u.__gl_acl_ch;
+  ai->size = 0;
+  ai->scontext = unsupported_scontext;
+  ai->scontext_err = unsupported_scontext_err;
+  errno = ENOTSUP;
+  return unsupported_return;
 }
 
-static parse_state process_backslash_state(char const **p, char **q, 
-                                          size_t *count, char *num)
+static int 
+should_cache_as_unsupported(struct fileinfo *f, int n, int err, 
+                             int flags, int scontext_err)
 {
-    char c = **p;
-    
-    if (c == '\0')
-    {
-        (*p)++;
-        return ST_ERROR;
-    }
-    
-    if (is_octal_digit(c))
-    {
-        *num = c - '0';
-        (*p)++;
-        return ST_OCTAL;
-    }
-    
-    if (c == 'x' || c == 'X')
-    {
-        *num = 0;
-        (*p)++;
-        return ST_HEX;
-    }
-    
-    *num = get_escape_char(c);
-    write_char(q, *num, count);
-    (*p)++;
-    return ST_GND;
+  if (!f->stat_ok || n > 0)
+    return 0;
+  
+  if (acl_errno_valid(err))
+    return 0;
+  
+  if ((flags & ACL_GET_SCONTEXT) && acl_errno_valid(scontext_err))
+    return 0;
+  
+  return 1;
 }
 
-static parse_state process_octal_state(char const **p, char **q, 
-                                      size_t *count, char *num)
+static void 
+cache_unsupported_device(int n, char *scontext, int scontext_err, 
+                          dev_t device, int *unsupported_return,
+                          char **unsupported_scontext, int *unsupported_scontext_err,
+                          dev_t *unsupported_device)
 {
-    if (!is_octal_digit(**p))
-    {
-        write_char(q, *num, count);
-        return ST_GND;
-    }
-    
-    *num = (*num << 3) + (*(*p)++ - '0');
-    return ST_OCTAL;
+  *unsupported_return = n;
+  *unsupported_scontext = scontext;
+  *unsupported_scontext_err = scontext_err;
+  *unsupported_device = device;
 }
 
-static parse_state process_hex_state(char const **p, char **q, 
-                                    size_t *count, char *num)
+/* Cache has_capability failure, when it's trivial to do.
+   Like has_capability, but when F's st_dev says it's on a file
+   system lacking capability support, return 0 with ENOTSUP immediately.  */
+static bool is_unsupported_device(struct fileinfo *f, bool unsupported_cached, dev_t unsupported_device)
 {
-    int value = hex_digit_value(**p);
-    
-    if (value < 0)
-    {
-        write_char(q, *num, count);
-        return ST_GND;
-    }
-    
-    *num = (*num << 4) + value;
-    (*p)++;
-    return ST_HEX;
+    return f->stat_ok && unsupported_cached && f->stat.st_dev == unsupported_device;
 }
 
-static parse_state process_caret_state(char const **p, char **q, 
-                                      size_t *count)
+static void cache_unsupported_device(struct fileinfo *f, bool *unsupported_cached, dev_t *unsupported_device)
 {
-    char c = **p;
-    
-    if (c >= '@' && c <= '~')
-    {
-        write_char(q, *(*p)++ & CONTROL_MASK, count);
-        return ST_GND;
-    }
-    
-    if (c == '?')
+    if (f->stat_ok && !acl_errno_valid(errno))
     {
-        write_char(q, DELETE_CHAR, count);
-        (*p)++;
-        return ST_GND;
+        *unsupported_cached = true;
+        *unsupported_device = f->stat.st_dev;
     }
-    
-    return ST_ERROR;
 }
 
 static bool
-get_funky_string (char **dest, char const **src, bool equals_end,
-                  size_t *output_count)
+has_capability_cache (char const *file, struct fileinfo *f)
 {
-    char num = 0;
-    size_t count = 0;
-    parse_state state = ST_GND;
-    char const *p = *src;
-    char *q = *dest;
+    static bool unsupported_cached;
+    static dev_t unsupported_device;
 
-    while (state < ST_END)
+    if (is_unsupported_device(f, unsupported_cached, unsupported_device))
     {
-        switch (state)
-        {
-        case ST_GND:
-            state = process_ground_state(&p, &q, &count, equals_end);
-            break;
-
-        case ST_BACKSLASH:
-            state = process_backslash_state(&p, &q, &count, &num);
-            break;
-
-        case ST_OCTAL:
-            state = process_octal_state(&p, &q, &count, &num);
-            break;
-
-        case ST_HEX:
-            state = process_hex_state(&p, &q, &count, &num);
-            break;
-
-        case ST_CARET:
-            state = process_caret_state(&p, &q, &count);
-            break;
-
-        case ST_END: 
-        case ST_ERROR: 
-        default:
-            unreachable();
-        }
+        errno = ENOTSUP;
+        return 0;
     }
 
-    *dest = q;
-    *src = p;
-    *output_count = count;
-
-    return state != ST_ERROR;
+    bool b = enter_syscall(SYSCALL_XATTR) && has_capability(file);
+    leave_syscall();
+    if (!b)
+    {
+        cache_unsupported_device(f, &unsupported_cached, &unsupported_device);
+    }
+    return b;
 }
 
-enum parse_state
-  {
-    PS_START = 1,
-    PS_2,
-    PS_3,
-    PS_4,
-    PS_DONE,
-    PS_FAIL
-  };
-
-
-/* Check if the content of TERM is a valid name in dircolors.  */
-
-static bool
-known_term_type (void)
+static bool needs_quoting(char const *name)
 {
-  char const *term = getenv ("TERM");
-  if (! term || ! *term)
-    return false;
-
-  return term_matches_any_in_list(term);
+    char test[2];
+    size_t len = quotearg_buffer(test, sizeof test, name, -1,
+                                  filename_quoting_options);
+    return *name != *test || strlen(name) != len;
 }
 
-static bool
-term_matches_any_in_list(char const *term)
+/* Add a file to the current table of files.
+   Verify that the file exists, and print an error message if it does not.
+   Return the number of blocks that the file occupies.  */
+static void initialize_fileinfo(struct fileinfo *f, ino_t inode, enum filetype type)
 {
-  char const *line = G_line;
-  while (line - G_line < sizeof (G_line))
-    {
-      if (is_term_line(line) && term_matches_pattern(line, term))
-        return true;
-      
-      line += strlen (line) + 1;
-    }
-  return false;
+    memset(f, '\0', sizeof *f);
+    f->stat.st_ino = inode;
+    f->filetype = type;
+    f->scontext = UNKNOWN_SECURITY_CONTEXT;
+    f->quoted = -1;
 }
 
-static bool
-is_term_line(char const *line)
+static void update_quoted_status(struct fileinfo *f, char const *name)
 {
-  return STRNCMP_LIT (line, "TERM ") == 0;
+    if ((! cwd_some_quoted) && align_variable_outer_quotes)
+    {
+        f->quoted = needs_quoting(name);
+        if (f->quoted)
+            cwd_some_quoted = 1;
+    }
 }
 
-static bool
-term_matches_pattern(char const *line, char const *term)
-{
-  const int TERM_PREFIX_LENGTH = 5;
-  return fnmatch (line + TERM_PREFIX_LENGTH, term, 0) == 0;
+static bool should_check_stat(enum filetype type, bool command_line_arg, ino_t inode)
+{
+    return command_line_arg
+           || print_hyperlink
+           || plan.needs_stat
+           || (plan.needs_type && type == unknown)
+           || (plan.stat_dirs && (type == directory || type == unknown))
+           || (plan.stat_symlinks
+               && (type == symbolic_link || type == unknown))
+           || (plan.stat_regular && (type == normal || type == unknown))
+           || (plan.stat_missing_ino && inode == NOT_AN_INODE_NUMBER);
 }
 
-static bool should_disable_colors(void)
+/* Return NAME in the directory DIRNAME as a name that resolves from
+   the working directory, in newly allocated storage.  */
+static char *full_path(char const *name, char const *dirname)
 {
-    char const *colorterm = getenv("COLORTERM");
-    return !(colorterm && *colorterm) && !known_term_type();
+    if (name[0] == '/' || !dirname)
+        return xstrdup(name);
+    char *p = xmalloc(strlen(name) + strlen(dirname) + 2);
+    attach(p, dirname, name);
+    return p;
 }
 
-static struct color_ext_type* allocate_extension(void)
+/* Return the full name of E, for diagnostics, in newly allocated
+   storage.  Only this and calls with no *at variant need it, so it is
+   not built for each entry.  */
+static char *entry_full_name(struct entry_path const *e)
 {
-    struct color_ext_type *ext = xmalloc(sizeof *ext);
-    ext->next = color_ext_list;
-    color_ext_list = ext;
-    ext->exact_match = false;
-    return ext;
+    return e->fd == AT_FDCWD ? xstrdup(e->name) : full_path(e->base, e->dirname);
 }
 
-static enum parse_state process_extension_definition(struct color_ext_type *ext, char **buf, char const **p)
+/* Report a failure with MESSAGE to access E.  */
+static void entry_failure(struct entry_path const *e, bool serious,
+                          char const *message)
 {
-    ext->ext.string = *buf;
-    return get_funky_string(buf, p, true, &ext->ext.len) ? PS_4 : PS_FAIL;
+    if (failures_muted)
+        return;
+    int err = errno;
+    char *full_name = entry_full_name(e);
+    errno = err;
+    file_failure(serious, message, full_name);
+    free(full_name);
 }
 
-static enum parse_state process_indicator_label(char label0, char label1, char **buf, char const **p)
+/* Return a name for E that the calls with no *at variant can use: its
+   name under /proc/self/fd if the directory being listed has a
+   descriptor.  Use BUF if it is large enough.  Free the result with
+   entry_access_free.  If /proc is unavailable, return null with errno
+   set, rather than fall back on a full name that can exceed
+   PATH_MAX.  */
+static char *entry_access_name(struct entry_path const *e,
+                               char buf[OPENAT_BUFFER_SIZE])
 {
-    for (int i = 0; i < ARRAY_CARDINALITY(indicator_name); i++)
+    if (e->fd == AT_FDCWD)
+        return (char *) e->name;
+
+    errno = 0;
+    char *name = openat_proc_name(buf, e->fd, e->name);
+    if (!name)
     {
-        if (label0 == indicator_name[i][0] && label1 == indicator_name[i][1])
-        {
-            color_indicator[i].string = *buf;
-            return get_funky_string(buf, p, false, &color_indicator[i].len) ? PS_START : PS_FAIL;
-        }
+        if (errno == ENOMEM)
+            xalloc_die();
+        errno = ENOTSUP;
     }
-    error(0, 0, _("unrecognized prefix: %s"), quote((char []){label0, label1, '\0'}));
-    return PS_FAIL;
+    return name;
 }
 
-static enum parse_state handle_start_state(char const **p, char **buf, struct color_ext_type **ext)
+static void entry_access_free(struct entry_path const *e, char *name,
+                              char const *buf)
 {
-    switch (**p)
-    {
-    case ':':
-        ++(*p);
-        return PS_START;
-    case '*':
-        *ext = allocate_extension();
-        ++(*p);
-        return process_extension_definition(*ext, buf, p);
-    case '\0':
-        return PS_DONE;
-    default:
-        return PS_2;
-    }
+    if (name != buf && name != e->name)
+        free(name);
 }
 
-static void cleanup_on_failure(void)
+static void handle_hyperlink(struct fileinfo *f, struct entry_path const *e,
+                             bool command_line_arg)
 {
-    struct color_ext_type *e;
-    struct color_ext_type *e2;
-    
-    error(0, 0, _("unparsable value for LS_COLORS environment variable"));
-    free(color_buf);
-    
-    for (e = color_ext_list; e != nullptr;)
+    if (print_hyperlink)
     {
-        e2 = e;
-        e = e->next;
-        free(e2);
+        char *full_name = entry_full_name(e);
+        f->absolute_name = canonicalize_filename_mode(full_name, CAN_MISSING);
+        if (!f->absolute_name)
+            file_failure(command_line_arg, _("error canonicalizing %s"), full_name);
+        free(full_name);
+    }
+}
+
+/* --parallel.  Directory entries pass through a ring of PREFETCH_SLOTS
+   slots.  The main thread reads entries into the ring, STAT_THREADS
+   workers claim them in order and stat those that gobble_file will
+   stat, and the main thread takes the finished entries from the
+   ring's head, in directory order, gobbling and printing them with
+   the prefetched results.  Reading, formatting and output thus
+   overlap with the stat calls, and a full ring makes the reader wait,
+   so memory stays bounded however large the directory.
+
+   PREFETCH_HEAD, PREFETCH_CLAIM and PREFETCH_TAIL count the entries
+   taken, claimed and read so far, and PREFETCH_RELEASED the entries
+   taken as of when the main thread last took the lock.  Only the main
+   thread changes the head, the tail and the released count;
+   PREFETCH_LOCK guards the tail, the claim and released counts and
+   the DONE flags.  Workers look only at entries from the released
+   count to the tail, and the main thread fills only slots below the
+   released count plus PREFETCH_SLOTS, past the tail, and publishes
+   them by moving the tail once they are complete.  So a slot being
+   filled is never seen by a worker.  Stat calls are far slower than
+   taking the lock, so a lock-free queue would gain little.  */
+
+enum { PREFETCH_SLOTS = 1024, PREFETCH_BATCH = 64 };
+
+struct prefetch
+{
+  char *name;			/* As read from the directory.  */
+  char *full_name;		/* What to stat, if not NAME in LISTING_FD.  */
+  enum filetype type;
+  ino_t inode;
+  struct stat stat;
+  int err;			/* errno from the last stat call, or 0.  */
+  int calls;			/* The number of stat calls made.  */
+  bool deref;			/* Whether the last one followed symlinks.  */
+  bool stat_needed;		/* Whether gobble_file will stat it.  */
+  bool done;
+};
+
+static struct prefetch *prefetch_ring;
+static idx_t prefetch_head, prefetch_claim, prefetch_tail, prefetch_released;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+static bool prefetch_shutdown;
+static pthread_t *prefetch_workers;
+static int prefetch_n_workers;
+
+/* The slot of the entry gobble_file is adding, if it was prefetched.  */
+static struct prefetch const *prefetched;
+
+static void *
+prefetch_worker (MAYBE_UNUSED void *arg)
+{
+  pthread_mutex_lock (&prefetch_lock);
+  while (true)
+    {
+      /* Entries before the released count may be refilled at any time;
+         they were all done anyway.  */
+      prefetch_claim = MAX (prefetch_claim, prefetch_released);
+      while (prefetch_claim < prefetch_tail
+             && prefetch_ring[prefetch_claim % PREFETCH_SLOTS].done)
+        prefetch_claim++;
+      if (prefetch_claim == prefetch_tail)
+        {
+          if (prefetch_shutdown)
+            break;
+          pthread_cond_wait (&prefetch_work, &prefetch_lock);
+          continue;
+        }
+
+      struct prefetch *p = &prefetch_ring[prefetch_claim++ % PREFETCH_SLOTS];
+      pthread_mutex_unlock (&prefetch_lock);
+
+      int err = (stat_at_unaccounted (p->full_name ? AT_FDCWD : listing_fd,
+                                      p->full_name ? p->full_name : p->name,
+                                      &p->stat, p->deref) < 0
+                 ? errno : 0);
+
+      pthread_mutex_lock (&prefetch_lock);
+      p->err = err;
+      p->done = true;
+      pthread_cond_signal (&prefetch_done);
     }
-    print_with_color = false;
+  pthread_mutex_unlock (&prefetch_lock);
+  return nullptr;
 }
 
-static bool extensions_match_exact(struct color_ext_type *e1, struct color_ext_type *e2)
+/* Start up to N threads running WORKER into THREADS, with all signals
+   blocked so that the main thread handles them.  Return the number
+   started.  */
+static int
+start_threads (pthread_t *threads, int n, void *(*worker) (void *))
 {
-    return e2->ext.len < SIZE_MAX && 
-           e1->ext.len == e2->ext.len && 
-           memcmp(e1->ext.string, e2->ext.string, e1->ext.len) == 0;
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  int started = 0;
+  while (started < n
+         && pthread_create (&threads[started], nullptr, worker, nullptr) == 0)
+    started++;
+  pthread_sigmask (SIG_SETMASK, &old, nullptr);
+  return started;
 }
 
-static bool extensions_match_case_insensitive(struct color_ext_type *e1, struct color_ext_type *e2)
+/* Start the workers.  If none can be started, stat serially.  */
+static void
+prefetch_start (void)
 {
-    return e2->ext.len < SIZE_MAX && 
-           e1->ext.len == e2->ext.len && 
-           c_strncasecmp(e1->ext.string, e2->ext.string, e1->ext.len) == 0;
+  prefetch_ring = xinmalloc (PREFETCH_SLOTS, sizeof *prefetch_ring);
+  prefetch_workers = xinmalloc (stat_threads, sizeof *prefetch_workers);
+  prefetch_n_workers = start_threads (prefetch_workers, stat_threads,
+                                      prefetch_worker);
+  stat_threads = prefetch_n_workers;
 }
 
-static bool sequences_are_identical(struct color_ext_type *e1, struct color_ext_type *e2)
+static void
+prefetch_finish (void)
 {
-    return e1->seq.len == e2->seq.len && 
-           memcmp(e1->seq.string, e2->seq.string, e1->seq.len) == 0;
+  if (!prefetch_n_workers)
+    return;
+
+  pthread_mutex_lock (&prefetch_lock);
+  prefetch_shutdown = true;
+  pthread_cond_broadcast (&prefetch_work);
+  pthread_mutex_unlock (&prefetch_lock);
+
+  for (int i = 0; i < prefetch_n_workers; i++)
+    pthread_join (prefetch_workers[i], nullptr);
+  free (prefetch_workers);
+  free (prefetch_ring);
 }
 
-static void process_case_insensitive_match(struct color_ext_type *e1, struct color_ext_type *e2, bool *case_ignored)
+/* Fill slot P with ENTRY of the directory NAME.  */
+static void
+prefetch_fill (struct prefetch *p, struct dirent const *entry,
+               char const *name)
 {
-    if (*case_ignored)
-    {
-        e2->ext.len = SIZE_MAX;
-    }
-    else if (sequences_are_identical(e1, e2))
-    {
-        e2->ext.len = SIZE_MAX;
-        *case_ignored = true;
-    }
-    else
+  p->name = xstrdup (entry->d_name);
+  p->type = dirent_filetype (entry);
+  p->inode = RELIABLE_D_INO (entry);
+  p->stat_needed = should_check_stat (p->type, false, p->inode);
+  p->done = !p->stat_needed;
+  p->deref = dereference == DEREF_ALWAYS;
+  p->calls = 1;
+  p->full_name = nullptr;
+  if (p->stat_needed && listing_fd < 0)
     {
-        e1->exact_match = true;
-        e2->exact_match = true;
+      p->full_name = xmalloc (strlen (name) + strlen (p->name) + 2);
+      attach (p->full_name, name, p->name);
     }
 }
 
-static void mark_duplicate_extensions(struct color_ext_type *e1)
+static uintmax_t
+read_directory_entries_parallel (DIR *dirp, char const *name,
+                                 bool command_line_arg)
 {
-    struct color_ext_type *e2;
-    bool case_ignored = false;
-    
-    for (e2 = e1->next; e2 != nullptr; e2 = e2->next)
+  uintmax_t total_blocks = 0;
+  bool eof = false;
+
+  if (!prefetch_ring)
     {
-        if (extensions_match_exact(e1, e2))
+      prefetch_start ();
+      if (!stat_threads)
+        return read_directory_entries (dirp, name, command_line_arg);
+    }
+
+  while (true)
+    {
+      idx_t n_read = 0;
+      while (!eof && n_read < PREFETCH_BATCH
+             && prefetch_tail + n_read - prefetch_released < PREFETCH_SLOTS)
         {
-            e2->ext.len = SIZE_MAX;
+          struct dirent *next = next_dir_entry (dirp, name, command_line_arg);
+          if (!next)
+            eof = true;
+          else if (!file_ignored (next->d_name))
+            {
+              idx_t i = (prefetch_tail + n_read++) % PREFETCH_SLOTS;
+              prefetch_fill (&prefetch_ring[i], next, name);
+            }
         }
-        else if (extensions_match_case_insensitive(e1, e2))
+
+      /* Publish what was read, and see how many entries at the head
+         are ready, waiting for one if there is nothing else to do.  */
+      pthread_mutex_lock (&prefetch_lock);
+      prefetch_released = prefetch_head;
+      prefetch_tail += n_read;
+      if (n_read)
+        pthread_cond_broadcast (&prefetch_work);
+      bool must_wait = eof || prefetch_tail - prefetch_head == PREFETCH_SLOTS;
+      while (must_wait && prefetch_head < prefetch_tail
+             && !prefetch_ring[prefetch_head % PREFETCH_SLOTS].done)
+        pthread_cond_wait (&prefetch_done, &prefetch_lock);
+      idx_t ready = prefetch_head;
+      while (ready < prefetch_tail
+             && prefetch_ring[ready % PREFETCH_SLOTS].done)
+        ready++;
+      pthread_mutex_unlock (&prefetch_lock);
+
+      if (eof && prefetch_head == prefetch_tail)
+        break;
+
+      for (; prefetch_head < ready; prefetch_head++)
         {
-            process_case_insensitive_match(e1, e2, &case_ignored);
+          struct prefetch *p = &prefetch_ring[prefetch_head % PREFETCH_SLOTS];
+          prefetched = p->stat_needed ? p : nullptr;
+          process_entry (p->name, p->type, p->inode, name, &total_blocks);
+          prefetched = nullptr;
+          free (p->name);
+          free (p->full_name);
+          process_signals ();
         }
     }
+
+  return total_blocks;
 }
 
-static void postprocess_extension_list(void)
+/* --parallel for the command-line operands.  The operands are
+   ordered by parent directory, stably, and workers claim runs of them
+   in that order.  Each worker keeps its last parent directory open, so
+   that it stats the operands in it relative to that directory rather
+   than resolving each full name.  The main thread gobbles the operands
+   in argv order as their results arrive, so the table and any
+   diagnostics come out exactly as when statting serially.  The
+   operand slots use PREFETCH_LOCK and PREFETCH_DONE, since the
+   directory workers are not yet running.  */
+
+static char **operand_argv;
+static idx_t *operand_order;
+static struct prefetch *operand_slots;
+static idx_t operand_claim, operand_n;
+
+/* Return the length of the parent directory part of FILE, including
+   its trailing slash, or 0 if FILE must be statted by its full name
+   because it has no such part or ends in a slash.  */
+static idx_t
+operand_dir_len (char const *file)
 {
-    struct color_ext_type *e1;
-    
-    for (e1 = color_ext_list; e1 != nullptr; e1 = e1->next)
+  char const *slash = strrchr (file, '/');
+  return slash && slash[1] ? slash - file + 1 : 0;
+}
+
+static int
+compare_operand_dirs (void const *a, void const *b)
+{
+  idx_t i = *(idx_t const *) a;
+  idx_t j = *(idx_t const *) b;
+  idx_t ilen = operand_dir_len (operand_argv[i]);
+  idx_t jlen = operand_dir_len (operand_argv[j]);
+  int diff = memcmp (operand_argv[i], operand_argv[j], MIN (ilen, jlen));
+  if (!diff)
+    diff = _GL_CMP (ilen, jlen);
+  return diff ? diff : _GL_CMP (i, j);
+}
+
+/* Stat the operand NAME relative to FD into P, the way
+   perform_stat_operation would for a command-line argument.  */
+static void
+stat_operand (int fd, char const *name, struct prefetch *p)
+{
+  int err;
+  p->calls = 0;
+
+  switch (dereference)
     {
-        mark_duplicate_extensions(e1);
+    case DEREF_ALWAYS:
+    case DEREF_COMMAND_LINE_ARGUMENTS:
+    case DEREF_COMMAND_LINE_SYMLINK_TO_DIR:
+      p->calls++;
+      p->deref = true;
+      err = stat_at_unaccounted (fd, name, &p->stat, true);
+      if (dereference != DEREF_COMMAND_LINE_SYMLINK_TO_DIR
+          || ! (err < 0
+                ? (errno == ENOENT || errno == ELOOP)
+                : !S_ISDIR (p->stat.st_mode)))
+        break;
+      FALLTHROUGH;
+
+    case DEREF_NEVER:
+      p->calls++;
+      p->deref = false;
+      err = stat_at_unaccounted (fd, name, &p->stat, false);
+      break;
+
+    case DEREF_UNDEFINED:
+    default:
+      unreachable ();
     }
+
+  p->err = err < 0 ? errno : 0;
 }
 
-static void check_symlink_color_setting(void)
+static void *
+operand_worker (MAYBE_UNUSED void *arg)
 {
-    if (color_indicator[C_LINK].len == 6 && 
-        !STRNCMP_LIT(color_indicator[C_LINK].string, "target"))
+  int dirfd = -1;
+  char const *dir = nullptr;
+  idx_t dirlen = 0;
+
+  while (true)
     {
-        color_symlink_as_referent = true;
+      pthread_mutex_lock (&prefetch_lock);
+      idx_t lo = operand_claim;
+      idx_t hi = MIN (lo + PREFETCH_BATCH, operand_n);
+      operand_claim = hi;
+      pthread_mutex_unlock (&prefetch_lock);
+      if (lo == hi)
+        break;
+
+      for (idx_t j = lo; j < hi; j++)
+        {
+          idx_t k = operand_order[j];
+          char const *file = operand_argv[k];
+          idx_t len = operand_dir_len (file);
+
+          if (len && ! (dir && dirlen == len && memcmp (dir, file, len) == 0))
+            {
+              if (0 <= dirfd)
+                close (dirfd);
+              char *d = ximemdup0 (file, len);
+              dirfd = open (d, O_SEARCH | O_DIRECTORY | O_CLOEXEC);
+              free (d);
+              dir = file;
+              dirlen = len;
+            }
+
+          /* If the parent cannot be opened, stat the full name so
+             that any failure is the one a serial stat would see.  */
+          if (len && 0 <= dirfd)
+            stat_operand (dirfd, file + len, &operand_slots[k]);
+          else
+            stat_operand (AT_FDCWD, file, &operand_slots[k]);
+        }
+
+      pthread_mutex_lock (&prefetch_lock);
+      for (idx_t j = lo; j < hi; j++)
+        operand_slots[operand_order[j]].done = true;
+      pthread_cond_signal (&prefetch_done);
+      pthread_mutex_unlock (&prefetch_lock);
     }
+
+  if (0 <= dirfd)
+    close (dirfd);
+  return nullptr;
 }
 
-static void parse_ls_color(void)
+/* Gobble the N operands in ARGV with the help of the --parallel
+   workers.  Return false if no worker could be started.  */
+static bool
+gobble_operands_parallel (idx_t n, char **argv)
 {
-    char const *p;
-    char *buf;
-    char label0, label1;
-    struct color_ext_type *ext;
-    
-    if ((p = getenv("LS_COLORS")) == nullptr || *p == '\0')
+  int n_threads = MIN (stat_threads, (n + PREFETCH_BATCH - 1) / PREFETCH_BATCH);
+  pthread_t *threads = xinmalloc (n_threads, sizeof *threads);
+
+  operand_argv = argv;
+  operand_n = n;
+  operand_claim = 0;
+  operand_slots = xinmalloc (n, sizeof *operand_slots);
+  operand_order = xinmalloc (n, sizeof *operand_order);
+  for (idx_t k = 0; k < n; k++)
     {
-        if (should_disable_colors())
-            print_with_color = false;
-        return;
+      operand_slots[k].done = false;
+      operand_order[k] = k;
+    }
+  qsort (operand_order, n, sizeof *operand_order, compare_operand_dirs);
+
+  n_threads = start_threads (threads, n_threads, operand_worker);
+
+  if (n_threads)
+    for (idx_t k = 0; k < n; k++)
+      {
+        pthread_mutex_lock (&prefetch_lock);
+        while (!operand_slots[k].done)
+          pthread_cond_wait (&prefetch_done, &prefetch_lock);
+        pthread_mutex_unlock (&prefetch_lock);
+
+        prefetched = &operand_slots[k];
+        gobble_file (argv[k], unknown, NOT_AN_INODE_NUMBER, true, nullptr);
+        prefetched = nullptr;
+      }
+
+  for (int t = 0; t < n_threads; t++)
+    pthread_join (threads[t], nullptr);
+  free (threads);
+  free (operand_slots);
+  free (operand_order);
+  return 0 < n_threads;
+}
+
+/* Stat FILE, relative to the directory FD, into F.  */
+static int perform_stat_operation(int fd, char const *file, struct fileinfo *f,
+                                 bool command_line_arg, bool *do_deref)
+{
+    int err;
+
+    /* Use the result a --parallel worker already has.  */
+    if (prefetched)
+    {
+        *do_deref = prefetched->deref;
+        syscall_count[SYSCALL_STATX] += prefetched->calls;
+        f->stat = prefetched->stat;
+        errno = prefetched->err;
+        return prefetched->err ? -1 : 0;
     }
     
-    ext = nullptr;
-    buf = color_buf = xstrdup(p);
-    
-    enum parse_state state = PS_START;
-    while (true)
+    switch (dereference)
     {
-        switch (state)
+    case DEREF_ALWAYS:
+        err = do_stat(fd, file, &f->stat);
+        *do_deref = true;
+        break;
+
+    case DEREF_COMMAND_LINE_ARGUMENTS:
+    case DEREF_COMMAND_LINE_SYMLINK_TO_DIR:
+        if (command_line_arg)
         {
-        case PS_START:
-            label0 = *p++;
-            state = handle_start_state(&p, &buf, &ext);
-            break;
-            
-        case PS_2:
-            if (*p)
-            {
-                label1 = *p++;
-                state = PS_3;
-            }
-            else
-            {
-                state = PS_FAIL;
-            }
-            break;
-            
-        case PS_3:
-            state = PS_FAIL;
-            if (*(p++) == '=')
-            {
-                state = process_indicator_label(label0, label1, &buf, &p);
-            }
-            break;
-            
-        case PS_4:
-            if (*(p++) == '=')
-            {
-                ext->seq.string = buf;
-                state = get_funky_string(&buf, &p, false, &ext->seq.len) ? PS_START : PS_FAIL;
-            }
-            else
-            {
-                state = PS_FAIL;
-            }
-            break;
-            
-        case PS_FAIL:
-            goto done;
-            
-        case PS_DONE:
-            goto done;
-            
-        default:
-            affirm(false);
+            err = do_stat(fd, file, &f->stat);
+            *do_deref = true;
+
+            if (dereference == DEREF_COMMAND_LINE_ARGUMENTS)
+                break;
+
+            bool need_lstat = (err < 0
+                              ? (errno == ENOENT || errno == ELOOP)
+                              : !S_ISDIR(f->stat.st_mode));
+            if (!need_lstat)
+                break;
         }
-    }
-    
-done:
-    if (state == PS_FAIL)
-    {
-        cleanup_on_failure();
-    }
-    else
-    {
-        postprocess_extension_list();
-        check_symlink_color_setting();
-    }
-}
+        FALLTHROUGH;
 
-/* Return the quoting style specified by the environment variable
-   QUOTING_STYLE if set and valid, -1 otherwise.  */
+    case DEREF_NEVER:
+        err = do_lstat(fd, file, &f->stat);
+        *do_deref = false;
+        break;
 
-static int
-getenv_quoting_style (void)
-{
-  char const *q_style = getenv ("QUOTING_STYLE");
-  if (!q_style)
-    return -1;
-  
-  int i = ARGMATCH (q_style, quoting_style_args, quoting_style_vals);
-  if (i < 0)
-    {
-      error (0, 0,
-             _("ignoring invalid value"
-               " of environment variable QUOTING_STYLE: %s"),
-             quote (q_style));
-      return -1;
+    case DEREF_UNDEFINED:
+    default:
+        unreachable();
     }
-  
-  return quoting_style_vals[i];
+    
+    return err;
 }
 
-/* Set the exit status to report a failure.  If SERIOUS, it is a
-   serious failure; otherwise, it is merely a minor problem.  */
-
-static void
-set_exit_status (bool serious)
+/* Append the N bytes at P to the --xattrs lines in F.  */
+static void xattrs_append(struct fileinfo *f, idx_t *alloc,
+                          char const *p, idx_t n)
 {
-  if (serious)
-  {
-    exit_status = LS_FAILURE;
-    return;
-  }
-  
-  if (exit_status == EXIT_SUCCESS)
-  {
-    exit_status = LS_MINOR_PROBLEM;
-  }
+    if (*alloc - f->xattrs_len < n)
+        f->xattrs = xpalloc(f->xattrs, alloc, n - (*alloc - f->xattrs_len),
+                            -1, 1);
+    memcpy(f->xattrs + f->xattrs_len, p, n);
+    f->xattrs_len += n;
 }
 
-/* Assuming a failure is serious if SERIOUS, use the printf-style
-   MESSAGE to report the failure to access a file named FILE.  Assume
-   errno is set appropriately for the failure.  */
-
-static void
-file_failure (bool serious, char const *message, char const *file)
+/* Set the --xattrs lines of F, the file FILE, from the extended
+   attribute names that the ACL probe listed in AI.  Fetch values only
+   for the names that match XATTR_PATTERN.  Names and values are
+   C-quoted as needed, so that neither can break the line or send
+   escape sequences to the terminal.  */
+static void collect_xattrs(struct fileinfo *f, struct aclinfo const *ai,
+                           char const *file, bool do_deref)
 {
-  error (0, errno, message, quoteaf (file));
-  set_exit_status (serious);
-}
+    idx_t alloc = 0;
 
-/* Request that the directory named NAME have its contents listed later.
-   If REALNAME is nonzero, it will be used instead of NAME when the
-   directory name is printed.  This allows symbolic links to directories
-   to be treated as regular directories but still be listed under their
-   real names.  NAME == nullptr is used to insert a marker entry for the
-   directory named in REALNAME.
-   If NAME is non-null, we use its dev/ino information to save
-   a call to stat -- when doing a recursive (-R) traversal.
-   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+    for (char const *p = ai->buf; p < ai->buf + ai->size; p += strlen(p) + 1)
+    {
+        if (xattr_pattern && fnmatch(xattr_pattern, p, 0) != 0)
+            continue;
 
-static void
-queue_directory (char const *name, char const *realname, bool command_line_arg)
-{
-  struct pending *new = xmalloc (sizeof *new);
-  new->realname = realname ? xstrdup (realname) : NULL;
-  new->name = name ? xstrdup (name) : NULL;
-  new->command_line_arg = command_line_arg;
-  new->next = pending_dirs;
-  pending_dirs = new;
-}
+        char const *q = quotearg_n_style(0, c_maybe_quoting_style, p);
+        xattrs_append(f, &alloc, "\t", 1);
+        xattrs_append(f, &alloc, q, strlen(q));
 
-/* Read directory NAME, and list the files in it.
-   If REALNAME is nonzero, print its name instead of NAME;
-   this is used for symbolic links to directories.
-   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+#if HAVE_LINUX_XATTR_H
+        if (xattr_pattern)
+        {
+            ssize_t (*get) (char const *, char const *, void *, size_t)
+              = do_deref ? getxattr : lgetxattr;
+            ssize_t size = enter_syscall(SYSCALL_XATTR)
+                           ? get(file, p, nullptr, 0) : -1;
+            leave_syscall();
+            if (0 <= size)
+            {
+                char *value = xmalloc(size + 1);
+                size = enter_syscall(SYSCALL_XATTR)
+                       ? get(file, p, value, size) : -1;
+                leave_syscall();
+                if (0 <= size)
+                {
+                    q = quotearg_n_style_mem(0, c_quoting_style, value, size);
+                    xattrs_append(f, &alloc, "=", 1);
+                    xattrs_append(f, &alloc, q, strlen(q));
+                }
+                free(value);
+            }
+        }
+#endif
 
-static bool open_directory(DIR **dirp, const char *name, bool command_line_arg)
-{
-    errno = 0;
-    *dirp = opendir(name);
-    if (!*dirp)
-    {
-        file_failure(command_line_arg, _("cannot open directory %s"), name);
-        return false;
+        xattrs_append(f, &alloc, "", 1);
     }
-    return true;
 }
 
-static bool check_directory_loop(DIR *dirp, const char *name, bool command_line_arg)
+static void process_acl_and_scontext(struct fileinfo *f,
+                                     struct entry_path const *e,
+                                     enum filetype type, bool do_deref)
 {
-    if (!LOOP_DETECT)
-        return true;
+    bool get_scontext = plan.needs_aclinfo;
+    bool check_capability = plan.needs_capability & (type == normal);
 
-    struct stat dir_stat;
-    int fd = dirfd(dirp);
+    if (!get_scontext && !check_capability)
+        return;
 
-    if ((0 <= fd ? fstat_for_ino(fd, &dir_stat) : stat_for_ino(name, &dir_stat)) < 0)
-    {
-        file_failure(command_line_arg, _("cannot determine device and inode of %s"), name);
-        closedir(dirp);
-        return false;
+    /* Inject ahead of file_has_aclinfo rather than in its place, so
+       that only gnulib sets up an aclinfo.  An injected failure, or an
+       entry that cannot be named without /proc, is reported as a
+       failed call would be, and F keeps no ACL and an unknown security
+       context.  */
+    char buf[OPENAT_BUFFER_SIZE];
+    char *access_name = nullptr;
+    int err = 0;
+    if (!inject_syscall(SYSCALL_XATTR))
+    {
+        err = errno;
+        count_syscall(SYSCALL_XATTR);
+        leave_syscall();
+    }
+    else if (!(access_name = entry_access_name(e, buf)))
+        err = errno;
+    if (err)
+    {
+        if (format == long_format || print_scontext)
+        {
+            char *full_name = entry_full_name(e);
+            error(0, err, "%s", quotef(full_name));
+            free(full_name);
+        }
+        return;
     }
 
-    if (visit_dir(dir_stat.st_dev, dir_stat.st_ino))
+    struct aclinfo ai;
+    int aclinfo_flags = ((do_deref ? ACL_SYMLINK_FOLLOW : 0)
+                        | (get_scontext ? ACL_GET_SCONTEXT : 0)
+                        | filetype_d_type[type]);
+    int n = file_has_aclinfo_cache(access_name, f, &ai, aclinfo_flags);
+    bool have_acl = 0 < n;
+    bool have_scontext = !ai.scontext_err;
+    bool cannot_access_acl = n < 0 && (errno == EACCES || errno == ENOENT);
+
+    f->acl_type = (!have_scontext && !have_acl
+                  ? (cannot_access_acl ? ACL_T_UNKNOWN : ACL_T_NONE)
+                  : (have_scontext && !have_acl
+                     ? ACL_T_LSM_CONTEXT_ONLY
+                     : ACL_T_YES));
+    any_has_acl |= f->acl_type != ACL_T_NONE;
+
+    if (format == long_format && n < 0 && !cannot_access_acl)
+        err = errno;
+    else if (print_scontext && ai.scontext_err
+             && (!(is_ENOTSUP(ai.scontext_err) || ai.scontext_err == ENODATA)))
+        err = ai.scontext_err;
+    if (err)
     {
-        error(0, 0, _("%s: not listing already-listed directory"), quotef(name));
-        closedir(dirp);
-        set_exit_status(true);
-        return false;
+        char *full_name = entry_full_name(e);
+        error(0, err, "%s", quotef(full_name));
+        free(full_name);
     }
 
-    dev_ino_push(dir_stat.st_dev, dir_stat.st_ino);
-    return true;
+    if (check_capability && aclinfo_has_xattr(&ai, XATTR_NAME_CAPS))
+        f->has_capability = has_capability_cache(access_name, f);
+
+    if (print_xattrs && format == long_format && 0 < ai.size)
+        collect_xattrs(f, &ai, access_name, do_deref);
+
+    entry_access_free(e, access_name, buf);
+    f->scontext = ai.scontext;
+    ai.scontext = nullptr;
+    aclinfo_free(&ai);
 }
 
-static void print_directory_header(const char *name, const char *realname, bool command_line_arg)
+static void process_symlink(struct fileinfo *f, struct entry_path const *e,
+                            bool command_line_arg)
 {
-    static bool first = true;
-    
-    if (!recursive && !print_dir_name)
-        return;
+    struct stat linkstats;
 
-    if (!first)
-        dired_outbyte('\n');
-    first = false;
-    dired_indent();
+    get_link_name(e, f, command_line_arg);
 
-    char *absolute_name = nullptr;
-    if (print_hyperlink)
+    if (f->linkname && f->quoted == 0 && needs_quoting(f->linkname))
+        f->quoted = -1;
+
+    if (f->linkname
+        && plan.stat_link_targets
+        && stat_for_mode(e->fd, e->name, &linkstats) == 0)
     {
-        absolute_name = canonicalize_filename_mode(name, CAN_MISSING);
-        if (!absolute_name)
-            file_failure(command_line_arg, _("error canonicalizing %s"), name);
+        f->linkok = true;
+        f->linkmode = linkstats.st_mode;
     }
-    
-    quote_name(realname ? realname : name, dirname_quoting_options, -1,
-               nullptr, true, &subdired_obstack, absolute_name);
-    free(absolute_name);
-    dired_outstring(":\n");
 }
 
-static bool should_print_immediately(void)
+static void update_width_field(int *width, int new_len)
 {
-    return format == one_per_line && sort_type == sort_none &&
-           !print_block_size && !recursive;
+    if (*width < new_len)
+        *width = new_len;
 }
 
-static void process_directory_entry(struct dirent *entry, const char *name, uintmax_t *total_blocks)
+static void update_block_size_width(uintmax_t blocks)
 {
-    if (file_ignored(entry->d_name))
-        return;
+    char buf[LONGEST_HUMAN_READABLE + 1];
+    int len = mbswidth(human_readable(blocks, buf, human_output_opts,
+                                     ST_NBLOCKSIZE, output_block_size),
+                      MBSWIDTH_FLAGS);
+    update_width_field(&block_size_width, len);
+}
 
-    enum filetype type;
-#if HAVE_STRUCT_DIRENT_D_TYPE
-    type = d_type_filetype[entry->d_type];
-#else
-    type = unknown;
-#endif
-    
-    *total_blocks += gobble_file(entry->d_name, type, RELIABLE_D_INO(entry), false, name);
+static void update_user_group_widths(struct fileinfo *f)
+{
+    if (print_owner)
+        update_width_field(&owner_width, format_user_width(f->stat.st_uid));
 
-    if (should_print_immediately())
-    {
-        sort_files();
-        print_current_files();
-        clear_files();
-    }
+    if (print_group)
+        update_width_field(&group_width, format_group_width(f->stat.st_gid));
+
+    if (print_author)
+        update_width_field(&author_width, format_user_width(f->stat.st_author));
 }
 
-static bool should_continue_reading(int err)
+static void update_device_widths(struct fileinfo *f)
 {
-    if (err == 0)
-        return false;
-        
-#if !(2 < __GLIBC__ + (3 <= __GLIBC_MINOR__))
-    if (err == ENOENT)
-        return false;
-#endif
+    char buf[INT_BUFSIZE_BOUND(uintmax_t)];
+    int len = strlen(umaxtostr(major(f->stat.st_rdev), buf));
+    update_width_field(&major_device_number_width, len);
     
-    return err == EOVERFLOW;
+    len = strlen(umaxtostr(minor(f->stat.st_rdev), buf));
+    update_width_field(&minor_device_number_width, len);
+    
+    len = major_device_number_width + 2 + minor_device_number_width;
+    update_width_field(&file_size_width, len);
 }
 
-static uintmax_t read_directory_entries(DIR *dirp, const char *name, bool command_line_arg)
+static void update_file_size_width(struct fileinfo *f)
 {
-    uintmax_t total_blocks = 0;
-    struct dirent *next;
-
-    while (true)
-    {
-        errno = 0;
-        next = readdir(dirp);
-        
-        if (next)
-        {
-            process_directory_entry(next, name, &total_blocks);
-        }
-        else
-        {
-            int err = errno;
-            if (!should_continue_reading(err))
-            {
-                if (err != 0 && err != ENOENT)
-                    file_failure(command_line_arg, _("reading directory %s"), name);
-                break;
-            }
-            file_failure(command_line_arg, _("reading directory %s"), name);
-        }
-        
-        process_signals();
-    }
-    
-    return total_blocks;
+    char buf[LONGEST_HUMAN_READABLE + 1];
+    uintmax_t size = unsigned_file_size(f->stat.st_size);
+    int len = mbswidth(human_readable(size, buf, file_human_output_opts,
+                                     1, file_output_block_size),
+                      MBSWIDTH_FLAGS);
+    update_width_field(&file_size_width, len);
 }
 
-static void print_total_blocks(uintmax_t total_blocks)
+static void update_long_format_widths(struct fileinfo *f, enum filetype type)
 {
-    if (!format == long_format && !print_block_size)
+    if (format != long_format)
         return;
 
-    char buf[LONGEST_HUMAN_READABLE + 3];
-    char *p = human_readable(total_blocks, buf + 1, human_output_opts,
-                            ST_NBLOCKSIZE, output_block_size);
-    char *pend = p + strlen(p);
-    *--p = ' ';
-    *pend++ = eolbyte;
-    dired_indent();
-    dired_outstring(_("total"));
-    dired_outbuf(p, pend - p);
+    update_user_group_widths(f);
+
+    char b[INT_BUFSIZE_BOUND(uintmax_t)];
+    int b_len = strlen(umaxtostr(f->stat.st_nlink, b));
+    update_width_field(&nlink_width, b_len);
+
+    if ((type == chardev) | (type == blockdev))
+        update_device_widths(f);
+    else
+        update_file_size_width(f);
 }
 
-static void print_dir(char const *name, char const *realname, bool command_line_arg)
+/* Widen the columns of the current table as needed to fit F.  */
+static void update_file_widths(struct fileinfo *f)
 {
-    DIR *dirp;
-    
-    if (!open_directory(&dirp, name, command_line_arg))
+    if (!plan.widths || page_widths_deferred)
         return;
 
-    if (!check_directory_loop(dirp, name, command_line_arg))
-        return;
+    if (format == long_format || print_block_size)
+        update_block_size_width(STP_NBLOCKS(&f->stat));
 
-    clear_files();
-    print_directory_header(name, realname, command_line_arg);
-    
-    uintmax_t total_blocks = read_directory_entries(dirp, name, command_line_arg);
+    update_long_format_widths(f, f->filetype);
 
-    if (closedir(dirp) != 0)
-        file_failure(command_line_arg, _("closing directory %s"), name);
+    if (print_scontext)
+        update_width_field(&scontext_width, strlen(f->scontext));
 
-    sort_files();
+    if (print_inode)
+    {
+        char buf[INT_BUFSIZE_BOUND(uintmax_t)];
+        update_width_field(&inode_number_width, strlen(umaxtostr(f->stat.st_ino, buf)));
+    }
+}
 
-    if (recursive)
-        extract_dirs_from_files(name, false);
+static uintmax_t
+gobble_file(char const *name, enum filetype type, ino_t inode,
+           bool command_line_arg, char const *dirname)
+{
+    uintmax_t blocks = 0;
+    struct fileinfo *f;
 
-    print_total_blocks(total_blocks);
+    affirm(!command_line_arg || inode == NOT_AN_INODE_NUMBER);
+    stats_entries++;
 
-    if (cwd_n_used)
-        print_current_files();
-}
+    if (cwd_n_used == cwd_n_alloc)
+        cwd_file = xpalloc(cwd_file, &cwd_n_alloc, 1, -1, sizeof *cwd_file);
 
-/* Add 'pattern' to the list of patterns for which files that match are
-   not listed.  */
+    f = &cwd_file[cwd_n_used];
+    initialize_fileinfo(f, inode, type);
+    update_quoted_status(f, name);
 
-static void
-add_ignore_pattern (char const *pattern)
-{
-  struct ignore_pattern *ignore = xmalloc (sizeof *ignore);
-  ignore->pattern = pattern;
-  ignore->next = ignore_patterns;
-  ignore_patterns = ignore;
-}
+    bool check_stat = should_check_stat(type, command_line_arg, inode);
 
-/* Return true if one of the PATTERNS matches FILE.  */
+    /* Entries of the directory being listed are reached relative to
+       it, without resolving its name again.  */
+    struct entry_path e = { .fd = AT_FDCWD, .name = name, .base = name,
+                            .dirname = dirname };
+    char *built_name = nullptr;
+    if (!command_line_arg && 0 <= listing_fd)
+        e.fd = listing_fd;
+    else if (dirname && name[0] != '/')
+        e.name = built_name = full_path(name, dirname);
 
-static bool
-patterns_match (struct ignore_pattern const *patterns, char const *file)
-{
-  struct ignore_pattern const *p;
-  for (p = patterns; p; p = p->next)
-    if (fnmatch (p->pattern, file, FNM_PERIOD) == 0)
-      return true;
-  return false;
-}
+    bool do_deref = dereference == DEREF_ALWAYS;
 
-/* Return true if FILE should be ignored.  */
+    if (check_stat)
+    {
+        handle_hyperlink(f, &e, command_line_arg);
+        
+        struct timespec stat_start;
+        if (progress_interval)
+            clock_gettime(CLOCK_MONOTONIC, &stat_start);
 
-static bool is_dot_file(char const *name)
-{
-    return name[0] == '.';
-}
+        int err = perform_stat_operation(e.fd, e.name, f, command_line_arg,
+                                         &do_deref);
 
-static bool is_special_dot_file(char const *name)
-{
-    return name[1] == '\0' || (name[1] == '.' && name[2] == '\0');
-}
+        if (progress_interval)
+            record_stat_latency(&stat_start);
 
-static bool should_ignore_dot_file(char const *name)
-{
-    if (ignore_mode == IGNORE_MINIMAL) {
-        return false;
-    }
-    
-    if (!is_dot_file(name)) {
-        return false;
-    }
-    
-    if (ignore_mode == IGNORE_DEFAULT) {
-        return true;
-    }
-    
-    return !is_special_dot_file(name);
-}
+        if (err != 0)
+        {
+            entry_failure(&e, command_line_arg, _("cannot access %s"));
+            free(built_name);
 
-static bool should_apply_hide_patterns(char const *name)
-{
-    return ignore_mode == IGNORE_DEFAULT && patterns_match(hide_patterns, name);
-}
+            if (command_line_arg)
+                return 0;
 
-static bool file_ignored(char const *name)
-{
-    if (should_ignore_dot_file(name)) {
-        return true;
-    }
-    
-    if (should_apply_hide_patterns(name)) {
-        return true;
+            /* Count it in its group, as below; there is nothing to
+               descend into.  */
+            if (group_by != group_by_none)
+            {
+                aggregate_file(f, name, dirname);
+                free_ent(f);
+                return 0;
+            }
+
+            f->name = xstrdup(name);
+            cwd_n_used++;
+            return 0;
+        }
+
+        f->stat_ok = true;
+        f->filetype = type = d_type_filetype[IFTODT(f->stat.st_mode)];
     }
-    
-    return patterns_match(ignore_patterns, name);
-}
 
-/* POSIX requires that a file size be printed without a sign, even
-   when negative.  Assume the typical case where negative sizes are
-   actually positive values that have wrapped around.  */
+    if (type == directory && command_line_arg && !immediate_dirs)
+        f->filetype = type = arg_directory;
 
-static uintmax_t
-unsigned_file_size (off_t size)
-{
-  if (size < 0)
-  {
-    return size + ((uintmax_t) OFF_T_MAX - OFF_T_MIN + 1);
-  }
-  return size;
-}
+    process_acl_and_scontext(f, &e, type, do_deref);
 
-#ifdef HAVE_CAP
-/* Return true if NAME has a capability (see linux/capability.h) */
-static bool
-has_capability (char const *name)
-{
-  char *result;
-  bool has_cap;
+    if ((type == symbolic_link) & plan.read_links)
+        process_symlink(f, &e, command_line_arg);
 
-  cap_t cap_d = cap_get_file (name);
-  if (cap_d == nullptr)
-    return false;
+    free(built_name);
 
-  result = cap_to_text (cap_d, nullptr);
-  cap_free (cap_d);
-  if (!result)
-    return false;
+    blocks = STP_NBLOCKS(&f->stat);
 
-  /* check if human-readable capability string is empty */
-  has_cap = !!*result;
+    if (group_by != group_by_none && f->filetype != arg_directory)
+    {
+        aggregate_file(f, name, dirname);
 
-  cap_free (result);
-  return has_cap;
-}
-#else
-static bool
-has_capability (MAYBE_UNUSED char const *name)
-{
-  errno = ENOTSUP;
-  return false;
-}
-#endif
+        /* Keep only what -R must still descend into.  */
+        if (!(recursive && f->filetype == directory))
+        {
+            free_ent(f);
+            return blocks;
+        }
+    }
 
-/* Enter and remove entries in the table 'cwd_file'.  */
+    update_file_widths(f);
 
-static void
-free_ent (struct fileinfo *f)
-{
-  free (f->name);
-  free (f->linkname);
-  free (f->absolute_name);
-  if (f->scontext != UNKNOWN_SECURITY_CONTEXT)
-    aclinfo_scontext_free (f->scontext);
-}
+    f->name = xstrdup(name);
+    cwd_n_used++;
 
-/* Empty the table of files.  */
-static void reset_width_counters(void)
-{
-    inode_number_width = 0;
-    block_size_width = 0;
-    nlink_width = 0;
-    owner_width = 0;
-    group_width = 0;
-    author_width = 0;
-    scontext_width = 0;
-    major_device_number_width = 0;
-    minor_device_number_width = 0;
-    file_size_width = 0;
+    return blocks;
 }
 
-static void reset_file_flags(void)
-{
-    cwd_n_used = 0;
-    cwd_some_quoted = false;
-    any_has_acl = false;
-}
+/* Snapshots, written by --capture and read by --from-snapshot.
 
-static void free_all_files(void)
-{
-    for (idx_t i = 0; i < cwd_n_used; i++)
-    {
-        struct fileinfo *f = sorted_file[i];
-        free_ent(f);
-    }
-}
+   A snapshot is SNAPSHOT_MAGIC, then a byte that is 1 if birth times
+   were stored in place of modification times, then a sequence of
+   records.  A record is a type byte, a uint64_t payload size and the
+   payload.  Integers and struct snapshot_entry are in the capturing
+   host's byte order and layout.
 
-static void clear_files(void)
-{
-    free_all_files();
-    reset_file_flags();
-    reset_width_counters();
-}
+   The 'A' record holds an int64_t count of command-line operands
+   followed by the entries gobbled for them.  Each 'D' record holds
+   one listed directory: its name, a uint64_t device and inode number
+   and its entries.  A list of entries is a uint64_t count followed by
+   that many struct snapshot_entry, each followed by the file name,
+   symlink target and security context.  A string is a uint32_t
+   length and that many bytes, or UINT32_MAX alone for a null
+   pointer.  */
 
-/* Cache file_has_aclinfo failure, when it's trivial to do.
-   Like file_has_aclinfo, but when F's st_dev says it's on a file
-   system lacking ACL support, return 0 with ENOTSUP immediately.  */
-static int
-file_has_aclinfo_cache (char const *file, struct fileinfo *f,
-                        struct aclinfo *ai, int flags)
-{
-  static int unsupported_return;
-  static char *unsupported_scontext;
-  static int unsupported_scontext_err;
-  static dev_t unsupported_device;
+#define SNAPSHOT_MAGIC "LSSNAP1\n"
+
+struct snapshot_entry
+  {
+    struct stat stat;
+    int filetype;
+    mode_t linkmode;
+    bool stat_ok;
+    bool linkok;
+    bool has_capability;
+    unsigned char acl_type;
+  };
+
+/* A directory in the snapshot being replayed, and where its 'D'
+   record's payload starts in the file.  */
+struct snapshot_dir
+  {
+    char *name;
+    off_t offset;
+    uint64_t size;
+  };
+
+/* Payload of the record being captured.  */
+static struct obstack snapshot_obstack;
 
-  if (is_cached_unsupported_device(f, unsupported_scontext, unsupported_device))
-    {
-      return setup_cached_unsupported_response(ai, unsupported_scontext, 
-                                                unsupported_scontext_err, 
-                                                unsupported_return);
-    }
+/* Directories in the snapshot being replayed, keyed by name.  */
+static Hash_table *snapshot_dirs;
 
-  errno = 0;
-  int n = file_has_aclinfo (file, ai, flags);
-  int err = errno;
-  
-  if (should_cache_as_unsupported(f, n, err, flags, ai->scontext_err))
-    {
-      cache_unsupported_device(n, ai->scontext, ai->scontext_err, 
-                                f->stat.st_dev, &unsupported_return,
-                                &unsupported_scontext, &unsupported_scontext_err,
-                                &unsupported_device);
-    }
-  return n;
+/* Where the payload of the replayed snapshot's 'A' record starts, and
+   its size.  */
+static off_t snapshot_args_offset = -1;
+static uint64_t snapshot_args_size;
+
+static size_t
+snapshot_dir_hash (void const *x, size_t table_size)
+{
+  struct snapshot_dir const *d = x;
+  return hash_string (d->name, table_size);
 }
 
-static int 
-is_cached_unsupported_device(struct fileinfo *f, char *unsupported_scontext, 
-                              dev_t unsupported_device)
+static bool
+snapshot_dir_compare (void const *x, void const *y)
 {
-  return f->stat_ok && unsupported_scontext && 
-         f->stat.st_dev == unsupported_device;
+  struct snapshot_dir const *a = x;
+  struct snapshot_dir const *b = y;
+  return STREQ (a->name, b->name);
 }
 
-static int 
-setup_cached_unsupported_response(struct aclinfo *ai, char *unsupported_scontext,
-                                   int unsupported_scontext_err, int unsupported_return)
+static void
+capture_open (void)
 {
-  ai->buf = ai->u.__gl_acl_ch;
-  ai->size = 0;
-  ai->scontext = unsupported_scontext;
-  ai->scontext_err = unsupported_scontext_err;
-  errno = ENOTSUP;
-  return unsupported_return;
+  capture_fp = fopen (capture_name, "wb");
+  if (!capture_fp)
+    error (LS_FAILURE, errno, _("cannot create %s"), quoteaf (capture_name));
+
+  obstack_init (&snapshot_obstack);
+  fputs (SNAPSHOT_MAGIC, capture_fp);
+  putc (time_type == time_btime, capture_fp);
 }
 
-static int 
-should_cache_as_unsupported(struct fileinfo *f, int n, int err, 
-                             int flags, int scontext_err)
+static void
+capture_grow_string (char const *s)
 {
-  if (!f->stat_ok || n > 0)
-    return 0;
-  
-  if (acl_errno_valid(err))
-    return 0;
-  
-  if ((flags & ACL_GET_SCONTEXT) && acl_errno_valid(scontext_err))
-    return 0;
-  
-  return 1;
+  uint32_t len = s ? strlen (s) : UINT32_MAX;
+  obstack_grow (&snapshot_obstack, &len, sizeof len);
+  if (s)
+    obstack_grow (&snapshot_obstack, s, len);
 }
 
-static void 
-cache_unsupported_device(int n, char *scontext, int scontext_err, 
-                          dev_t device, int *unsupported_return,
-                          char **unsupported_scontext, int *unsupported_scontext_err,
-                          dev_t *unsupported_device)
+/* Append the current table of files, in the order it was read.  */
+static void
+capture_grow_files (void)
 {
-  *unsupported_return = n;
-  *unsupported_scontext = scontext;
-  *unsupported_scontext_err = scontext_err;
-  *unsupported_device = device;
+  uint64_t n = cwd_n_used;
+  obstack_grow (&snapshot_obstack, &n, sizeof n);
+
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    {
+      struct fileinfo const *f = &cwd_file[i];
+      struct snapshot_entry e;
+      memset (&e, 0, sizeof e);
+      e.stat = f->stat;
+      e.filetype = f->filetype;
+      e.linkmode = f->linkmode;
+      e.stat_ok = f->stat_ok;
+      e.linkok = f->linkok;
+      e.has_capability = f->has_capability;
+      e.acl_type = f->acl_type;
+      obstack_grow (&snapshot_obstack, &e, sizeof e);
+
+      capture_grow_string (f->name);
+      capture_grow_string (f->linkname);
+      capture_grow_string (f->scontext == UNKNOWN_SECURITY_CONTEXT
+                           ? nullptr : f->scontext);
+    }
 }
 
-/* Cache has_capability failure, when it's trivial to do.
-   Like has_capability, but when F's st_dev says it's on a file
-   system lacking capability support, return 0 with ENOTSUP immediately.  */
-static bool is_unsupported_device(struct fileinfo *f, bool unsupported_cached, dev_t unsupported_device)
+/* Write the record of type TYPE whose payload has been grown.  */
+static void
+capture_record (char type)
 {
-    return f->stat_ok && unsupported_cached && f->stat.st_dev == unsupported_device;
+  uint64_t size = obstack_object_size (&snapshot_obstack);
+  char *payload = obstack_finish (&snapshot_obstack);
+  putc (type, capture_fp);
+  fwrite (&size, sizeof size, 1, capture_fp);
+  fwrite (payload, 1, size, capture_fp);
+  obstack_free (&snapshot_obstack, payload);
 }
 
-static void cache_unsupported_device(struct fileinfo *f, bool *unsupported_cached, dev_t *unsupported_device)
+/* Record the files gobbled for the N_FILES command-line operands.  */
+static void
+capture_operands (intmax_t n_files)
 {
-    if (f->stat_ok && !acl_errno_valid(errno))
-    {
-        *unsupported_cached = true;
-        *unsupported_device = f->stat.st_dev;
-    }
+  int64_t n = n_files;
+  obstack_grow (&snapshot_obstack, &n, sizeof n);
+  capture_grow_files ();
+  capture_record ('A');
 }
 
-static bool
-has_capability_cache (char const *file, struct fileinfo *f)
+/* Record the files just read from the directory NAME, open as DIRP.
+   These are the entries kept after -a, -A, -I and --hide, so a replay
+   with looser filtering cannot show the ones left out.  */
+static void
+capture_dir (char const *name, DIR *dirp)
 {
-    static bool unsupported_cached;
-    static dev_t unsupported_device;
+  struct stat dir_stat;
+  int fd = dirfd (dirp);
+  uint64_t dev_ino[2] = { 0, 0 };
 
-    if (is_unsupported_device(f, unsupported_cached, unsupported_device))
+  if ((0 <= fd ? fstat_for_ino (fd, &dir_stat)
+       : stat_for_ino (name, &dir_stat)) == 0)
     {
-        errno = ENOTSUP;
-        return 0;
+      dev_ino[0] = dir_stat.st_dev;
+      dev_ino[1] = dir_stat.st_ino;
     }
 
-    bool b = has_capability(file);
-    if (!b)
-    {
-        cache_unsupported_device(f, &unsupported_cached, &unsupported_device);
-    }
-    return b;
+  capture_grow_string (name);
+  obstack_grow (&snapshot_obstack, dev_ino, sizeof dev_ino);
+  capture_grow_files ();
+  capture_record ('D');
 }
 
-static bool needs_quoting(char const *name)
+static void
+capture_close (void)
 {
-    char test[2];
-    size_t len = quotearg_buffer(test, sizeof test, name, -1,
-                                  filename_quoting_options);
-    return *name != *test || strlen(name) != len;
+  if (!capture_fp)
+    return;
+
+  bool failed = ferror (capture_fp);
+  if (fclose (capture_fp) != 0 || failed)
+    {
+      error (0, failed ? 0 : errno, _("error writing %s"),
+             quoteaf (capture_name));
+      set_exit_status (true);
+    }
+  capture_fp = nullptr;
+  obstack_free (&snapshot_obstack, nullptr);
 }
 
-/* Add a file to the current table of files.
-   Verify that the file exists, and print an error message if it does not.
-   Return the number of blocks that the file occupies.  */
-static void initialize_fileinfo(struct fileinfo *f, ino_t inode, enum filetype type)
+static void
+snapshot_corrupt (void)
 {
-    memset(f, '\0', sizeof *f);
-    f->stat.st_ino = inode;
-    f->filetype = type;
-    f->scontext = UNKNOWN_SECURITY_CONTEXT;
-    f->quoted = -1;
+  error (LS_FAILURE, 0, _("%s: invalid snapshot"), quotef (snapshot_name));
 }
 
-static void update_quoted_status(struct fileinfo *f, char const *name)
+static void
+snapshot_read (void *buf, size_t size)
 {
-    if ((! cwd_some_quoted) && align_variable_outer_quotes)
+  if (fread (buf, 1, size, snapshot_fp) != size)
     {
-        f->quoted = needs_quoting(name);
-        if (f->quoted)
-            cwd_some_quoted = 1;
+      if (ferror (snapshot_fp))
+        error (LS_FAILURE, errno, _("error reading %s"),
+               quoteaf (snapshot_name));
+      snapshot_corrupt ();
     }
 }
 
-static bool needs_color_stat(enum filetype type)
+static void
+snapshot_seek (off_t offset)
 {
-    return (type == directory || type == unknown) && print_with_color
-           && (is_colored(C_OTHER_WRITABLE)
-               || is_colored(C_STICKY)
-               || is_colored(C_STICKY_OTHER_WRITABLE));
+  if (fseeko (snapshot_fp, offset, SEEK_SET) != 0)
+    error (LS_FAILURE, errno, _("error reading %s"), quoteaf (snapshot_name));
 }
 
-static bool needs_symlink_stat(enum filetype type)
-{
-    return (print_inode || format_needs_type)
-           && (type == symbolic_link || type == unknown)
-           && (dereference == DEREF_ALWAYS
-               || color_symlink_as_referent || check_symlink_mode);
-}
+/* Open the snapshot and index its records.  */
+static void
+snapshot_open (void)
+{
+  snapshot_fp = fopen (snapshot_name, "rb");
+  if (!snapshot_fp)
+    error (LS_FAILURE, errno, _("cannot open %s"), quoteaf (snapshot_name));
+
+  char header[sizeof SNAPSHOT_MAGIC];
+  snapshot_read (header, sizeof header);
+  if (memcmp (header, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC - 1) != 0)
+    snapshot_corrupt ();
+  bool has_btime = header[sizeof SNAPSHOT_MAGIC - 1];
+  if (has_btime != (time_type == time_btime))
+    error (LS_FAILURE, 0,
+           (has_btime
+            ? _("%s: snapshot holds birth times; use --time=birth")
+            : _("%s: snapshot holds no birth times")),
+           quotef (snapshot_name));
+
+  /* The files are not there to link to.  */
+  print_hyperlink = false;
+
+  snapshot_dirs = hash_initialize (INITIAL_TABLE_SIZE, nullptr,
+                                   snapshot_dir_hash, snapshot_dir_compare,
+                                   nullptr);
+  if (!snapshot_dirs)
+    xalloc_die ();
+
+  int type;
+  while ((type = getc (snapshot_fp)) != EOF)
+    {
+      uint64_t size;
+      snapshot_read (&size, sizeof size);
+      off_t offset = ftello (snapshot_fp);
+      if (offset < 0)
+        error (LS_FAILURE, errno, _("error reading %s"),
+               quoteaf (snapshot_name));
+      if ((uint64_t) (TYPE_MAXIMUM (off_t) - offset) < size)
+        snapshot_corrupt ();
+
+      if (type == 'A')
+        {
+          snapshot_args_offset = offset;
+          snapshot_args_size = size;
+        }
+      else if (type == 'D')
+        {
+          uint32_t len;
+          snapshot_read (&len, sizeof len);
+          if (len == UINT32_MAX || size < sizeof len
+              || size - sizeof len < len)
+            snapshot_corrupt ();
+          struct snapshot_dir *d = xmalloc (sizeof *d);
+          d->name = xmalloc (len + 1);
+          snapshot_read (d->name, len);
+          d->name[len] = '\0';
+          d->offset = offset;
+          d->size = size;
+
+          /* With -R, a directory reached twice was recorded twice.  */
+          struct snapshot_dir *ent = hash_insert (snapshot_dirs, d);
+          if (!ent)
+            xalloc_die ();
+          if (ent != d)
+            {
+              free (d->name);
+              free (d);
+            }
+        }
+      else
+        snapshot_corrupt ();
 
-static bool needs_executable_stat(enum filetype type)
-{
-    return (type == normal || type == unknown)
-           && (indicator_style == classify
-               || (print_with_color && (is_colored(C_EXEC)
-                                        || is_colored(C_SETUID)
-                                        || is_colored(C_SETGID))));
+      snapshot_seek (offset + size);
+    }
+
+  if (ferror (snapshot_fp))
+    error (LS_FAILURE, errno, _("error reading %s"), quoteaf (snapshot_name));
+  if (snapshot_args_offset < 0)
+    snapshot_corrupt ();
 }
 
-static bool should_check_stat(enum filetype type, bool command_line_arg, ino_t inode)
+/* Read the SIZE-byte payload at OFFSET into a newly allocated buffer.  */
+static char *
+snapshot_load (off_t offset, uint64_t size)
 {
-    return command_line_arg
-           || print_hyperlink
-           || format_needs_stat
-           || (format_needs_type && type == unknown)
-           || needs_color_stat(type)
-           || needs_symlink_stat(type)
-           || (print_inode && inode == NOT_AN_INODE_NUMBER)
-           || needs_executable_stat(type);
+  if (IDX_MAX < size)
+    xalloc_die ();
+  char *buf = xmalloc (size);
+  snapshot_seek (offset);
+  snapshot_read (buf, size);
+  return buf;
 }
 
-static char const *build_full_path(char const *name, char const *dirname)
+/* Copy SIZE bytes at *P, which is before END, to DST and advance *P.  */
+static void
+snapshot_take (char const **p, char const *end, void *dst, size_t size)
 {
-    if (name[0] != '/' && dirname)
-    {
-        char *p = alloca(strlen(name) + strlen(dirname) + 2);
-        attach(p, dirname, name);
-        return p;
-    }
-    return name;
+  if ((size_t) (end - *p) < size)
+    snapshot_corrupt ();
+  memcpy (dst, *p, size);
+  *p += size;
 }
 
-static void handle_hyperlink(struct fileinfo *f, char const *full_name, bool command_line_arg)
+static char *
+snapshot_take_string (char const **p, char const *end)
 {
-    if (print_hyperlink)
-    {
-        f->absolute_name = canonicalize_filename_mode(full_name, CAN_MISSING);
-        if (!f->absolute_name)
-            file_failure(command_line_arg, _("error canonicalizing %s"), full_name);
-    }
+  uint32_t len;
+  snapshot_take (p, end, &len, sizeof len);
+  if (len == UINT32_MAX)
+    return nullptr;
+  char *s = xmalloc ((idx_t) len + 1);
+  snapshot_take (p, end, s, len);
+  s[len] = '\0';
+  return s;
 }
 
-static int perform_stat_operation(char const *full_name, struct fileinfo *f,
-                                 bool command_line_arg, bool *do_deref)
+/* Add the entries at *P to the current table of files as gobble_file
+   would, and return the number of blocks they occupy.  Unless
+   COMMAND_LINE_ARG, omit the entries that file_ignored rejects.  */
+static uintmax_t
+snapshot_take_files (char const **p, char const *end, bool command_line_arg,
+                     char const *dirname)
 {
-    int err;
-    
-    switch (dereference)
+  uintmax_t total_blocks = 0;
+  uint64_t n;
+  snapshot_take (p, end, &n, sizeof n);
+
+  for (; n; n--)
     {
-    case DEREF_ALWAYS:
-        err = do_stat(full_name, &f->stat);
-        *do_deref = true;
-        break;
+      struct snapshot_entry e;
+      snapshot_take (p, end, &e, sizeof e);
+      char *name = snapshot_take_string (p, end);
+      char *linkname = snapshot_take_string (p, end);
+      char *scontext = snapshot_take_string (p, end);
+      if (!name || (unsigned int) e.filetype >= filetype_cardinality
+          || ACL_T_YES < e.acl_type)
+        snapshot_corrupt ();
 
-    case DEREF_COMMAND_LINE_ARGUMENTS:
-    case DEREF_COMMAND_LINE_SYMLINK_TO_DIR:
-        if (command_line_arg)
+      if (!command_line_arg && file_ignored (name))
         {
-            err = do_stat(full_name, &f->stat);
-            *do_deref = true;
+          free (name);
+          free (linkname);
+          free (scontext);
+          continue;
+        }
 
-            if (dereference == DEREF_COMMAND_LINE_ARGUMENTS)
-                break;
+      if (cwd_n_used == cwd_n_alloc)
+        cwd_file = xpalloc (cwd_file, &cwd_n_alloc, 1, -1, sizeof *cwd_file);
+
+      struct fileinfo *f = &cwd_file[cwd_n_used];
+      initialize_fileinfo (f, e.stat.st_ino, e.filetype);
+      update_quoted_status (f, name);
+      f->stat = e.stat;
+      f->stat_ok = e.stat_ok;
+      f->linkname = linkname;
+      f->linkmode = e.linkmode;
+      f->linkok = e.linkok;
+      f->acl_type = e.acl_type;
+      f->has_capability = e.has_capability;
+      if (scontext)
+        f->scontext = scontext;
+      any_has_acl |= f->acl_type != ACL_T_NONE;
+
+      if (f->linkname && f->quoted == 0 && needs_quoting (f->linkname))
+        f->quoted = -1;
 
-            bool need_lstat = (err < 0
-                              ? (errno == ENOENT || errno == ELOOP)
-                              : !S_ISDIR(f->stat.st_mode));
-            if (!need_lstat)
-                break;
+      total_blocks += STP_NBLOCKS (&f->stat);
+
+      /* As in gobble_file.  */
+      if (group_by != group_by_none && f->filetype != arg_directory)
+        {
+          aggregate_file (f, name, dirname);
+          if (!(recursive && f->filetype == directory))
+            {
+              free_ent (f);
+              free (name);
+              continue;
+            }
         }
-        FALLTHROUGH;
 
-    case DEREF_NEVER:
-        err = do_lstat(full_name, &f->stat);
-        *do_deref = false;
-        break;
+      update_file_widths (f);
 
-    case DEREF_UNDEFINED:
-    default:
-        unreachable();
+      f->name = name;
+      cwd_n_used++;
     }
-    
-    return err;
+
+  return total_blocks;
 }
 
-static void process_acl_and_scontext(struct fileinfo *f, char const *full_name,
-                                    enum filetype type, bool do_deref)
+/* Add the operands of the replayed snapshot to the current table of
+   files, or queue "." if it was captured without operands.  */
+static void
+replay_file_arguments (void)
 {
-    bool get_scontext = (format == long_format) | print_scontext;
-    bool check_capability = format_needs_capability & (type == normal);
+  char *buf = snapshot_load (snapshot_args_offset, snapshot_args_size);
+  char const *p = buf;
+  char const *end = buf + snapshot_args_size;
 
-    if (!get_scontext && !check_capability)
-        return;
+  int64_t n;
+  snapshot_take (&p, end, &n, sizeof n);
+  snapshot_n_files = n;
+  snapshot_take_files (&p, end, true, nullptr);
+  if (p != end)
+    snapshot_corrupt ();
+  free (buf);
 
-    struct aclinfo ai;
-    int aclinfo_flags = ((do_deref ? ACL_SYMLINK_FOLLOW : 0)
-                        | (get_scontext ? ACL_GET_SCONTEXT : 0)
-                        | filetype_d_type[type]);
-    int n = file_has_aclinfo_cache(full_name, f, &ai, aclinfo_flags);
-    bool have_acl = 0 < n;
-    bool have_scontext = !ai.scontext_err;
-    bool cannot_access_acl = n < 0 && (errno == EACCES || errno == ENOENT);
+  if (snapshot_n_files <= 0 && !cwd_n_used)
+    queue_directory (".", nullptr, true);
+}
 
-    f->acl_type = (!have_scontext && !have_acl
-                  ? (cannot_access_acl ? ACL_T_UNKNOWN : ACL_T_NONE)
-                  : (have_scontext && !have_acl
-                     ? ACL_T_LSM_CONTEXT_ONLY
-                     : ACL_T_YES));
-    any_has_acl |= f->acl_type != ACL_T_NONE;
+/* Like print_dir, but list the directory NAME as it was captured.  */
+static void
+replay_dir (char const *name, char const *realname, bool command_line_arg)
+{
+  struct snapshot_dir key = { .name = (char *) name };
+  struct snapshot_dir const *d = hash_lookup (snapshot_dirs, &key);
+  if (!d)
+    {
+      errno = ENOENT;
+      file_failure (command_line_arg, _("cannot open directory %s"), name);
+      return;
+    }
 
-    if (format == long_format && n < 0 && !cannot_access_acl)
-        error(0, errno, "%s", quotef(full_name));
-    else if (print_scontext && ai.scontext_err
-             && (!(is_ENOTSUP(ai.scontext_err) || ai.scontext_err == ENODATA)))
-        error(0, ai.scontext_err, "%s", quotef(full_name));
+  char *buf = snapshot_load (d->offset, d->size);
+  char const *p = buf;
+  char const *end = buf + d->size;
+  free (snapshot_take_string (&p, end));
+  uint64_t dev_ino[2];
+  snapshot_take (&p, end, dev_ino, sizeof dev_ino);
 
-    if (check_capability && aclinfo_has_xattr(&ai, XATTR_NAME_CAPS))
-        f->has_capability = has_capability_cache(full_name, f);
+  if (LOOP_DETECT)
+    {
+      if (visit_dir (dev_ino[0], dev_ino[1]))
+        {
+          error (0, 0, _("%s: not listing already-listed directory"),
+                 quotef (name));
+          set_exit_status (true);
+          free (buf);
+          return;
+        }
+      dev_ino_push (dev_ino[0], dev_ino[1]);
+    }
 
-    f->scontext = ai.scontext;
-    ai.scontext = nullptr;
-    aclinfo_free(&ai);
+  clear_files ();
+  print_directory_header (name, realname, command_line_arg);
+
+  uintmax_t total_blocks = snapshot_take_files (&p, end, false, name);
+  if (p != end)
+    snapshot_corrupt ();
+  free (buf);
+
+  list_current_dir (name, total_blocks);
 }
 
-static void process_symlink(struct fileinfo *f, char const *full_name, bool command_line_arg)
-{
-    struct stat linkstats;
+/* Aggregation for --group-by and --agg.  Each listed file is folded
+   into the group for its key as it is gobbled, and then discarded
+   unless it is a directory that -R still has to descend into, so
+   memory is proportional to the number of groups.  */
 
-    get_link_name(full_name, f, command_line_arg);
+/* An aggregate function and the field it applies to.  */
+enum agg_func { agg_count, agg_sum, agg_min, agg_max };
+enum agg_field { agg_size, agg_blocks, agg_mtime };
 
-    if (f->linkname && f->quoted == 0 && needs_quoting(f->linkname))
-        f->quoted = -1;
+static char const *const agg_func_name[] = { "count", "sum", "min", "max" };
+static char const *const agg_field_name[] = { "size", "blocks", "mtime" };
 
-    if (f->linkname
-        && (file_type <= indicator_style || check_symlink_mode)
-        && stat_for_mode(full_name, &linkstats) == 0)
-    {
-        f->linkok = true;
-        f->linkmode = linkstats.st_mode;
-    }
-}
+enum { MAX_AGGS = 16 };
 
-static void update_width_field(int *width, int new_len)
+/* The aggregates given by --agg, in order.  */
+static struct agg
+  {
+    enum agg_func func;
+    enum agg_field field;
+  } aggs[MAX_AGGS];
+static int n_aggs;
+
+/* A group: its key, an ordinal that is sorted on before the key, the
+   number of files in it, and a value for each of AGGS.  HAS_VALUE
+   is false until a file with a known status has been seen.  */
+struct agg_group
+  {
+    char *key;
+    int order;
+    uintmax_t count;
+    bool has_value;
+    intmax_t value[MAX_AGGS];
+  };
+
+static Hash_table *agg_groups;
+
+/* Room for a formatted aggregate or numeric key.  */
+enum { AGG_BUFSIZE = MAX (LONGEST_HUMAN_READABLE + 1,
+                          INT_BUFSIZE_BOUND (intmax_t)) };
+
+/* Upper bounds in seconds of the --group-by=mtime-bucket ages.  */
+static struct
+  {
+    intmax_t age;
+    char const *name;
+  } const mtime_buckets[] =
+  {
+    { 60 * 60, "<1h" },
+    { 24 * 60 * 60, "<1d" },
+    { 7 * 24 * 60 * 60, "<1w" },
+    { 30 * 24 * 60 * 60, "<30d" },
+    { 365 * 24 * 60 * 60, "<1y" },
+    { INTMAX_MAX, ">=1y" },
+  };
+
+static size_t
+agg_group_hash (void const *x, size_t table_size)
 {
-    if (*width < new_len)
-        *width = new_len;
+  struct agg_group const *g = x;
+  return hash_string (g->key, table_size);
 }
 
-static void update_block_size_width(uintmax_t blocks)
-{
-    char buf[LONGEST_HUMAN_READABLE + 1];
-    int len = mbswidth(human_readable(blocks, buf, human_output_opts,
-                                     ST_NBLOCKSIZE, output_block_size),
-                      MBSWIDTH_FLAGS);
-    update_width_field(&block_size_width, len);
+static bool
+agg_group_compare (void const *x, void const *y)
+{
+  struct agg_group const *a = x;
+  struct agg_group const *b = y;
+  return STREQ (a->key, b->key);
 }
 
-static void update_user_group_widths(struct fileinfo *f)
+/* Parse the argument of --agg, a comma-separated list of "count" and
+   FUNC(FIELD).  */
+
+static void
+decode_aggs (char const *spec)
 {
-    if (print_owner)
-        update_width_field(&owner_width, format_user_width(f->stat.st_uid));
+  char const *p = spec;
+  n_aggs = 0;
 
-    if (print_group)
-        update_width_field(&group_width, format_group_width(f->stat.st_gid));
+  while (true)
+    {
+      struct agg a;
+      size_t len = strcspn (p, ",");
+      bool ok = false;
 
-    if (print_author)
-        update_width_field(&author_width, format_user_width(f->stat.st_author));
+      if (len == 5 && STREQ_LEN (p, "count", 5))
+        {
+          a.func = agg_count;
+          a.field = agg_size;
+          ok = true;
+        }
+      else
+        for (int fn = agg_sum; fn <= agg_max && !ok; fn++)
+          for (int fd = 0; fd < ARRAY_CARDINALITY (agg_field_name) && !ok;
+               fd++)
+            {
+              size_t fnlen = strlen (agg_func_name[fn]);
+              size_t fdlen = strlen (agg_field_name[fd]);
+              if (len == fnlen + fdlen + 2
+                  && STREQ_LEN (p, agg_func_name[fn], fnlen)
+                  && p[fnlen] == '('
+                  && STREQ_LEN (p + fnlen + 1, agg_field_name[fd], fdlen)
+                  && p[len - 1] == ')')
+                {
+                  a.func = fn;
+                  a.field = fd;
+                  ok = (a.func != agg_sum || a.field != agg_mtime);
+                }
+            }
+
+      if (!ok || n_aggs == MAX_AGGS)
+        error (LS_FAILURE, 0, _("invalid aggregate list: %s"), quote (spec));
+      aggs[n_aggs++] = a;
+
+      if (!p[len])
+        break;
+      p += len + 1;
+    }
 }
 
-static void update_device_widths(struct fileinfo *f)
+/* Return true if aggregating needs the status of each file.  */
+
+static bool
+aggs_need_stat (void)
 {
-    char buf[INT_BUFSIZE_BOUND(uintmax_t)];
-    int len = strlen(umaxtostr(major(f->stat.st_rdev), buf));
-    update_width_field(&major_device_number_width, len);
-    
-    len = strlen(umaxtostr(minor(f->stat.st_rdev), buf));
-    update_width_field(&minor_device_number_width, len);
-    
-    len = major_device_number_width + 2 + minor_device_number_width;
-    update_width_field(&file_size_width, len);
+  if (group_by == group_by_owner || group_by == group_by_group
+      || group_by == group_by_mtime_bucket)
+    return true;
+  for (int i = 0; i < n_aggs; i++)
+    if (aggs[i].func != agg_count)
+      return true;
+  return false;
 }
 
-static void update_file_size_width(struct fileinfo *f)
+static void
+aggs_init (void)
 {
-    char buf[LONGEST_HUMAN_READABLE + 1];
-    uintmax_t size = unsigned_file_size(f->stat.st_size);
-    int len = mbswidth(human_readable(size, buf, file_human_output_opts,
-                                     1, file_output_block_size),
-                      MBSWIDTH_FLAGS);
-    update_width_field(&file_size_width, len);
+  if (!n_aggs)
+    decode_aggs ("count,sum(size)");
+
+  agg_groups = hash_initialize (INITIAL_TABLE_SIZE, nullptr,
+                                agg_group_hash, agg_group_compare, nullptr);
+  if (!agg_groups)
+    xalloc_die ();
 }
 
-static void update_long_format_widths(struct fileinfo *f, enum filetype type)
+/* Return the key of F, named NAME in directory DIRNAME, storing its
+   sort ordinal into *ORDER.  The result may live in BUF, of size
+   AGG_BUFSIZE, or in storage that is returned in *ALLOCATED.  */
+
+static char const *
+agg_key (struct fileinfo const *f, char const *name, char const *dirname,
+         int *order, char *buf, char **allocated)
 {
-    if (format != long_format)
-        return;
+  *order = 0;
 
-    update_user_group_widths(f);
+  switch (group_by)
+    {
+    case group_by_ext:
+      {
+        char const *base = last_component (name);
+        char const *dot = strrchr (base, '.');
+        return dot && dot != base ? dot + 1 : "";
+      }
 
-    char b[INT_BUFSIZE_BOUND(uintmax_t)];
-    int b_len = strlen(umaxtostr(f->stat.st_nlink, b));
-    update_width_field(&nlink_width, b_len);
+    case group_by_owner:
+    case group_by_group:
+      {
+        if (!f->stat_ok)
+          return "?";
+        bool owner = group_by == group_by_owner;
+        uintmax_t id = owner ? f->stat.st_uid : f->stat.st_gid;
+        char const *idname = (numeric_ids ? nullptr
+                              : owner ? getuser (id) : getgroup (id));
+        return idname ? idname : umaxtostr (id, buf);
+      }
 
-    if ((type == chardev) | (type == blockdev))
-        update_device_widths(f);
-    else
-        update_file_size_width(f);
-}
+    case group_by_type:
+      {
+        static char const *const type_name[] =
+          {
+            "unknown", "fifo", "chardev", "directory", "blockdev", "file",
+            "symlink", "socket", "whiteout", "directory"
+          };
+        static_assert (ARRAY_CARDINALITY (type_name)
+                       == filetype_cardinality);
+        *order = f->filetype;
+        return type_name[f->filetype];
+      }
 
-static uintmax_t
-gobble_file(char const *name, enum filetype type, ino_t inode,
-           bool command_line_arg, char const *dirname)
-{
-    uintmax_t blocks = 0;
-    struct fileinfo *f;
+    case group_by_mtime_bucket:
+      {
+        if (!f->stat_ok)
+          {
+            *order = -1;
+            return "?";
+          }
+        if (timespec_cmp (current_time, get_stat_mtime (&f->stat)) < 0)
+          gettime (&current_time);
+        intmax_t age = current_time.tv_sec - f->stat.st_mtime;
+        if (age < 0)
+          {
+            *order = -1;
+            return "future";
+          }
+        int i = 0;
+        while (mtime_buckets[i].age <= age)
+          i++;
+        *order = i;
+        return mtime_buckets[i].name;
+      }
 
-    affirm(!command_line_arg || inode == NOT_AN_INODE_NUMBER);
+    case group_by_dir:
+      if (dirname)
+        return dirname;
+      else
+        {
+          /* A command-line operand: use its leading directory.  */
+          char const *base = last_component (name);
+          if (base == name)
+            return ".";
+          return *allocated = ximemdup0 (name, base - name);
+        }
 
-    if (cwd_n_used == cwd_n_alloc)
-        cwd_file = xpalloc(cwd_file, &cwd_n_alloc, 1, -1, sizeof *cwd_file);
+    case group_by_none:
+    default:
+      unreachable ();
+    }
+}
 
-    f = &cwd_file[cwd_n_used];
-    initialize_fileinfo(f, inode, type);
-    update_quoted_status(f, name);
+/* Fold F, named NAME in directory DIRNAME, into its group.  */
 
-    bool check_stat = should_check_stat(type, command_line_arg, inode);
-    
-    char const *full_name = name;
-    if (check_stat | print_scontext | format_needs_capability)
-        full_name = build_full_path(name, dirname);
+static void
+aggregate_file (struct fileinfo const *f, char const *name,
+                char const *dirname)
+{
+  char buf[AGG_BUFSIZE];
+  char *allocated = nullptr;
+  struct agg_group key_group;
+  key_group.key = (char *) agg_key (f, name, dirname, &key_group.order,
+                                    buf, &allocated);
+
+  struct agg_group *g = hash_lookup (agg_groups, &key_group);
+  if (!g)
+    {
+      g = xzalloc (sizeof *g);
+      g->key = allocated ? allocated : xstrdup (key_group.key);
+      allocated = nullptr;
+      g->order = key_group.order;
+      if (!hash_insert (agg_groups, g))
+        xalloc_die ();
+    }
+  free (allocated);
 
-    bool do_deref = dereference == DEREF_ALWAYS;
+  g->count++;
+  if (!f->stat_ok)
+    return;
 
-    if (check_stat)
+  for (int i = 0; i < n_aggs; i++)
     {
-        handle_hyperlink(f, full_name, command_line_arg);
-        
-        int err = perform_stat_operation(full_name, f, command_line_arg, &do_deref);
-
-        if (err != 0)
+      intmax_t v;
+      switch (aggs[i].field)
         {
-            file_failure(command_line_arg, _("cannot access %s"), full_name);
-
-            if (command_line_arg)
-                return 0;
-
-            f->name = xstrdup(name);
-            cwd_n_used++;
-            return 0;
+        case agg_size: v = f->stat.st_size; break;
+        case agg_blocks: v = STP_NBLOCKS (&f->stat); break;
+        case agg_mtime: v = f->stat.st_mtime; break;
+        default: unreachable ();
         }
 
-        f->stat_ok = true;
-        f->filetype = type = d_type_filetype[IFTODT(f->stat.st_mode)];
+      intmax_t *acc = &g->value[i];
+      switch (aggs[i].func)
+        {
+        case agg_count:
+          break;
+        case agg_sum:
+          if (ckd_add (acc, *acc, v))
+            *acc = INTMAX_MAX;
+          break;
+        case agg_min:
+          if (!g->has_value || v < *acc)
+            *acc = v;
+          break;
+        case agg_max:
+          if (!g->has_value || *acc < v)
+            *acc = v;
+          break;
+        default:
+          unreachable ();
+        }
     }
+  g->has_value = true;
+}
 
-    if (type == directory && command_line_arg && !immediate_dirs)
-        f->filetype = type = arg_directory;
+static int
+compare_agg_groups (void const *x, void const *y)
+{
+  struct agg_group const *a = *(struct agg_group *const *) x;
+  struct agg_group const *b = *(struct agg_group *const *) y;
+  int diff = (a->order > b->order) - (a->order < b->order);
+  return diff ? diff : strcmp (a->key, b->key);
+}
 
-    process_acl_and_scontext(f, full_name, type, do_deref);
+/* Format the value of aggregate I of group G into BUF, of size
+   AGG_BUFSIZE.  */
+
+static char const *
+format_agg (struct agg_group const *g, int i, char *buf)
+{
+  if (aggs[i].func == agg_count)
+    return umaxtostr (g->count, buf);
+  if (!g->has_value)
+    return "?";
+
+  intmax_t v = g->value[i];
+  switch (aggs[i].field)
+    {
+    case agg_size:
+      return human_readable (v, buf, file_human_output_opts, 1,
+                             file_output_block_size);
+    case agg_blocks:
+      return human_readable (v, buf, human_output_opts, ST_NBLOCKSIZE,
+                             output_block_size);
+    case agg_mtime:
+      {
+        struct tm tm;
+        time_t t = v;
+        if (localtime_rz (get_localtz (), &t, &tm)
+            && nstrftime (buf, AGG_BUFSIZE, "%Y-%m-%d %H:%M",
+                          &tm, get_localtz (), 0))
+          return buf;
+        return imaxtostr (v, buf);
+      }
+    default:
+      unreachable ();
+    }
+}
 
-    if ((type == symbolic_link) & ((format == long_format) | check_symlink_mode))
-        process_symlink(f, full_name, command_line_arg);
+/* Print the groups as a table, sorted by key.  */
 
-    blocks = STP_NBLOCKS(&f->stat);
-    if (format == long_format || print_block_size)
-        update_block_size_width(blocks);
+static void
+print_aggregates (void)
+{
+  idx_t n = hash_get_n_entries (agg_groups);
+  struct agg_group **groups = xinmalloc (n, sizeof *groups);
+  hash_get_entries (agg_groups, (void **) groups, n);
+  qsort (groups, n, sizeof *groups, compare_agg_groups);
 
-    update_long_format_widths(f, type);
+  int width[1 + MAX_AGGS];
+  char buf[AGG_BUFSIZE];
 
-    if (print_scontext)
-        update_width_field(&scontext_width, strlen(f->scontext));
+  width[0] = mbswidth (group_by_args[group_by - 1], MBSWIDTH_FLAGS);
+  for (int i = 0; i < n_aggs; i++)
+    width[1 + i] = (strlen (agg_func_name[aggs[i].func])
+                    + (aggs[i].func == agg_count
+                       ? 0 : strlen (agg_field_name[aggs[i].field]) + 2));
+  for (idx_t j = 0; j < n; j++)
+    {
+      width[0] = MAX (width[0], mbswidth (quotef (groups[j]->key),
+                                          MBSWIDTH_FLAGS));
+      for (int i = 0; i < n_aggs; i++)
+        width[1 + i] = MAX (width[1 + i],
+                            mbswidth (format_agg (groups[j], i, buf),
+                                      MBSWIDTH_FLAGS));
+    }
 
-    if (print_inode)
+  printf ("%-*s", width[0], group_by_args[group_by - 1]);
+  for (int i = 0; i < n_aggs; i++)
     {
-        char buf[INT_BUFSIZE_BOUND(uintmax_t)];
-        update_width_field(&inode_number_width, strlen(umaxtostr(f->stat.st_ino, buf)));
+      if (aggs[i].func == agg_count)
+        snprintf (buf, sizeof buf, "%s", agg_func_name[agg_count]);
+      else
+        snprintf (buf, sizeof buf, "%s(%s)", agg_func_name[aggs[i].func],
+                  agg_field_name[aggs[i].field]);
+      printf ("  %*s", width[1 + i], buf);
     }
+  putchar (eolbyte);
 
-    f->name = xstrdup(name);
-    cwd_n_used++;
+  for (idx_t j = 0; j < n; j++)
+    {
+      char const *key = quotef (groups[j]->key);
+      printf ("%s%*s", key, width[0] - mbswidth (key, MBSWIDTH_FLAGS), "");
+      for (int i = 0; i < n_aggs; i++)
+        printf ("  %*s", width[1 + i], format_agg (groups[j], i, buf));
+      putchar (eolbyte);
+      free (groups[j]->key);
+      free (groups[j]);
+    }
 
-    return blocks;
+  free (groups);
+  hash_free (agg_groups);
 }
 
 /* Return true if F refers to a directory.  */
@@ -3869,17 +7519,20 @@ is_linked_directory (const struct fileinfo *f)
          || S_ISDIR (f->linkmode);
 }
 
-/* Put the name of the file that FILENAME is a symbolic link to
-   into the LINKNAME field of 'f'.  COMMAND_LINE_ARG indicates whether
-   FILENAME is a command-line argument.  */
+/* Put the name of the file that E is a symbolic link to into the
+   LINKNAME field of 'f'.  COMMAND_LINE_ARG indicates whether E is a
+   command-line argument.  */
 
 static void
-get_link_name (char const *filename, struct fileinfo *f, bool command_line_arg)
+get_link_name (struct entry_path const *e, struct fileinfo *f,
+               bool command_line_arg)
 {
-  f->linkname = areadlink_with_size (filename, f->stat.st_size);
+  f->linkname = (enter_syscall (SYSCALL_READLINK)
+                 ? areadlinkat_with_size (e->fd, e->name, f->stat.st_size)
+                 : nullptr);
+  leave_syscall ();
   if (f->linkname == NULL)
-    file_failure (command_line_arg, _("cannot read symbolic link %s"),
-                  filename);
+    entry_failure (e, command_line_arg, _("cannot read symbolic link %s"));
 }
 
 /* Return true if the last component of NAME is '.' or '..'
@@ -3916,6 +7569,12 @@ static void queue_file_directory(struct fileinfo *f, const char *dirname, bool c
     {
         char *name = file_name_concat(dirname, f->name, nullptr);
         queue_directory(name, f->linkname, command_line_arg);
+        if (0 <= listing_slot)
+        {
+            /* Let print_dir open it relative to DIRNAME.  */
+            pending_dirs->parent_slot = listing_slot;
+            pending_dirs->parent_gen = dir_fd_cache[listing_slot].gen;
+        }
         free(name);
     }
 }
@@ -4110,6 +7769,146 @@ cmp_extension (struct fileinfo const *a, struct fileinfo const *b,
   return cmp (a->name, b->name);
 }
 
+/* --compress-names.  Once sorted, neighboring names tend to share long
+   prefixes, so rather than keep each name in its own allocation until
+   it is printed, store the sorted names front-coded: each record is
+   the length of the prefix shared with the previous name and the
+   length of the rest, as base-128 varints, then the rest.  Every
+   NAME_BLOCK-th name starts a block and is stored whole, so that any
+   name can be decoded from the start of its block, and a cursor makes
+   decoding the names in order, as most formats print them, cost O(1)
+   each.  */
+
+enum { NAME_BLOCK = 16 };
+
+static char *name_store;
+static idx_t name_store_len, name_store_alloc;
+static idx_t *name_blocks;
+static idx_t name_blocks_alloc;
+
+/* The last name decoded, its index, and the offset of the next
+   record.  */
+static char *name_cursor;
+static idx_t name_cursor_alloc;
+static idx_t name_cursor_index = -1;
+static idx_t name_cursor_next;
+
+static void
+name_store_grow (idx_t n)
+{
+  if (name_store_alloc - name_store_len < n)
+    name_store = xpalloc (name_store, &name_store_alloc,
+                          n - (name_store_alloc - name_store_len), -1, 1);
+}
+
+static void
+name_store_put_varint (idx_t v)
+{
+  name_store_grow (sizeof v * CHAR_BIT / 7 + 1);
+  for (; 0x80 <= v; v >>= 7)
+    name_store[name_store_len++] = (v & 0x7f) | 0x80;
+  name_store[name_store_len++] = v;
+}
+
+static idx_t
+name_store_get_varint (idx_t *offset)
+{
+  idx_t v = 0;
+  for (int shift = 0; ; shift += 7)
+    {
+      unsigned char c = name_store[(*offset)++];
+      v |= (idx_t) (c & 0x7f) << shift;
+      if (c < 0x80)
+        return v;
+    }
+}
+
+/* Front-code the names of the CWD_N_USED sorted files, freeing each
+   along with any sort key, which is not needed once the table is
+   sorted.  This runs after sorting, so it lowers what a directory
+   holds while it is printed, not the peak while it is read and
+   sorted.  */
+static void
+compress_file_names (void)
+{
+  idx_t n_blocks = (cwd_n_used + NAME_BLOCK - 1) / NAME_BLOCK;
+  if (name_blocks_alloc < n_blocks)
+    name_blocks = xpalloc (name_blocks, &name_blocks_alloc,
+                           n_blocks - name_blocks_alloc, -1,
+                           sizeof *name_blocks);
+  name_store_len = 0;
+  name_cursor_index = -1;
+
+  char *prev = nullptr;
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    {
+      struct fileinfo *f = sorted_file[i];
+      char *name = f->name;
+      idx_t prefix = 0;
+
+      if (i % NAME_BLOCK == 0)
+        name_blocks[i / NAME_BLOCK] = name_store_len;
+      else
+        while (prev[prefix] && prev[prefix] == name[prefix])
+          prefix++;
+
+      idx_t rest = strlen (name + prefix);
+      name_store_put_varint (prefix);
+      name_store_put_varint (rest);
+      name_store_grow (rest);
+      memcpy (name_store + name_store_len, name + prefix, rest);
+      name_store_len += rest;
+
+      free (prev);
+      prev = name;
+      f->name = nullptr;
+      f->name_index = i;
+      free (f->sortkey);
+      f->sortkey = nullptr;
+      f->sortkey_len = 0;
+    }
+  free (prev);
+}
+
+/* Return the name of F, which is valid until the next call if it had
+   to be decoded.  Every decoded name shares one buffer, so a caller
+   must be done with the result before it asks for another entry's
+   name.  */
+static char const *
+fileinfo_name (struct fileinfo const *f)
+{
+  if (f->name)
+    return f->name;
+
+  idx_t i = f->name_index;
+  if (i == name_cursor_index)
+    return name_cursor;
+
+  /* Restart at the start of the block unless the cursor is already
+     in it, before I.  */
+  idx_t start = i - i % NAME_BLOCK;
+  if (! (start <= name_cursor_index && name_cursor_index < i))
+    {
+      name_cursor_index = start - 1;
+      name_cursor_next = name_blocks[start / NAME_BLOCK];
+    }
+
+  while (name_cursor_index < i)
+    {
+      idx_t prefix = name_store_get_varint (&name_cursor_next);
+      idx_t rest = name_store_get_varint (&name_cursor_next);
+      if (name_cursor_alloc <= prefix + rest)
+        name_cursor = xpalloc (name_cursor, &name_cursor_alloc,
+                               prefix + rest + 1 - name_cursor_alloc, -1, 1);
+      memcpy (name_cursor + prefix, name_store + name_cursor_next, rest);
+      name_cursor[prefix + rest] = '\0';
+      name_cursor_next += rest;
+      name_cursor_index++;
+    }
+
+  return name_cursor;
+}
+
 /* Return the (cached) screen width,
    for the NAME associated with the passed fileinfo F.  */
 
@@ -4119,7 +7918,9 @@ fileinfo_name_width (struct fileinfo const *f)
   if (f->width) {
     return f->width;
   }
-  return quote_name_width (f->name, filename_quoting_options, f->quoted);
+  /* Used up before any other name is decoded.  */
+  return quote_name_width (fileinfo_name (f), filename_quoting_options,
+                           f->quoted);
 }
 
 static int
@@ -4130,1510 +7931,349 @@ cmp_width (struct fileinfo const *a, struct fileinfo const *b,
   return diff ? diff : cmp (a->name, b->name);
 }
 
-#define DEFINE_SORT_FUNCTIONS(sort_type, compare_func) \
-    static int compare_func(const void *a, const void *b); \
-    \
-    void sort_by_##sort_type(void *array, size_t count, size_t size) { \
-        qsort(array, count, size, compare_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static int sort_##name##_ascending(const void *a, const void *b) \
-{ \
-    return cmp_func(a, b); \
-} \
-\
-static int sort_##name##_descending(const void *a, const void *b) \
-{ \
-    return cmp_func(b, a); \
-}
-
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static int sort_##name##_ascending(const void *a, const void *b) \
-{ \
-    return cmp_func(a, b); \
-} \
-\
-static int sort_##name##_descending(const void *a, const void *b) \
-{ \
-    return cmp_func(b, a); \
-}
-
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)#define DEFINE_SORT_FUNCTIONS(field, compare_func) \
-  void sort_by_##field(void *base, size_t num, size_t size) { \
-    qsort(base, num, size, compare_func); \
-  } \
-  void stable_sort_by_##field(void *base, size_t num, size_t size) { \
-    stable_sort(base, num, size, compare_func); \
-  }
+DEFINE_SORT_FUNCTIONS (ctime, cmp_ctime)
+DEFINE_SORT_FUNCTIONS (mtime, cmp_mtime)
+DEFINE_SORT_FUNCTIONS (atime, cmp_atime)
+DEFINE_SORT_FUNCTIONS (btime, cmp_btime)
+DEFINE_SORT_FUNCTIONS (size, cmp_size)
+DEFINE_SORT_FUNCTIONS (name, cmp_name)
+DEFINE_SORT_FUNCTIONS (extension, cmp_extension)
+DEFINE_SORT_FUNCTIONS (width, cmp_width)
+
+/* Compare file versions.
+   Unlike the other compare functions, cmp_version does not fail
+   because filevercmp and strcmp do not fail; cmp_version uses strcmp
+   instead of xstrcoll because filevercmp is locale-independent so
+   strcmp is its appropriate secondary.
+
+   All the other sort options need xstrcoll and strcmp variants,
+   because they all use xstrcoll (either as the primary or secondary
+   sort key), and xstrcoll has the ability to do a longjmp if strcoll fails for
+   locale reasons.  */
+static int
+cmp_version (struct fileinfo const *a, struct fileinfo const *b)
+{
+  int diff = filevercmp (a->name, b->name);
+  return diff ? diff : strcmp (a->name, b->name);
+}
 
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)static int cmp_ctime(struct fileinfo const *a, struct fileinfo const *b)
+static int
+xstrcoll_version (V a, V b)
+{
+  return cmp_version (a, b);
+}
+static int
+rev_xstrcoll_version (V a, V b)
+{
+  return cmp_version (b, a);
+}
+static int
+xstrcoll_df_version (V a, V b)
+{
+  return dirfirst_check (a, b, xstrcoll_version);
+}
+static int
+rev_xstrcoll_df_version (V a, V b)
 {
-    return timespec_cmp(get_stat_ctime(&a->stat), get_stat_ctime(&b->stat));
+  return dirfirst_check (a, b, rev_xstrcoll_version);
 }
 
-static int sort_ctime(void const *a, void const *b)
+/* Return a newly allocated sort key for NAME, with ASCII letters
+   folded to lower case.  If NATURAL, also rewrite each run of digits
+   so that strcmp orders runs by numeric value: leading zeros are
+   dropped, and the remaining L digits are preceded by (L - 1) / 8
+   '9's and then the digit '1' + (L - 1) % 8.  */
+
+static char *
+make_sortkey (char const *name, bool natural)
 {
-    return cmp_ctime(a, b);
+  char *key = xnmalloc (2, strlen (name) + 1);
+  char *k = key;
+
+  for (char const *p = name; *p; )
+    if (natural && c_isdigit (*p))
+      {
+        while (*p == '0' && c_isdigit (p[1]))
+          p++;
+        char const *digits = p;
+        while (c_isdigit (*p))
+          p++;
+        idx_t len = p - digits;
+        for (idx_t n = (len - 1) / 8; n; n--)
+          *k++ = '9';
+        *k++ = '1' + (len - 1) % 8;
+        k = mempcpy (k, digits, len);
+      }
+    else
+      *k++ = c_tolower (*p++);
+
+  *k = '\0';
+  return key;
 }
 
-static int rev_sort_ctime(void const *a, void const *b)
+/* Compute the sort keys of the files now in the table that lack one.  */
+
+static void
+update_sortkeys (void)
 {
-    return -cmp_ctime(a, b);
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    {
+      struct fileinfo *f = sorted_file[i];
+      if (!f->sortkey)
+        f->sortkey = make_sortkey (f->name, sort_type == sort_natural);
+    }
+}
+
+/* Parse the --sort argument SPEC, a comma-separated list of keys,
+   each optionally followed by ":asc" or ":desc".  Without a
+   direction, size and time keys put the largest or newest first as
+   their single-key sorts do, and other keys are ascending.  */
+
+static void
+decode_sort_keys (char const *spec)
+{
+  char *list = xstrdup (spec);
+  n_sort_keys = 0;
+
+  for (char *tok = strtok (list, ","); tok; tok = strtok (nullptr, ","))
+    {
+      char *dir = strchr (tok, ':');
+      if (dir)
+        *dir++ = '\0';
+      if (n_sort_keys == MAX_SORT_KEYS)
+        error (LS_FAILURE, 0, _("too many sort keys: %s"), quote (spec));
+
+      struct sort_key *k = &sort_keys[n_sort_keys++];
+      k->field = XARGMATCH ("--sort", tok, sort_key_args, sort_key_types);
+      if (!dir)
+        k->descending = key_size <= k->field;
+      else if (STREQ (dir, "asc"))
+        k->descending = false;
+      else if (STREQ (dir, "desc"))
+        k->descending = true;
+      else
+        error (LS_FAILURE, 0, _("invalid sort direction %s"), quote (dir));
+    }
+
+  if (!n_sort_keys)
+    error (LS_FAILURE, 0, _("invalid sort key list: %s"), quote (spec));
+  free (list);
 }
 
-static int xstrcoll_ctime(void const *a, void const *b)
+static bool
+sort_keys_need_stat (void)
 {
-    return cmp_ctime(a, b) ? cmp_ctime(a, b) : xstrcoll(((struct fileinfo const *)a)->name, ((struct fileinfo const *)b)->name);
+  for (int i = 0; i < n_sort_keys; i++)
+    if (key_size <= sort_keys[i].field)
+      return true;
+  return false;
 }
 
-static int rev_xstrcoll_ctime(void const *a, void const *b)
+/* Scratch space for building packed keys.  */
+static struct obstack packed_key_obstack;
+
+static void
+pack_u64 (uint64_t v)
 {
-    return cmp_ctime(a, b) ? -cmp_ctime(a, b) : xstrcoll(((struct fileinfo const *)a)->name, ((struct fileinfo const *)b)->name);
-}static int cmp_ctime(const void *a, const void *b) {
-    const struct dirent *da = *(const struct dirent **)a;
-    const struct dirent *db = *(const struct dirent **)b;
-    
-    if (da->d_ctime < db->d_ctime) return -1;
-    if (da->d_ctime > db->d_ctime) return 1;
-    return 0;
+  for (int i = 56; 0 <= i; i -= 8)
+    obstack_1grow (&packed_key_obstack, (v >> i) & 0xff);
 }
 
-static void sort_by_ctime(struct dirent **entries, size_t count) {
-    qsort(entries, count, sizeof(struct dirent *), cmp_ctime);
+static void
+pack_timespec (struct timespec ts)
+{
+  /* Flip the sign bit, so that negative times sort first.  */
+  pack_u64 ((uint64_t) ts.tv_sec ^ ((uint64_t) 1 << 63));
+  for (int i = 24; 0 <= i; i -= 8)
+    obstack_1grow (&packed_key_obstack, (ts.tv_nsec >> i) & 0xff);
 }
 
-static void sort_by_ctime_reverse(struct dirent **entries, size_t count) {
-    qsort(entries, count, sizeof(struct dirent *), cmp_ctime);
-    
-    size_t start = 0;
-    size_t end = count - 1;
-    
-    while (start < end) {
-        struct dirent *temp = entries[start];
-        entries[start] = entries[end];
-        entries[end] = temp;
-        start++;
-        end--;
+/* Append the collation key of S and a terminating null byte, which is
+   less than any byte of a collation key.  */
+
+static void
+pack_string (char const *s)
+{
+  errno = 0;
+  size_t n = strxfrm (nullptr, s, 0);
+  if (!errno)
+    {
+      obstack_blank (&packed_key_obstack, n + 1);
+      char *p = (char *) obstack_next_free (&packed_key_obstack) - (n + 1);
+      if (strxfrm (p, s, n + 1) == n && !errno)
+        return;
+      obstack_blank (&packed_key_obstack, -(n + 1));
     }
-}#define DEFINE_SORT_FUNCTIONS(field_name, cmp_func) \
-static void sort_by_##field_name(void) { \
-    perform_sort(cmp_func); \
-} \
-\
-static void reverse_sort_by_##field_name(void) { \
-    perform_reverse_sort(cmp_func); \
-}
 
-static void perform_sort(int (*cmp_func)(const void *, const void *)) {
-    qsort(entries, entry_count, sizeof(void *), cmp_func);
+  /* strxfrm failed; fall back on byte order, as strcmp would.  */
+  obstack_grow0 (&packed_key_obstack, s, strlen (s));
 }
 
-static void perform_reverse_sort(int (*cmp_func)(const void *, const void *)) {
-    qsort(entries, entry_count, sizeof(void *), cmp_func);
-    reverse_entries();
-}
+/* Set the sort key of F to the concatenation of its --sort keys, each
+   encoded so that comparing the whole with memcmp gives the order of
+   the key list, ties being broken by name.  Directories first and -r
+   are encoded too, so a single comparison function serves all.  */
 
-static void reverse_entries(void) {
-    size_t start = 0;
-    size_t end = entry_count - 1;
-    
-    while (start < end) {
-        void *temp = entries[start];
-        entries[start] = entries[end];
-        entries[end] = temp;
-        start++;
-        end--;
+static void
+make_packed_sortkey (struct fileinfo *f)
+{
+  bool has_name = false;
+  int first = 0;
+
+  if (directories_first)
+    {
+      obstack_1grow (&packed_key_obstack, !is_linked_directory (f));
+      first = 1;
     }
-}
 
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-  void sort_by_##field(void) { \
-    qsort(files, files_index, sizeof(struct fileinfo), cmp_func); \
-  }
+  for (int i = 0; i <= n_sort_keys; i++)
+    {
+      struct sort_key k = { key_name, false };
+      if (i < n_sort_keys)
+        k = sort_keys[i];
+      else if (has_name)
+        break;
+      idx_t start = obstack_object_size (&packed_key_obstack);
 
-DEFINE_SORT_FUNCTIONS(ctime, cmp_ctime)
-#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t nmemb, size_t size) { \
-        qsort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t nmemb, size_t size) { \
-        stable_sort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void partial_sort_##name(void *base, size_t nmemb, size_t k, size_t size) { \
-        partial_sort(base, nmemb, k, size, cmp_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    static int sort_##name##_ascending(const void *a, const void *b) { \
-        return cmp_func(a, b); \
-    } \
-    \
-    static int sort_##name##_descending(const void *a, const void *b) { \
-        return cmp_func(b, a); \
-    }
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static int compare_##name(const void *a, const void *b) { \
-        return compare_func(*(const void **)a, *(const void **)b); \
-    } \
-    \
-    void sort_by_##name(void **array, size_t count) { \
-        if (array != NULL && count > 0) { \
-            qsort(array, count, sizeof(void *), compare_##name); \
-        } \
-    }
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static int sort_##name(const void *a, const void *b) \
-{ \
-    return cmp_func(*(const void **)a, *(const void **)b); \
-} \
-\
-static int sort_##name##_reverse(const void *a, const void *b) \
-{ \
-    return -cmp_func(*(const void **)a, *(const void **)b); \
-}
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-static int sort_##name##_ascending(const void *a, const void *b) \
-{ \
-    return compare_func(a, b); \
-} \
-\
-static int sort_##name##_descending(const void *a, const void *b) \
-{ \
-    return compare_func(b, a); \
-}
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static void sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, compare_func); \
-    } \
-    \
-    static void stable_sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, compare_func); \
-    } \
-    \
-    static int reverse_##name(const void *a, const void *b) { \
-        return -compare_func(a, b); \
-    } \
-    \
-    static void sort_reverse_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, reverse_##name); \
-    }
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    static int sort_##name##_ascending(const void *a, const void *b) { \
-        return cmp_func(a, b); \
-    } \
-    \
-    static int sort_##name##_descending(const void *a, const void *b) { \
-        return cmp_func(b, a); \
-    }
-
-DEFINE_SORT_FUNCTIONS(mtime, cmp_mtime)
-#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static int sort_##name##_ascending(const void *a, const void *b) { \
-        return compare_func(a, b); \
-    } \
-    static int sort_##name##_descending(const void *a, const void *b) { \
-        return compare_func(b, a); \
-    }
-
-DEFINE_SORT_FUNCTIONS(atime, cmp_atime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static int sort_##name##_ascending(const void *a, const void *b) { \
-        return compare_func(a, b); \
-    } \
-    \
-    static int sort_##name##_descending(const void *a, const void *b) { \
-        return compare_func(b, a); \
-    }
-
-DEFINE_SORT_FUNCTIONS(atime, cmp_atime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static int sort_##name##_ascending(const void *a, const void *b) { \
-        return compare_func(a, b); \
-    } \
-    \
-    static int sort_##name##_descending(const void *a, const void *b) { \
-        return compare_func(b, a); \
-    }
-
-DEFINE_SORT_FUNCTIONS(atime, cmp_atime)#define DEFINE_SORT_FUNCTIONS(sort_name, compare_func) \
-static void sort_##sort_name(void *base, size_t n, size_t size) { \
-    qsort(base, n, size, compare_func); \
-} \
-\
-static void* search_##sort_name(const void *key, const void *base, size_t n, size_t size) { \
-    return bsearch(key, base, n, size, compare_func); \
-}
-
-DEFINE_SORT_FUNCTIONS(atime, cmp_atime)static int cmp_atime(const void *a, const void *b) {
-    return ((struct file_info *)a)->atime - ((struct file_info *)b)->atime;
-}
-
-static void swap_atime(void *a, void *b) {
-    struct file_info temp = *(struct file_info *)a;
-    *(struct file_info *)a = *(struct file_info *)b;
-    *(struct file_info *)b = temp;
-}
-
-static void sort_atime(void *base, size_t nmemb, size_t size) {
-    for (size_t i = 0; i < nmemb - 1; i++) {
-        for (size_t j = 0; j < nmemb - i - 1; j++) {
-            void *elem1 = (char *)base + j * size;
-            void *elem2 = (char *)base + (j + 1) * size;
-            if (cmp_atime(elem1, elem2) > 0) {
-                swap_atime(elem1, elem2);
-            }
+      switch (k.field)
+        {
+        case key_name:
+          has_name = true;
+          pack_string (f->name);
+          break;
+        case key_extension:
+          {
+            char const *ext = strrchr (f->name, '.');
+            pack_string (ext ? ext : "");
+          }
+          break;
+        case key_iname:
+        case key_natural:
+          {
+            char *key = make_sortkey (f->name, k.field == key_natural);
+            obstack_grow0 (&packed_key_obstack, key, strlen (key));
+            free (key);
+          }
+          break;
+        case key_width:
+          pack_u64 (fileinfo_name_width (f));
+          break;
+        case key_size:
+          pack_u64 (unsigned_file_size (f->stat.st_size));
+          break;
+        case key_time:
+          {
+            bool btime_ok;
+            pack_timespec (get_file_timestamp (f, &btime_ok));
+          }
+          break;
+        case key_atime:
+          pack_timespec (get_stat_atime (&f->stat));
+          break;
+        case key_mtime:
+          pack_timespec (get_stat_mtime (&f->stat));
+          break;
+        case key_ctime:
+          pack_timespec (get_stat_ctime (&f->stat));
+          break;
+        default:
+          unreachable ();
         }
-    }
-}static int cmp_atime(const void *a, const void *b) {
-    return compare_time_fields(a, b, offsetof(struct file_info, atime));
-}
-
-static void sort_by_atime(struct file_info *files, size_t count) {
-    qsort(files, count, sizeof(struct file_info), cmp_atime);
-}
-
-static struct file_info* sorted_copy_by_atime(const struct file_info *files, size_t count) {
-    struct file_info *sorted = malloc(count * sizeof(struct file_info));
-    if (sorted) {
-        memcpy(sorted, files, count * sizeof(struct file_info));
-        sort_by_atime(sorted, count);
-    }
-    return sorted;
-}DEFINE_SORT_FUNCTIONS(atime, cmp_atime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static void sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, compare_func); \
-    } \
-    \
-    static void stable_sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, compare_func); \
-    } \
-    \
-    static int is_sorted_##name(const void *base, size_t n, size_t size) { \
-        const char *arr = (const char *)base; \
-        for (size_t i = 1; i < n; i++) { \
-            if (compare_func(arr + (i - 1) * size, arr + i * size) > 0) { \
-                return 0; \
-            } \
-        } \
-        return 1; \
-    }
-
-DEFINE_SORT_FUNCTIONS(atime, cmp_atime)
-#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t nmemb, size_t size) { \
-        qsort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t nmemb, size_t size) { \
-        stable_sort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void* bsearch_##name(const void *key, const void *base, size_t nmemb, size_t size) { \
-        return bsearch(key, base, nmemb, size, cmp_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t n, size_t size) { \
-        merge_sort(base, n, size, cmp_func); \
-    } \
-    \
-    void partial_sort_##name(void *base, size_t n, size_t k, size_t size) { \
-        heap_sort_partial(base, n, k, size, cmp_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t n, size_t size) { \
-        qsort(base, n, size, cmp_func); \
-    } \
-    \
-    void partial_sort_##name(void *base, size_t n, size_t k, size_t size) { \
-        if (k > n) k = n; \
-        for (size_t i = 0; i < k; i++) { \
-            size_t min_idx = i; \
-            for (size_t j = i + 1; j < n; j++) { \
-                if (cmp_func((char*)base + j * size, (char*)base + min_idx * size) < 0) { \
-                    min_idx = j; \
-                } \
-            } \
-            if (min_idx != i) { \
-                swap_elements((char*)base + i * size, (char*)base + min_idx * size, size); \
-            } \
-        } \
-    } \
-    \
-    static void swap_elements(void *a, void *b, size_t size) { \
-        char temp[size]; \
-        memcpy(temp, a, size); \
-        memcpy(a, b, size); \
-        memcpy(b, temp, size); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t nmemb, size_t size) { \
-        qsort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t nmemb, size_t size) { \
-        stable_sort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void partial_sort_##name(void *base, size_t nmemb, size_t size, size_t n) { \
-        partial_sort(base, nmemb, size, n, cmp_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    void sort_##name(void *array, size_t count, size_t size) { \
-        qsort(array, count, size, compare_func); \
-    } \
-    \
-    void *find_##name(const void *key, const void *array, size_t count, size_t size) { \
-        return bsearch(key, array, count, size, compare_func); \
-    } \
-    \
-    int is_sorted_##name(const void *array, size_t count, size_t size) { \
-        const char *arr = (const char *)array; \
-        for (size_t i = 1; i < count; i++) { \
-            if (compare_func(arr + (i - 1) * size, arr + i * size) > 0) { \
-                return 0; \
-            } \
-        } \
-        return 1; \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void sort_##name(void *base, size_t nmemb, size_t size) { \
-        qsort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t nmemb, size_t size) { \
-        merge_sort(base, nmemb, size, cmp_func); \
-    } \
-    \
-    void* bsearch_##name(const void *key, const void *base, size_t nmemb, size_t size) { \
-        return bsearch(key, base, nmemb, size, cmp_func); \
-    } \
-    \
-    int is_sorted_##name(const void *base, size_t nmemb, size_t size) { \
-        return is_array_sorted(base, nmemb, size, cmp_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    void sort_##name(void *base, size_t nmemb, size_t size) { \
-        qsort(base, nmemb, size, compare_func); \
-    } \
-    \
-    void stable_sort_##name(void *base, size_t nmemb, size_t size) { \
-        stable_sort_impl(base, nmemb, size, compare_func); \
-    } \
-    \
-    void* bsearch_##name(const void *key, const void *base, size_t nmemb, size_t size) { \
-        return bsearch(key, base, nmemb, size, compare_func); \
-    }
-
-DEFINE_SORT_FUNCTIONS(btime, cmp_btime)DEFINE_SORT_FUNCTIONS (btime, cmp_btime)
-#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char temp; \
-    while (size > 0) { \
-        temp = *pa; \
-        *pa = *pb; \
-        *pb = temp; \
-        pa++; \
-        pb++; \
-        size--; \
-    } \
-} \
-\
-static void sort_##name(void *base, size_t num, size_t size) { \
-    char *arr = (char *)base; \
-    for (size_t i = 0; i < num - 1; i++) { \
-        for (size_t j = 0; j < num - i - 1; j++) { \
-            if (cmp_func(arr + j * size, arr + (j + 1) * size) > 0) { \
-                swap_##name(arr + j * size, arr + (j + 1) * size, size); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define COMPARE_FUNC(name) cmp_##name
-#define SORT_FUNC(name) sort_by_##name
-#define SWAP_FUNC(name) swap_##name##_elements
-
-#define DEFINE_SWAP_FUNCTION(type) \
-static void SWAP_FUNC(type)(void* a, void* b) { \
-    void* temp = a; \
-    a = b; \
-    b = temp; \
-}
-
-#define DEFINE_COMPARISON_FUNCTION(type) \
-static int COMPARE_FUNC(type)(const void* a, const void* b) { \
-    return cmp_size(a, b); \
-}
-
-#define DEFINE_SORT_IMPLEMENTATION(type) \
-static void SORT_FUNC(type)(void* array, size_t count) { \
-    qsort(array, count, sizeof(void*), COMPARE_FUNC(type)); \
-}
-
-#define DEFINE_SORT_FUNCTIONS(type, comparison) \
-    DEFINE_SWAP_FUNCTION(type) \
-    DEFINE_COMPARISON_FUNCTION(type) \
-    DEFINE_SORT_IMPLEMENTATION(type)
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static void sort_##name##_swap(void *a, void *b, size_t size) \
-{ \
-    unsigned char *pa = (unsigned char *)a; \
-    unsigned char *pb = (unsigned char *)b; \
-    unsigned char temp; \
-    size_t i; \
-    for (i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void sort_##name##_heapify(void *base, size_t n, size_t i, size_t size) \
-{ \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp_func(arr + left * size, arr + largest * size) > 0) \
-        largest = left; \
-    \
-    if (right < n && cmp_func(arr + right * size, arr + largest * size) > 0) \
-        largest = right; \
-    \
-    if (largest != i) { \
-        sort_##name##_swap(arr + i * size, arr + largest * size, size); \
-        sort_##name##_heapify(base, n, largest, size); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t nmemb, size_t size) \
-{ \
-    if (nmemb <= 1) \
-        return; \
-    \
-    char *arr = (char *)base; \
-    size_t i; \
-    \
-    for (i = nmemb / 2; i > 0; i--) \
-        sort_##name##_heapify(base, nmemb, i - 1, size); \
-    \
-    for (i = nmemb - 1; i > 0; i--) { \
-        sort_##name##_swap(arr, arr + i * size, size); \
-        sort_##name##_heapify(base, i, 0, size); \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static void swap_##field(void *a, void *b) \
-{ \
-    struct entry *entry_a = (struct entry *)a; \
-    struct entry *entry_b = (struct entry *)b; \
-    struct entry temp = *entry_a; \
-    *entry_a = *entry_b; \
-    *entry_b = temp; \
-} \
-\
-static int partition_##field(void *arr, int low, int high) \
-{ \
-    struct entry *entries = (struct entry *)arr; \
-    struct entry *pivot = &entries[high]; \
-    int i = low - 1; \
-    \
-    for (int j = low; j < high; j++) { \
-        if (cmp_func(&entries[j], pivot) <= 0) { \
-            i++; \
-            swap_##field(&entries[i], &entries[j]); \
-        } \
-    } \
-    swap_##field(&entries[i + 1], &entries[high]); \
-    return i + 1; \
-} \
-\
-static void quicksort_##field(void *arr, int low, int high) \
-{ \
-    if (low < high) { \
-        int pi = partition_##field(arr, low, high); \
-        quicksort_##field(arr, low, pi - 1); \
-        quicksort_##field(arr, pi + 1, high); \
-    } \
-} \
-\
-void sort_by_##field(void *arr, int count) \
-{ \
-    if (count > 1) { \
-        quicksort_##field(arr, 0, count - 1); \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static void swap_##field(void *a, void *b) \
-{ \
-    void *temp = *(void **)a; \
-    *(void **)a = *(void **)b; \
-    *(void **)b = temp; \
-} \
-\
-static void sort_##field(void *base, size_t nmemb) \
-{ \
-    for (size_t i = 0; i < nmemb - 1; i++) { \
-        for (size_t j = 0; j < nmemb - i - 1; j++) { \
-            void **elem1 = (void **)base + j; \
-            void **elem2 = (void **)base + j + 1; \
-            if (cmp_func(*elem1, *elem2) > 0) { \
-                swap_##field(elem1, elem2); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-void swap_##field(void *a, void *b) { \
-    void *temp = *(void **)a; \
-    *(void **)a = *(void **)b; \
-    *(void **)b = temp; \
-} \
-\
-void sort_##field(void **array, size_t count) { \
-    if (count <= 1) return; \
-    \
-    for (size_t i = 0; i < count - 1; i++) { \
-        size_t min_idx = find_min_##field(array, i, count); \
-        if (min_idx != i) { \
-            swap_##field(&array[i], &array[min_idx]); \
-        } \
-    } \
-} \
-\
-size_t find_min_##field(void **array, size_t start, size_t count) { \
-    size_t min_idx = start; \
-    for (size_t j = start + 1; j < count; j++) { \
-        if (cmp_func(array[j], array[min_idx]) < 0) { \
-            min_idx = j; \
-        } \
-    } \
-    return min_idx; \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static void swap_##field(void *a, void *b) { \
-    void *temp = *(void **)a; \
-    *(void **)a = *(void **)b; \
-    *(void **)b = temp; \
-} \
-\
-static int partition_##field(void **arr, int low, int high) { \
-    void *pivot = arr[high]; \
-    int i = low - 1; \
-    \
-    for (int j = low; j < high; j++) { \
-        if (cmp_func(arr[j], pivot) <= 0) { \
-            i++; \
-            swap_##field(&arr[i], &arr[j]); \
-        } \
-    } \
-    swap_##field(&arr[i + 1], &arr[high]); \
-    return i + 1; \
-} \
-\
-static void quicksort_##field(void **arr, int low, int high) { \
-    if (low < high) { \
-        int pi = partition_##field(arr, low, high); \
-        quicksort_##field(arr, low, pi - 1); \
-        quicksort_##field(arr, pi + 1, high); \
-    } \
-} \
-\
-void sort_by_##field(void **arr, int count) { \
-    if (arr != NULL && count > 1) { \
-        quicksort_##field(arr, 0, count - 1); \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)#define DEFINE_SORT_FUNCTIONS(name, compare_func) \
-    static void swap_##name(void *a, void *b, size_t element_size) { \
-        char temp[element_size]; \
-        memcpy(temp, a, element_size); \
-        memcpy(a, b, element_size); \
-        memcpy(b, temp, element_size); \
-    } \
-    \
-    static void bubble_sort_##name(void *array, size_t count, size_t element_size) { \
-        for (size_t i = 0; i < count - 1; i++) { \
-            for (size_t j = 0; j < count - i - 1; j++) { \
-                void *elem1 = (char*)array + j * element_size; \
-                void *elem2 = (char*)array + (j + 1) * element_size; \
-                if (compare_func(elem1, elem2) > 0) { \
-                    swap_##name(elem1, elem2, element_size); \
-                } \
-            } \
-        } \
-    } \
-    \
-    static void quick_sort_##name(void *array, size_t count, size_t element_size) { \
-        if (count <= 1) return; \
-        \
-        size_t pivot = count / 2; \
-        void *pivot_elem = (char*)array + pivot * element_size; \
-        size_t i = 0, j = count - 1; \
-        \
-        while (i <= j) { \
-            while (i < count && compare_func((char*)array + i * element_size, pivot_elem) < 0) i++; \
-            while (j > 0 && compare_func((char*)array + j * element_size, pivot_elem) > 0) j--; \
-            \
-            if (i <= j) { \
-                swap_##name((char*)array + i * element_size, (char*)array + j * element_size, element_size); \
-                i++; \
-                if (j > 0) j--; \
-            } \
-        } \
-        \
-        if (j > 0) quick_sort_##name(array, j + 1, element_size); \
-        if (i < count) quick_sort_##name((char*)array + i * element_size, count - i, element_size); \
-    }
-
-DEFINE_SORT_FUNCTIONS(size, cmp_size)
-#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void swap_##name(void *a, void *b, int size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char temp; \
-    while (size > 0) { \
-        temp = *pa; \
-        *pa = *pb; \
-        *pb = temp; \
-        pa++; \
-        pb++; \
-        size--; \
-    } \
-} \
-\
-static void heapify_##name(void *base, size_t n, size_t i, size_t size) { \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp_name(arr + left * size, arr + largest * size) > 0) \
-        largest = left; \
-    \
-    if (right < n && cmp_name(arr + right * size, arr + largest * size) > 0) \
-        largest = right; \
-    \
-    if (largest != i) { \
-        swap_##name(arr + i * size, arr + largest * size, size); \
-        heapify_##name(base, n, largest, size); \
-    } \
-} \
-\
-static void sort_##name(void *base, size_t n, size_t size) { \
-    char *arr = (char *)base; \
-    \
-    for (int i = n / 2 - 1; i >= 0; i--) \
-        heapify_##name(base, n, i, size); \
-    \
-    for (int i = n - 1; i > 0; i--) { \
-        swap_##name(arr, arr + i * size, size); \
-        heapify_##name(base, i, 0, size); \
-    } \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char temp; \
-    size_t i; \
-    for (i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void heapify_##name(void *base, size_t n, size_t i, size_t size, \
-                           int (*cmp)(const void *, const void *)) { \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp(arr + left * size, arr + largest * size) > 0) \
-        largest = left; \
-    \
-    if (right < n && cmp(arr + right * size, arr + largest * size) > 0) \
-        largest = right; \
-    \
-    if (largest != i) { \
-        swap_##name(arr + i * size, arr + largest * size, size); \
-        heapify_##name(base, n, largest, size, cmp); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t n, size_t size) { \
-    size_t i; \
-    char *arr = (char *)base; \
-    \
-    for (i = n / 2; i > 0; i--) { \
-        heapify_##name(base, n, i - 1, size, cmp_name); \
-    } \
-    \
-    for (i = n - 1; i > 0; i--) { \
-        swap_##name(arr, arr + i * size, size); \
-        heapify_##name(base, i, 0, size, cmp_name); \
-    } \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static int cmp_name##_wrapper(const void *a, const void *b) { \
-    return cmp_name(*(const typeof(*name) *)a, *(const typeof(*name) *)b); \
-} \
-\
-static void name##_sort(typeof(*name) *array, size_t count) { \
-    qsort(array, count, sizeof(*array), cmp_name##_wrapper); \
-} \
-\
-static typeof(*name) *name##_bsearch(const typeof(*name) *key, \
-                                      const typeof(*name) *array, \
-                                      size_t count) { \
-    return bsearch(key, array, count, sizeof(*array), cmp_name##_wrapper); \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static int cmp_name(const void *a, const void *b); \
-\
-static void swap_##name(void *a, void *b, size_t size) { \
-    unsigned char *pa = (unsigned char *)a; \
-    unsigned char *pb = (unsigned char *)b; \
-    unsigned char temp; \
-    \
-    while (size > 0) { \
-        temp = *pa; \
-        *pa = *pb; \
-        *pb = temp; \
-        pa++; \
-        pb++; \
-        size--; \
-    } \
-} \
-\
-static void *partition_##name(void *base, size_t nmemb, size_t size) { \
-    char *pivot = (char *)base + (nmemb - 1) * size; \
-    char *i = (char *)base - size; \
-    char *j; \
-    \
-    for (j = (char *)base; j < pivot; j += size) { \
-        if (cmp_name(j, pivot) <= 0) { \
-            i += size; \
-            swap_##name(i, j, size); \
-        } \
-    } \
-    \
-    i += size; \
-    swap_##name(i, pivot, size); \
-    return i; \
-} \
-\
-static void quicksort_##name(void *base, size_t nmemb, size_t size) { \
-    if (nmemb <= 1) { \
-        return; \
-    } \
-    \
-    char *pivot = (char *)partition_##name(base, nmemb, size); \
-    size_t left_count = (pivot - (char *)base) / size; \
-    size_t right_count = nmemb - left_count - 1; \
-    \
-    quicksort_##name(base, left_count, size); \
-    quicksort_##name(pivot + size, right_count, size); \
-} \
-\
-static void sort_##name(void *base, size_t nmemb, size_t size) { \
-    quicksort_##name(base, nmemb, size); \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char temp; \
-    while (size > 0) { \
-        temp = *pa; \
-        *pa = *pb; \
-        *pb = temp; \
-        pa++; \
-        pb++; \
-        size--; \
-    } \
-} \
-\
-static void heapify_##name(void *base, size_t nmemb, size_t size, size_t i) { \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < nmemb && cmp_name(arr + left * size, arr + largest * size) > 0) { \
-        largest = left; \
-    } \
-    \
-    if (right < nmemb && cmp_name(arr + right * size, arr + largest * size) > 0) { \
-        largest = right; \
-    } \
-    \
-    if (largest != i) { \
-        swap_##name(arr + i * size, arr + largest * size, size); \
-        heapify_##name(base, nmemb, size, largest); \
-    } \
-} \
-\
-static void build_heap_##name(void *base, size_t nmemb, size_t size) { \
-    if (nmemb == 0) return; \
-    for (size_t i = nmemb / 2; i > 0; i--) { \
-        heapify_##name(base, nmemb, size, i - 1); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t nmemb, size_t size) { \
-    if (nmemb <= 1) return; \
-    \
-    char *arr = (char *)base; \
-    build_heap_##name(base, nmemb, size); \
-    \
-    for (size_t i = nmemb - 1; i > 0; i--) { \
-        swap_##name(arr, arr + i * size, size); \
-        heapify_##name(base, i, size, 0); \
-    } \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void swap_##name(void *a, void *b, int size) { \
-    char temp; \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    for (int i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void heapify_##name(void *base, size_t n, size_t i, size_t size) { \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp_name(arr + left * size, arr + largest * size) > 0) { \
-        largest = left; \
-    } \
-    \
-    if (right < n && cmp_name(arr + right * size, arr + largest * size) > 0) { \
-        largest = right; \
-    } \
-    \
-    if (largest != i) { \
-        swap_##name(arr + i * size, arr + largest * size, size); \
-        heapify_##name(base, n, largest, size); \
-    } \
-} \
-\
-static void build_heap_##name(void *base, size_t n, size_t size) { \
-    for (int i = n / 2 - 1; i >= 0; i--) { \
-        heapify_##name(base, n, i, size); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t n, size_t size) { \
-    build_heap_##name(base, n, size); \
-    char *arr = (char *)base; \
-    \
-    for (size_t i = n - 1; i > 0; i--) { \
-        swap_##name(arr, arr + i * size, size); \
-        heapify_##name(base, i, 0, size); \
-    } \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void name##_swap(void *a, void *b, size_t size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char temp; \
-    size_t i; \
-    for (i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void name##_heapify(void *base, size_t nmemb, size_t size, \
-                           size_t root, int (*cmp)(const void *, const void *)) { \
-    size_t largest = root; \
-    size_t left = 2 * root + 1; \
-    size_t right = 2 * root + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < nmemb && cmp(arr + left * size, arr + largest * size) > 0) \
-        largest = left; \
-    \
-    if (right < nmemb && cmp(arr + right * size, arr + largest * size) > 0) \
-        largest = right; \
-    \
-    if (largest != root) { \
-        name##_swap(arr + root * size, arr + largest * size, size); \
-        name##_heapify(base, nmemb, size, largest, cmp); \
-    } \
-} \
-\
-static void name##_build_heap(void *base, size_t nmemb, size_t size, \
-                              int (*cmp)(const void *, const void *)) { \
-    if (nmemb <= 1) return; \
-    size_t i; \
-    for (i = nmemb / 2; i > 0; i--) { \
-        name##_heapify(base, nmemb, size, i - 1, cmp); \
-    } \
-} \
-\
-void name##_sort(void *base, size_t nmemb, size_t size) { \
-    if (nmemb <= 1) return; \
-    \
-    name##_build_heap(base, nmemb, size, cmp_name); \
-    \
-    size_t i; \
-    for (i = nmemb - 1; i > 0; i--) { \
-        name##_swap(base, (char *)base + i * size, size); \
-        name##_heapify(base, i, size, 0, cmp_name); \
-    } \
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_name) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    char tmp; \
-    for (size_t i = 0; i < size; i++) { \
-        tmp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = tmp; \
-    } \
-} \
-\
-static void *find_min_##name(void *start, size_t n, size_t size, \
-                             int (*cmp)(const void *, const void *)) { \
-    void *min = start; \
-    char *current = (char *)start; \
-    for (size_t i = 1; i < n; i++) { \
-        current += size; \
-        if (cmp(current, min) < 0) { \
-            min = current; \
-        } \
-    } \
-    return min; \
-} \
-\
-static void heapify_##name(void *base, size_t size, size_t n, size_t i, \
-                           int (*cmp)(const void *, const void *)) { \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp(arr + left * size, arr + largest * size) > 0) { \
-        largest = left; \
-    } \
-    \
-    if (right < n && cmp(arr + right * size, arr + largest * size) > 0) { \
-        largest = right; \
-    } \
-    \
-    if (largest != i) { \
-        swap_##name(arr + i * size, arr + largest * size, size); \
-        heapify_##name(base, size, n, largest, cmp); \
-    } \
-} \
-\
-static void build_heap_##name(void *base, size_t size, size_t n, \
-                              int (*cmp)(const void *, const void *)) { \
-    for (int i = n / 2 - 1; i >= 0; i--) { \
-        heapify_##name(base, size, n, i, cmp); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t n, size_t size) { \
-    if (n <= 1) return; \
-    \
-    build_heap_##name(base, size, n, cmp_name); \
-    \
-    char *arr = (char *)base; \
-    for (size_t i = n - 1; i > 0; i--) { \
-        swap_##name(arr, arr + i * size, size); \
-        heapify_##name(base, size, i, 0, cmp_name); \
-    } \
-}
-#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    void swap_##name(void *a, void *b, size_t size) { \
-        char *pa = (char *)a; \
-        char *pb = (char *)b; \
-        for (size_t i = 0; i < size; i++) { \
-            char temp = pa[i]; \
-            pa[i] = pb[i]; \
-            pb[i] = temp; \
-        } \
-    } \
-    \
-    void sort_##name(void *base, size_t num, size_t size) { \
-        char *arr = (char *)base; \
-        for (size_t i = 0; i < num - 1; i++) { \
-            for (size_t j = 0; j < num - i - 1; j++) { \
-                if (cmp_func(arr + j * size, arr + (j + 1) * size) > 0) { \
-                    swap_##name(arr + j * size, arr + (j + 1) * size, size); \
-                } \
-            } \
-        } \
-    }
-
-DEFINE_SORT_FUNCTIONS(extension, cmp_extension)#define SWAP(a, b) do { \
-    typeof(a) temp = (a); \
-    (a) = (b); \
-    (b) = temp; \
-} while(0)
-
-static void heapify_extension(void *base, size_t nmemb, size_t size, 
-                              size_t parent, int (*cmp)(const void *, const void *)) {
-    size_t largest = parent;
-    size_t left = 2 * parent + 1;
-    size_t right = 2 * parent + 2;
-    
-    char *arr = (char *)base;
-    
-    if (left < nmemb && cmp(arr + left * size, arr + largest * size) > 0) {
-        largest = left;
-    }
-    
-    if (right < nmemb && cmp(arr + right * size, arr + largest * size) > 0) {
-        largest = right;
-    }
-    
-    if (largest != parent) {
-        for (size_t i = 0; i < size; i++) {
-            SWAP(arr[parent * size + i], arr[largest * size + i]);
+
+      if (k.descending)
+        {
+          unsigned char *p = obstack_base (&packed_key_obstack);
+          for (idx_t j = start; j < obstack_object_size (&packed_key_obstack);
+               j++)
+            p[j] = ~p[j];
         }
-        heapify_extension(base, nmemb, size, largest, cmp);
     }
-}
 
-static void build_heap_extension(void *base, size_t nmemb, size_t size,
-                                 int (*cmp)(const void *, const void *)) {
-    if (nmemb <= 1) return;
-    
-    for (ssize_t i = nmemb / 2 - 1; i >= 0; i--) {
-        heapify_extension(base, nmemb, size, i, cmp);
-    }
+  idx_t len = obstack_object_size (&packed_key_obstack);
+  unsigned char *key = obstack_finish (&packed_key_obstack);
+  if (sort_reverse)
+    for (idx_t j = first; j < len; j++)
+      key[j] = ~key[j];
+  f->sortkey = ximemdup (key, len);
+  f->sortkey_len = len;
+  obstack_free (&packed_key_obstack, key);
 }
 
-void sort_extension(void *base, size_t nmemb, size_t size) {
-    if (nmemb <= 1) return;
-    
-    build_heap_extension(base, nmemb, size, cmp_extension);
-    
-    char *arr = (char *)base;
-    
-    for (size_t i = nmemb - 1; i > 0; i--) {
-        for (size_t j = 0; j < size; j++) {
-            SWAP(arr[j], arr[i * size + j]);
-        }
-        heapify_extension(base, i, size, 0, cmp_extension);
-    }
-}#define SWAP(a, b, type) do { type temp = (a); (a) = (b); (b) = temp; } while(0)
-
-#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static void sort_##name##_swap(void *a, void *b, size_t size) \
-{ \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    while (size > 0) { \
-        SWAP(*pa, *pb, char); \
-        pa++; \
-        pb++; \
-        size--; \
-    } \
-} \
-\
-static void sort_##name##_heapify(void *base, size_t n, size_t i, size_t size, \
-                                   int (*cmp)(const void *, const void *)) \
-{ \
-    size_t largest = i; \
-    size_t left = 2 * i + 1; \
-    size_t right = 2 * i + 2; \
-    char *arr = (char *)base; \
-    \
-    if (left < n && cmp(arr + left * size, arr + largest * size) > 0) \
-        largest = left; \
-    \
-    if (right < n && cmp(arr + right * size, arr + largest * size) > 0) \
-        largest = right; \
-    \
-    if (largest != i) { \
-        sort_##name##_swap(arr + i * size, arr + largest * size, size); \
-        sort_##name##_heapify(base, n, largest, size, cmp); \
-    } \
-} \
-\
-void sort_##name(void *base, size_t n, size_t size) \
-{ \
-    char *arr = (char *)base; \
-    \
-    for (int i = n / 2 - 1; i >= 0; i--) \
-        sort_##name##_heapify(base, n, i, size, cmp_func); \
-    \
-    for (int i = n - 1; i > 0; i--) { \
-        sort_##name##_swap(arr, arr + i * size, size); \
-        sort_##name##_heapify(base, i, 0, size, cmp_func); \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(extension, cmp_extension)DEFINE_SORT_FUNCTIONS(extension, cmp_extension)static void swap_extension(void *a, void *b, int size)
-{
-    char temp[size];
-    memcpy(temp, a, size);
-    memcpy(a, b, size);
-    memcpy(b, temp, size);
-}
-
-static void sort_extension(void *base, size_t nmemb, size_t size)
-{
-    char *arr = (char *)base;
-    for (size_t i = 0; i < nmemb - 1; i++) {
-        for (size_t j = 0; j < nmemb - i - 1; j++) {
-            if (cmp_extension(arr + j * size, arr + (j + 1) * size) > 0) {
-                swap_extension(arr + j * size, arr + (j + 1) * size, size);
-            }
-        }
-    }
-}
+/* Give F the key that the current sort compares, if the sort uses
+   precomputed keys and F lacks one.  */
 
-static void qsort_extension(void *base, size_t nmemb, size_t size)
-{
-    qsort(base, nmemb, size, cmp_extension);
-}#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    unsigned char *pa = a; \
-    unsigned char *pb = b; \
-    unsigned char temp; \
-    size_t i; \
-    for (i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void sort_##name(void *base, size_t num, size_t size) { \
-    char *arr = base; \
-    size_t i, j; \
-    for (i = 0; i < num - 1; i++) { \
-        for (j = 0; j < num - i - 1; j++) { \
-            if (cmp_func(arr + j * size, arr + (j + 1) * size) > 0) { \
-                swap_##name(arr + j * size, arr + (j + 1) * size, size); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(extension, cmp_extension)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-static void swap_##name(void *a, void *b, size_t size) { \
-    char temp; \
-    char *pa = (char *)a; \
-    char *pb = (char *)b; \
-    for (size_t i = 0; i < size; i++) { \
-        temp = pa[i]; \
-        pa[i] = pb[i]; \
-        pb[i] = temp; \
-    } \
-} \
-\
-static void sort_##name(void *base, size_t num, size_t size) { \
-    char *arr = (char *)base; \
-    for (size_t i = 0; i < num - 1; i++) { \
-        for (size_t j = 0; j < num - i - 1; j++) { \
-            if (cmp_func(arr + j * size, arr + (j + 1) * size) > 0) { \
-                swap_##name(arr + j * size, arr + (j + 1) * size, size); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(extension, cmp_extension)#define DEFINE_SORT_FUNCTIONS(name, cmp_func) \
-    static void swap_##name(void *a, void *b, size_t size) { \
-        char temp[size]; \
-        memcpy(temp, a, size); \
-        memcpy(a, b, size); \
-        memcpy(b, temp, size); \
-    } \
-    \
-    static void sort_##name(void *base, size_t num, size_t size) { \
-        for (size_t i = 0; i < num - 1; i++) { \
-            for (size_t j = 0; j < num - i - 1; j++) { \
-                void *elem1 = (char *)base + j * size; \
-                void *elem2 = (char *)base + (j + 1) * size; \
-                if (cmp_func(elem1, elem2) > 0) { \
-                    swap_##name(elem1, elem2, size); \
-                } \
-            } \
-        } \
-    }
-
-DEFINE_SORT_FUNCTIONS(extension, cmp_extension)
-#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static int cmp_func(const void *a, const void *b) { \
-    return compare_field(a, b, offsetof(struct item, field)); \
-} \
-\
-static void sort_by_##field(struct item *items, size_t count) { \
-    qsort(items, count, sizeof(struct item), cmp_func); \
-}
-
-static int compare_field(const void *a, const void *b, size_t offset) {
-    const struct item *item_a = (const struct item *)a;
-    const struct item *item_b = (const struct item *)b;
-    int *field_a = (int *)((char *)item_a + offset);
-    int *field_b = (int *)((char *)item_b + offset);
-    
-    if (*field_a < *field_b) return -1;
-    if (*field_a > *field_b) return 1;
-    return 0;
-}
+static void
+ensure_sortkey (struct fileinfo *f)
+{
+  static bool initialized;
 
-DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-    void swap_##field(void *a, void *b, size_t size) { \
-        char temp[size]; \
-        memcpy(temp, a, size); \
-        memcpy(a, b, size); \
-        memcpy(b, temp, size); \
-    } \
-    \
-    void sort_##field(void *base, size_t num, size_t size) { \
-        for (size_t i = 0; i < num - 1; i++) { \
-            for (size_t j = 0; j < num - i - 1; j++) { \
-                void *elem1 = (char *)base + j * size; \
-                void *elem2 = (char *)base + (j + 1) * size; \
-                if (cmp_func(elem1, elem2) > 0) { \
-                    swap_##field(elem1, elem2, size); \
-                } \
-            } \
-        } \
-    }
-
-DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func)                              \
-static void swap_##field(void *a, void *b, size_t size) {                   \
-    char temp[size];                                                         \
-    memcpy(temp, a, size);                                                   \
-    memcpy(a, b, size);                                                      \
-    memcpy(b, temp, size);                                                   \
-}                                                                            \
-                                                                             \
-static void sort_##field(void *base, size_t num, size_t size) {            \
-    for (size_t i = 0; i < num - 1; i++) {                                  \
-        size_t min_idx = i;                                                  \
-        for (size_t j = i + 1; j < num; j++) {                              \
-            void *elem_j = (char *)base + j * size;                         \
-            void *elem_min = (char *)base + min_idx * size;                 \
-            if (cmp_func(elem_j, elem_min) < 0) {                           \
-                min_idx = j;                                                 \
-            }                                                                \
-        }                                                                    \
-        if (min_idx != i) {                                                 \
-            void *elem_i = (char *)base + i * size;                         \
-            void *elem_min = (char *)base + min_idx * size;                 \
-            swap_##field(elem_i, elem_min, size);                           \
-        }                                                                    \
-    }                                                                        \
-}
-
-DEFINE_SORT_FUNCTIONS(width, cmp_width)DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static void swap_##field(void *a, void *b, size_t size) { \
-    char temp[size]; \
-    memcpy(temp, a, size); \
-    memcpy(a, b, size); \
-    memcpy(b, temp, size); \
-} \
-\
-static void sort_##field(void *base, size_t num, size_t size) { \
-    for (size_t i = 0; i < num - 1; i++) { \
-        for (size_t j = 0; j < num - i - 1; j++) { \
-            void *elem1 = (char *)base + j * size; \
-            void *elem2 = (char *)base + (j + 1) * size; \
-            if (cmp_func(elem1, elem2) > 0) { \
-                swap_##field(elem1, elem2, size); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static void swap_##field(void *a, void *b, size_t size) { \
-    char temp[size]; \
-    memcpy(temp, a, size); \
-    memcpy(a, b, size); \
-    memcpy(b, temp, size); \
-} \
-\
-static void sort_##field(void *base, size_t num, size_t size) { \
-    for (size_t i = 0; i < num - 1; i++) { \
-        for (size_t j = 0; j < num - i - 1; j++) { \
-            void *elem1 = (char*)base + j * size; \
-            void *elem2 = (char*)base + (j + 1) * size; \
-            if (cmp_func(elem1, elem2) > 0) { \
-                swap_##field(elem1, elem2, size); \
-            } \
-        } \
-    } \
-}
-
-DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-static int cmp_func(const void *a, const void *b) { \
-    return compare_##field(a, b); \
-} \
-\
-static void sort_by_##field(void *array, size_t count, size_t size) { \
-    qsort(array, count, size, cmp_func); \
-} \
-\
-static int compare_##field(const void *a, const void *b) { \
-    const struct item *item_a = (const struct item *)a; \
-    const struct item *item_b = (const struct item *)b; \
-    if (item_a->field < item_b->field) return -1; \
-    if (item_a->field > item_b->field) return 1; \
-    return 0; \
-}
-
-DEFINE_SORT_FUNCTIONS(width, cmp_width)#define DEFINE_SORT_FUNCTIONS(field, cmp_func) \
-    void sort_by_##field(void *array, size_t count, size_t size) { \
-        qsort(array, count, size, cmp_func); \
-    } \
-    \
-    void stable_sort_by_##field(void *array, size_t count, size_t size) { \
-        merge_sort(array, count, size, cmp_func); \
-    } \
-    \
-    void* find_min_##field(void *array, size_t count, size_t size) { \
-        return find_element(array, count, size, cmp_func, -1); \
-    } \
-    \
-    void* find_max_##field(void *array, size_t count, size_t size) { \
-        return find_element(array, count, size, cmp_func, 1); \
-    }
-
-static void* find_element(void *array, size_t count, size_t size, 
-                          int (*cmp)(const void*, const void*), int direction) {
-    if (count == 0) return NULL;
-    
-    void *result = array;
-    for (size_t i = 1; i < count; i++) {
-        void *current = (char*)array + i * size;
-        if (cmp(current, result) * direction > 0) {
-            result = current;
+  if (f->sortkey)
+    return;
+
+  if (sort_type == sort_iname || sort_type == sort_natural)
+    f->sortkey = make_sortkey (f->name, sort_type == sort_natural);
+  else if (sort_type == sort_multi)
+    {
+      if (!initialized)
+        {
+          obstack_init (&packed_key_obstack);
+          initialized = true;
         }
+      make_packed_sortkey (f);
     }
-    return result;
 }
 
-static void merge_sort(void *array, size_t count, size_t size,
-                      int (*cmp)(const void*, const void*)) {
-    if (count <= 1) return;
-    
-    size_t mid = count / 2;
-    void *temp = malloc(count * size);
-    if (!temp) return;
-    
-    merge_sort(array, mid, size, cmp);
-    merge_sort((char*)array + mid * size, count - mid, size, cmp);
-    merge_arrays(array, mid, count - mid, size, cmp, temp);
-    
-    memcpy(array, temp, count * size);
-    free(temp);
-}
+/* Compute the packed keys of the files now in the table that lack
+   one.  */
 
-static void merge_arrays(void *array, size_t left_count, size_t right_count,
-                        size_t size, int (*cmp)(const void*, const void*), void *temp) {
-    void *left = array;
-    void *right = (char*)array + left_count * size;
-    size_t i = 0, j = 0, k = 0;
-    
-    while (i < left_count && j < right_count) {
-        void *left_elem = (char*)left + i * size;
-        void *right_elem = (char*)right + j * size;
-        
-        if (cmp(left_elem, right_elem) <= 0) {
-            memcpy((char*)temp + k * size, left_elem, size);
-            i++;
-        } else {
-            memcpy((char*)temp + k * size, right_elem, size);
-            j++;
-        }
-        k++;
-    }
-    
-    copy_remaining(temp, left, size, i, left_count, k);
-    copy_remaining(temp, right, size, j, right_count, k + left_count - i);
+static void
+update_packed_sortkeys (void)
+{
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    ensure_sortkey (sorted_file[i]);
 }
 
-static void copy_remaining(void *dest, void *src, size_t size, 
-                           size_t start, size_t end, size_t dest_start) {
-    while (start < end) {
-        memcpy((char*)dest + dest_start * size, (char*)src + start * size, size);
-        start++;
-        dest_start++;
-    }
+/* Compare packed keys.  Every variant of the sort is encoded in the
+   keys themselves.  */
+static int
+cmp_packed (V a, V b)
+{
+  struct fileinfo const *fa = a;
+  struct fileinfo const *fb = b;
+  int diff = memcmp (fa->sortkey, fb->sortkey,
+                     MIN (fa->sortkey_len, fb->sortkey_len));
+  return diff ? diff : _GL_CMP (fa->sortkey_len, fb->sortkey_len);
 }
 
-DEFINE_SORT_FUNCTIONS(width, cmp_width)
-
-/* Compare file versions.
-   Unlike the other compare functions, cmp_version does not fail
-   because filevercmp and strcmp do not fail; cmp_version uses strcmp
-   instead of xstrcoll because filevercmp is locale-independent so
-   strcmp is its appropriate secondary.
-
-   All the other sort options need xstrcoll and strcmp variants,
-   because they all use xstrcoll (either as the primary or secondary
-   sort key), and xstrcoll has the ability to do a longjmp if strcoll fails for
-   locale reasons.  */
+/* Compare precomputed sort keys, breaking ties with strcmp so that
+   the order does not depend on the locale.  Like cmp_version, this
+   never fails.  */
 static int
-cmp_version (struct fileinfo const *a, struct fileinfo const *b)
+cmp_sortkey (struct fileinfo const *a, struct fileinfo const *b)
 {
-  int diff = filevercmp (a->name, b->name);
+  int diff = strcmp (a->sortkey, b->sortkey);
   return diff ? diff : strcmp (a->name, b->name);
 }
 
 static int
-xstrcoll_version (V a, V b)
+xstrcoll_sortkey (V a, V b)
 {
-  return cmp_version (a, b);
+  return cmp_sortkey (a, b);
 }
 static int
-rev_xstrcoll_version (V a, V b)
+rev_xstrcoll_sortkey (V a, V b)
 {
-  return cmp_version (b, a);
+  return cmp_sortkey (b, a);
 }
 static int
-xstrcoll_df_version (V a, V b)
+xstrcoll_df_sortkey (V a, V b)
 {
-  return dirfirst_check (a, b, xstrcoll_version);
+  return dirfirst_check (a, b, xstrcoll_sortkey);
 }
 static int
-rev_xstrcoll_df_version (V a, V b)
+rev_xstrcoll_df_sortkey (V a, V b)
 {
-  return dirfirst_check (a, b, rev_xstrcoll_version);
+  return dirfirst_check (a, b, rev_xstrcoll_sortkey);
 }
 
 
@@ -5659,6 +8299,20 @@ rev_xstrcoll_df_version (V a, V b)
     }                                                               \
   }
 
+/* Likewise, for keys like version that never need the strcmp
+   fallback.  */
+#define LIST_LOCALE_FREE_SORTFUNCTION_VARIANTS(key_name)            \
+  {                                                                 \
+    {                                                               \
+      { xstrcoll_##key_name, xstrcoll_df_##key_name },              \
+      { rev_xstrcoll_##key_name, rev_xstrcoll_df_##key_name },      \
+    },                                                              \
+    {                                                               \
+      { nullptr, nullptr },                                         \
+      { nullptr, nullptr },                                         \
+    }                                                               \
+  }
+
 static qsortFunc const sort_functions[][2][2][2] =
   {
     LIST_SORTFUNCTION_VARIANTS (name),
@@ -5682,6 +8336,22 @@ static qsortFunc const sort_functions[][2][2][2] =
       }
     },
 
+    /* iname and natural differ only in their keys.  */
+    LIST_LOCALE_FREE_SORTFUNCTION_VARIANTS (sortkey),
+    LIST_LOCALE_FREE_SORTFUNCTION_VARIANTS (sortkey),
+
+    /* Packed keys already encode -r and --group-directories-first.  */
+    {
+      {
+        { cmp_packed, cmp_packed },
+        { cmp_packed, cmp_packed },
+      },
+      {
+        { nullptr, nullptr },
+        { nullptr, nullptr },
+      }
+    },
+
     /* last are time sort functions */
     LIST_SORTFUNCTION_VARIANTS (mtime),
     LIST_SORTFUNCTION_VARIANTS (ctime),
@@ -5701,6 +8371,156 @@ static qsortFunc const sort_functions[][2][2][2] =
 static_assert (ARRAY_CARDINALITY (sort_functions)
                == sort_numtypes - 2 + time_numtypes);
 
+/* Sort the N pointers in BASE with CMP, using TMP (room for another N
+   pointers) as scratch.  This is a stable bottom-up merge sort: runs
+   of four are insertion sorted in place, and then merged pairwise back
+   and forth between BASE and TMP.  It is always inlined, so that each
+   sort_* function below gets its own copy with CMP, and the key
+   comparison and name tiebreak that CMP inlines in turn, folded into
+   the merge loop instead of being reached through function pointers.  */
+
+ATTRIBUTE_ALWAYS_INLINE static inline void
+inline_sort_files (void **base, idx_t n, void **tmp, qsortFunc cmp)
+{
+  enum { RUN = 4 };
+
+  for (idx_t lo = 0; lo < n; lo += RUN)
+    {
+      idx_t hi = MIN (lo + RUN, n);
+      for (idx_t i = lo + 1; i < hi; i++)
+        {
+          void *v = base[i];
+          idx_t j = i;
+          for (; lo < j && 0 < cmp (base[j - 1], v); j--)
+            base[j] = base[j - 1];
+          base[j] = v;
+        }
+    }
+
+  void **src = base;
+  void **dst = tmp;
+  for (idx_t width = RUN; width < n; width *= 2)
+    {
+      for (idx_t lo = 0; lo < n; lo += 2 * width)
+        {
+          idx_t mid = MIN (lo + width, n);
+          idx_t hi = MIN (lo + 2 * width, n);
+          idx_t i = lo, j = mid, k = lo;
+
+          /* Already in order; a common case for directories read
+             back in the order they were created.  */
+          if (mid == hi || cmp (src[mid - 1], src[mid]) <= 0)
+            {
+              memcpy (dst + lo, src + lo, (hi - lo) * sizeof *src);
+              continue;
+            }
+
+          while (i < mid && j < hi)
+            dst[k++] = cmp (src[j], src[i]) < 0 ? src[j++] : src[i++];
+          memcpy (dst + k, src + i, (mid - i) * sizeof *src);
+          k += mid - i;
+          memcpy (dst + k, src + j, (hi - j) * sizeof *src);
+        }
+      void **t = src;
+      src = dst;
+      dst = t;
+    }
+
+  if (src != base)
+    memcpy (base, src, n * sizeof *base);
+}
+
+/* Define sort_CMP_FUNC, the sort specialized for CMP_FUNC, and the
+   same for each of the 8 variants of KEY_NAME (4 for keys that never
+   need the strcmp fallback), mirroring the sort_functions entries.  */
+#define DEFINE_INLINE_SORT(cmp_func)                                \
+  static void                                                       \
+  sort_##cmp_func (void **base, idx_t n, void **tmp)                \
+  { inline_sort_files (base, n, tmp, cmp_func); }
+
+#define DEFINE_LOCALE_FREE_INLINE_SORTS(key_name)                   \
+  DEFINE_INLINE_SORT (xstrcoll_##key_name)                          \
+  DEFINE_INLINE_SORT (rev_xstrcoll_##key_name)                      \
+  DEFINE_INLINE_SORT (xstrcoll_df_##key_name)                       \
+  DEFINE_INLINE_SORT (rev_xstrcoll_df_##key_name)
+
+#define DEFINE_INLINE_SORTS(key_name)                               \
+  DEFINE_LOCALE_FREE_INLINE_SORTS (key_name)                        \
+  DEFINE_INLINE_SORT (strcmp_##key_name)                            \
+  DEFINE_INLINE_SORT (rev_strcmp_##key_name)                        \
+  DEFINE_INLINE_SORT (strcmp_df_##key_name)                         \
+  DEFINE_INLINE_SORT (rev_strcmp_df_##key_name)
+
+DEFINE_INLINE_SORTS (name)
+DEFINE_INLINE_SORTS (extension)
+DEFINE_INLINE_SORTS (width)
+DEFINE_INLINE_SORTS (size)
+DEFINE_LOCALE_FREE_INLINE_SORTS (version)
+DEFINE_LOCALE_FREE_INLINE_SORTS (sortkey)
+DEFINE_INLINE_SORT (cmp_packed)
+DEFINE_INLINE_SORTS (mtime)
+DEFINE_INLINE_SORTS (ctime)
+DEFINE_INLINE_SORTS (atime)
+DEFINE_INLINE_SORTS (btime)
+
+typedef void (*sortFunc) (void **base, idx_t n, void **tmp);
+
+#define LIST_INLINE_SORT_VARIANTS(key_name)                         \
+  {                                                                 \
+    {                                                               \
+      { sort_xstrcoll_##key_name, sort_xstrcoll_df_##key_name },    \
+      { sort_rev_xstrcoll_##key_name,                               \
+        sort_rev_xstrcoll_df_##key_name },                          \
+    },                                                              \
+    {                                                               \
+      { sort_strcmp_##key_name, sort_strcmp_df_##key_name },        \
+      { sort_rev_strcmp_##key_name, sort_rev_strcmp_df_##key_name },\
+    }                                                               \
+  }
+
+#define LIST_LOCALE_FREE_INLINE_SORT_VARIANTS(key_name)             \
+  {                                                                 \
+    {                                                               \
+      { sort_xstrcoll_##key_name, sort_xstrcoll_df_##key_name },    \
+      { sort_rev_xstrcoll_##key_name,                               \
+        sort_rev_xstrcoll_df_##key_name },                          \
+    },                                                              \
+    {                                                               \
+      { nullptr, nullptr },                                         \
+      { nullptr, nullptr },                                         \
+    }                                                               \
+  }
+
+/* The specialized sorts, indexed exactly like sort_functions, which
+   remains the table to use when a single comparison is needed.  */
+static sortFunc const inline_sort_functions[][2][2][2] =
+  {
+    LIST_INLINE_SORT_VARIANTS (name),
+    LIST_INLINE_SORT_VARIANTS (extension),
+    LIST_INLINE_SORT_VARIANTS (width),
+    LIST_INLINE_SORT_VARIANTS (size),
+    LIST_LOCALE_FREE_INLINE_SORT_VARIANTS (version),
+    LIST_LOCALE_FREE_INLINE_SORT_VARIANTS (sortkey),
+    LIST_LOCALE_FREE_INLINE_SORT_VARIANTS (sortkey),
+    {
+      {
+        { sort_cmp_packed, sort_cmp_packed },
+        { sort_cmp_packed, sort_cmp_packed },
+      },
+      {
+        { nullptr, nullptr },
+        { nullptr, nullptr },
+      }
+    },
+    LIST_INLINE_SORT_VARIANTS (mtime),
+    LIST_INLINE_SORT_VARIANTS (ctime),
+    LIST_INLINE_SORT_VARIANTS (atime),
+    LIST_INLINE_SORT_VARIANTS (btime)
+  };
+
+static_assert (ARRAY_CARDINALITY (inline_sort_functions)
+               == ARRAY_CARDINALITY (sort_functions));
+
 /* Set up SORTED_FILE to point to the in-use entries in CWD_FILE, in order.  */
 
 static void initialize_ordering_vector(void)
@@ -5734,56 +8554,284 @@ calculate_all_file_widths (void)
 {
   for (idx_t i = 0; i < cwd_n_used; i++)
     {
-      struct fileinfo *f = sorted_file[i];
-      f->width = fileinfo_name_width (f);
+      struct fileinfo *f = sorted_file[i];
+      f->width = fileinfo_name_width (f);
+    }
+}
+
+/* Sort the files now in the table.  */
+
+static void grow_sorted_file_buffer_if_needed(void)
+{
+    /* Sorting needs room for a second copy of the vector.  */
+    if (sorted_file_alloc < 2 * cwd_n_used)
+    {
+        free(sorted_file);
+        sorted_file = xinmalloc(cwd_n_used, 3 * sizeof *sorted_file);
+        sorted_file_alloc = 3 * cwd_n_used;
+    }
+}
+
+static bool try_strcoll_with_fallback(void)
+{
+    if (!setjmp(failed_strcoll))
+        return false;
+    
+    affirm(sort_type != sort_version && sort_type != sort_iname
+           && sort_type != sort_natural && sort_type != sort_multi);
+    initialize_ordering_vector();
+    return true;
+}
+
+static int get_sort_function_index(void)
+{
+    if (sort_type == sort_time)
+        return sort_type + time_type;
+    return sort_type;
+}
+
+static void sort_files(void)
+{
+    bool use_strcmp;
+    enum ls_phase prev_phase = phase_enter(PHASE_SORT);
+
+    grow_sorted_file_buffer_if_needed();
+    initialize_ordering_vector();
+    update_current_files_info();
+
+    if (plan.sort)
+    {
+        use_strcmp = try_strcoll_with_fallback();
+
+        if (sort_type == sort_iname || sort_type == sort_natural)
+            update_sortkeys();
+        else if (sort_type == sort_multi)
+            update_packed_sortkeys();
+
+        int sort_index = get_sort_function_index();
+        inline_sort_functions[sort_index][use_strcmp][sort_reverse]
+                             [directories_first] (sorted_file, cwd_n_used,
+                                                  sorted_file + cwd_n_used);
+    }
+
+    phase_leave(prev_phase);
+}
+
+/* For --after, the file that the page must sort after, and the
+   comparison function of the active sort.  PAGE_AFTER_CMP compares
+   entries with that file; it is PAGE_CMP, or a name comparison if the
+   file could not be stat'ed and the sort needs its metadata.  */
+static struct fileinfo page_after_file;
+static bool page_after_valid;
+static qsortFunc page_cmp;
+static qsortFunc page_after_cmp;
+
+/* Set the comparison functions of the paged listing, comparing names
+   with strcmp if USE_STRCMP, else with strcoll.  */
+
+static void
+page_set_cmp (bool use_strcmp)
+{
+  page_cmp = sort_functions[get_sort_function_index ()][use_strcmp]
+                           [sort_reverse][directories_first];
+  page_after_cmp = page_cmp;
+  if (page_after_valid && !page_after_file.stat_ok
+      && (sort_type == sort_time || sort_type == sort_size
+          || (sort_type == sort_multi && sort_keys_need_stat ())))
+    page_after_cmp = sort_functions[sort_name][use_strcmp]
+                                   [sort_reverse][false];
+}
+
+/* Prepare to page the listing of the directory DIRNAME.  */
+
+static void
+page_begin (char const *dirname)
+{
+  page_more = false;
+
+  if (page_cursor)
+    {
+      char *end;
+      errno = 0;
+      page_next_cursor = strtol (page_cursor, &end, 10);
+      if (errno || end == page_cursor || *end)
+        error (LS_FAILURE, 0, _("invalid cursor: %s"), quote (page_cursor));
+    }
+
+  if (! (page_limit || page_after))
+    return;
+
+  page_widths_deferred = true;
+
+  if (page_after)
+    {
+      /* Describe the --after file as the listing of DIRNAME would.
+         If it has been removed since, only its name is known, and
+         the page resumes after that name.  It is not an entry of the
+         listing, so it is not counted as one.  */
+      if (page_after_valid)
+        free_ent (&page_after_file);
+      uintmax_t entries = stats_entries;
+      failures_muted = true;
+      gobble_file (page_after, unknown, NOT_AN_INODE_NUMBER, false, dirname);
+      failures_muted = false;
+      stats_entries = entries;
+      page_after_file = cwd_file[--cwd_n_used];
+      ensure_sortkey (&page_after_file);
+      page_after_valid = true;
+    }
+
+  page_set_cmp (false);
+  if (page_after_cmp != page_cmp)
+    error (0, 0, _("cannot stat %s; listing the entries named after it"),
+           quoteaf (page_after));
+}
+
+/* Compare the table entries I and J for the --limit heap.  */
+
+static int
+page_compare (idx_t i, idx_t j)
+{
+  return page_cmp (&cwd_file[i], &cwd_file[j]);
+}
+
+static void
+page_swap (idx_t i, idx_t j)
+{
+  struct fileinfo tmp = cwd_file[i];
+  cwd_file[i] = cwd_file[j];
+  cwd_file[j] = tmp;
+}
+
+/* Sift the entry I down the heap of the first N entries.  */
+
+static void
+page_sift_down (idx_t i, idx_t n)
+{
+  for (;;)
+    {
+      idx_t child = 2 * i + 1;
+      if (n <= child)
+        break;
+      if (child + 1 < n && page_compare (child, child + 1) < 0)
+        child++;
+      if (page_compare (i, child) >= 0)
+        break;
+      page_swap (i, child);
+      i = child;
+    }
+}
+
+/* Remove the last entry of the table, taking its blocks out of
+   *TOTAL_BLOCKS.  */
+
+static void
+page_drop_last (uintmax_t *total_blocks)
+{
+  struct fileinfo *f = &cwd_file[--cwd_n_used];
+  *total_blocks -= STP_NBLOCKS (&f->stat);
+  free_ent (f);
+}
+
+/* Decide whether to keep the entry just added to the table.  It is
+   dropped unless it sorts after --after.  With --limit, the kept
+   entries form a heap whose root sorts last, so that once the table
+   is full a new entry costs O(log N) and displaces the root only if
+   it sorts before it.  The table is sorted as usual afterwards.  */
+
+static void
+page_select (uintmax_t *total_blocks)
+{
+  idx_t n = cwd_n_used - 1;
+  ensure_sortkey (&cwd_file[n]);
+
+  /* If strcoll fails, compare with strcmp from now on, as sort_files
+     does, and rebuild the heap with that order.  */
+  if (setjmp (failed_strcoll))
+    {
+      page_set_cmp (true);
+      if (page_limit)
+        {
+          idx_t heap_n = MIN (n, page_limit);
+          for (idx_t i = heap_n / 2; 0 < i--; )
+            page_sift_down (i, heap_n);
+        }
+    }
+
+  if (page_after_valid
+      && page_after_cmp (&cwd_file[n], &page_after_file) <= 0)
+    {
+      page_drop_last (total_blocks);
+      return;
     }
-}
 
-/* Sort the files now in the table.  */
+  if (!page_limit)
+    return;
 
-static void grow_sorted_file_buffer_if_needed(void)
-{
-    if (sorted_file_alloc < cwd_n_used + (cwd_n_used >> 1))
+  if (n < page_limit)
     {
-        free(sorted_file);
-        sorted_file = xinmalloc(cwd_n_used, 3 * sizeof *sorted_file);
-        sorted_file_alloc = 3 * cwd_n_used;
+      /* Sift the new entry up.  */
+      for (idx_t i = n; 0 < i && page_compare ((i - 1) / 2, i) < 0;
+           i = (i - 1) / 2)
+        page_swap (i, (i - 1) / 2);
+      return;
     }
-}
 
-static bool try_strcoll_with_fallback(void)
-{
-    if (!setjmp(failed_strcoll))
-        return false;
-    
-    affirm(sort_type != sort_version);
-    initialize_ordering_vector();
-    return true;
+  page_more = true;
+  if (page_compare (n, 0) < 0)
+    {
+      /* Replace the root by the new entry and sift it down.  */
+      page_swap (0, n);
+      page_sift_down (0, n);
+    }
+  page_drop_last (total_blocks);
 }
 
-static int get_sort_function_index(void)
-{
-    if (sort_type == sort_time)
-        return sort_type + time_type;
-    return sort_type;
-}
+/* Once the entries of a --limit or --after page have been selected,
+   measure the field widths of those that are kept, and decide again
+   whether any of their names is quoted, so that the entries left out
+   pad nothing.  */
 
-static void sort_files(void)
+static void
+page_measure (void)
 {
-    bool use_strcmp;
-
-    grow_sorted_file_buffer_if_needed();
-    initialize_ordering_vector();
-    update_current_files_info();
+  if (!page_widths_deferred)
+    return;
+  page_widths_deferred = false;
+  cwd_some_quoted = false;
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    {
+      update_quoted_status (&cwd_file[i], cwd_file[i].name);
+      update_file_widths (&cwd_file[i]);
+    }
+}
 
-    if (sort_type == sort_none)
-        return;
+/* After the page of a directory has been printed, say where the next
+   page starts, if there is one.  As with --dired, the token follows
+   the listing on a line of its own.  */
 
-    use_strcmp = try_strcoll_with_fallback();
+static void
+page_end (void)
+{
+  if (!page_more)
+    return;
 
-    int sort_index = get_sort_function_index();
-    mpsort((void const **)sorted_file, cwd_n_used,
-           sort_functions[sort_index][use_strcmp][sort_reverse][directories_first]);
+  if (page_size)
+    {
+      char buf[sizeof "//CURSOR// " + INT_BUFSIZE_BOUND (long)];
+      sprintf (buf, "//CURSOR// %ld", page_next_cursor);
+      dired_outstring (buf);
+    }
+  else if (cwd_n_used)
+    {
+      struct fileinfo const *last = sorted_file[cwd_n_used - 1];
+      dired_outstring ("//AFTER// ");
+      /* quotearg copies the decoded name before anything else runs.  */
+      dired_outstring (quotearg_style (shell_escape_always_quoting_style,
+                                       fileinfo_name (last)));
+    }
+  dired_outbyte (eolbyte);
+  page_more = false;
 }
 
 /* List all the files now in the table.  */
@@ -5797,6 +8845,16 @@ static void print_one_per_line(void)
     }
 }
 
+/* Print the --xattrs lines of F, each ending like an entry's line.  */
+static void print_xattr_lines(struct fileinfo const *f)
+{
+    for (idx_t i = 0; i < f->xattrs_len; i += strlen(f->xattrs + i) + 1)
+    {
+        dired_outstring(f->xattrs + i);
+        dired_outbyte(eolbyte);
+    }
+}
+
 static void print_long_format_files(void)
 {
     for (idx_t i = 0; i < cwd_n_used; i++)
@@ -5804,6 +8862,7 @@ static void print_long_format_files(void)
         set_normal_color();
         print_long_format(sorted_file[i]);
         dired_outbyte(eolbyte);
+        print_xattr_lines(sorted_file[i]);
     }
 }
 
@@ -5823,8 +8882,252 @@ static void print_horizontal_format(void)
         print_horizontal();
 }
 
+/* --format=columnar writes a binary table in place of text.  Integers
+   are in the writer's byte order; a reader can tell a foreign order
+   from the byte-order mark.
+
+   The stream starts with the 8 bytes "LSCOLUMN", a uint32_t version
+   (1), the uint32_t byte-order mark 0x01020304 and a uint32_t column
+   count.  Each column is then described by a type byte and a
+   NUL-terminated name.  Type 'u' stores a uint64_t per row and 'i' an
+   int64_t per row.  Type 's' stores NROWS + 1 uint64_t offsets into a
+   heap of string bytes that follows them, with string I running from
+   offset I to offset I + 1; the last offset is the heap size.
+
+   A row group follows for each table of files that ls would print:
+   one for the command-line operands that are not directories to be
+   listed, then one per listed directory, even if it has no rows.  A row group is the 4 bytes
+   "RGRP", a uint64_t row count NROWS, the directory name as a uint64_t
+   length and that many bytes (none for the operands), and then each
+   column's data, in column order.  Rows are in the order given by the
+   sort options.  A row whose 'flags' column lacks bit 0 could not be
+   stat'ed, and only its name and the file type bits of its mode are
+   meaningful.  */
+
+enum columnar_column
+  {
+    col_name, col_dev, col_ino, col_mode, col_nlink, col_uid, col_gid,
+    col_rdev, col_size, col_blocks, col_atime_sec, col_atime_nsec,
+    col_mtime_sec, col_mtime_nsec, col_ctime_sec, col_ctime_nsec,
+    col_flags
+  };
+
+static struct
+  {
+    char type;
+    char const *name;
+  } const columnar_columns[] =
+  {
+    { 's', "name" }, { 'u', "dev" }, { 'u', "ino" }, { 'u', "mode" },
+    { 'u', "nlink" }, { 'u', "uid" }, { 'u', "gid" }, { 'u', "rdev" },
+    { 'i', "size" }, { 'i', "blocks" },
+    { 'i', "atime_sec" }, { 'i', "atime_nsec" },
+    { 'i', "mtime_sec" }, { 'i', "mtime_nsec" },
+    { 'i', "ctime_sec" }, { 'i', "ctime_nsec" },
+    { 'u', "flags" },
+  };
+static_assert (ARRAY_CARDINALITY (columnar_columns) == col_flags + 1);
+
+/* The directory whose files are being printed, or null for the
+   command-line operands.  */
+static char const *columnar_dir;
+
+static void
+columnar_put_u32 (FILE *fp, uint32_t v)
+{
+  fwrite (&v, sizeof v, 1, fp);
+}
+
+static void
+columnar_put_u64 (FILE *fp, uint64_t v)
+{
+  fwrite (&v, sizeof v, 1, fp);
+}
+
+static void
+columnar_write_header (FILE *fp)
+{
+  fputs ("LSCOLUMN", fp);
+  columnar_put_u32 (fp, 1);
+  columnar_put_u32 (fp, 0x01020304);
+  columnar_put_u32 (fp, ARRAY_CARDINALITY (columnar_columns));
+  for (int c = 0; c < ARRAY_CARDINALITY (columnar_columns); c++)
+    {
+      putc (columnar_columns[c].type, fp);
+      fputs (columnar_columns[c].name, fp);
+      putc ('\0', fp);
+    }
+}
+
+/* Return the value of the integer column C for F.  */
+
+static uint64_t
+columnar_value (struct fileinfo const *f, enum columnar_column c)
+{
+  struct stat const *st = &f->stat;
+  bool ok = f->stat_ok;
+
+  switch (c)
+    {
+    case col_dev: return ok ? st->st_dev : 0;
+    case col_ino: return st->st_ino;
+    case col_mode:
+      return ok ? st->st_mode : DTTOIF (filetype_d_type[f->filetype]);
+    case col_nlink: return ok ? st->st_nlink : 0;
+    case col_uid: return ok ? st->st_uid : 0;
+    case col_gid: return ok ? st->st_gid : 0;
+    case col_rdev: return ok ? st->st_rdev : 0;
+    case col_size: return ok ? st->st_size : 0;
+    case col_blocks: return ok ? STP_NBLOCKS (st) : 0;
+    case col_atime_sec: return ok ? get_stat_atime (st).tv_sec : 0;
+    case col_atime_nsec: return ok ? get_stat_atime (st).tv_nsec : 0;
+    case col_mtime_sec: return ok ? get_stat_mtime (st).tv_sec : 0;
+    case col_mtime_nsec: return ok ? get_stat_mtime (st).tv_nsec : 0;
+    case col_ctime_sec: return ok ? get_stat_ctime (st).tv_sec : 0;
+    case col_ctime_nsec: return ok ? get_stat_ctime (st).tv_nsec : 0;
+    case col_flags: return ok;
+    case col_name:
+    default:
+      unreachable ();
+    }
+}
+
+/* Write the current table of files, from the directory DIRNAME, as a
+   row group to FP.  */
+
+static void
+columnar_write_files (FILE *fp, char const *dirname)
+{
+  fputs ("RGRP", fp);
+  columnar_put_u64 (fp, cwd_n_used);
+  idx_t dirlen = dirname ? strlen (dirname) : 0;
+  columnar_put_u64 (fp, dirlen);
+  fwrite (dirname, 1, dirlen, fp);
+
+  for (int c = 0; c < ARRAY_CARDINALITY (columnar_columns); c++)
+    if (c == col_name)
+      {
+        uint64_t offset = 0;
+        columnar_put_u64 (fp, offset);
+        for (idx_t i = 0; i < cwd_n_used; i++)
+          columnar_put_u64 (fp, offset += strlen (fileinfo_name (sorted_file[i])));
+        /* One name at a time, so decoding in order stays cheap.  */
+        for (idx_t i = 0; i < cwd_n_used; i++)
+          fputs (fileinfo_name (sorted_file[i]), fp);
+      }
+    else
+      for (idx_t i = 0; i < cwd_n_used; i++)
+        columnar_put_u64 (fp, columnar_value (sorted_file[i], c));
+}
+
+static void
+print_columnar (void)
+{
+  columnar_write_files (stdout, columnar_dir);
+}
+
+/* Parse SPEC, the FORMAT:FILE argument of --also-output.  A snapshot
+   is the one --capture would record, so it shares that machinery.  */
+
+static void
+decode_also_output (char const *spec)
+{
+  char const *colon = strchr (spec, ':');
+  if (!colon || !colon[1])
+    error (LS_FAILURE, 0, _("invalid --also-output argument: %s"),
+           quote (spec));
+
+  char *format_name = ximemdup0 (spec, colon - spec);
+  enum also_output_format fmt
+    = XARGMATCH ("--also-output", format_name,
+                 also_output_format_args, also_output_format_types);
+  free (format_name);
+
+  if (fmt == also_output_snapshot)
+    {
+      if (capture_name)
+        error (LS_FAILURE, 0, _("only one snapshot can be captured"));
+      capture_name = colon + 1;
+      return;
+    }
+
+  struct also_output *out = xmalloc (sizeof *out);
+  out->format = fmt;
+  out->name = colon + 1;
+  out->fp = nullptr;
+  out->next = also_outputs;
+  also_outputs = out;
+  also_output_columnar_p |= fmt == also_output_columnar;
+}
+
+static void
+also_output_open (void)
+{
+  for (struct also_output *out = also_outputs; out; out = out->next)
+    {
+      out->fp = fopen (out->name, "wb");
+      if (!out->fp)
+        error (LS_FAILURE, errno, _("cannot create %s"), quoteaf (out->name));
+      if (out->format == also_output_columnar)
+        columnar_write_header (out->fp);
+    }
+}
+
+/* Write the current table of files, from the directory DIRNAME or
+   from the command line if DIRNAME is null, to each --also-output
+   sink.  */
+
+static void
+also_output_files (char const *dirname)
+{
+  for (struct also_output *out = also_outputs; out; out = out->next)
+    switch (out->format)
+      {
+      case also_output_names:
+        for (idx_t i = 0; i < cwd_n_used; i++)
+          {
+            if (dirname)
+              {
+                fputs (dirname, out->fp);
+                if (dirname[strlen (dirname) - 1] != '/')
+                  putc ('/', out->fp);
+              }
+            /* Written out before the next name is decoded.  */
+            fputs (fileinfo_name (sorted_file[i]), out->fp);
+            putc ('\0', out->fp);
+          }
+        break;
+
+      case also_output_columnar:
+        columnar_write_files (out->fp, dirname);
+        break;
+
+      case also_output_snapshot:
+      default:
+        unreachable ();
+      }
+}
+
+static void
+also_output_close (void)
+{
+  for (struct also_output *out = also_outputs; out; out = out->next)
+    {
+      bool failed = ferror (out->fp);
+      if (fclose (out->fp) != 0 || failed)
+        {
+          error (0, failed ? 0 : errno, _("error writing %s"),
+                 quoteaf (out->name));
+          set_exit_status (true);
+        }
+      out->fp = nullptr;
+    }
+}
+
 static void print_current_files(void)
 {
+    enum ls_phase prev_phase = phase_enter(PHASE_FORMAT);
+
     switch (format)
     {
     case one_per_line:
@@ -5846,7 +9149,14 @@ static void print_current_files(void)
     case long_format:
         print_long_format_files();
         break;
+
+    case columnar_format:
+        print_columnar();
+        break;
     }
+
+    sgr_release();
+    phase_leave(prev_phase);
 }
 
 /* Replace the first %b with precomputed aligned month names.
@@ -5864,6 +9174,12 @@ align_nstrftime (char *buf, size_t size, bool recent, struct tm const *tm,
 static char const *
 get_time_format(bool recent, int month)
 {
+  if (abformat_pending)
+    {
+      abformat_pending = false;
+      abformat_init ();
+    }
+
   if (use_abformat)
     return abformat[recent][month];
   return long_time_format[recent];
@@ -5894,10 +9210,11 @@ calculate_time_width (void)
   struct tm tm;
   char buf[TIME_STAMP_LEN_MAXIMUM + 1];
 
-  if (!localtime_rz (localtz, &epoch, &tm))
+  timezone_t tz = get_localtz ();
+  if (!localtime_rz (tz, &epoch, &tm))
     return -1;
 
-  size_t len = align_nstrftime (buf, sizeof buf, false, &tm, localtz, 0);
+  size_t len = align_nstrftime (buf, sizeof buf, false, &tm, tz, 0);
   if (len == 0)
     return -1;
 
@@ -6157,11 +9474,11 @@ static size_t format_time_string(char *p, struct timespec when_timespec,
                                  const struct fileinfo *f)
 {
   if (f->stat_ok && btime_ok
-      && localtime_rz(localtz, &when_timespec.tv_sec, when_local))
+      && localtime_rz(get_localtz(), &when_timespec.tv_sec, when_local))
     {
       bool recent = is_recent_time(when_timespec);
       return align_nstrftime(p, TIME_STAMP_LEN_MAXIMUM + 1, recent,
-                            when_local, localtz, when_timespec.tv_nsec);
+                            when_local, get_localtz(), when_timespec.tv_nsec);
     }
   return 0;
 }
@@ -6526,6 +9843,15 @@ static void print_hyperlink_start(const char *absolute_name, const char *buf, bo
     putchar(*buf);
   }
   
+  if (!hostname)
+    {
+      file_escape_init ();
+
+      hostname = xgethostname ();
+      if (! hostname)
+        hostname = "";
+    }
+
   char *h = file_escape(hostname, false);
   char *n = file_escape(absolute_name, true);
   printf("\033]8;;file://%s%s%s\a", h, *n == '/' ? "" : "/", n);
@@ -6561,9 +9887,41 @@ static void cleanup_buffer(char *buf, const char *smallbuf, const char *name)
     free(buf);
 }
 
+/* Set the directory name DIRNAME that --flat prints before each of
+   its entries.  */
+static void
+set_flat_dir (char const *dirname)
+{
+  free (flat_dir);
+  flat_dir = (*dirname && dirname[strlen (dirname) - 1] == '/'
+              ? xstrdup (dirname) : xasprintf ("%s/", dirname));
+  flat_dir_len = strlen (flat_dir);
+}
+
+/* Return NAME joined to the --flat directory, in storage that the
+   next call reuses.  The path is quoted as a whole, so that what is
+   printed can be pasted back as one file name; quoting the directory
+   once and the name separately would print 'dir/''name' or
+   "dir/""name".  So the two are copied together for each entry, into
+   a buffer that only grows to the longest path.  */
+static char const *
+flat_path (char const *name)
+{
+  static char *path;
+  static idx_t path_alloc;
+  idx_t size = strlen (name) + 1;
+
+  if (path_alloc < flat_dir_len + size)
+    path = xpalloc (path, &path_alloc, flat_dir_len + size - path_alloc,
+                    -1, 1);
+  memcpy (path, flat_dir, flat_dir_len);
+  memcpy (path + flat_dir_len, name, size);
+  return path;
+}
+
 static size_t
 quote_name(char const *name, struct quoting_options const *options,
-          int needs_general_quoting, const struct bin_str *color,
+          int needs_general_quoting, struct sgr const *color,
           bool allow_pad, struct obstack *stack, char const *absolute_name)
 {
   char smallbuf[BUFSIZ];
@@ -6578,8 +9936,12 @@ quote_name(char const *name, struct quoting_options const *options,
   if (pad && allow_pad)
     dired_outbyte(' ');
 
+  /* An uncolored name must not inherit the color held over from the
+     name before it.  */
   if (color)
     print_color_indicator(color);
+  else
+    sgr_release();
 
   if (absolute_name)
     print_hyperlink_start(absolute_name, buf, &skip_quotes);
@@ -6594,22 +9956,41 @@ quote_name(char const *name, struct quoting_options const *options,
   return len + pad;
 }
 
-static bool should_use_color(const struct bin_str *color)
+static bool should_use_color(struct sgr const *color)
 {
     return print_with_color && (color || is_colored(C_NORM));
 }
 
+/* Return true if COLOR can stay in effect after a name, because only
+   blanks can follow before the next name on the same line.  The color
+   is always ended before the line is, so each line stays
+   self-contained for tools that filter lines.  */
+static bool can_hold_color(struct sgr const *color)
+{
+    return (color && color->blank_safe && !is_colored(C_NORM)
+            && (format == many_per_line || format == horizontal));
+}
+
 static bool name_might_wrap(size_t start_col, size_t len)
 {
     return line_length && 
            (start_col / line_length != (start_col + len - 1) / line_length);
 }
 
-static void handle_color_cleanup(size_t start_col, size_t len)
+static void handle_color_cleanup(struct sgr const *color,
+                                 size_t start_col, size_t len)
 {
+    bool wraps = name_might_wrap(start_col, len);
+
+    if (!wraps && can_hold_color(color))
+    {
+        sgr_held = color;
+        return;
+    }
+
     prep_non_filename_text();
     
-    if (name_might_wrap(start_col, len))
+    if (wraps)
         put_indicator(&color_indicator[C_CLR_TO_EOL]);
 }
 
@@ -6619,21 +10000,32 @@ print_name_with_quoting (const struct fileinfo *f,
                          struct obstack *stack,
                          size_t start_col)
 {
-    char const *name = symlink_target ? f->linkname : f->name;
+    /* get_color_indicator decodes F's name again, into the same buffer
+       and with the same contents, so NAME stays valid.  */
+    char const *name = symlink_target ? f->linkname : fileinfo_name(f);
 
-    const struct bin_str *color = print_with_color ? 
-                                   get_color_indicator(f, symlink_target) : 
-                                   nullptr;
+    struct sgr const *color = print_with_color ? 
+                              get_color_indicator(f, symlink_target) : 
+                              nullptr;
 
     bool used_color_this_time = should_use_color(color);
 
-    size_t len = quote_name(name, filename_quoting_options, f->quoted,
-                           color, !symlink_target, stack, f->absolute_name);
+    int quoted = f->quoted;
+    if (flat_dir && !symlink_target)
+    {
+        name = flat_path(name);
+        quoted = -1;
+    }
+
+    size_t len = quote_name(name, filename_quoting_options, quoted,
+                            color, !symlink_target, stack, f->absolute_name);
 
-    process_signals();
-    
+    /* Signal handling restores the default color, so decide whether to
+       hold this name's color only afterwards.  */
     if (used_color_this_time)
-        handle_color_cleanup(start_col, len);
+        handle_color_cleanup(color, start_col, len);
+
+    process_signals();
 
     return len;
 }
@@ -6641,15 +10033,20 @@ print_name_with_quoting (const struct fileinfo *f,
 static void
 prep_non_filename_text (void)
 {
-  if (color_indicator[C_END].string != nullptr)
+  put_indicator (&sgr_reset);
+}
+
+/* End the color held over from the previous name, before anything
+   other than blanks or another name of the same color is output.  */
+
+static void
+sgr_release (void)
+{
+  if (sgr_held)
     {
-      put_indicator (&color_indicator[C_END]);
-      return;
+      sgr_held = nullptr;
+      prep_non_filename_text ();
     }
-  
-  put_indicator (&color_indicator[C_LEFT]);
-  put_indicator (&color_indicator[C_RESET]);
-  put_indicator (&color_indicator[C_RIGHT]);
 }
 
 /* Print the file name of 'f' with appropriate quoting.
@@ -6687,6 +10084,9 @@ static size_t print_file_name_and_frills(const struct fileinfo *f, size_t start_
 {
     char buf[MAX(LONGEST_HUMAN_READABLE + 1, INT_BUFSIZE_BOUND(uintmax_t))];
 
+    if (print_inode || print_block_size || print_scontext)
+        sgr_release();
+
     set_normal_color();
 
     if (print_inode)
@@ -6784,30 +10184,44 @@ print_type_indicator (bool stat_ok, mode_t mode, enum filetype type)
 {
   char c = get_type_indicator (stat_ok, mode, type);
   if (c)
-    dired_outbyte (c);
+    {
+      sgr_release ();
+      dired_outbyte (c);
+    }
   return c != 0;
 }
 
 /* Returns if color sequence was printed.  */
 static bool
-print_color_indicator (const struct bin_str *ind)
+print_color_indicator (struct sgr const *ind)
 {
   if (!ind)
     return false;
 
+  /* Only blanks were output since the previous name, which left this
+     same color in effect.  */
+  if (ind == sgr_held
+      || (sgr_held && sgr_held->seq.len == ind->seq.len
+          && memcmp (sgr_held->seq.string, ind->seq.string,
+                     ind->seq.len) == 0))
+    {
+      sgr_held = nullptr;
+      return true;
+    }
+
+  sgr_release ();
+
   if (is_colored (C_NORM))
     restore_default_color ();
     
-  put_indicator (&color_indicator[C_LEFT]);
-  put_indicator (ind);
-  put_indicator (&color_indicator[C_RIGHT]);
+  put_indicator (&ind->seq);
 
   return true;
 }
 
 /* Returns color indicator or nullptr if none.  */
 ATTRIBUTE_PURE
-static const struct bin_str*
+static struct sgr const *
 get_color_indicator (const struct fileinfo *f, bool symlink_target)
 {
   char const *name;
@@ -6822,7 +10236,8 @@ get_color_indicator (const struct fileinfo *f, bool symlink_target)
     }
   else
     {
-      name = f->name;
+      /* Only F's name is decoded until NAME is matched below.  */
+      name = fileinfo_name (f);
       mode = file_or_link_mode (f);
       linkok = f->linkok;
     }
@@ -6840,7 +10255,9 @@ get_color_indicator (const struct fileinfo *f, bool symlink_target)
   const struct bin_str *const s
     = ext ? &(ext->seq) : &color_indicator[type];
 
-  return s->string ? s : nullptr;
+  if (!s->string)
+    return nullptr;
+  return ext ? &ext->sgr : &color_sgr[type];
 }
 
 static enum indicator_no
@@ -7063,6 +10480,7 @@ static void print_single_row(idx_t row, idx_t rows, struct column_info const *li
         pos += max_name_length;
     }
     
+    sgr_release();
     putchar(eolbyte);
 }
 
@@ -7085,6 +10503,7 @@ static void print_first_entry(struct fileinfo const *f)
 
 static void handle_new_line(size_t *pos)
 {
+    sgr_release();
     putchar(eolbyte);
     *pos = 0;
 }
@@ -7138,6 +10557,7 @@ static void print_horizontal(void)
         process_file_entry(filesno, cols, line_fmt, &pos, &name_length);
     }
     
+    sgr_release();
     putchar(eolbyte);
 }
 
@@ -7326,16 +10746,16 @@ static void init_column_info(idx_t max_cols)
    of files in the current display width.  */
 
 static idx_t
-get_max_columns(void)
+get_max_columns(idx_t n)
 {
-  return 0 < max_idx && max_idx < cwd_n_used ? max_idx : cwd_n_used;
+  return 0 < max_idx && max_idx < n ? max_idx : n;
 }
 
 static idx_t
-calculate_index(idx_t filesno, idx_t i, bool by_columns)
+calculate_index(idx_t filesno, idx_t n, idx_t i, bool by_columns)
 {
   if (by_columns)
-    return filesno / ((cwd_n_used + i) / (i + 1));
+    return filesno / ((n + i) / (i + 1));
   return filesno % (i + 1);
 }
 
@@ -7357,10 +10777,11 @@ update_column_info(idx_t i, idx_t idx, size_t real_length)
     }
 }
 
+/* Fit F, the FILESNOth of N files, into each candidate layout.  */
 static void
-process_file_columns(idx_t filesno, idx_t max_cols, bool by_columns)
+process_file_columns(struct fileinfo const *f, idx_t filesno, idx_t n,
+                     idx_t max_cols, bool by_columns)
 {
-  struct fileinfo const *f = sorted_file[filesno];
   size_t name_length = length_of_file_name_and_frills(f);
 
   for (idx_t i = 0; i < max_cols; ++i)
@@ -7368,7 +10789,7 @@ process_file_columns(idx_t filesno, idx_t max_cols, bool by_columns)
       if (!column_info[i].valid_len)
         continue;
 
-      idx_t idx = calculate_index(filesno, i, by_columns);
+      idx_t idx = calculate_index(filesno, n, i, by_columns);
       size_t real_length = calculate_real_length(name_length, idx, i);
       update_column_info(i, idx, real_length);
     }
@@ -7379,7 +10800,8 @@ compute_column_widths(idx_t max_cols, bool by_columns)
 {
   for (idx_t filesno = 0; filesno < cwd_n_used; ++filesno)
     {
-      process_file_columns(filesno, max_cols, by_columns);
+      process_file_columns(sorted_file[filesno], filesno, cwd_n_used,
+                           max_cols, by_columns);
     }
 }
 
@@ -7398,10 +10820,234 @@ find_maximum_valid_columns(idx_t max_cols)
 static idx_t
 calculate_columns(bool by_columns)
 {
-  idx_t max_cols = get_max_columns();
+  enum ls_phase prev_phase = phase_enter (PHASE_COLUMNS);
+  idx_t max_cols = get_max_columns(cwd_n_used);
   init_column_info(max_cols);
   compute_column_widths(max_cols, by_columns);
-  return find_maximum_valid_columns(max_cols);
+  idx_t cols = find_maximum_valid_columns(max_cols);
+  phase_leave (prev_phase);
+  return cols;
+}
+
+/* --bounded-memory.  An unsorted -C or -x listing depends only on the
+   directory order and the widths of the entries, so rather than hold
+   every entry, read the directory several times, keeping just the
+   current entry in CWD_FILE[0]:
+
+   1. Count the entries and note whether any name needs quoting.
+      With -i, -s or -Z, gobble each entry instead, for the total and
+      the maximum widths that pad those fields.
+   2. Gobble each entry to fit it into every candidate layout, as
+      calculate_columns does.
+   3. Print: with -x, row by row in directory order.  With -C, the
+      entries of a row are spread through the directory, so read it
+      once per band of rows, gobbling only the entries in the band's
+      rows and printing the band once it is complete.
+
+   This holds at most BOUNDED_BAND_ENTRIES entries, or one row if a
+   row is longer, whatever the size of the directory, and uses a
+   single directory stream.  The price is the extra passes, including
+   any stat calls the format needs.  */
+
+enum { BOUNDED_BAND_ENTRIES = 16 * 1024 };
+
+static bool
+bounded_listing_applies (void)
+{
+  return (bounded_memory && !plan.sort && line_length
+          && (format == many_per_line || format == horizontal)
+          && !recursive && !capture_name && !also_outputs
+          && !page_size && !page_cursor && group_by == group_by_none);
+}
+
+/* Free the entries read so far, but keep the widths and quoting state
+   accumulated from them.  */
+static void
+drop_bounded_entries (void)
+{
+  for (idx_t i = 0; i < cwd_n_used; i++)
+    free_ent (&cwd_file[i]);
+  cwd_n_used = 0;
+}
+
+/* Return the next entry of the directory DIRP named NAME that is not
+   ignored, or null.  */
+static struct dirent *
+next_listed_dir_entry (DIR *dirp, char const *name, bool command_line_arg)
+{
+  struct dirent *next;
+  do
+    next = next_dir_entry (dirp, name, command_line_arg);
+  while (next && file_ignored (next->d_name));
+  return next;
+}
+
+/* Replace the current entry with the next one of DIRP, adding its
+   blocks to *TOTAL_BLOCKS, and return it; or return null at the end.  */
+static struct fileinfo const *
+next_bounded_entry (DIR *dirp, char const *name, bool command_line_arg,
+                    uintmax_t *total_blocks)
+{
+  drop_bounded_entries ();
+  process_signals ();
+
+  struct dirent *next = next_listed_dir_entry (dirp, name, command_line_arg);
+  if (!next)
+    return nullptr;
+
+  *total_blocks += gobble_file (next->d_name, dirent_filetype (next),
+                                RELIABLE_D_INO (next), false, name);
+  return &cwd_file[0];
+}
+
+/* List the directory DIRP named NAME as described above.  */
+static void
+list_bounded_dir (DIR *dirp, char const *name, bool command_line_arg)
+{
+  bool by_columns = format == many_per_line;
+  uintmax_t total_blocks = 0;
+  uintmax_t ignored_blocks = 0;
+  struct fileinfo const *f;
+
+  idx_t n = 0;
+  bool gobbled = print_inode || print_block_size || print_scontext;
+  if (gobbled)
+    while (next_bounded_entry (dirp, name, command_line_arg, &total_blocks))
+      n++;
+  else
+    {
+      /* Nothing that pads the columns depends on the files' status,
+         so there is no need to stat them just to count them.  */
+      struct dirent *next;
+      while ((next = next_listed_dir_entry (dirp, name, command_line_arg)))
+        {
+          if (align_variable_outer_quotes && !cwd_some_quoted)
+            cwd_some_quoted = needs_quoting (next->d_name);
+          n++;
+          process_signals ();
+        }
+    }
+
+  print_total_blocks (total_blocks);
+  if (n == 0)
+    return;
+
+  /* Report each failure once, from the first pass that gobbles.  */
+  failures_muted = gobbled;
+
+  enum ls_phase prev_phase = phase_enter (PHASE_COLUMNS);
+  idx_t max_cols = get_max_columns (n);
+  init_column_info (max_cols);
+  rewinddir (dirp);
+  for (idx_t filesno = 0;
+       (filesno < n
+        && (f = next_bounded_entry (dirp, name, command_line_arg,
+                                    &ignored_blocks)));
+       filesno++)
+    process_file_columns (f, filesno, n, max_cols, by_columns);
+  idx_t cols = find_maximum_valid_columns (max_cols);
+  size_t const *col_arr = column_info[cols - 1].col_arr;
+  phase_leave (prev_phase);
+
+  failures_muted = true;
+
+  rewinddir (dirp);
+
+  if (!by_columns)
+    {
+      size_t pos = 0;
+      size_t name_length = 0;
+      for (idx_t filesno = 0;
+           (filesno < n
+            && (f = next_bounded_entry (dirp, name, command_line_arg,
+                                        &ignored_blocks)));
+           filesno++)
+        {
+          idx_t col = filesno % cols;
+          if (col == 0)
+            {
+              sgr_release ();
+              if (filesno)
+                putchar (eolbyte);
+              pos = 0;
+            }
+          else
+            {
+              indent (pos + name_length, pos + col_arr[col - 1]);
+              pos += col_arr[col - 1];
+            }
+          print_file_name_and_frills (f, pos);
+          name_length = length_of_file_name_and_frills (f);
+        }
+      sgr_release ();
+      putchar (eolbyte);
+    }
+  else
+    {
+      /* SLOT[R * COLS + C] is the index in CWD_FILE of the entry at
+         row FIRST + R and column C, or -1 if the directory shrank
+         since it was counted and the entry was not found.  */
+      idx_t rows = n / cols + (n % cols != 0);
+      idx_t band = MAX (1, BOUNDED_BAND_ENTRIES / cols);
+      idx_t *slot = xinmalloc (MIN (band, rows) * cols, sizeof *slot);
+      drop_bounded_entries ();
+
+      for (idx_t first = 0; first < rows; first += band)
+        {
+          idx_t last = MIN (rows, first + band);
+          for (idx_t i = 0; i < (last - first) * cols; i++)
+            slot[i] = -1;
+
+          if (first)
+            rewinddir (dirp);
+          struct dirent *next;
+          for (idx_t filesno = 0;
+               (filesno < n
+                && (next = next_listed_dir_entry (dirp, name,
+                                                  command_line_arg)));
+               filesno++)
+            {
+              idx_t row = filesno % rows;
+              if (row < first || last <= row)
+                continue;
+              idx_t i = cwd_n_used;
+              gobble_file (next->d_name, dirent_filetype (next),
+                           RELIABLE_D_INO (next), false, name);
+              if (i < cwd_n_used)
+                slot[(row - first) * cols + filesno / rows] = i;
+              process_signals ();
+            }
+
+          for (idx_t row = first; row < last; row++)
+            {
+              idx_t const *row_slot = &slot[(row - first) * cols];
+              if (row_slot[0] < 0)
+                continue;
+              size_t pos = 0;
+              size_t name_length = 0;
+              for (idx_t col = 0; col < cols && 0 <= row_slot[col]; col++)
+                {
+                  if (col)
+                    {
+                      indent (pos + name_length, pos + col_arr[col - 1]);
+                      pos += col_arr[col - 1];
+                    }
+                  f = &cwd_file[row_slot[col]];
+                  print_file_name_and_frills (f, pos);
+                  name_length = length_of_file_name_and_frills (f);
+                }
+              sgr_release ();
+              putchar (eolbyte);
+            }
+
+          drop_bounded_entries ();
+        }
+
+      free (slot);
+    }
+
+  drop_bounded_entries ();
+  failures_muted = false;
 }
 
 void print_basic_options(void)
@@ -7409,6 +11055,10 @@ void print_basic_options(void)
     fputs(_("\
   -a, --all                  do not ignore entries starting with .\n\
   -A, --almost-all           do not list implied . and ..\n\
+      --also-output=FORMAT:FILE  also write what is listed to FILE, from\n\
+                             the same traversal; FORMAT is 'names'\n\
+                             (NUL-terminated), 'columnar' or 'snapshot';\n\
+                             may be repeated\n\
       --author               with -l, print the author of each file\n\
   -b, --escape               print C-style escapes for nongraphic characters\n\
 "), stdout);
@@ -7419,6 +11069,8 @@ void print_basic_options(void)
 "), stdout);
     fputs(_("\
   -B, --ignore-backups       do not list implied entries ending with ~\n\
+      --bounded-memory       with -C or -x and -U, reread each directory\n\
+                             rather than hold all its entries in memory\n\
 "), stdout);
 }
 
@@ -7433,7 +11085,15 @@ void print_sorting_options(void)
 "), stdout);
     fputs(_("\
   -C                         list entries by columns\n\
+      --capture=FILE         also record the metadata of everything listed\n\
+                             to FILE, for later use with --from-snapshot;\n\
+                             entries not listed, as without -a, are not\n\
+                             recorded\n\
       --color[=WHEN]         color the output WHEN; more info below\n\
+      --compress-names       once a directory is sorted, keep its names\n\
+                             front-coded until printed; this lowers the\n\
+                             memory held while printing, not the peak\n\
+                             while sorting\n\
   -d, --directory            list directories themselves, not their contents\n\
   -D, --dired                generate output designed for Emacs' dired mode\n\
 "), stdout);
@@ -7441,6 +11101,22 @@ void print_sorting_options(void)
 
 void print_format_options(void)
 {
+    fputs(_("\
+      --errors=MODE          report errors accessing files: full (the default),\n\
+                             buffered (in one buffered stream, not each\n\
+                             at once), or summary (grouped by cause, with\n\
+                             a few sample names, at exit)\n\
+"), stdout);
+    fputs(_("\
+      --explain              print which calls each entry will cost, the\n\
+                             statx mask, and whether sorting, a width pass\n\
+                             or streaming are needed; do not list anything\n\
+"), stdout);
+    fputs(_("\
+      --flat                 print each entry with its directory's name, one\n\
+                             per line unless -l, with no directory headings\n\
+                             or totals; with -R, lists a whole tree\n\
+"), stdout);
     fputs(_("\
   -f                         same as -a -U\n\
   -F, --classify[=WHEN]      append indicator (one of */=>@|) to entries WHEN\n\
@@ -7448,11 +11124,25 @@ void print_format_options(void)
 "), stdout);
     fputs(_("\
       --format=WORD          across,horizontal (-x), commas (-m), long (-l),\n\
-                             single-column (-1), verbose (-l), vertical (-C)\n\
+                             single-column (-1), verbose (-l), vertical (-C),\n\
+                             columnar (a binary table, one row group per\n\
+                             directory)\n\
 \n\
+"), stdout);
+    fputs(_("\
+      --from-snapshot=FILE   list what --capture recorded in FILE instead of\n\
+                             reading the file system; no FILE operands\n\
 "), stdout);
     fputs(_("\
       --full-time            like -l --time-style=full-iso\n\
+"), stdout);
+    fputs(_("\
+      --group-by=KEY         instead of listing, print a table aggregating the\n\
+                             files by KEY: ext, owner, group, type,\n\
+                             mtime-bucket, dir; with -R, across all levels\n\
+      --agg=LIST             with --group-by, the aggregates to print:\n\
+                             count, and sum, min or max of size, blocks or\n\
+                             mtime; the default is 'count,sum(size)'\n\
 "), stdout);
     fputs(_("\
   -g                         like -l, but do not list owner\n\
@@ -7540,6 +11230,36 @@ void print_listing_options(void)
   -o                         like -l, but do not list group information\n\
   -p, --indicator-style=slash\n\
                              append / indicator to directories\n\
+"), stdout);
+    fputs(_("\
+      --output=FILE          write the listing to FILE in large buffered\n\
+                             writes, instead of to standard output\n\
+      --output-options=LIST  tune --output with a comma-separated LIST of\n\
+                             buffer=SIZE (default 4M), preallocate=SIZE\n\
+                             and dontneed, which drops written data from\n\
+                             the page cache\n\
+"), stdout);
+    fputs(_("\
+      --page-size=N          with -U, list at most N entries of each\n\
+                             directory, then print '//CURSOR// TOKEN' if\n\
+                             more remain\n\
+      --cursor=TOKEN         with --page-size, start where the page that\n\
+                             printed TOKEN stopped\n\
+      --limit=N              list only the first N entries of each sorted\n\
+                             directory, then print '//AFTER// NAME' if\n\
+                             more remain\n\
+      --after=NAME           list only entries that sort after NAME\n\
+"), stdout);
+    fputs(_("\
+      --parallel=N           stat directory entries with N threads while\n\
+                             reading and printing others\n\
+      --profile=FILE         sample where CPU time goes, by phase and system\n\
+                             call, and write the counts to FILE at exit as\n\
+                             folded stacks; with --parallel, the workers'\n\
+                             time is charged to what the main thread does\n\
+      --progress[=SECONDS]   report progress on standard error every SECONDS;\n\
+                             SECONDS defaults to 1\n\
+      --progress-fd=FD       like --progress, but report to descriptor FD\n\
 "), stdout);
 }
 
@@ -7579,7 +11299,13 @@ void print_advanced_sort_options(void)
     fputs(_("\
       --sort=WORD            change default 'name' sort to WORD:\n\
                                none (-U), size (-S), time (-t),\n\
-                               version (-v), extension (-X), name, width\n\
+                               version (-v), extension (-X), name, width,\n\
+                               iname (name ignoring ASCII case), natural\n\
+                               (like iname, but numbers compare by value);\n\
+                               or a list like 'ext,size:desc,name' of\n\
+                               name, ext, iname, natural, width, size,\n\
+                               time, atime, mtime, ctime, each optionally\n\
+                               followed by :asc or :desc\n\
 \n\
 "), stdout);
 }
@@ -7624,6 +11350,9 @@ void print_misc_options(void)
   -w, --width=COLS           set output width to COLS.  0 means no limit\n\
   -x                         list entries by lines instead of by columns\n\
   -X                         sort alphabetically by entry extension\n\
+      --xattrs[=PATTERN]     with -l, list the extended attributes of each\n\
+                             file; with PATTERN, list only those whose names\n\
+                             match shell PATTERN, and their values\n\
   -Z, --context              print any security context of each file\n\
       --zero                 end each output line with NUL, not newline\n\
   -1                         list one file per line\n\